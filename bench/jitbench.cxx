@@ -0,0 +1,626 @@
+#include <jitlib/jitlib.h>
+#include <algorithm>
+#include <cerrno>
+#include <chrono>
+#include <cmath>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <numeric>
+#include <sched.h>
+#include <string>
+#include <string_view>
+#include <vector>
+
+namespace
+{
+    using Clock = std::chrono::steady_clock;
+
+    struct Config
+    {
+        std::size_t repeat = 20;               // samples per measurement
+        std::chrono::milliseconds warmup{100}; // per measurement, also sizes the batches
+        std::chrono::milliseconds time{500};   // per measurement, across all samples
+        int cpu = -1;                          // to pin to, -1 for where we started
+        bool pin = true;
+        bool json = false;
+        bool scaling = false;
+        bool optimised = false;                // compile with CompileOptions::optimised
+        std::string filter;
+    };
+
+    struct Workload
+    {
+        char const *name;
+        char const *description;
+        jitlib::Ops ops;
+    };
+
+    struct Summary
+    {
+        double min;
+        double median;
+        double mean;
+        double stddev;
+    };
+
+    struct Result
+    {
+        Workload const *workload;
+        std::uint64_t ops;     // executed per run
+        Summary interpreter;   // ns per run
+        Summary jit;           // ns per run
+        Summary compile;       // ns per compile()
+        std::size_t code_size; // bytes
+    };
+
+    // Generated programs varying one way, see generate().
+    struct Dimension
+    {
+        char const *name;
+        std::vector<double> values;
+        void (*apply)(jitlib::GenerateOptions &options, double value);
+    };
+
+    // One point along a Dimension, averaged over the seeds.
+    struct ScalingPoint
+    {
+        Dimension const *dimension;
+        double value;
+        std::size_t ops;     // in the program
+        double executed;     // ops per run
+        double compile;      // ns per compile()
+        double bytes_per_op; // of code
+        double run;          // ns per run of the compiled code
+    };
+
+    // Seeds to average each point of a scaling curve over
+    constexpr std::uint64_t kSeeds = 4;
+
+    // Adds up what it's called with, so the callouts aren't free.
+    void tally(jitlib::ExecutionEnvironment &env)
+    {
+        *static_cast<std::uint64_t *>(env.userdata) += env.regs[0];
+    }
+
+    // Add and negate in a 256 x 256 loop.
+    jitlib::Ops arithmetic()
+    {
+        return {
+            jitlib::Op::make_SetImm(0, 0),          // r0 = 0
+            jitlib::Op::make_Label("outer"),        //
+            jitlib::Op::make_SetImm(1, 0),          // r1 = 0
+            jitlib::Op::make_Label("inner"),        //
+            jitlib::Op::make_AddReg(2, 1),          // r2 += r1
+            jitlib::Op::make_AddReg(3, 2),          // r3 += r2
+            jitlib::Op::make_Negate(3),             // r3 = -r3
+            jitlib::Op::make_AddImm(1, 1),          // r1 += 1
+            jitlib::Op::make_JumpIfZero(1, "next"), // if (r1 == 0) goto next
+            jitlib::Op::make_Jump("inner"),         // goto inner
+            jitlib::Op::make_Label("next"),         //
+            jitlib::Op::make_AddImm(0, 1),          // r0 += 1
+            jitlib::Op::make_JumpIfZero(0, "done"), // if (r0 == 0) goto done
+            jitlib::Op::make_Jump("outer"),         // goto outer
+            jitlib::Op::make_Label("done"),         //
+            jitlib::Op::make_Return(),
+        };
+    }
+
+    // Copies the bottom half of memory to the top, 32 times over.
+    jitlib::Ops copy()
+    {
+        return {
+            jitlib::Op::make_SetImm(3, 32),         // r3 = 32
+            jitlib::Op::make_Label("pass"),         //
+            jitlib::Op::make_SetImm(0, 0),          // r0 = 0
+            jitlib::Op::make_Label("copy"),         //
+            jitlib::Op::make_Load(2, 0),            // r2 = mem[r0]
+            jitlib::Op::make_SetReg(1, 0),          // r1 = r0
+            jitlib::Op::make_AddImm(1, 128),        // r1 += 128
+            jitlib::Op::make_Store(1, 2),           // mem[r1] = r2
+            jitlib::Op::make_AddImm(0, 1),          // r0 += 1
+            jitlib::Op::make_SetReg(2, 0),          // r2 = r0
+            jitlib::Op::make_AddImm(2, 128),        // r2 += 128
+            jitlib::Op::make_JumpIfZero(2, "next"), // if (r0 == 128) goto next
+            jitlib::Op::make_Jump("copy"),          // goto copy
+            jitlib::Op::make_Label("next"),         //
+            jitlib::Op::make_AddImm(3, 255),        // r3 -= 1
+            jitlib::Op::make_JumpIfZero(3, "done"), // if (r3 == 0) goto done
+            jitlib::Op::make_Jump("pass"),          // goto pass
+            jitlib::Op::make_Label("done"),         //
+            jitlib::Op::make_Return(),
+        };
+    }
+
+    // Keeps a running total in a memory cell, updating it twice a step of a
+    // 256 step loop.
+    jitlib::Ops cells()
+    {
+        return {
+            jitlib::Op::make_SetImm(3, 0),          // r3 = 0
+            jitlib::Op::make_Label("loop"),         //
+            jitlib::Op::make_SetImm(1, 7),          // r1 = 7
+            jitlib::Op::make_Load(0, 1),            // r0 = mem[r1]
+            jitlib::Op::make_AddReg(0, 3),          // r0 += r3
+            jitlib::Op::make_Store(1, 0),           // mem[r1] = r0
+            jitlib::Op::make_Load(2, 1),            // r2 = mem[r1]
+            jitlib::Op::make_AddImm(2, 1),          // r2 += 1
+            jitlib::Op::make_Store(1, 2),           // mem[r1] = r2
+            jitlib::Op::make_AddImm(3, 1),          // r3 += 1
+            jitlib::Op::make_JumpIfZero(3, "done"), // if (r3 == 0) goto done
+            jitlib::Op::make_Jump("loop"),          // goto loop
+            jitlib::Op::make_Label("done"),         //
+            jitlib::Op::make_Return(),
+        };
+    }
+
+    // Recurses 200 deep, 64 times over.
+    jitlib::Ops recursion()
+    {
+        return {
+            jitlib::Op::make_SetImm(3, 64),         // r3 = 64
+            jitlib::Op::make_Label("outer"),        //
+            jitlib::Op::make_SetImm(0, 200),        // r0 = 200
+            jitlib::Op::make_Call("recurse"),       // recurse()
+            jitlib::Op::make_AddImm(3, 255),        // r3 -= 1
+            jitlib::Op::make_JumpIfZero(3, "done"), // if (r3 == 0) goto done
+            jitlib::Op::make_Jump("outer"),         // goto outer
+            jitlib::Op::make_Label("done"),         //
+            jitlib::Op::make_Return(),              //
+            jitlib::Op::make_Label("recurse"),      //
+            jitlib::Op::make_AddImm(1, 1),          // r1 += 1
+            jitlib::Op::make_AddImm(0, 255),        // r0 -= 1
+            jitlib::Op::make_JumpIfZero(0, "base"), // if (r0 == 0) goto base
+            jitlib::Op::make_Call("recurse"),       // recurse()
+            jitlib::Op::make_Label("base"),         //
+            jitlib::Op::make_Return(),
+        };
+    }
+
+    // Calls out on every iteration of a 256 step loop, like examples/print.cxx.
+    jitlib::Ops callouts()
+    {
+        return {
+            jitlib::Op::make_SetImm(3, 0),          // r3 = 0
+            jitlib::Op::make_Label("loop"),         //
+            jitlib::Op::make_AddImm(0, 1),          // r0 += 1
+            jitlib::Op::make_CallOut(tally),        // tally()
+            jitlib::Op::make_AddImm(3, 1),          // r3 += 1
+            jitlib::Op::make_JumpIfZero(3, "done"), // if (r3 == 0) goto done
+            jitlib::Op::make_Jump("loop"),          // goto loop
+            jitlib::Op::make_Label("done"),         //
+            jitlib::Op::make_Return(),
+        };
+    }
+
+    // As examples/fib.cxx.
+    jitlib::Ops fib()
+    {
+        return {
+            jitlib::Op::make_SetImm(3, 0),            // r3 = 0
+            jitlib::Op::make_SetImm(0, 1),            // r0 = 1
+            jitlib::Op::make_SetImm(1, 1),            // r1 = 1
+            jitlib::Op::make_Label("begin"),          //
+            jitlib::Op::make_SetReg(2, 1),            // r2 = r1
+            jitlib::Op::make_AddReg(2, 0),            // r2 += r0
+            jitlib::Op::make_SetReg(0, 1),            // r0 = r1
+            jitlib::Op::make_SetReg(1, 2),            // r1 = r2
+            jitlib::Op::make_Store(3, 0),             // mem[r3] = r0
+            jitlib::Op::make_AddImm(3, 1),            // r3 += 1
+            jitlib::Op::make_JumpIfZero(3, "return"), // if (r3 == 0) goto return
+            jitlib::Op::make_Jump("begin"),           // goto begin
+            jitlib::Op::make_Label("return"),         //
+            jitlib::Op::make_Return(),
+        };
+    }
+
+    Summary summarise(std::vector<double> samples)
+    {
+        std::sort(samples.begin(), samples.end());
+        std::size_t const n = samples.size();
+        double const median = n % 2 != 0 ? samples[n / 2] : (samples[n / 2 - 1] + samples[n / 2]) / 2;
+        double const mean = std::accumulate(samples.begin(), samples.end(), 0.0) / static_cast<double>(n);
+        double variance = 0;
+        for (double sample : samples)
+        {
+            variance += (sample - mean) * (sample - mean);
+        }
+        double const stddev = n > 1 ? std::sqrt(variance / static_cast<double>(n - 1)) : 0.0;
+        return Summary{samples.front(), median, mean, stddev};
+    }
+
+    // Calls |func| for the warm-up time, working out how many calls make a
+    // sample, then takes |config.repeat| samples of ns per call.
+    template <typename Func>
+    Summary measure(Config const &config, Func &&func)
+    {
+        std::size_t calls = 0;
+        auto const start = Clock::now();
+        auto elapsed = Clock::duration{};
+        while (calls == 0 || elapsed < config.warmup)
+        {
+            func();
+            calls++;
+            elapsed = Clock::now() - start;
+        }
+        double const per_call = static_cast<double>(elapsed.count()) / static_cast<double>(calls);
+        double const per_sample = static_cast<double>(Clock::duration(config.time).count()) / static_cast<double>(config.repeat);
+        std::size_t const batch = std::max<std::size_t>(1, static_cast<std::size_t>(per_sample / per_call));
+
+        std::vector<double> samples;
+        for (std::size_t r = 0; r < config.repeat; r++)
+        {
+            auto const begin = Clock::now();
+            for (std::size_t i = 0; i < batch; i++)
+            {
+                func();
+            }
+            std::chrono::duration<double, std::nano> const took = Clock::now() - begin;
+            samples.push_back(took.count() / static_cast<double>(batch));
+        }
+        return summarise(std::move(samples));
+    }
+
+    jitlib::CompileOptions compile_options(Config const &config)
+    {
+        jitlib::CompileOptions options;
+        options.optimised = config.optimised;
+        return options;
+    }
+
+    // As measure(), but only timing compile() and not freeing what it made.
+    Summary measure_compile(Config const &config, jitlib::Ops const &ops)
+    {
+        jitlib::CompileOptions const options = compile_options(config);
+        auto const warmup_end = Clock::now() + config.warmup;
+        while (Clock::now() < warmup_end)
+        {
+            jitlib::compile(ops, options);
+        }
+        std::vector<double> samples;
+        for (std::size_t r = 0; r < config.repeat; r++)
+        {
+            auto const begin = Clock::now();
+            auto const code = jitlib::compile(ops, options);
+            std::chrono::duration<double, std::nano> const took = Clock::now() - begin;
+            samples.push_back(took.count());
+        }
+        return summarise(std::move(samples));
+    }
+
+    Result run_workload(Config const &config, Workload const &workload)
+    {
+        std::uint64_t tallied = 0;
+        jitlib::ExecutionEnvironment env{};
+        env.userdata = &tallied;
+
+        // Count what a run executes, which also checks it finishes
+        jitlib::OpCounters counters;
+        if (jitlib::run(workload.ops, env, counters) != jitlib::Status::Returned)
+        {
+            std::fprintf(stderr, "%s didn't return\n", workload.name);
+            std::exit(EXIT_FAILURE);
+        }
+
+        Result result{};
+        result.workload = &workload;
+        result.ops = std::accumulate(counters.executed.begin(), counters.executed.end(), std::uint64_t{});
+        result.interpreter = measure(config, [&]
+                                     { jitlib::run(workload.ops, env); });
+        auto const code = jitlib::compile(workload.ops, compile_options(config));
+        result.code_size = code.size();
+        result.jit = measure(config, [&]
+                             { code.run(env); });
+        result.compile = measure_compile(config, workload.ops);
+        return result;
+    }
+
+    ScalingPoint run_point(Config const &config, Dimension const &dimension, double value)
+    {
+        // Split the time between the seeds
+        Config per_seed = config;
+        per_seed.warmup /= kSeeds;
+        per_seed.time /= kSeeds;
+
+        ScalingPoint point{&dimension, value, 0, 0, 0, 0, 0};
+        for (std::uint64_t seed = 0; seed < kSeeds; seed++)
+        {
+            jitlib::GenerateOptions options;
+            options.ops = 256;
+            dimension.apply(options, value);
+            point.ops = options.ops;
+            jitlib::Ops const ops = jitlib::generate(options, seed);
+
+            jitlib::ExecutionEnvironment env{};
+            jitlib::OpCounters counters;
+            jitlib::run(ops, env, counters);
+            point.executed += static_cast<double>(std::accumulate(counters.executed.begin(), counters.executed.end(), std::uint64_t{}));
+            point.compile += measure_compile(per_seed, ops).median;
+            auto const code = jitlib::compile(ops, compile_options(config));
+            point.bytes_per_op += static_cast<double>(code.size()) / static_cast<double>(options.ops);
+            point.run += measure(per_seed, [&]
+                                 { code.run(env); })
+                             .median;
+        }
+        point.executed /= kSeeds;
+        point.compile /= kSeeds;
+        point.bytes_per_op /= kSeeds;
+        point.run /= kSeeds;
+        return point;
+    }
+
+    // How compiling, code size and running grow with each way a program
+    // can get bigger, to catch anything superlinear
+    std::vector<Dimension> const &dimensions()
+    {
+        static std::vector<Dimension> const dimensions{
+            {"ops", {16, 32, 64, 128, 256}, [](jitlib::GenerateOptions &options, double value)
+             { options.ops = static_cast<std::size_t>(value); }},
+            {"labels", {0, 0.1, 0.2, 0.4}, [](jitlib::GenerateOptions &options, double value)
+             { options.labels = value; }},
+            {"branches", {0, 0.1, 0.2, 0.3, 0.4}, [](jitlib::GenerateOptions &options, double value)
+             { options.branches = value; }},
+            {"callouts", {0, 0.05, 0.1, 0.2}, [](jitlib::GenerateOptions &options, double value)
+             { options.callouts = value; }},
+            {"calls", {0, 0.05, 0.1, 0.2}, [](jitlib::GenerateOptions &options, double value)
+             {
+                 options.subroutines = 8;
+                 options.calls = value;
+             }},
+        };
+        return dimensions;
+    }
+
+    double per_second(std::uint64_t ops, Summary const &summary)
+    {
+        return static_cast<double>(ops) * 1e9 / summary.median;
+    }
+
+    void print_table(std::vector<Result> const &results)
+    {
+        std::printf("%-10s %10s %14s %14s %8s %12s %10s %8s\n", "workload", "ops/run", "interp ns/run", "jit ns/run", "speedup",
+                    "jit Mops/s", "compile us", "bytes");
+        for (Result const &result : results)
+        {
+            std::printf("%-10s %10llu %14.0f %14.0f %7.1fx %12.1f %10.1f %8zu\n", result.workload->name, static_cast<unsigned long long>(result.ops),
+                        result.interpreter.median, result.jit.median, result.interpreter.median / result.jit.median,
+                        per_second(result.ops, result.jit) / 1e6, result.compile.median / 1e3, result.code_size);
+        }
+        std::printf("Medians, see --json for the spread\n");
+    }
+
+    // Compile time per op is also given relative to the first point of
+    // each dimension, which should stay about flat.
+    void print_scaling(std::vector<ScalingPoint> const &points)
+    {
+        std::printf("%-10s %8s %6s %10s %12s %10s %12s %12s\n", "dimension", "value", "ops", "executed", "compile us", "growth", "bytes/op",
+                    "jit ns/run");
+        double first = 0;
+        for (std::size_t i = 0; i < points.size(); i++)
+        {
+            ScalingPoint const &point = points[i];
+            double const per_op = point.compile / static_cast<double>(point.ops);
+            if (i == 0 || point.dimension != points[i - 1].dimension)
+            {
+                first = per_op;
+            }
+            std::printf("%-10s %8g %6zu %10.0f %12.1f %9.2fx %12.1f %12.0f\n", point.dimension->name, point.value, point.ops, point.executed,
+                        point.compile / 1e3, per_op / first, point.bytes_per_op, point.run);
+        }
+    }
+
+    std::string to_json(Summary const &summary)
+    {
+        char buffer[160];
+        std::snprintf(buffer, sizeof(buffer), "{\"min\": %.1f, \"median\": %.1f, \"mean\": %.1f, \"stddev\": %.1f}", summary.min, summary.median,
+                      summary.mean, summary.stddev);
+        return buffer;
+    }
+
+    void print_json(Config const &config, int cpu, std::vector<Result> const &results, std::vector<ScalingPoint> const &points)
+    {
+        jitlib::CpuFeatures const &features = jitlib::host_cpu_features();
+        std::printf("{\n  \"config\": {\"repeat\": %zu, \"warmup_ms\": %lld, \"time_ms\": %lld, \"cpu\": %d, \"optimised\": %s},\n",
+                    config.repeat, static_cast<long long>(config.warmup.count()), static_cast<long long>(config.time.count()), cpu,
+                    config.optimised ? "true" : "false");
+        std::printf("  \"features\": {\"bmi1\": %s, \"bmi2\": %s, \"lzcnt\": %s, \"avx2\": %s, \"erms\": %s, \"fsrm\": %s, \"alignment\": %zu},\n",
+                    features.bmi1 ? "true" : "false", features.bmi2 ? "true" : "false", features.lzcnt ? "true" : "false",
+                    features.avx2 ? "true" : "false", features.erms ? "true" : "false", features.fsrm ? "true" : "false", features.alignment);
+        std::printf("  \"benchmarks\": [\n");
+        for (std::size_t i = 0; i < results.size(); i++)
+        {
+            Result const &result = results[i];
+            std::printf("    {\"name\": \"%s\", \"description\": \"%s\", \"ops_per_run\": %llu, \"code_size\": %zu,\n", result.workload->name,
+                        result.workload->description, static_cast<unsigned long long>(result.ops), result.code_size);
+            std::printf("     \"interpreter\": {\"ns_per_run\": %s, \"ops_per_second\": %.0f},\n", to_json(result.interpreter).c_str(),
+                        per_second(result.ops, result.interpreter));
+            std::printf("     \"jit\": {\"ns_per_run\": %s, \"ops_per_second\": %.0f},\n", to_json(result.jit).c_str(), per_second(result.ops, result.jit));
+            std::printf("     \"compile\": {\"ns\": %s}}%s\n", to_json(result.compile).c_str(), i + 1 != results.size() ? "," : "");
+        }
+        std::printf("  ],\n  \"scaling\": [\n");
+        for (std::size_t i = 0; i < points.size(); i++)
+        {
+            ScalingPoint const &point = points[i];
+            std::printf("    {\"dimension\": \"%s\", \"value\": %g, \"ops\": %zu, \"executed_per_run\": %.1f, \"compile_ns\": %.1f, "
+                        "\"bytes_per_op\": %.2f, \"ns_per_run\": %.1f}%s\n",
+                        point.dimension->name, point.value, point.ops, point.executed, point.compile, point.bytes_per_op, point.run,
+                        i + 1 != points.size() ? "," : "");
+        }
+        std::printf("  ]\n}\n");
+    }
+
+    [[noreturn]] void usage(char const *program)
+    {
+        std::fprintf(stderr,
+                     "Usage: %s [--json] [--scaling] [--optimised] [--filter NAME] [--repeat N] [--warmup MS] [--time MS] [--cpu N | --no-pin]\n"
+                     "  --json       print the results as JSON\n"
+                     "  --scaling    measure generated programs growing in size, labels,\n"
+                     "               branches, callouts and calls instead of the workloads\n"
+                     "  --optimised  compile with CompileOptions::optimised\n"
+                     "  --filter     only run workloads or dimensions whose name contains NAME\n"
+                     "  --repeat     samples to take of each measurement (20)\n"
+                     "  --warmup     ms to run each before sampling it (100)\n"
+                     "  --time       ms to spend sampling each (500)\n"
+                     "  --cpu        CPU to pin to, default the one it starts on\n"
+                     "  --no-pin     leave it to the scheduler\n",
+                     program);
+        std::exit(EXIT_FAILURE);
+    }
+
+    Config parse(int argc, char **argv)
+    {
+        Config config;
+        for (int i = 1; i < argc; i++)
+        {
+            std::string_view const arg = argv[i];
+            auto value = [&]
+            {
+                if (i + 1 == argc)
+                {
+                    usage(argv[0]);
+                }
+                return argv[++i];
+            };
+            auto number = [&]
+            {
+                char *end = nullptr;
+                char const *const text = value();
+                long long const parsed = std::strtoll(text, &end, 10);
+                if (*end != '\0' || parsed < 0)
+                {
+                    usage(argv[0]);
+                }
+                return parsed;
+            };
+            if (arg == "--json")
+            {
+                config.json = true;
+            }
+            else if (arg == "--scaling")
+            {
+                config.scaling = true;
+            }
+            else if (arg == "--optimised")
+            {
+                config.optimised = true;
+            }
+            else if (arg == "--filter")
+            {
+                config.filter = value();
+            }
+            else if (arg == "--repeat")
+            {
+                config.repeat = static_cast<std::size_t>(std::max(1LL, number()));
+            }
+            else if (arg == "--warmup")
+            {
+                config.warmup = std::chrono::milliseconds(number());
+            }
+            else if (arg == "--time")
+            {
+                config.time = std::chrono::milliseconds(number());
+            }
+            else if (arg == "--cpu")
+            {
+                config.cpu = static_cast<int>(number());
+            }
+            else if (arg == "--no-pin")
+            {
+                config.pin = false;
+            }
+            else
+            {
+                usage(argv[0]);
+            }
+        }
+        return config;
+    }
+
+    // Keeps us on one CPU, so that migrations don't show up as noise.
+    // Returns it, or -1 if we aren't pinned.
+    int pin(Config const &config)
+    {
+        if (!config.pin)
+        {
+            return -1;
+        }
+        int const cpu = config.cpu >= 0 ? config.cpu : sched_getcpu();
+        cpu_set_t set;
+        CPU_ZERO(&set);
+        if (cpu >= 0)
+        {
+            CPU_SET(cpu, &set);
+        }
+        if (cpu < 0 || sched_setaffinity(0, sizeof(set), &set) != 0)
+        {
+            std::fprintf(stderr, "Couldn't pin to CPU %d: %s\n", cpu, std::strerror(errno));
+            return -1;
+        }
+        return cpu;
+    }
+}
+
+int main(int argc, char **argv)
+{
+    Config const config = parse(argc, argv);
+    int const cpu = pin(config);
+
+    std::vector<Workload> const workloads{
+        {"arith", "register arithmetic in nested loops", arithmetic()},
+        {"copy", "loads and stores copying memory", copy()},
+        {"cells", "loads and stores to the same memory cell", cells()},
+        {"calls", "deep recursion through Call", recursion()},
+        {"callouts", "a callout on every loop iteration", callouts()},
+        {"fib", "examples/fib.cxx", fib()},
+    };
+    auto selected = [&](char const *name)
+    {
+        if (std::string_view(name).find(config.filter) == std::string_view::npos)
+        {
+            return false;
+        }
+        if (!config.json)
+        {
+            std::fprintf(stderr, "Running %s...\n", name);
+        }
+        return true;
+    };
+    std::vector<Result> results;
+    std::vector<ScalingPoint> points;
+    if (config.scaling)
+    {
+        for (Dimension const &dimension : dimensions())
+        {
+            if (selected(dimension.name))
+            {
+                for (double value : dimension.values)
+                {
+                    points.push_back(run_point(config, dimension, value));
+                }
+            }
+        }
+    }
+    else
+    {
+        for (Workload const &workload : workloads)
+        {
+            if (selected(workload.name))
+            {
+                results.push_back(run_workload(config, workload));
+            }
+        }
+    }
+
+    if (config.json)
+    {
+        print_json(config, cpu, results, points);
+    }
+    else if (config.scaling)
+    {
+        print_scaling(points);
+    }
+    else
+    {
+        print_table(results);
+    }
+}
@@ -0,0 +1,74 @@
+#include <jitlib/jitlib.h>
+#include <cstdio>
+
+namespace
+{
+    // Stands in for the real callout, which is only linked into the binary
+    // using the object
+    void count(jitlib::ExecutionEnvironment &) {}
+}
+
+int main(int argc, char **argv)
+{
+    if (argc != 2)
+    {
+        fprintf(stderr, "Usage: %s <output.o>\n", argv[0]);
+        return 1;
+    }
+
+    jitlib::Module const fib{"fib", {
+        // r3 = 0
+        jitlib::Op::make_SetImm(3, 0),
+
+        // r0 = 1, r1 = 1
+        jitlib::Op::make_SetImm(0, 1),
+        jitlib::Op::make_SetImm(1, 1),
+
+        jitlib::Op::make_Label("begin"),
+
+        // r2 = r1 + r0
+        jitlib::Op::make_SetReg(2, 1),
+        jitlib::Op::make_AddReg(2, 0),
+
+        // (r0, r1) = (r1, r2)
+        jitlib::Op::make_SetReg(0, 1),
+        jitlib::Op::make_SetReg(1, 2),
+
+        // mem[r3] = r0
+        jitlib::Op::make_Store(3, 0),
+
+        // r3++
+        jitlib::Op::make_AddImm(3, 1),
+
+        // if (r3 == 0) return
+        jitlib::Op::make_JumpIfZero(3, "return"),
+        jitlib::Op::make_Jump("begin"),
+        jitlib::Op::make_Label("return"),
+        jitlib::Op::make_Return(),
+    }};
+    jitlib::Module const countdown{"countdown", {
+        // r0 = 3
+        jitlib::Op::make_SetImm(0, 3),
+
+        jitlib::Op::make_Label("loop"),
+
+        // count(), then give way
+        jitlib::Op::make_CallOut(count),
+        jitlib::Op::make_Yield(),
+
+        // if (--r0 == 0) return
+        jitlib::Op::make_AddImm(0, 255),
+        jitlib::Op::make_JumpIfZero(0, "return"),
+        jitlib::Op::make_Jump("loop"),
+        jitlib::Op::make_Label("return"),
+        jitlib::Op::make_Return(),
+    }};
+
+    // Only assume the baseline instruction set, the object may well be run
+    // somewhere other than where it was built
+    jitlib::CallOutRegistry registry;
+    registry.add("count", count);
+    jitlib::CompileOptions options;
+    options.features = jitlib::CpuFeatures{};
+    jitlib::write_object(argv[1], {fib, countdown}, registry, options);
+}
@@ -0,0 +1,39 @@
+#include <jitlib/jitlib.h>
+#include <chrono>
+#include <cstdio>
+
+// Written by jitaot at build time
+extern "C" jitlib::NativeProgram const fib;
+extern "C" jitlib::NativeProgram const countdown;
+
+extern "C" void count(jitlib::ExecutionEnvironment &env)
+{
+    printf("count, r0 = %u\n", env.regs[0]);
+}
+
+int main()
+{
+    jitlib::ExecutionEnvironment env{};
+    jitlib::run(fib, env);
+    for (std::size_t i = 0; i < 16; i++)
+    {
+        printf("%03u ", env.mem[i]);
+    }
+    printf("\n");
+
+    constexpr std::size_t num_times = 1'000;
+    auto start = std::chrono::high_resolution_clock::now();
+    for (std::size_t i = 0; i < num_times; i++)
+    {
+        jitlib::run(fib, env);
+    }
+    auto end = std::chrono::high_resolution_clock::now();
+    printf("Linked in: %fns\n", (end - start).count() / double(num_times));
+
+    // Suspends and resumes like any other code
+    env = {};
+    while (jitlib::run(countdown, env) == jitlib::Status::Yielded)
+    {
+        printf("yielded at pc %u\n", env.pc);
+    }
+}
@@ -0,0 +1,71 @@
+#include <jitlib/jitlib.h>
+#include <algorithm>
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <thread>
+#include <vector>
+
+namespace
+{
+    void count(jitlib::ExecutionEnvironment &env)
+    {
+        env.regs[3] += 1;
+    }
+
+    // A chain of small subroutines filling the whole program
+    jitlib::Ops make_program()
+    {
+        jitlib::Ops program{};
+        std::size_t i = 0;
+        program[i++] = jitlib::Op::make_Call("f00");
+        program[i++] = jitlib::Op::make_Return();
+        for (int f = 0; i + 6 <= program.size(); f++)
+        {
+            char const name[]{'f', char('0' + f / 10), char('0' + f % 10), '\0'};
+            char const next[]{'f', char('0' + (f + 1) / 10), char('0' + (f + 1) % 10), '\0'};
+            bool const last = i + 12 > program.size();
+            program[i++] = jitlib::Op::make_Label(name);
+            program[i++] = jitlib::Op::make_AddImm(0, 1);
+            program[i++] = jitlib::Op::make_Store(0, 0);
+            program[i++] = jitlib::Op::make_CallOut(count);
+            program[i++] = last ? jitlib::Op::make_Nop() : jitlib::Op::make_Call(next);
+            program[i++] = jitlib::Op::make_Return();
+        }
+        return program;
+    }
+
+    // Median wall time of compiling |program|, in microseconds
+    double profile(jitlib::Ops const &program, jitlib::CompileOptions const &options)
+    {
+        constexpr std::size_t num_times = 1'000;
+        std::vector<double> times;
+        for (std::size_t i = 0; i < num_times; i++)
+        {
+            auto start = std::chrono::high_resolution_clock::now();
+            auto code = jitlib::compile(program, options);
+            auto end = std::chrono::high_resolution_clock::now();
+            times.push_back(std::chrono::duration<double, std::micro>(end - start).count());
+        }
+        std::nth_element(times.begin(), times.begin() + times.size() / 2, times.end());
+        return times[times.size() / 2];
+    }
+}
+
+int main(int argc, char **argv)
+{
+    // Up to one thread per core unless told otherwise
+    auto const program = make_program();
+    std::size_t const max_threads = argc > 1 ? std::strtoul(argv[1], nullptr, 10) : std::max(1u, std::thread::hardware_concurrency());
+
+    double serial = 0;
+    printf("threads  compile (us)  speedup\n");
+    for (std::size_t threads = 1; threads <= max_threads; threads *= 2)
+    {
+        jitlib::CompileOptions options;
+        options.threads = threads;
+        double const time = profile(program, options);
+        serial = threads == 1 ? time : serial;
+        printf("%7zu  %12.2f  %6.2fx\n", threads, time, serial / time);
+    }
+}
@@ -42,40 +42,45 @@ namespace
         }
         return str;
     }
-}
 
-int main()
-{
-    jitlib::Ops const program{
-        // r3 = 0
-        jitlib::Op::make_SetImm(3, 0),
+    constexpr jitlib::Ops fib_program()
+    {
+        return {
+            // r3 = 0
+            jitlib::Op::make_SetImm(3, 0),
+
+            // r0 = 1, r1 = 1
+            jitlib::Op::make_SetImm(0, 1),
+            jitlib::Op::make_SetImm(1, 1),
 
-        // r0 = 1, r1 = 1
-        jitlib::Op::make_SetImm(0, 1),
-        jitlib::Op::make_SetImm(1, 1),
+            jitlib::Op::make_Label("begin"),
 
-        jitlib::Op::make_Label("begin"),
+            // r2 = r1 + r0
+            jitlib::Op::make_SetReg(2, 1),
+            jitlib::Op::make_AddReg(2, 0),
 
-        // r2 = r1 + r0
-        jitlib::Op::make_SetReg(2, 1),
-        jitlib::Op::make_AddReg(2, 0),
+            // (r0, r1) = (r1, r2)
+            jitlib::Op::make_SetReg(0, 1),
+            jitlib::Op::make_SetReg(1, 2),
 
-        // (r0, r1) = (r1, r2)
-        jitlib::Op::make_SetReg(0, 1),
-        jitlib::Op::make_SetReg(1, 2),
+            // mem[r3] = r0
+            jitlib::Op::make_Store(3, 0),
 
-        // mem[r3] = r0
-        jitlib::Op::make_Store(3, 0),
+            // r3++
+            jitlib::Op::make_AddImm(3, 1),
 
-        // r3++
-        jitlib::Op::make_AddImm(3, 1),
+            // if (r3 == 0) return
+            jitlib::Op::make_JumpIfZero(3, "return"),
+            jitlib::Op::make_Jump("begin"),
+            jitlib::Op::make_Label("return"),
+            jitlib::Op::make_Return(),
+        };
+    }
+}
 
-        // if (r3 == 0) return
-        jitlib::Op::make_JumpIfZero(3, "return"),
-        jitlib::Op::make_Jump("begin"),
-        jitlib::Op::make_Label("return"),
-        jitlib::Op::make_Return(),
-    };
+int main()
+{
+    jitlib::Ops const program = fib_program();
 
     {
         jitlib::ExecutionEnvironment env{};
@@ -96,4 +101,27 @@ int main()
 
         printf("Compiled: %fns\n%s\n", compiled_time, compiled_mem.c_str());
     }
+
+    {
+        jitlib::ExecutionEnvironment env{};
+        jitlib::run_specialised<fib_program>(env);
+        auto specialised_mem = to_string(env);
+        auto specialised_time = profile(jitlib::run_specialised<fib_program>, env);
+
+        printf("Specialised: %fns\n%s\n", specialised_time, specialised_mem.c_str());
+    }
+
+    {
+        jitlib::CompileOptions options;
+        options.metered = true;
+        auto code = jitlib::compile(program, options);
+
+        jitlib::ExecutionEnvironment env{};
+        env.fuel = ~std::uint64_t{};
+        run_compiled(code, env);
+        auto compiled_mem = to_string(env);
+        auto compiled_time = profile(run_compiled, code, env);
+
+        printf("Compiled (metered): %fns\n%s\n", compiled_time, compiled_mem.c_str());
+    }
 }
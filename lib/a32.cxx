@@ -7,6 +7,10 @@
 // registers: r0,r1,r2,r3
 // r12 - base data ptr / ExecutionEnvironment
 // r14 - temporary
+// r11 - stack pointer on entry, so that we can exit from any depth
+//
+// Guest Calls use the native stack, so suspending copies their return
+// addresses out to |NativeFrames| and resuming pushes them back.
 //
 // Fake link register is pushed before branch, emulating x86 call.
 // Return is then simply a pop{pc}.
@@ -16,7 +20,13 @@ namespace jitlib
     static_assert(jitlib::kNumRegisters == 4, "Native code will need changing");
     static_assert(std::is_same_v<Value, uint8_t>, "Native code will need changing");
     static_assert(offsetof(ExecutionEnvironment, mem) == 0, "ExecutionEnvironment and data ptr aren't interchangeable");
-    static_assert(std::is_same_v<NativeRegister, std::uint32_t>, "Registers are 32bit");
+    static_assert(offsetof(ExecutionEnvironment, regs) == 0x100, "Native code will need changing");
+    static_assert(offsetof(ExecutionEnvironment, pc) == 0x104, "Native code will need changing");
+    static_assert(offsetof(ExecutionEnvironment, fuel) == 0x110, "Native code will need changing");
+    static_assert(offsetof(ExecutionEnvironment, pending) == 0x159, "Native code will need changing");
+    static_assert(sizeof(void *) == 4, "Pointers are 32bit");
+    static_assert(offsetof(NativeFrames, frames) == 4, "Native code will need changing");
+    static_assert(kMaxCallDepth < 0x100, "Native code will need changing");
 
     namespace
     {
@@ -208,123 +218,346 @@ namespace jitlib
             return 1;
         }
 
-        std::size_t handle_callout(Op const &op, uint32_t *buffer)
+        std::size_t handle_conditional(Op const &op, uint32_t *buffer)
+        {
+            // Every A32 encoding carries a condition field, so lower the op as
+            // usual and then swap "always" for "not equal".
+            std::size_t size = 0;
+            switch (op.type)
+            {
+            case OpType::Nop:
+                return 0;
+
+            case OpType::SetReg:
+            case OpType::SetImm:
+                size = handle_set(op, buffer);
+                break;
+
+            case OpType::AddReg:
+            case OpType::AddImm:
+            case OpType::Negate:
+                size = handle_arithmetic(op, buffer);
+                break;
+
+            default:
+                throw std::logic_error("Unknown conditional op");
+            }
+            if (buffer != nullptr)
+            {
+                for (std::size_t i = 0; i < size; i++)
+                {
+                    buffer[i] = (buffer[i] & 0x0fffffff) | 0x10000000; // ne
+                }
+            }
+            return size;
+        }
+
+        std::size_t handle_exit(std::size_t pc, Status status, uint32_t const *buffer_base, uint32_t *buffer, std::size_t exit_offset)
+        {
+            uint32_t ins[]{
+                // r14 = pc | (status << 8)
+                0xe3a0e000 | uint32_t(static_cast<Value>(pc)), // mov r14, #pc
+                0xe38eec00 | uint32_t(status),                 // orr r14, r14, #(status << 8)
+                0xea000000,                                    // b <exit>
+            };
+            if (buffer != nullptr)
+            {
+                std::size_t relative_address = exit_offset / 4 - (buffer + std::size(ins) - buffer_base);
+                relative_address -= 1;
+                std::end(ins)[-1] |= (relative_address & 0x00ffffff);
+                std::copy(std::begin(ins), std::end(ins), buffer);
+            }
+            return std::size(ins);
+        }
+
+        std::size_t handle_charge(std::size_t pc, uint32_t const *buffer_base, uint32_t *buffer, std::size_t exit_offset)
+        {
+            uint32_t const ins[]{
+                // Decrement the 64bit |ExecutionEnvironment::fuel|
+                0xe59ce110, // ldr r14, [r12, #272]
+                0xe25ee001, // subs r14, r14, #1
+                0xe58ce110, // str r14, [r12, #272]
+                0xe59ce114, // ldr r14, [r12, #276]
+                0xe2cee000, // sbc r14, r14, #0
+                0xe58ce114, // str r14, [r12, #276]
+                0xe35e0000, // cmp r14, #0
+                0x059ce110, // ldreq r14, [r12, #272]
+                0x035e0000, // cmpeq r14, #0
+                0x1a000002, // bne <continue>
+            };
+            if (buffer != nullptr)
+            {
+                buffer = std::copy(std::begin(ins), std::end(ins), buffer);
+            }
+            return std::size(ins) + handle_exit(pc, Status::OutOfFuel, buffer_base, buffer, exit_offset);
+        }
+
+        std::size_t handle_count(std::uint64_t *counter, uint32_t *buffer)
         {
-            auto helper_thunk = [](NativeState *state, CallOutFunc func)
+            uint32_t ins[]{
+                // Borrow r0 to increment the 64bit counter
+                0xe52d0004, // push {r0}
+                0xe59fe000, // ldr r14, [pc, #0]
+                0xea000000, // b 1f
+                0x00000000, // <counter>
+                0xe59e0000, // 1: ldr r0, [r14]
+                0xe2900001, // adds r0, r0, #1
+                0xe58e0000, // str r0, [r14]
+                0xe59e0004, // ldr r0, [r14, #4]
+                0xe2a00000, // adc r0, r0, #0
+                0xe58e0004, // str r0, [r14, #4]
+                0xe49d0004, // pop {r0}
+            };
+            if (buffer != nullptr)
             {
-                auto *env = static_cast<ExecutionEnvironment *>(state->data);
-                std::copy(std::begin(state->regs), std::end(state->regs), std::begin(env->regs));
-                func(*env);
-                std::copy(std::begin(env->regs), std::end(env->regs), std::begin(state->regs));
+                memcpy(&ins[3], &counter, 4);
+                std::copy(std::begin(ins), std::end(ins), buffer);
+            }
+            return std::size(ins);
+        }
+
+        // Bumps |counters[address]|, for the address in |reg|, which may be
+        // the r0 borrowed, so it's added on first
+        std::size_t handle_access(std::uint64_t *counters, uint32_t reg, uint32_t *buffer)
+        {
+            uint32_t ins[]{
+                0xe59fe000,       // ldr r14, [pc, #0]
+                0xea000000,       // b 1f
+                0x00000000,       // <counters>
+                0xe08ee180 | reg, // 1: add r14, r14, reg, lsl #3
+                0xe52d0004,       // push {r0}
+                0xe59e0000,       // ldr r0, [r14]
+                0xe2900001,       // adds r0, r0, #1
+                0xe58e0000,       // str r0, [r14]
+                0xe59e0004,       // ldr r0, [r14, #4]
+                0xe2a00000,       // adc r0, r0, #0
+                0xe58e0004,       // str r0, [r14, #4]
+                0xe49d0004,       // pop {r0}
+            };
+            if (buffer != nullptr)
+            {
+                memcpy(&ins[2], &counters, 4);
+                std::copy(std::begin(ins), std::end(ins), buffer);
+            }
+            return std::size(ins);
+        }
+
+        std::size_t handle_pending(std::size_t pc, uint32_t const *buffer_base, uint32_t *buffer, std::size_t exit_offset)
+        {
+            uint32_t const ins[]{
+                0xe5dce159, // ldrb r14, [r12, #345]
+                0xe35e0000, // cmp r14, #0
+                0x0a000002, // beq <continue>
             };
+            if (buffer != nullptr)
+            {
+                buffer = std::copy(std::begin(ins), std::end(ins), buffer);
+            }
+            return std::size(ins) + handle_exit(pc, Status::Pending, buffer_base, buffer, exit_offset);
+        }
 
+        std::size_t handle_callout(Op const &op, std::size_t index, uint32_t const *buffer_base, uint32_t *buffer, std::vector<Relocation> *relocations,
+                                   bool position_independent)
+        {
             uint32_t const enter[]{
-                // Give us some stack
-                0xe24dd01c, // sub sp, sp, #28
+                // Store current register values to |ExecutionEnvironment::regs|
+                0xe5cc0100, // strb r0, [r12, #256]
+                0xe5cc1101, // strb r1, [r12, #257]
+                0xe5cc2102, // strb r2, [r12, #258]
+                0xe5cc3103, // strb r3, [r12, #259]
 
-                // Store current register values to a |NativeState| on the stack
-                0xe58d0000, // str r0, [sp, #0]
-                0xe58d1004, // str r1, [sp, #4]
-                0xe58d2008, // str r2, [sp, #8]
-                0xe58d300c, // str r3, [sp, #12]
-                0xe58dc010, // str r12, [sp, #16]
+                // Align the stack, keeping hold of the old one and r12
+                0xe1a0e00d, // mov r14, sp
+                0xe3cdd007, // bic sp, sp, #7
+                0xe92d5000, // push {r12, r14}
 
                 // Setup first arg
-                0xe1a0000d, // mov r0, sp
-
-                // Setup second arg
+                0xe1a0000c, // mov r0, r12
+            };
+            // Setup call
+            uint32_t const absolute[]{
                 0xe59f1000, // ldr r1, [pc, #0]
-                0xea000000, // b call_thunk
+                0xea000000, // b leave
                 0x00000000, // <callout>
             };
-            uint32_t const call_thunk[]{
-                // Setup call
-                0xe59f2000, // ldr r2, [pc, #0]
+            uint32_t const relative[]{
+                0xe59f1004, // ldr r1, [pc, #4]
+                0xe79f1001, // 1: ldr r1, [pc, r1]
                 0xea000000, // b leave
-                0x00000000, // <thunk>
+                0x00000000, // <slot - 1b - 8>
             };
             uint32_t const leave[]{
-                // Call into the helper thunk
-                0xe12fff32, // blx r2
-
-                // Read off each register from |NativeState|
-                0xe59d0000, // ldr r0, [sp, #0]
-                0xe59d1004, // ldr r1, [sp, #4]
-                0xe59d2008, // ldr r2, [sp, #8]
-                0xe59d300c, // ldr r3, [sp, #12]
-                0xe59dc010, // ldr r12, [sp, #16]
-
-                // Restore stack
-                0xe28dd01c, // add sp, sp, #28
+                // Call into the callout
+                0xe12fff31, // blx r1
+
+                // Restore r12 and the stack
+                0xe8bd5000, // pop {r12, r14}
+                0xe1a0d00e, // mov sp, r14
+
+                // Read back each register from |ExecutionEnvironment::regs|
+                0xe5dc0100, // ldrb r0, [r12, #256]
+                0xe5dc1101, // ldrb r1, [r12, #257]
+                0xe5dc2102, // ldrb r2, [r12, #258]
+                0xe5dc3103, // ldrb r3, [r12, #259]
             };
+            std::size_t const setup = position_independent ? std::size(relative) : std::size(absolute);
             if (buffer != nullptr)
             {
                 buffer = std::copy(std::begin(enter), std::end(enter), buffer);
-                // Patch callout address
-                memcpy(buffer - 1, &op.func, 4);
-
-                buffer = std::copy(std::begin(call_thunk), std::end(call_thunk), buffer);
-                // Patch thunk address
-                auto *thunk_ptr = static_cast<void (*)(NativeState *, CallOutFunc)>(helper_thunk);
-                memcpy(buffer - 1, &thunk_ptr, 4);
+                if (position_independent)
+                {
+                    // pc reads as the word holding the slot's distance
+                    buffer = std::copy(std::begin(relative), std::end(relative), buffer);
+                    if (relocations != nullptr)
+                    {
+                        relocations->push_back(Relocation{static_cast<std::size_t>(buffer - 1 - buffer_base) * 4, index});
+                    }
+                }
+                else
+                {
+                    // Patch callout address
+                    buffer = std::copy(std::begin(absolute), std::end(absolute), buffer);
+                    memcpy(buffer - 1, &op.func, 4);
+                    if (relocations != nullptr)
+                    {
+                        relocations->push_back(Relocation{static_cast<std::size_t>(buffer - 1 - buffer_base) * 4, index});
+                    }
+                }
 
                 buffer = std::copy(std::begin(leave), std::end(leave), buffer);
             }
-            return std::size(enter) + std::size(call_thunk) + std::size(leave);
+            return std::size(enter) + setup + std::size(leave);
         }
 
-        std::size_t preamble32(uint32_t *buffer)
+        std::size_t encode_conditional32(Op const &jump, Op const *ops, std::size_t count, uint32_t *buffer)
         {
-            uint32_t const enter[]{
-                // Store return address.
-                0xe52de004, // push {r14}
+            auto reg = encode_reg(jump.regA);
+            uint32_t const ins[]{
+                0xe3500000 | (reg << 16), // cmp reg, #0
+            };
+            std::size_t size = std::size(ins);
+            if (buffer != nullptr)
+            {
+                std::copy(std::begin(ins), std::end(ins), buffer);
+            }
+            for (std::size_t i = 0; i < count; i++)
+            {
+                size += handle_conditional(ops[i], buffer != nullptr ? buffer + size : nullptr);
+            }
+            return size;
+        }
 
-                // Store address of |NativeState| to the stack
-                0xe52d0004, // push {r0}
+        std::size_t preamble32(uint32_t *buffer)
+        {
+            uint32_t enter[]{
+                // Store return address and keep hold of the |NativeFrames|
+                // below the stack pointer on entry.
+                0xe92d4800, // push {r11, r14}
+                0xe52d2004, // push {r2}
+                0xe1a0b00d, // mov r11, sp
 
-                // Read off each register from |NativeState|
-                0xe5901004, // ldr r1, [r0, #4]
-                0xe5902008, // ldr r2, [r0, #8]
-                0xe590300c, // ldr r3, [r0, #12]
-                0xe590c010, // ldr r12, [r0, #16]
-                0xe5900000, // ldr r0, [r0, #0]
+                // Keep hold of the |ExecutionEnvironment|
+                0xe1a0c000, // mov r12, r0
 
                 // Save return address, x86 call style.
                 0xe28fe004, // add r14, pc, #4
                 0xe52de004, // push {r14}
-                // Call into the rest of the code
-                0xe1a00000, // nop
+                // Call into the rest of the code, via resume
+                0xea000000, // b <resume>
             };
             uint32_t const leave[]{
-                // Load |NativeState| address from stack
-                0xe49dc004, // pop {r12}
-
-                // Store new register values back to |NativeState|
-                0xe58c0000, // str r0, [r12, #0]
-                0xe58c1004, // str r1, [r12, #4]
-                0xe58c2008, // str r2, [r12, #8]
-                0xe58c300c, // str r3, [r12, #12]
+                // Store new register values back to |ExecutionEnvironment::regs|
+                0xe5cc0100, // strb r0, [r12, #256]
+                0xe5cc1101, // strb r1, [r12, #257]
+                0xe5cc2102, // strb r2, [r12, #258]
+                0xe5cc3103, // strb r3, [r12, #259]
 
-                // Return
-                0xe49df004, // pop {pc}
+                // Return |Status::Returned|
+                0xe3a00000, // mov r0, #0
+                0xe28dd004, // add sp, sp, #4
+                0xe8bd8800, // pop {r11, pc}
 
                 // Safety guard
                 0xe7f000f0, // udf
                 0xe7f000f0, // udf
                 0xe7f000f0, // udf
             };
+            uint32_t const resume[]{
+                // Push the return addresses of any Calls we're resuming inside
+                0xe4923004, // ldr r3, [r2], #4
+                0xe0822103, // add r2, r2, r3, lsl #2
+                0xe2533001, // 1: subs r3, r3, #1
+                0xa5320004, // ldrge r0, [r2, #-4]!
+                0xa52d0004, // pushge {r0}
+                0xcafffffb, // bgt 1b
+                0xe1a0e001, // mov r14, r1
+
+                // Read off each register from |ExecutionEnvironment::regs|
+                0xe5dc0100, // ldrb r0, [r12, #256]
+                0xe5dc1101, // ldrb r1, [r12, #257]
+                0xe5dc2102, // ldrb r2, [r12, #258]
+                0xe5dc3103, // ldrb r3, [r12, #259]
+
+                // Start executing
+                0xe1a0f00e, // mov pc, r14
+            };
             if (buffer != nullptr)
             {
+                std::end(enter)[-1] |= (std::size(leave) - 1) & 0x00ffffff;
                 buffer = std::copy(std::begin(enter), std::end(enter), buffer);
-                // Patch call address
-                uint32_t const relative_address = std::size(leave);
-                buffer[-1] = 0xea000000 + relative_address - 1, // b <offset>
                 buffer = std::copy(std::begin(leave), std::end(leave), buffer);
+                buffer = std::copy(std::begin(resume), std::end(resume), buffer);
+            }
+            return std::size(enter) + std::size(leave) + std::size(resume);
+        }
+
+        std::size_t exit_stub32(uint32_t *buffer)
+        {
+            uint32_t const ins[]{
+                // Store register values back to |ExecutionEnvironment::regs|
+                0xe5cc0100, // strb r0, [r12, #256]
+                0xe5cc1101, // strb r1, [r12, #257]
+                0xe5cc2102, // strb r2, [r12, #258]
+                0xe5cc3103, // strb r3, [r12, #259]
+
+                // Split r14 into |ExecutionEnvironment::pc| and the status
+                0xe5cce104, // strb r14, [r12, #260]
+                0xe1a0042e, // lsr r0, r14, #8
+
+                // Copy out the return addresses of the Calls we're in, from
+                // the top of the stack down to the one returning to the
+                // preamble, keeping at most kMaxCallDepth
+                0xe59b1000,                 // ldr r1, [r11]
+                0xe24b2004,                 // sub r2, r11, #4
+                0xe042200d,                 // sub r2, r2, sp
+                0xe1a02122,                 // lsr r2, r2, #2
+                0xe4812004,                 // str r2, [r1], #4
+                0xe3520000 | kMaxCallDepth, // cmp r2, #kMaxCallDepth
+                0x83a02000 | kMaxCallDepth, // movhi r2, #kMaxCallDepth
+                0xe2522001,                 // 1: subs r2, r2, #1
+                0xa49d3004,                 // popge {r3}
+                0xa4813004,                 // strge r3, [r1], #4
+                0xcafffffb,                 // bgt 1b
+
+                // Return
+                0xe1a0d00b, // mov sp, r11
+                0xe28dd004, // add sp, sp, #4
+                0xe8bd8800, // pop {r11, pc}
+
+                // Safety guard
+                0xe7f000f0, // udf
+                0xe7f000f0, // udf
+                0xe7f000f0, // udf
+            };
+            if (buffer != nullptr)
+            {
+                std::copy(std::begin(ins), std::end(ins), buffer);
             }
-            return std::size(enter) + std::size(leave);
+            return std::size(ins);
         }
 
-        std::size_t encode32(Op const &op, uint32_t const *buffer_base, uint32_t *buffer, LabelToOffsetMap const *label_to_offset)
+        std::size_t encode32(Op const &op, std::size_t index, uint32_t const *buffer_base, uint32_t *buffer, LabelToOffsetMap const *label_to_offset, std::size_t exit_offset,
+                             std::vector<Relocation> *relocations, bool position_independent)
         {
             switch (op.type)
             {
@@ -356,7 +589,13 @@ namespace jitlib
                 return 0;
 
             case OpType::CallOut:
-                return handle_callout(op, buffer);
+            {
+                std::size_t const size = handle_callout(op, index, buffer_base, buffer, relocations, position_independent);
+                return size + handle_pending(index + 1, buffer_base, buffer != nullptr ? buffer + size : nullptr, exit_offset);
+            }
+
+            case OpType::Yield:
+                return handle_exit(index + 1, Status::Yielded, buffer_base, buffer, exit_offset);
             }
             return 0;
         }
@@ -370,10 +609,83 @@ namespace jitlib
             return preamble32(buffer32) * 4;
         }
 
-        std::size_t encode(Op const &op, uint8_t const *buffer_base, uint8_t *buffer, LabelToOffsetMap const *label_to_offset) {
-            uint32_t const *buffer_base32 = reinterpret_cast<uint32_t const*>(buffer_base);
+        std::size_t exit_stub(uint8_t *buffer)
+        {
+            uint32_t *buffer32 = reinterpret_cast<uint32_t *>(buffer);
+            return exit_stub32(buffer32) * 4;
+        }
+
+        std::size_t encode(Op const &op, std::size_t index, EncodeContext const &ctx, uint8_t *buffer) {
+            uint32_t const *buffer_base32 = reinterpret_cast<uint32_t const*>(ctx.buffer_base);
             uint32_t *buffer32 = reinterpret_cast<uint32_t *>(buffer);
-            return encode32(op, buffer_base32, buffer32, label_to_offset) * 4;
+            auto at = [&](std::size_t offset)
+            { return buffer32 != nullptr ? buffer32 + offset : nullptr; };
+            std::size_t size = 0;
+            if (ctx.charges != nullptr && (*ctx.charges)[index])
+            {
+                size = handle_charge(index, buffer_base32, buffer32, ctx.exit_offset);
+            }
+            if (ctx.counters != nullptr)
+            {
+                // Only once it's not going to stop for fuel and run it again
+                size += handle_count(&ctx.counters->executed[index], at(size));
+            }
+            if (ctx.memory_counters != nullptr && op.type == OpType::Load)
+            {
+                size += handle_count(&ctx.memory_counters->accesses[index], at(size));
+                size += handle_access(ctx.memory_counters->reads.data(), encode_reg(op.regB), at(size));
+            }
+            else if (ctx.memory_counters != nullptr && op.type == OpType::Store)
+            {
+                size += handle_count(&ctx.memory_counters->accesses[index], at(size));
+                size += handle_access(ctx.memory_counters->writes.data(), encode_reg(op.regA), at(size));
+            }
+            size += encode32(op, index, buffer_base32, at(size), ctx.label_to_offset, ctx.exit_offset, ctx.relocations, ctx.position_independent);
+            if (ctx.counters != nullptr && op.type == OpType::JumpIfZero)
+            {
+                size += handle_count(&ctx.counters->fell_through[index], at(size));
+            }
+            return size * 4;
+        }
+
+        std::size_t exit(std::size_t pc, Status status, EncodeContext const &ctx, uint8_t *buffer)
+        {
+            uint32_t const *buffer_base32 = reinterpret_cast<uint32_t const *>(ctx.buffer_base);
+            uint32_t *buffer32 = reinterpret_cast<uint32_t *>(buffer);
+            return handle_exit(pc, status, buffer_base32, buffer32, ctx.exit_offset) * 4;
+        }
+
+        std::size_t encode_conditional(Op const &jump, Op const *ops, std::size_t count, uint8_t *buffer)
+        {
+            uint32_t *buffer32 = reinterpret_cast<uint32_t *>(buffer);
+            return encode_conditional32(jump, ops, count, buffer32) * 4;
+        }
+
+        std::size_t pad(std::size_t length, uint8_t *buffer)
+        {
+            ASSERT(length % 4 == 0);
+            if (buffer != nullptr)
+            {
+                std::fill_n(reinterpret_cast<uint32_t *>(buffer), length / 4, 0xe1a00000); // nop
+            }
+            return length;
+        }
+
+        std::size_t jump(std::size_t offset, EncodeContext const &ctx, uint8_t *buffer)
+        {
+            uint32_t const *buffer_base32 = reinterpret_cast<uint32_t const *>(ctx.buffer_base);
+            uint32_t *buffer32 = reinterpret_cast<uint32_t *>(buffer);
+            uint32_t ins[]{
+                0xea000000, // b <offset>
+            };
+            if (buffer32 != nullptr)
+            {
+                std::size_t relative_address = offset / 4 - (buffer32 + std::size(ins) - buffer_base32);
+                relative_address -= 1;
+                std::end(ins)[-1] |= (relative_address & 0x00ffffff);
+                std::copy(std::begin(ins), std::end(ins), buffer32);
+            }
+            return std::size(ins) * 4;
         }
     }
 }
@@ -0,0 +1,213 @@
+#include "internal.h"
+#include <jitlib/async.h>
+#include <cerrno>
+#include <system_error>
+#include <sys/epoll.h>
+#include <unistd.h>
+
+namespace jitlib
+{
+    namespace
+    {
+        // What the callout that left the program pending is waiting for
+        struct PendingIo
+        {
+            int fd = -1; // -1 to just give other tasks a turn
+            std::uint32_t events = 0;
+            CallOutFunc completion = nullptr;
+        };
+
+        thread_local PendingIo *t_pending = nullptr;
+        thread_local EventLoop *t_running = nullptr;
+
+        // Points |t_pending| at |io| while the program runs
+        struct PendingScope
+        {
+            explicit PendingScope(PendingIo &io) : previous{std::exchange(t_pending, &io)} {}
+            ~PendingScope() { t_pending = previous; }
+            PendingIo *previous;
+        };
+
+        template <typename Runner>
+        Task<Status> run_pending(Runner runner, ExecutionEnvironment &env)
+        {
+            for (;;)
+            {
+                PendingIo io;
+                Status status;
+                {
+                    PendingScope scope(io);
+                    status = runner(env);
+                }
+                if (status != Status::Pending)
+                {
+                    co_return status;
+                }
+                if (io.fd >= 0)
+                {
+                    co_await EventLoop::current().wait(io.fd, io.events);
+                }
+                else
+                {
+                    co_await EventLoop::current().yield();
+                }
+                if (io.completion != nullptr)
+                {
+                    io.completion(env);
+                }
+            }
+        }
+    }
+
+    void EventLoop::FdAwaiter::await_suspend(std::coroutine_handle<> handle)
+    {
+        m_handle = handle;
+        epoll_event event{};
+        event.events = m_events;
+        event.data.ptr = this;
+        if (epoll_ctl(m_loop.m_epoll, EPOLL_CTL_ADD, m_fd, &event) == 0)
+        {
+            m_loop.m_waiting++;
+        }
+        else if (errno == EPERM)
+        {
+            // Regular files can't be polled, they're always ready
+            m_loop.m_ready.push_back(handle);
+        }
+        else
+        {
+            throw std::system_error(errno, std::generic_category(), "epoll_ctl");
+        }
+    }
+
+    EventLoop::EventLoop() : m_epoll{epoll_create1(EPOLL_CLOEXEC)}, m_waiting{0}
+    {
+        if (m_epoll < 0)
+        {
+            throw std::system_error(errno, std::generic_category(), "epoll_create1");
+        }
+    }
+
+    EventLoop::~EventLoop()
+    {
+        close(m_epoll);
+    }
+
+    EventLoop &EventLoop::current()
+    {
+        if (t_running != nullptr)
+        {
+            return *t_running;
+        }
+        thread_local EventLoop fallback;
+        return fallback;
+    }
+
+    void EventLoop::spawn(Task<Status> task)
+    {
+        m_ready.push_back(task.m_handle);
+        m_spawned.push_back(std::move(task));
+    }
+
+    void EventLoop::run()
+    {
+        run_until(nullptr);
+    }
+
+    Status EventLoop::run(Task<Status> task)
+    {
+        m_ready.push_back(task.m_handle);
+        run_until(&task);
+        return task.await_resume();
+    }
+
+    void EventLoop::run_until(Task<Status> const *task)
+    {
+        auto *const previous = std::exchange(t_running, this);
+        struct Restore
+        {
+            EventLoop *previous;
+            ~Restore() { t_running = previous; }
+        } const restore{previous};
+
+        std::vector<std::coroutine_handle<>> resuming;
+        epoll_event events[16];
+        for (;;)
+        {
+            // Run everything that's ready, including anything that becomes
+            // ready along the way
+            while (!m_ready.empty())
+            {
+                resuming.swap(m_ready);
+                for (auto handle : resuming)
+                {
+                    handle.resume();
+                }
+                resuming.clear();
+            }
+
+            // Drop spawned tasks once they're done, passing on any failure
+            for (auto it = m_spawned.begin(); it != m_spawned.end();)
+            {
+                if (!it->done())
+                {
+                    ++it;
+                    continue;
+                }
+                Task<Status> done = std::move(*it);
+                it = m_spawned.erase(it);
+                done.await_resume();
+            }
+            if (m_spawned.empty() && (task == nullptr || task->done()))
+            {
+                return;
+            }
+
+            // Block until some descriptors are ready
+            if (m_waiting == 0)
+            {
+                throw std::logic_error("Event loop has unfinished tasks but nothing to wait for");
+            }
+            int const count = epoll_wait(m_epoll, events, std::size(events), -1);
+            if (count < 0)
+            {
+                if (errno == EINTR)
+                {
+                    continue;
+                }
+                throw std::system_error(errno, std::generic_category(), "epoll_wait");
+            }
+            for (int i = 0; i < count; i++)
+            {
+                auto *const awaiter = static_cast<FdAwaiter *>(events[i].data.ptr);
+                epoll_ctl(m_epoll, EPOLL_CTL_DEL, awaiter->m_fd, nullptr);
+                m_waiting--;
+                awaiter->m_events = events[i].events;
+                m_ready.push_back(awaiter->m_handle);
+            }
+        }
+    }
+
+    Task<Status> run_async(CompiledCode const &code, ExecutionEnvironment &env)
+    {
+        return run_pending([&code](ExecutionEnvironment &e)
+                           { return code.run(e); },
+                           env);
+    }
+
+    Task<Status> run_async(Ops const &ops, ExecutionEnvironment &env)
+    {
+        return run_pending([&ops](ExecutionEnvironment &e)
+                           { return run(ops, e); },
+                           env);
+    }
+
+    void await_fd(ExecutionEnvironment &env, int fd, std::uint32_t events, CallOutFunc completion)
+    {
+        env.pending = true;
+        if (t_pending != nullptr)
+        {
+            *t_pending = PendingIo{fd, events, completion};
+        }
+    }
+}
@@ -0,0 +1,439 @@
+#include "internal.h"
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <optional>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+namespace jitlib
+{
+    namespace
+    {
+        // Bump whenever the file layout changes.
+        constexpr std::uint32_t kCacheVersion = 1;
+        constexpr char kCacheMagic[8]{'j', 'i', 't', 'c', 'a', 'c', 'h', 'e'};
+
+        struct CacheHeader
+        {
+            char magic[8];
+            std::uint32_t version;
+            std::uint32_t page_size;
+            std::uint64_t key;
+            std::uint64_t metadata_size; // straight after the header
+            std::uint64_t code_offset;   // page aligned
+            std::uint64_t code_size;     // page aligned
+            std::uint64_t used;
+            std::uint64_t compiled;
+            std::uint64_t exit_offset;
+        };
+
+        class Writer
+        {
+        public:
+            template <typename T>
+            void put(T const &value)
+            {
+                auto const *bytes = reinterpret_cast<uint8_t const *>(&value);
+                m_data.insert(m_data.end(), bytes, bytes + sizeof(T));
+            }
+            std::vector<uint8_t> &data() { return m_data; }
+
+        private:
+            std::vector<uint8_t> m_data;
+        };
+
+        class Reader
+        {
+        public:
+            Reader(uint8_t const *data, std::size_t size) : m_data{data}, m_size{size} {}
+            template <typename T>
+            T get()
+            {
+                if (m_size < sizeof(T))
+                {
+                    throw std::out_of_range("Truncated cache entry");
+                }
+                T value;
+                memcpy(&value, m_data, sizeof(T));
+                m_data += sizeof(T);
+                m_size -= sizeof(T);
+                return value;
+            }
+
+        private:
+            uint8_t const *m_data;
+            std::size_t m_size;
+        };
+
+        // Everything about an op that the code depends on, in a fixed size
+        // record each. Callouts are left out as they're relocated.
+        constexpr std::size_t kOpRecordSize = 2 + sizeof(Label);
+
+        std::vector<uint8_t> serialise_ops(Ops const &ops)
+        {
+            std::vector<uint8_t> data(ops.size() * kOpRecordSize);
+            uint8_t *record = data.data();
+            for (Op const &op : ops)
+            {
+                record[0] = static_cast<uint8_t>(op.type);
+                record[1] = op.regA;
+                switch (op.type)
+                {
+                case OpType::Jump:
+                case OpType::JumpIfZero:
+                case OpType::Call:
+                case OpType::Label:
+                    memcpy(record + 2, op.label.data.data(), sizeof(Label));
+                    break;
+                case OpType::CallOut:
+                    break;
+                default:
+                    record[2] = op.regB;
+                    break;
+                }
+                record += kOpRecordSize;
+            }
+            return data;
+        }
+
+        // FNV-1a, a word at a time
+        std::uint64_t hash(std::uint64_t seed, std::vector<uint8_t> const &data)
+        {
+            std::uint64_t value = seed;
+            std::size_t i = 0;
+            for (; i + 8 <= data.size(); i += 8)
+            {
+                std::uint64_t word;
+                memcpy(&word, data.data() + i, 8);
+                value = (value ^ word) * 0x100000001b3;
+            }
+            for (; i < data.size(); i++)
+            {
+                value = (value ^ data[i]) * 0x100000001b3;
+            }
+            return value;
+        }
+
+        // One of each op, to catch the backend lowering anything differently
+        // from when an entry was saved.
+        void put_backend(Writer &writer, CpuFeatures const &features, bool metered)
+        {
+            OpFlags charges;
+            charges.fill(true);
+            LabelToOffsetMap const label_to_offset{{"probe", 0}};
+            std::vector<uint8_t> code(native::preamble(nullptr) + native::exit_stub(nullptr));
+            native::exit_stub(code.data() + native::preamble(code.data()));
+            auto lower = [&](auto const &encode)
+            {
+                std::size_t const offset = code.size();
+                code.resize(offset + encode(nullptr, nullptr));
+                encode(code.data(), code.data() + offset);
+            };
+            for (int type = 0; type <= static_cast<int>(OpType::Yield); type++)
+            {
+                for (Register reg = 0; reg < kNumRegisters; reg++)
+                {
+                    Op op{static_cast<OpType>(type), reg, {.regB = static_cast<Register>((reg + 1) % kNumRegisters)}};
+                    if (op.type == OpType::Jump || op.type == OpType::JumpIfZero || op.type == OpType::Call || op.type == OpType::Label)
+                    {
+                        op.label = "probe";
+                    }
+                    else if (op.type == OpType::CallOut)
+                    {
+                        op.func = nullptr;
+                    }
+                    lower([&](uint8_t const *base, uint8_t *buffer)
+                          { return native::encode(op, 0, EncodeContext{base, &label_to_offset, features, 0, metered ? &charges : nullptr}, buffer); });
+                    if (type <= static_cast<int>(OpType::Negate) && op.type != OpType::Return && op.type != OpType::Load && op.type != OpType::Store)
+                    {
+                        lower([&](uint8_t const *, uint8_t *buffer)
+                              { return native::encode_conditional(Op::make_JumpIfZero(reg, "probe"), &op, 1, buffer); });
+                    }
+                }
+            }
+            lower([&](uint8_t const *base, uint8_t *buffer)
+                  { return native::jump(0, EncodeContext{base, nullptr, features, 0, nullptr}, buffer); });
+            writer.data().insert(writer.data().end(), code.begin(), code.end());
+        }
+
+        // Hash of the backend's output for these settings, worked out once per
+        // thread for the last settings asked for.
+        std::uint64_t backend_fingerprint(CpuFeatures const &features, bool metered)
+        {
+            auto flags = [](CpuFeatures const &f, bool m)
+            { return std::array<bool, 7>{f.bmi1, f.bmi2, f.lzcnt, f.avx2, f.erms, f.fsrm, m}; };
+            thread_local std::optional<std::pair<CpuFeatures, bool>> last;
+            thread_local std::uint64_t fingerprint = 0;
+            if (last && flags(last->first, last->second) == flags(features, metered) && last->first.alignment == features.alignment)
+            {
+                return fingerprint;
+            }
+            Writer writer;
+            writer.put(kCacheVersion);
+            writer.put(features.alignment);
+            writer.put(flags(features, metered));
+            put_backend(writer, features, metered);
+            last.emplace(features, metered);
+            fingerprint = hash(0xcbf29ce484222325, writer.data());
+            return fingerprint;
+        }
+
+        std::uint64_t cache_key(std::vector<uint8_t> const &ops, CpuFeatures const &features, bool metered)
+        {
+            return hash(backend_fingerprint(features, metered), ops);
+        }
+
+        std::filesystem::path cache_path(std::filesystem::path const &directory, std::uint64_t key)
+        {
+            char name[32];
+            snprintf(name, sizeof(name), "%016llx.jit", static_cast<unsigned long long>(key));
+            return directory / name;
+        }
+
+        bool read_all(int fd, void *buffer, std::size_t size, off_t offset)
+        {
+            auto *bytes = static_cast<uint8_t *>(buffer);
+            while (size != 0)
+            {
+                ssize_t const count = pread(fd, bytes, size, offset);
+                if (count <= 0)
+                {
+                    return false;
+                }
+                bytes += count;
+                size -= count;
+                offset += count;
+            }
+            return true;
+        }
+
+        bool write_all(int fd, void const *buffer, std::size_t size)
+        {
+            auto const *bytes = static_cast<uint8_t const *>(buffer);
+            while (size != 0)
+            {
+                ssize_t const count = write(fd, bytes, size);
+                if (count <= 0)
+                {
+                    return false;
+                }
+                bytes += count;
+                size -= count;
+            }
+            return true;
+        }
+
+        // Closes the file descriptor on the way out
+        struct File
+        {
+            explicit File(int fd) : fd{fd} {}
+            ~File()
+            {
+                if (fd >= 0)
+                {
+                    close(fd);
+                }
+            }
+            int fd;
+        };
+    }
+
+    std::shared_ptr<CompiledCode::Image> load_cached(std::filesystem::path const &directory, Ops const &ops, CpuFeatures const &features, bool metered)
+    {
+        auto const serialised = serialise_ops(ops);
+        std::uint64_t const key = cache_key(serialised, features, metered);
+        File const file(open(cache_path(directory, key).c_str(), O_RDONLY | O_CLOEXEC));
+        CacheHeader header;
+        if (file.fd < 0 || !read_all(file.fd, &header, sizeof(header), 0))
+        {
+            return nullptr;
+        }
+        if (memcmp(header.magic, kCacheMagic, sizeof(kCacheMagic)) != 0 || header.version != kCacheVersion ||
+            header.page_size != static_cast<std::uint32_t>(sysconf(_SC_PAGE_SIZE)) || header.key != key)
+        {
+            return nullptr;
+        }
+        struct stat status;
+        if (fstat(file.fd, &status) != 0 || header.code_offset > static_cast<std::uint64_t>(status.st_size) ||
+            header.code_size > static_cast<std::uint64_t>(status.st_size) - header.code_offset ||
+            header.metadata_size > header.code_offset || header.used > header.code_size || header.compiled > header.used ||
+            header.exit_offset >= header.used)
+        {
+            return nullptr;
+        }
+        std::vector<uint8_t> metadata(header.metadata_size);
+        if (!read_all(file.fd, metadata.data(), metadata.size(), sizeof(header)))
+        {
+            return nullptr;
+        }
+
+        // Make sure it really is this program, then read where everything is
+        if (metadata.size() < serialised.size() || !std::equal(serialised.begin(), serialised.end(), metadata.begin()))
+        {
+            return nullptr;
+        }
+        auto image = std::make_shared<CompiledCode::Image>(ops);
+        image->used = header.used;
+        image->compiled = header.compiled;
+        image->exit_offset = header.exit_offset;
+        image->features = features;
+        image->metered = metered;
+        image->layout = empty_layout(ops);
+        std::vector<Relocation> relocations;
+        try
+        {
+            Reader reader(metadata.data() + serialised.size(), metadata.size() - serialised.size());
+            image->loop_heads = reader.get<OpFlags>();
+            image->charges = reader.get<OpFlags>();
+
+            // Offsets outside the code would be jumped to all the same, so a
+            // damaged entry is no better than a miss. Only the ends of ops
+            // can be at the very end of the mapping.
+            auto code_offset = [&](bool target, bool optional)
+            {
+                auto const value = reader.get<std::uint64_t>();
+                if ((!optional || value != CompiledCode::kNoEntry) && (value > header.used || (target && value >= header.code_size)))
+                {
+                    throw std::out_of_range("Offset outside the code");
+                }
+                return value;
+            };
+            Layout &layout = image->layout;
+            for (std::size_t i = 0; i < ops.size(); i++)
+            {
+                layout.entries[i] = code_offset(true, true);
+                layout.ends[i] = code_offset(false, true);
+            }
+            auto const labels = reader.get<std::uint64_t>();
+            layout.labels.reserve(labels);
+            layout.label_to_offset.reserve(labels);
+            for (auto count = labels; count != 0; count--)
+            {
+                Label label{""};
+                label.data = reader.get<std::array<char, 16>>();
+                auto const pc = reader.get<std::uint64_t>();
+                if (pc >= ops.size())
+                {
+                    return nullptr;
+                }
+                layout.labels[label] = pc;
+                layout.label_to_offset[label] = code_offset(true, false);
+            }
+            auto const returns = reader.get<std::uint64_t>();
+            layout.returns.reserve(returns);
+            for (auto count = returns; count != 0; count--)
+            {
+                auto const at = code_offset(true, false);
+                layout.returns[at] = reader.get<Value>();
+            }
+            for (auto count = reader.get<std::uint64_t>(); count != 0; count--)
+            {
+                auto const offset = reader.get<std::uint64_t>();
+                auto const index = reader.get<std::uint64_t>();
+                if (index >= ops.size() || ops[index].type != OpType::CallOut || offset + sizeof(CallOutFunc) > header.used)
+                {
+                    return nullptr;
+                }
+                relocations.push_back(Relocation{static_cast<std::size_t>(offset), static_cast<std::size_t>(index)});
+            }
+        }
+        catch (std::out_of_range const &)
+        {
+            return nullptr;
+        }
+        image->op_map = map_ops(image->layout);
+
+        // Map the code in and point it at this process's callouts, which only
+        // copies the pages that need it
+        void *const code = mmap(nullptr, header.code_size, PROT_READ | PROT_WRITE, MAP_PRIVATE, file.fd, static_cast<off_t>(header.code_offset));
+        if (code == MAP_FAILED)
+        {
+            return nullptr;
+        }
+        image->code = static_cast<uint8_t *>(code);
+        image->size = header.code_size;
+        for (Relocation const &relocation : relocations)
+        {
+            memcpy(image->code + relocation.offset, &ops[relocation.index].func, sizeof(CallOutFunc));
+        }
+        if (mprotect(code, header.code_size, PROT_READ | PROT_EXEC) != 0)
+        {
+            return nullptr;
+        }
+        return image;
+    }
+
+    void store_cached(std::filesystem::path const &directory, CompiledCode::Image const &image, std::vector<Relocation> const &relocations)
+    {
+        auto const serialised = serialise_ops(image.ops);
+        Writer metadata;
+        metadata.data() = serialised;
+        metadata.put(image.loop_heads);
+        metadata.put(image.charges);
+        Layout const &layout = image.layout;
+        for (std::size_t i = 0; i < image.ops.size(); i++)
+        {
+            metadata.put(static_cast<std::uint64_t>(layout.entries[i]));
+            metadata.put(static_cast<std::uint64_t>(layout.ends[i]));
+        }
+        metadata.put(static_cast<std::uint64_t>(layout.labels.size()));
+        for (auto const &[label, index] : layout.labels)
+        {
+            metadata.put(label.data);
+            metadata.put(static_cast<std::uint64_t>(index));
+            metadata.put(static_cast<std::uint64_t>(layout.label_to_offset.at(label)));
+        }
+        metadata.put(static_cast<std::uint64_t>(layout.returns.size()));
+        for (auto const &[offset, pc] : layout.returns)
+        {
+            metadata.put(static_cast<std::uint64_t>(offset));
+            metadata.put(pc);
+        }
+        metadata.put(static_cast<std::uint64_t>(relocations.size()));
+        for (Relocation const &relocation : relocations)
+        {
+            metadata.put(static_cast<std::uint64_t>(relocation.offset));
+            metadata.put(static_cast<std::uint64_t>(relocation.index));
+        }
+
+        auto const page_size = static_cast<std::size_t>(sysconf(_SC_PAGE_SIZE));
+        CacheHeader header{};
+        memcpy(header.magic, kCacheMagic, sizeof(kCacheMagic));
+        header.version = kCacheVersion;
+        header.page_size = static_cast<std::uint32_t>(page_size);
+        header.key = cache_key(serialised, image.features, image.metered);
+        header.metadata_size = metadata.data().size();
+        header.code_offset = (sizeof(header) + metadata.data().size() + page_size - 1) / page_size * page_size;
+        header.code_size = image.size;
+        header.used = image.used;
+        header.compiled = image.compiled;
+        header.exit_offset = image.exit_offset;
+
+        // Write it all out under a temporary name nobody else has, not even
+        // another thread storing the same entry, then move it into place so
+        // that nobody can load half an entry
+        std::error_code error;
+        std::filesystem::create_directories(directory, error);
+        auto const path = cache_path(directory, header.key);
+        std::string temporary = path.string() + ".XXXXXX";
+        bool written = false;
+        {
+            File const file(mkostemp(temporary.data(), O_CLOEXEC));
+            if (file.fd < 0)
+            {
+                return;
+            }
+            std::vector<uint8_t> const padding(header.code_offset - sizeof(header) - metadata.data().size());
+            written = fchmod(file.fd, 0644) == 0 && write_all(file.fd, &header, sizeof(header)) &&
+                      write_all(file.fd, metadata.data().data(), metadata.data().size()) && write_all(file.fd, padding.data(), padding.size()) &&
+                      write_all(file.fd, image.code, image.size);
+        }
+        if (!written || rename(temporary.c_str(), path.c_str()) != 0)
+        {
+            std::filesystem::remove(temporary, error);
+        }
+    }
+}
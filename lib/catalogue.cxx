@@ -0,0 +1,450 @@
+#include "internal.h"
+#include <jitlib/catalogue.h>
+#include <algorithm>
+#include <cerrno>
+#include <cstring>
+#include <fcntl.h>
+#include <fstream>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <system_error>
+#include <unistd.h>
+
+namespace jitlib
+{
+    namespace
+    {
+        // Bump whenever the file layout changes.
+        constexpr std::uint32_t kCatalogueVersion = 1;
+        constexpr char kCatalogueMagic[8]{'j', 'i', 't', 'p', 'r', 'o', 'g', 's'};
+        constexpr std::uint32_t kMaxSymbols = 1u << 24;
+
+        struct CatalogueHeader
+        {
+            char magic[8];
+            std::uint32_t version;
+            std::uint32_t programs;
+            std::uint32_t ops;
+            std::uint32_t labels;
+            std::uint32_t callouts;
+            std::uint32_t names_size;
+            std::uint64_t programs_offset; // ProgramEntry each
+            std::uint64_t ops_offset;      // PackedOp each
+            std::uint64_t labels_offset;   // Label each
+            std::uint64_t callouts_offset; // CallOutEntry each
+            std::uint64_t names_offset;    // callout names, one after another
+        };
+
+        struct ProgramEntry
+        {
+            std::uint32_t first; // index of its first op
+            std::uint32_t count; // ops after that are Nops
+        };
+
+        // Labels and callouts are given by a 24 bit index into their table,
+        // split across |regA| and |operand|. Jumps and Calls give the pc of
+        // their label, everything else its register or immediate.
+        struct PackedOp
+        {
+            std::uint8_t type;
+            std::uint8_t regA;
+            std::uint16_t operand;
+        };
+        static_assert(sizeof(PackedOp) == 4);
+
+        struct CallOutEntry
+        {
+            std::uint32_t offset; // into the names
+            std::uint32_t size;
+        };
+
+        PackedOp pack_symbol(OpType type, std::uint32_t index)
+        {
+            if (index >= kMaxSymbols)
+            {
+                throw std::length_error("Too many labels or callouts for a catalogue");
+            }
+            return PackedOp{static_cast<std::uint8_t>(type), static_cast<std::uint8_t>(index), static_cast<std::uint16_t>(index >> 8)};
+        }
+
+        std::uint32_t symbol(PackedOp const &op)
+        {
+            return op.regA | (std::uint32_t(op.operand) << 8);
+        }
+
+        // An op as interpret() reads it
+        struct UnpackedOp
+        {
+            OpType type;
+            Register regA;
+            Register regB;
+            Value imm;
+            std::uint32_t symbol;
+        };
+
+        // A program in the file, for interpret()
+        struct PackedProgram
+        {
+            PackedOp const *ops;
+            std::size_t count;
+            std::vector<CallOutFunc> const &funcs;
+
+            UnpackedOp operator[](Value pc) const
+            {
+                if (pc >= count)
+                {
+                    return UnpackedOp{OpType::Nop, 0, 0, 0, 0};
+                }
+                PackedOp const &op = ops[pc];
+                auto const type = static_cast<OpType>(op.type);
+                auto const low = static_cast<Value>(op.operand);
+                bool const reg_reg = type == OpType::Load || type == OpType::Store || type == OpType::SetReg || type == OpType::AddReg;
+                if (op.type > static_cast<std::uint8_t>(OpType::Yield) || (type != OpType::Label && type != OpType::CallOut && op.regA >= kNumRegisters) ||
+                    (reg_reg && low >= kNumRegisters))
+                {
+                    throw std::out_of_range("Bad op in catalogue at pc " + std::to_string(pc));
+                }
+                return UnpackedOp{type, op.regA, low, low, symbol(op)};
+            }
+            Value target(UnpackedOp const &op) const { return op.imm; }
+            CallOutFunc func(UnpackedOp const &op) const
+            {
+                if (op.symbol >= funcs.size())
+                {
+                    throw std::out_of_range("Bad callout in catalogue");
+                }
+                return funcs[op.symbol];
+            }
+        };
+
+        template <typename T>
+        T const *section(uint8_t const *data, std::size_t size, std::uint64_t offset, std::uint64_t count)
+        {
+            if (offset % alignof(T) != 0 || offset > size || count > (size - offset) / sizeof(T))
+            {
+                throw std::runtime_error("Catalogue is corrupt");
+            }
+            return reinterpret_cast<T const *>(data + offset);
+        }
+
+        template <typename T>
+        void write(std::ofstream &file, std::vector<T> const &items)
+        {
+            file.write(reinterpret_cast<char const *>(items.data()), static_cast<std::streamsize>(items.size() * sizeof(T)));
+        }
+
+        std::uint64_t align(std::uint64_t offset)
+        {
+            return (offset + 7) & ~std::uint64_t{7};
+        }
+    }
+
+    void CallOutRegistry::add(std::string name, CallOutFunc func)
+    {
+        auto const [it, added] = m_funcs.try_emplace(name, func);
+        if (!added)
+        {
+            // The function it replaces doesn't go by this name any more
+            auto const old = m_names.find(it->second);
+            if (old != m_names.end() && old->second == name)
+            {
+                m_names.erase(old);
+            }
+            it->second = func;
+        }
+        m_names[func] = std::move(name);
+    }
+
+    CallOutFunc CallOutRegistry::find(std::string_view name) const
+    {
+        auto it = m_funcs.find(std::string(name));
+        return it != m_funcs.end() ? it->second : nullptr;
+    }
+
+    std::string const *CallOutRegistry::name_of(CallOutFunc func) const
+    {
+        auto it = m_names.find(func);
+        return it != m_names.end() ? &it->second : nullptr;
+    }
+
+    void save_catalogue(std::filesystem::path const &path, std::vector<Ops> const &programs, CallOutRegistry const &registry)
+    {
+        std::vector<ProgramEntry> entries;
+        std::vector<PackedOp> packed;
+        std::vector<Label> labels;
+        std::unordered_map<Label, std::uint32_t> label_indices;
+        std::vector<CallOutEntry> callouts;
+        std::vector<char> names;
+        std::unordered_map<CallOutFunc, std::uint32_t> callout_indices;
+        for (Ops const &ops : programs)
+        {
+            // Leave off the Nops at the end
+            std::size_t count = ops.size();
+            while (count != 0 && ops[count - 1].type == OpType::Nop)
+            {
+                count--;
+            }
+            entries.push_back(ProgramEntry{static_cast<std::uint32_t>(packed.size()), static_cast<std::uint32_t>(count)});
+
+            auto const label_to_index = find_labels(ops);
+            for (std::size_t i = 0; i < count; i++)
+            {
+                Op const &op = ops[i];
+                switch (op.type)
+                {
+                case OpType::Label:
+                {
+                    auto [it, added] = label_indices.emplace(op.label, static_cast<std::uint32_t>(labels.size()));
+                    if (added)
+                    {
+                        labels.push_back(op.label);
+                    }
+                    packed.push_back(pack_symbol(op.type, it->second));
+                    break;
+                }
+                case OpType::CallOut:
+                {
+                    auto [it, added] = callout_indices.emplace(op.func, static_cast<std::uint32_t>(callouts.size()));
+                    if (added)
+                    {
+                        std::string const *name = registry.name_of(op.func);
+                        if (name == nullptr)
+                        {
+                            throw std::invalid_argument("Callout at pc " + std::to_string(i) + " isn't registered");
+                        }
+                        callouts.push_back(CallOutEntry{static_cast<std::uint32_t>(names.size()), static_cast<std::uint32_t>(name->size())});
+                        names.insert(names.end(), name->begin(), name->end());
+                    }
+                    packed.push_back(pack_symbol(op.type, it->second));
+                    break;
+                }
+                case OpType::Jump:
+                case OpType::JumpIfZero:
+                case OpType::Call:
+                {
+                    auto it = label_to_index.find(op.label);
+                    if (it == label_to_index.end())
+                    {
+                        throw std::logic_error("Unknown label: " + std::string(op.label.data.data()));
+                    }
+                    packed.push_back(PackedOp{static_cast<std::uint8_t>(op.type), op.regA, static_cast<std::uint16_t>(it->second)});
+                    break;
+                }
+                default:
+                    packed.push_back(PackedOp{static_cast<std::uint8_t>(op.type), op.regA, op.regB});
+                    break;
+                }
+            }
+        }
+
+        CatalogueHeader header{};
+        memcpy(header.magic, kCatalogueMagic, sizeof(kCatalogueMagic));
+        header.version = kCatalogueVersion;
+        header.programs = static_cast<std::uint32_t>(entries.size());
+        header.ops = static_cast<std::uint32_t>(packed.size());
+        header.labels = static_cast<std::uint32_t>(labels.size());
+        header.callouts = static_cast<std::uint32_t>(callouts.size());
+        header.names_size = static_cast<std::uint32_t>(names.size());
+        header.programs_offset = align(sizeof(header));
+        header.ops_offset = align(header.programs_offset + entries.size() * sizeof(ProgramEntry));
+        header.labels_offset = align(header.ops_offset + packed.size() * sizeof(PackedOp));
+        header.callouts_offset = align(header.labels_offset + labels.size() * sizeof(Label));
+        header.names_offset = align(header.callouts_offset + callouts.size() * sizeof(CallOutEntry));
+
+        std::ofstream file(path, std::ios::binary | std::ios::trunc);
+        auto pad_to = [&](std::uint64_t offset)
+        {
+            while (static_cast<std::uint64_t>(file.tellp()) < offset)
+            {
+                file.put('\0');
+            }
+        };
+        file.write(reinterpret_cast<char const *>(&header), sizeof(header));
+        pad_to(header.programs_offset);
+        write(file, entries);
+        pad_to(header.ops_offset);
+        write(file, packed);
+        pad_to(header.labels_offset);
+        write(file, labels);
+        pad_to(header.callouts_offset);
+        write(file, callouts);
+        pad_to(header.names_offset);
+        write(file, names);
+        if (!file)
+        {
+            throw std::runtime_error("Couldn't write catalogue " + path.string());
+        }
+    }
+
+    Catalogue::Catalogue(std::filesystem::path const &path, CallOutRegistry const &registry) : m_data{}, m_size{}
+    {
+        int const fd = open(path.c_str(), O_RDONLY | O_CLOEXEC);
+        if (fd < 0)
+        {
+            throw std::system_error(errno, std::generic_category(), "open " + path.string());
+        }
+        struct stat status;
+        if (fstat(fd, &status) != 0 || static_cast<std::size_t>(status.st_size) < sizeof(CatalogueHeader))
+        {
+            close(fd);
+            throw std::runtime_error("Not a catalogue: " + path.string());
+        }
+        m_size = static_cast<std::size_t>(status.st_size);
+        void *const data = mmap(nullptr, m_size, PROT_READ, MAP_PRIVATE, fd, 0);
+        close(fd);
+        if (data == MAP_FAILED)
+        {
+            throw std::system_error(errno, std::generic_category(), "mmap " + path.string());
+        }
+        m_data = static_cast<uint8_t const *>(data);
+
+        // Check it's a catalogue, with everything where it says it is, then
+        // look up the callouts it uses
+        try
+        {
+            auto const &header = *reinterpret_cast<CatalogueHeader const *>(m_data);
+            if (memcmp(header.magic, kCatalogueMagic, sizeof(kCatalogueMagic)) != 0 || header.version != kCatalogueVersion)
+            {
+                throw std::runtime_error("Not a catalogue: " + path.string());
+            }
+            auto const *programs = section<ProgramEntry>(m_data, m_size, header.programs_offset, header.programs);
+            section<PackedOp>(m_data, m_size, header.ops_offset, header.ops);
+            section<Label>(m_data, m_size, header.labels_offset, header.labels);
+            auto const *callouts = section<CallOutEntry>(m_data, m_size, header.callouts_offset, header.callouts);
+            auto const *names = section<char>(m_data, m_size, header.names_offset, header.names_size);
+            for (std::uint32_t i = 0; i < header.programs; i++)
+            {
+                if (programs[i].count > std::tuple_size_v<Ops> || programs[i].first > header.ops - programs[i].count)
+                {
+                    throw std::runtime_error("Catalogue is corrupt");
+                }
+            }
+            for (std::uint32_t i = 0; i < header.callouts; i++)
+            {
+                if (callouts[i].offset > header.names_size || callouts[i].size > header.names_size - callouts[i].offset)
+                {
+                    throw std::runtime_error("Catalogue is corrupt");
+                }
+                std::string_view const name(names + callouts[i].offset, callouts[i].size);
+                CallOutFunc const func = registry.find(name);
+                if (func == nullptr)
+                {
+                    throw std::out_of_range("Unknown callout: " + std::string(name));
+                }
+                m_funcs.push_back(func);
+            }
+        }
+        catch (...)
+        {
+            munmap(const_cast<uint8_t *>(m_data), m_size);
+            throw;
+        }
+    }
+
+    Catalogue::~Catalogue()
+    {
+        if (m_data != nullptr)
+        {
+            munmap(const_cast<uint8_t *>(m_data), m_size);
+        }
+    }
+
+    Catalogue::Catalogue(Catalogue &&o) : m_data{std::exchange(o.m_data, nullptr)}, m_size{o.m_size}, m_funcs{std::move(o.m_funcs)} {}
+    Catalogue &Catalogue::operator=(Catalogue &&o)
+    {
+        std::swap(m_data, o.m_data);
+        std::swap(m_size, o.m_size);
+        std::swap(m_funcs, o.m_funcs);
+        return *this;
+    }
+
+    std::size_t Catalogue::size() const
+    {
+        return m_data != nullptr ? reinterpret_cast<CatalogueHeader const *>(m_data)->programs : 0;
+    }
+
+    Status Catalogue::run(std::size_t index, ExecutionEnvironment &env) const
+    {
+        if (index >= size())
+        {
+            throw std::out_of_range("No program " + std::to_string(index));
+        }
+        auto const &header = *reinterpret_cast<CatalogueHeader const *>(m_data);
+        ProgramEntry const &program = reinterpret_cast<ProgramEntry const *>(m_data + header.programs_offset)[index];
+        auto const *ops = reinterpret_cast<PackedOp const *>(m_data + header.ops_offset) + program.first;
+        return interpret(PackedProgram{ops, program.count, m_funcs}, env);
+    }
+
+    Status Catalogue::run_from(std::size_t index, Label const &label, ExecutionEnvironment &env) const
+    {
+        if (index >= size())
+        {
+            throw std::out_of_range("No program " + std::to_string(index));
+        }
+        auto const &header = *reinterpret_cast<CatalogueHeader const *>(m_data);
+        ProgramEntry const &program = reinterpret_cast<ProgramEntry const *>(m_data + header.programs_offset)[index];
+        auto const *ops = reinterpret_cast<PackedOp const *>(m_data + header.ops_offset) + program.first;
+        auto const *labels = reinterpret_cast<Label const *>(m_data + header.labels_offset);
+
+        // Labels are interned, so look for the op declaring this one's index
+        // rather than unpacking the program
+        auto const *const interned = std::find(labels, labels + header.labels, label);
+        for (std::uint32_t pc = 0; interned != labels + header.labels && pc < program.count; pc++)
+        {
+            if (ops[pc].type == static_cast<std::uint8_t>(OpType::Label) && symbol(ops[pc]) == static_cast<std::uint32_t>(interned - labels))
+            {
+                env.pc = static_cast<Value>(pc);
+                return run(index, env);
+            }
+        }
+        throw std::out_of_range("Unknown label: " + std::string(label.data.data()));
+    }
+
+    Ops Catalogue::ops(std::size_t index) const
+    {
+        if (index >= size())
+        {
+            throw std::out_of_range("No program " + std::to_string(index));
+        }
+        auto const &header = *reinterpret_cast<CatalogueHeader const *>(m_data);
+        ProgramEntry const &program = reinterpret_cast<ProgramEntry const *>(m_data + header.programs_offset)[index];
+        auto const *packed = reinterpret_cast<PackedOp const *>(m_data + header.ops_offset) + program.first;
+        auto const *labels = reinterpret_cast<Label const *>(m_data + header.labels_offset);
+        PackedProgram const view{packed, program.count, m_funcs};
+
+        Ops ops{};
+        for (std::size_t i = 0; i < program.count; i++)
+        {
+            UnpackedOp const op = view[static_cast<Value>(i)];
+            switch (op.type)
+            {
+            case OpType::Label:
+                if (op.symbol >= header.labels)
+                {
+                    throw std::out_of_range("Bad label in catalogue");
+                }
+                ops[i] = Op{op.type, 0, {.label = labels[op.symbol]}};
+                break;
+            case OpType::CallOut:
+                ops[i] = Op{op.type, 0, {.func = view.func(op)}};
+                break;
+            case OpType::Jump:
+            case OpType::JumpIfZero:
+            case OpType::Call:
+            {
+                UnpackedOp const target = view[view.target(op)];
+                if (target.type != OpType::Label || target.symbol >= header.labels)
+                {
+                    throw std::out_of_range("Bad jump in catalogue");
+                }
+                ops[i] = Op{op.type, op.regA, {.label = labels[target.symbol]}};
+                break;
+            }
+            default:
+                ops[i] = Op{op.type, op.regA, {.regB = op.regB}};
+                break;
+            }
+        }
+        return ops;
+    }
+}
@@ -1,67 +1,951 @@
 #include "internal.h"
+#include <algorithm>
+#include <optional>
+#include <stdexcept>
+#include <string>
+#include <thread>
+#include <utility>
+#include <vector>
 
 namespace jitlib
 {
-    CompiledCode::CompiledCode() : m_code{}, m_size{} {}
-    CompiledCode::CompiledCode(void *code, std::size_t size) : m_code{code}, m_size{size} {}
-    CompiledCode::~CompiledCode()
+    namespace
     {
-        if (m_code != nullptr)
+        // Largest number of ops guarded by a JumpIfZero that we'll lower
+        // without a branch.
+        constexpr std::size_t kMaxConditionalOps = 2;
+
+        bool is_predicable(Op const &op)
+        {
+            switch (op.type)
+            {
+            case OpType::Nop:
+            case OpType::SetReg:
+            case OpType::SetImm:
+            case OpType::AddReg:
+            case OpType::AddImm:
+            case OpType::Negate:
+                return true;
+            default:
+                return false;
+            }
+        }
+
+        // Returns the number of ops skipped by a short forward JumpIfZero at
+        // |index| if they can be lowered as conditional register ops instead,
+        // or 0 if it should be left as a branch.
+        std::size_t conditional_length(Ops const &ops, std::size_t index)
+        {
+            Op const &jump = ops[index];
+            if (jump.type != OpType::JumpIfZero)
+            {
+                return 0;
+            }
+            std::size_t guarded = 0;
+            for (std::size_t i = index + 1; i < ops.size(); i++)
+            {
+                Op const &op = ops[i];
+                if (op.type == OpType::Label && op.label == jump.label)
+                {
+                    return guarded != 0 ? i - index - 1 : 0;
+                }
+                if (!is_predicable(op))
+                {
+                    return 0;
+                }
+                if (op.type != OpType::Nop && ++guarded > kMaxConditionalOps)
+                {
+                    return 0;
+                }
+            }
+            return 0;
+        }
+
+        bool is_backwards_jump(std::unordered_map<Label, std::size_t> const &label_to_index, Op const &op, std::size_t index)
+        {
+            if (op.type != OpType::Jump && op.type != OpType::JumpIfZero)
+            {
+                return false;
+            }
+            auto it = label_to_index.find(op.label);
+            return it != label_to_index.end() && it->second <= index;
+        }
+    }
+
+    std::unordered_map<Label, std::size_t> find_labels(Ops const &ops)
+    {
+        std::unordered_map<Label, std::size_t> label_to_index;
+        for (std::size_t i = 0; i < ops.size(); i++)
+        {
+            if (ops[i].type == OpType::Label)
+            {
+                label_to_index[ops[i].label] = i;
+            }
+        }
+        return label_to_index;
+    }
+
+    OpFlags find_loop_heads(Ops const &ops)
+    {
+        auto const label_to_index = find_labels(ops);
+        OpFlags loop_heads{};
+        for (std::size_t i = 0; i < ops.size(); i++)
+        {
+            if (is_backwards_jump(label_to_index, ops[i], i))
+            {
+                loop_heads[label_to_index.at(ops[i].label)] = true;
+            }
+        }
+        return loop_heads;
+    }
+
+    OpFlags find_charges(Ops const &ops)
+    {
+        auto const label_to_index = find_labels(ops);
+        OpFlags charges{};
+        for (std::size_t i = 0; i < ops.size(); i++)
+        {
+            charges[i] = ops[i].type == OpType::Call || is_backwards_jump(label_to_index, ops[i], i);
+        }
+        return charges;
+    }
+
+    std::size_t padding(std::size_t offset, std::size_t alignment)
+    {
+        return alignment > 1 ? (alignment - offset % alignment) % alignment : 0;
+    }
+
+    bool same_op(Op const &a, Op const &b)
+    {
+        if (a.type != b.type || a.regA != b.regA)
+        {
+            return false;
+        }
+        switch (a.type)
+        {
+        case OpType::Load:
+        case OpType::Store:
+        case OpType::SetReg:
+        case OpType::AddReg:
+            return a.regB == b.regB;
+        case OpType::SetImm:
+        case OpType::AddImm:
+            return a.imm == b.imm;
+        case OpType::Jump:
+        case OpType::JumpIfZero:
+        case OpType::Call:
+        case OpType::Label:
+            return a.label == b.label;
+        case OpType::CallOut:
+            return a.func == b.func;
+        default:
+            return true;
+        }
+    }
+
+    Layout empty_layout(Ops const &ops)
+    {
+        Layout layout;
+        layout.entries.assign(ops.size(), CompiledCode::kNoEntry);
+        layout.ends.assign(ops.size(), CompiledCode::kNoEntry);
+        return layout;
+    }
+
+    std::vector<OpRange> map_ops(Layout const &layout)
+    {
+        std::vector<OpRange> op_map;
+        for (std::size_t i = 0; i < layout.entries.size(); i++)
+        {
+            if (layout.entries[i] != CompiledCode::kNoEntry && layout.ends[i] > layout.entries[i])
+            {
+                op_map.push_back(OpRange{static_cast<std::uint32_t>(layout.entries[i]), static_cast<std::uint32_t>(layout.ends[i]), static_cast<Value>(i)});
+            }
+        }
+        std::sort(op_map.begin(), op_map.end(), [](OpRange const &a, OpRange const &b)
+                  { return a.begin < b.begin; });
+        return op_map;
+    }
+
+    std::size_t find_op(std::vector<OpRange> const &op_map, std::size_t offset)
+    {
+        auto it = std::upper_bound(op_map.begin(), op_map.end(), offset, [](std::size_t at, OpRange const &range)
+                                   { return at < range.begin; });
+        if (it == op_map.begin() || offset >= std::prev(it)->end)
+        {
+            return CompiledCode::kNoEntry;
+        }
+        return std::prev(it)->op;
+    }
+
+    std::size_t emit(Ops const &ops, std::size_t begin, std::size_t end, OpFlags const &loop_heads, EncodeContext const &ctx,
+                     uint8_t *code, std::size_t offset, Layout &layout)
+    {
+        auto at = [&](std::size_t at_offset)
+        { return code != nullptr ? code + at_offset : nullptr; };
+        for (std::size_t i = begin; i < end; i++)
+        {
+            Op const &op = ops[i];
+            if (op.type == OpType::Label)
+            {
+                if (loop_heads[i])
+                {
+                    offset += native::pad(padding(offset, ctx.features.alignment), at(offset));
+                }
+                layout.label_to_offset[op.label] = offset;
+                layout.labels[op.label] = i;
+            }
+            layout.entries[i] = offset;
+            if (i != 0 && ops[i - 1].type == OpType::Call)
+            {
+                // Resumed Calls return here, past any padding
+                layout.returns[offset] = static_cast<Value>(i);
+            }
+            if (std::size_t guarded = ctx.counters == nullptr ? conditional_length(ops, i) : 0; guarded != 0)
+            {
+                offset += native::encode_conditional(op, &ops[i + 1], guarded, at(offset));
+                layout.ends[i] = offset;
+                i += guarded;
+                continue;
+            }
+            if (op.type == OpType::CallOut && ctx.callout != nullptr)
+            {
+                offset += native::encode(Op::make_CallOut(ctx.callout), i, ctx, at(offset));
+            }
+            else
+            {
+                offset += native::encode(op, i, ctx, at(offset));
+            }
+            layout.ends[i] = offset;
+            if (op.type == OpType::Call)
+            {
+                layout.returns[offset] = static_cast<Value>(i + 1);
+            }
+        }
+        return offset;
+    }
+
+    Status enter(uint8_t const *code, void const *entry, NativeFrames &frames, ExecutionEnvironment &env)
+    {
+        // Call the function, it reads and writes the registers in place.
+        // Metered code lets an empty budget wrap around, so put it back.
+        bool const unmetered = env.fuel == 0;
+        Status const status = reinterpret_cast<NativeFunction>(code)(&env, entry, &frames);
+        if (unmetered)
+        {
+            env.fuel = 0;
+        }
+        env.pending = false;
+        if (status == Status::Returned)
+        {
+            env.depth = 0;
+            return status;
+        }
+        if (frames.count > kMaxCallDepth)
+        {
+            throw std::length_error("Call stack too deep to suspend");
+        }
+        env.depth = static_cast<Value>(frames.count);
+        return status;
+    }
+
+    namespace
+    {
+        // Basic blocks start at the first op and at each label.
+        bool is_leader(Ops const &ops, std::size_t index)
+        {
+            return index == 0 || ops[index].type == OpType::Label;
+        }
+
+        // Splits the program into about four regions per thread, each made of
+        // whole basic blocks, as op index ranges.
+        std::vector<std::pair<std::size_t, std::size_t>> partition(Ops const &ops, std::size_t threads)
+        {
+            std::size_t const count = threads > 1 ? threads * 4 : 1;
+            std::size_t const chunk = (ops.size() + count - 1) / count;
+            std::vector<std::pair<std::size_t, std::size_t>> regions;
+            for (std::size_t begin = 0; begin < ops.size();)
+            {
+                std::size_t end = std::min(begin + chunk, ops.size());
+                while (end < ops.size() && !is_leader(ops, end))
+                {
+                    end++;
+                }
+                regions.emplace_back(begin, end);
+                begin = end;
+            }
+            return regions;
+        }
+
+        // An image of |ops| with nothing lowered yet.
+        std::shared_ptr<CompiledCode::Image> new_image(Ops const &ops, CpuFeatures const &features, CompileOptions const &options)
+        {
+            auto image = std::make_shared<CompiledCode::Image>(ops);
+            image->exit_offset = native::preamble(nullptr);
+            image->features = features;
+            image->metered = options.metered;
+            image->lazy = options.lazy;
+            image->loop_heads = find_loop_heads(ops);
+            image->charges = find_charges(ops);
+            image->layout = empty_layout(ops);
+            image->layout.labels = find_labels(ops);
+            image->perf = name_symbols(options.perf);
+            if (options.counted)
+            {
+                image->counters = std::make_shared<OpCounters>();
+            }
+            image->traced = options.traced;
+            if (options.memory_counted)
+            {
+                image->memory_counters = std::make_shared<MemoryCounters>();
+            }
+            image->optimised = options.optimised;
+            return image;
+        }
+
+        // Tells perf where everything in |image| is, if asked to.
+        void publish(CompiledCode::Image const &image)
+        {
+            if (!image.perf.map && !image.perf.jitdump)
+            {
+                return;
+            }
+            // The way in and out goes under the program's own name
+            auto symbols = symbolise(image.perf.name, image.layout);
+            if (!symbols.empty() && symbols.front().name == image.perf.name)
+            {
+                symbols.front().begin = 0;
+            }
+            else
+            {
+                symbols.insert(symbols.begin(), Symbol{0, symbols.empty() ? image.used : symbols.front().begin, image.perf.name});
+            }
+            publish_symbols(image.perf, image.code, symbols);
+        }
+
+        // The traced image this thread is running, for traced_callout()
+        thread_local CompiledCode::Image const *t_traced = nullptr;
+
+        // Runs the code, which may stop at a stub with |kCompileStatus|.
+        Status execute(CompiledCode::Image const &image, ExecutionEnvironment &env)
+        {
+            Layout const &layout = image.layout;
+            uint8_t const *const code = image.code;
+            auto find_entry = [&](Value pc)
+            {
+                if (pc >= layout.entries.size() || layout.entries[pc] == CompiledCode::kNoEntry)
+                {
+                    throw std::out_of_range("No entry point for pc " + std::to_string(pc));
+                }
+                return code + layout.entries[pc];
+            };
+
+            // Find where to start, and the Calls to return through
+            auto const *entry = find_entry(env.pc);
+            if (env.depth > kMaxCallDepth)
+            {
+                throw std::out_of_range("Call depth " + std::to_string(env.depth) + " is too deep");
+            }
+            NativeFrames frames;
+            frames.count = env.depth;
+            for (std::size_t i = 0; i < frames.count; i++)
+            {
+                frames.frames[i] = find_entry(env.calls[frames.count - 1 - i]);
+            }
+
+            // Run it, noting which Calls it suspended in, if any
+            struct Traced
+            {
+                CompiledCode::Image const *outer;
+                ~Traced() { t_traced = outer; }
+            } const traced{std::exchange(t_traced, image.traced ? &image : t_traced)};
+            Status const status = enter(code, entry, frames, env);
+            for (std::size_t i = 0; i < env.depth; i++)
+            {
+                auto const offset = static_cast<uint8_t const *>(frames.frames[i]) - code;
+                env.calls[frames.count - 1 - i] = layout.returns.at(offset);
+            }
+            return status;
+        }
+
+        // Compiles the ops reachable from |pc| that haven't been compiled yet,
+        // without following Calls, onto the end of a copy of |current|.
+        std::shared_ptr<CompiledCode::Image const> compile_reachable(CompiledCode::Image const &current, Value pc)
+        {
+            TraceSpan const span(trace::kCompileReachable, pc);
+            Ops const &ops = current.ops;
+            Layout const &old_layout = current.layout;
+            auto const label_to_index = find_labels(ops);
+            auto compiled = [&](std::size_t index)
+            { return old_layout.entries[index] != CompiledCode::kNoEntry; };
+            auto falls_through = [&](std::size_t index)
+            { return ops[index].type != OpType::Jump && ops[index].type != OpType::Return; };
+
+            OpFlags region{};
+            std::vector<std::size_t> pending{pc};
+            while (!pending.empty())
+            {
+                std::size_t const i = pending.back();
+                pending.pop_back();
+                if (i >= ops.size() || region[i] || compiled(i))
+                {
+                    continue;
+                }
+                region[i] = true;
+                if (std::size_t guarded = conditional_length(ops, i); guarded != 0)
+                {
+                    std::fill_n(region.begin() + i + 1, guarded, true);
+                    pending.push_back(i + guarded + 1);
+                    continue;
+                }
+                Op const &op = ops[i];
+                if (op.type == OpType::Jump || op.type == OpType::JumpIfZero)
+                {
+                    if (auto it = label_to_index.find(op.label); it != label_to_index.end())
+                    {
+                        pending.push_back(it->second);
+                    }
+                }
+                if (falls_through(i))
+                {
+                    pending.push_back(i + 1);
+                }
+            }
+
+            // Calls out of it to anything else that isn't compiled go via a
+            // stub, unless there's one already
+            std::vector<std::size_t> stubs; // label op indices
+            for (std::size_t i = 0; i < ops.size(); i++)
+            {
+                if (!region[i] || ops[i].type != OpType::Call)
+                {
+                    continue;
+                }
+                auto it = label_to_index.find(ops[i].label);
+                if (it != label_to_index.end() && !compiled(it->second) && !region[it->second] &&
+                    !old_layout.label_to_offset.contains(ops[i].label) && std::find(stubs.begin(), stubs.end(), it->second) == stubs.end())
+                {
+                    stubs.push_back(it->second);
+                }
+            }
+
+            // Lower the stubs, then each run of consecutive ops, jumping back
+            // to wherever the last one falls through to
+            auto lower = [&](EncodeContext const &ctx, uint8_t *code, Layout &layout)
+            {
+                auto at = [&](std::size_t offset)
+                { return code != nullptr ? code + offset : nullptr; };
+                std::size_t offset = current.used;
+                for (std::size_t label : stubs)
+                {
+                    layout.label_to_offset[ops[label].label] = offset;
+                    offset += native::exit(label, kCompileStatus, ctx, at(offset));
+                }
+                for (std::size_t begin = 0; begin < ops.size();)
+                {
+                    if (!region[begin])
+                    {
+                        begin++;
+                        continue;
+                    }
+                    std::size_t end = begin;
+                    while (end < ops.size() && region[end])
+                    {
+                        end++;
+                    }
+                    offset = emit(ops, begin, end, current.loop_heads, ctx, code, offset, layout);
+                    if (end < ops.size() && falls_through(end - 1))
+                    {
+                        offset += native::jump(layout.entries[end], ctx, at(offset));
+                    }
+                    begin = end;
+                }
+                return offset;
+            };
+            OpFlags const *const charges = current.metered ? &current.charges : nullptr;
+            Layout sizing = old_layout;
+            std::size_t size = lower(EncodeContext{nullptr, nullptr, current.features, current.exit_offset, charges, nullptr, current.counters.get(), current.traced ? traced_callout : nullptr, current.memory_counters.get()}, nullptr, sizing);
+
+            auto image = std::make_shared<CompiledCode::Image>(ops);
+            image->code = native::allocate(size);
+            image->size = size;
+            image->exit_offset = current.exit_offset;
+            image->features = current.features;
+            image->metered = current.metered;
+            image->lazy = current.lazy;
+            image->loop_heads = current.loop_heads;
+            image->charges = current.charges;
+            image->layout = old_layout;
+            image->perf = current.perf;
+            image->counters = current.counters;
+            image->traced = current.traced;
+            image->memory_counters = current.memory_counters;
+            image->optimised = current.optimised;
+            if (current.code != nullptr)
+            {
+                std::copy(current.code, current.code + current.used, image->code);
+            }
+            else
+            {
+                std::size_t const preamble = native::preamble(image->code);
+                native::exit_stub(image->code + preamble);
+            }
+
+            EncodeContext const ctx{image->code, &sizing.label_to_offset, current.features, current.exit_offset, charges, nullptr, current.counters.get(), current.traced ? traced_callout : nullptr, current.memory_counters.get()};
+            std::size_t const offset = lower(ctx, image->code, image->layout);
+
+            // Point any Calls that went via a stub straight at the new code
+            for (std::size_t i = 0; i < ops.size(); i++)
+            {
+                if (ops[i].type == OpType::Call && compiled(i) && region[label_to_index.at(ops[i].label)])
+                {
+                    native::encode(ops[i], i, ctx, image->code + old_layout.entries[i]);
+                }
+            }
+            ASSERT(offset <= image->size);
+            image->used = offset;
+            image->compiled = offset;
+            image->op_map = map_ops(image->layout);
+            native::finalise(image->code, offset, image->size);
+            publish(*image);
+            return image;
+        }
+
+        // Compiles whatever |env| is about to enter, in |image| or in
+        // whatever beat us to publishing a newer version.
+        std::shared_ptr<CompiledCode::Image const> compile_entered(std::atomic<std::shared_ptr<CompiledCode::Image const>> &published,
+                                                                   std::shared_ptr<CompiledCode::Image const> image, ExecutionEnvironment const &env)
+        {
+            auto uncompiled = [](CompiledCode::Image const &version, Value pc)
+            { return pc < version.layout.entries.size() && version.layout.entries[pc] == CompiledCode::kNoEntry; };
+            for (;;)
+            {
+                auto updated = image;
+                if (uncompiled(*updated, env.pc))
+                {
+                    updated = compile_reachable(*updated, env.pc);
+                }
+                for (std::size_t i = 0; i < env.depth && i < kMaxCallDepth; i++)
+                {
+                    if (uncompiled(*updated, env.calls[i]))
+                    {
+                        updated = compile_reachable(*updated, env.calls[i]);
+                    }
+                }
+                if (updated == image || published.compare_exchange_strong(image, updated))
+                {
+                    return updated;
+                }
+            }
+        }
+    }
+
+    void traced_callout(ExecutionEnvironment &env)
+    {
+        // Called from straight after the call in the callout's own code
+        CompiledCode::Image const *const image = t_traced;
+        ASSERT(image != nullptr);
+        auto const *const from = static_cast<uint8_t const *>(__builtin_return_address(0));
+        std::size_t const index = find_op(image->op_map, static_cast<std::size_t>(from - image->code) - 1);
+        ASSERT(index != CompiledCode::kNoEntry);
+        TraceSpan const span(trace::kCallOut, index);
+        image->ops[index].func(env);
+    }
+
+    CompiledCode::Image::~Image()
+    {
+        if (code != nullptr)
         {
-            native::deallocate(m_code, m_size);
+            native::deallocate(code, size);
         }
     }
-    CompiledCode::CompiledCode(CompiledCode &&o) : CompiledCode() { operator=(std::move(o)); }
+
+    CompiledCode::CompiledCode() : m_image{} {}
+    CompiledCode::CompiledCode(std::shared_ptr<Image const> image) : m_image{std::move(image)} {}
+    CompiledCode::~CompiledCode() = default;
+    CompiledCode::CompiledCode(CompiledCode &&o) : m_image{o.m_image.exchange(nullptr)} {}
     CompiledCode &CompiledCode::operator=(CompiledCode &&o)
     {
-        std::swap(m_code, o.m_code);
-        std::swap(m_size, o.m_size);
+        m_image.store(o.m_image.exchange(m_image.load()));
         return *this;
     }
 
-    void CompiledCode::run(ExecutionEnvironment &env) const
+    Status CompiledCode::run(ExecutionEnvironment &env) const
     {
-        // Setup registers
-        NativeState state{};
-        std::copy(std::begin(env.regs), std::end(env.regs), std::begin(state.regs));
-        state.data = env.mem.data();
+        // Hold on to each version for as long as we're running it
+        auto image = m_image.load();
+        ASSERT(image != nullptr);
+        if (image->optimised && env.pc < image->ops.size() && !is_entry(image->ops, env.pc))
+        {
+            throw std::invalid_argument("Optimised code can't be entered at pc " + std::to_string(env.pc));
+        }
+        TraceSpan const span(trace::kRun, env.pc);
+        for (;;)
+        {
+            if (image->lazy)
+            {
+                image = compile_entered(m_image, std::move(image), env);
+            }
+            Status const status = execute(*image, env);
+            if (status != kCompileStatus)
+            {
+                return status;
+            }
+        }
+    }
+
+    std::size_t CompiledCode::size() const
+    {
+        return m_image.load()->used;
+    }
+
+    std::size_t CompiledCode::op_at(std::size_t offset) const
+    {
+        return find_op(m_image.load()->op_map, offset);
+    }
+
+    std::shared_ptr<OpCounters const> CompiledCode::counters() const
+    {
+        return m_image.load()->counters;
+    }
+
+    std::shared_ptr<MemoryCounters const> CompiledCode::memory_counters() const
+    {
+        return m_image.load()->memory_counters;
+    }
+
+    bool CompiledCode::optimised() const
+    {
+        return m_image.load()->optimised;
+    }
+
+    Status CompiledCode::run_from(Label const &label, ExecutionEnvironment &env) const
+    {
+        env.pc = m_image.load()->layout.labels.at(label);
+        return run(env);
+    }
+
+    PatchResult CompiledCode::patch(Ops const &edited)
+    {
+        auto const current = m_image.load();
+        ASSERT(current != nullptr);
+        TraceSpan const span(trace::kPatch);
+        PatchResult result;
+
+        // Optimised code is brought up to date with the optimised edit,
+        // which only differs in the straight runs of ops that were edited
+        std::optional<Ops> optimised;
+        Ops const &ops = current->optimised ? optimised.emplace(optimise(edited)) : edited;
+
+        std::vector<std::size_t> changed;
+        for (std::size_t i = 0; i < ops.size(); i++)
+        {
+            if (!same_op(current->ops[i], ops[i]))
+            {
+                changed.push_back(i);
+            }
+        }
+        if (changed.empty())
+        {
+            return result;
+        }
+
+        // Anything that moves labels or changes how ops are grouped or
+        // metered needs everything compiling again
+        auto recompile = [&]
+        {
+            CompileOptions options{current->features, current->metered, current->lazy};
+            options.perf = current->perf;
+            options.counted = current->counters != nullptr;
+            options.traced = current->traced;
+            options.memory_counted = current->memory_counters != nullptr;
+            options.optimised = current->optimised;
+            m_image.store(compile(edited, options).m_image.load());
+            result.recompiled = true;
+            return result;
+        };
+        if (current->lazy || current->counters != nullptr || current->traced || current->memory_counters != nullptr)
+        {
+            return recompile();
+        }
+        bool const reshaped = std::any_of(changed.begin(), changed.end(), [&](std::size_t i)
+                                          { return ops[i].type != current->ops[i].type || ops[i].type == OpType::Label ||
+                                                   ops[i].type == OpType::Jump || ops[i].type == OpType::JumpIfZero || ops[i].type == OpType::Call; });
+        if (reshaped)
+        {
+            if (find_loop_heads(ops) != current->loop_heads || find_charges(ops) != current->charges)
+            {
+                return recompile();
+            }
+            for (std::size_t i = 0; i < ops.size(); i++)
+            {
+                if (conditional_length(ops, i) != conditional_length(current->ops, i))
+                {
+                    return recompile();
+                }
+            }
+            for (std::size_t i : changed)
+            {
+                if (ops[i].type == OpType::Label || current->ops[i].type == OpType::Label)
+                {
+                    return recompile();
+                }
+            }
+        }
+        OpFlags const &loop_heads = current->loop_heads;
+
+        // Rewrite ops of the same type and size where they are, otherwise
+        // recompile their whole block
+        Layout const &old_layout = current->layout;
+        OpFlags const *const charges_ptr = current->metered ? &current->charges : nullptr;
+        EncodeContext const sizing{nullptr, nullptr, current->features, current->exit_offset, charges_ptr};
+        auto leader_of = [&](std::size_t index)
+        {
+            while (!is_leader(ops, index))
+            {
+                index--;
+            }
+            return index;
+        };
+        auto block_end = [&](std::size_t leader)
+        {
+            std::size_t end = leader + 1;
+            while (end < ops.size() && !is_leader(ops, end))
+            {
+                end++;
+            }
+            return end;
+        };
+        auto fits = [&](std::size_t i)
+        {
+            return ops[i].type == current->ops[i].type && old_layout.entries[i] != kNoEntry && conditional_length(ops, i) == 0 &&
+                   native::encode(ops[i], i, sizing, nullptr) == old_layout.ends[i] - old_layout.entries[i];
+        };
+        std::vector<std::size_t> blocks; // leaders, in order
+        for (std::size_t i : changed)
+        {
+            if (!fits(i) && (blocks.empty() || blocks.back() != leader_of(i)))
+            {
+                blocks.push_back(leader_of(i));
+            }
+        }
+        std::vector<std::size_t> in_place;
+        for (std::size_t i : changed)
+        {
+            if (std::find(blocks.begin(), blocks.end(), leader_of(i)) == blocks.end())
+            {
+                in_place.push_back(i);
+            }
+        }
 
-        // Call the function
-        reinterpret_cast<NativeFunction>(m_code)(&state);
+        // Each moved block leaves a jump behind, so it needs room for one
+        std::size_t const jump_size = native::jump(0, sizing, nullptr);
+        for (std::size_t leader : blocks)
+        {
+            std::size_t const end = block_end(leader);
+            std::size_t code_end = old_layout.entries[leader];
+            for (std::size_t i = leader; i < end; i++)
+            {
+                if (old_layout.ends[i] != kNoEntry)
+                {
+                    code_end = std::max(code_end, old_layout.ends[i]);
+                }
+            }
+            if (code_end - old_layout.entries[leader] < jump_size)
+            {
+                return recompile();
+            }
+        }
 
-        // Copy back registers
-        std::copy(std::begin(state.regs), std::end(state.regs), std::begin(env.regs));
+        // Size up the moved blocks, each falling through to the next one
+        // back where it was
+        Layout layout = old_layout;
+        std::size_t size = current->used;
+        for (std::size_t leader : blocks)
+        {
+            std::size_t const end = block_end(leader);
+            size = emit(ops, leader, end, loop_heads, sizing, nullptr, size, layout);
+            if (end < ops.size())
+            {
+                size += native::jump(old_layout.entries[end], sizing, nullptr);
+            }
+        }
+        if (size > 2 * current->compiled)
+        {
+            // Don't let repeated edits bloat the code or chain jumps forever
+            return recompile();
+        }
+
+        // Copy the code, so as not to disturb anyone running it
+        auto image = std::make_shared<Image>(ops);
+        image->code = native::allocate(size);
+        image->size = size;
+        image->compiled = current->compiled;
+        image->exit_offset = current->exit_offset;
+        image->features = current->features;
+        image->metered = current->metered;
+        image->loop_heads = current->loop_heads;
+        image->charges = current->charges;
+        image->perf = current->perf;
+        image->optimised = current->optimised;
+        std::copy(current->code, current->code + current->used, image->code);
+
+        EncodeContext const ctx{image->code, &layout.label_to_offset, current->features, current->exit_offset, charges_ptr};
+        image->layout = old_layout;
+        std::size_t offset = current->used;
+        for (std::size_t leader : blocks)
+        {
+            std::size_t const end = block_end(leader);
+            native::jump(offset, ctx, image->code + old_layout.entries[leader]);
+            offset = emit(ops, leader, end, loop_heads, ctx, image->code, offset, image->layout);
+            if (end < ops.size())
+            {
+                offset += native::jump(old_layout.entries[end], ctx, image->code + offset);
+            }
+            result.relocated++;
+        }
+        for (std::size_t i : in_place)
+        {
+            native::encode(ops[i], i, ctx, image->code + old_layout.entries[i]);
+            result.patched++;
+        }
+        ASSERT(offset <= image->size);
+        image->used = offset;
+        image->op_map = map_ops(image->layout);
+        native::finalise(image->code, offset, image->size);
+        publish(*image);
+
+        // Anyone running from now on gets the new version
+        m_image.store(std::move(image));
+        return result;
     }
 
-    CompiledCode compile(Ops const &ops)
+    std::shared_ptr<CompiledCode::Image> compile_eagerly(Ops const &ops, CompileOptions const &options, std::vector<Relocation> *relocations, bool position_independent)
     {
-        // Pass over the code to get the total size and label locations
+        CpuFeatures const features = options.features.value_or(host_cpu_features());
+        auto image = new_image(ops, features, options);
+        OpFlags const *const charges_ptr = options.metered ? &image->charges : nullptr;
+        OpFlags const &loop_heads = image->loop_heads;
+        std::size_t const exit_offset = image->exit_offset;
+        std::size_t const code_offset = exit_offset + native::exit_stub(nullptr);
+
+        // Split the program up to lower each region independently. The
+        // first starts straight after the exit stub, the rest are aligned so
+        // that their loop heads are padded the same wherever they land.
+        std::size_t const threads = options.threads != 0 ? options.threads : std::max(1u, std::thread::hardware_concurrency());
+        auto const regions = partition(ops, threads);
+        auto region_start = [&](std::size_t r)
+        { return r == 0 ? code_offset : 0; };
+
+        // Pass over each region to get its size and label locations
+        std::optional<TraceSpan> phase(std::in_place, trace::kLabelPass);
+        std::vector<Layout> sizing(regions.size(), empty_layout(ops));
+        std::vector<std::size_t> lengths(regions.size());
+        EncodeContext const sizing_ctx{nullptr, nullptr, features, exit_offset, charges_ptr, nullptr, image->counters.get(), image->traced ? traced_callout : nullptr, image->memory_counters.get(), position_independent};
+        parallel_for(regions.size(), threads, [&](std::size_t r)
+                     { lengths[r] = emit(ops, regions[r].first, regions[r].second, loop_heads, sizing_ctx, nullptr, region_start(r), sizing[r]) - region_start(r); });
+
+        // Lay them out one after another, noting where each label ended up
         LabelToOffsetMap label_to_offset;
-        std::size_t size = native::preamble(nullptr);
-        for (Op const &op : ops)
+        std::vector<std::size_t> bases(regions.size());
+        std::size_t size = code_offset;
+        for (std::size_t r = 0; r < regions.size(); r++)
         {
-            if (op.type == OpType::Label)
+            if (r != 0)
+            {
+                size += padding(size, features.alignment);
+            }
+            bases[r] = size;
+            size += lengths[r];
+            for (auto const &[label, offset] : sizing[r].label_to_offset)
             {
-                label_to_offset[op.label] = size;
+                label_to_offset[label] = bases[r] + offset - region_start(r);
             }
-            size += native::encode(op, nullptr, nullptr, nullptr);
         }
 
+        phase.reset();
+
         // Allocate a buffer that we can make executable
-        auto *const code = native::allocate(size);
+        image->code = native::allocate(size);
+        image->size = size;
 
-        // Copy it over
-        std::size_t offset = native::preamble(code);
-        for (Op const &op : ops)
+        // Copy each region over, noting where each op starts
+        phase.emplace(trace::kEncode);
+        EncodeContext const ctx{image->code, &label_to_offset, features, exit_offset, charges_ptr, nullptr, image->counters.get(), image->traced ? traced_callout : nullptr, image->memory_counters.get(), position_independent};
+        std::size_t offset = native::preamble(image->code);
+        offset += native::exit_stub(image->code + offset);
+        ASSERT(offset == code_offset);
+        std::vector<Layout> layouts(regions.size(), empty_layout(ops));
+        std::vector<std::vector<Relocation>> region_relocations(regions.size());
+        parallel_for(regions.size(), threads, [&](std::size_t r)
+                     {
+                         EncodeContext region_ctx = ctx;
+                         region_ctx.relocations = relocations != nullptr ? &region_relocations[r] : nullptr;
+                         std::size_t const gap = r == 0 ? code_offset : bases[r - 1] + lengths[r - 1];
+                         native::pad(bases[r] - gap, image->code + gap);
+                         std::size_t const end = emit(ops, regions[r].first, regions[r].second, loop_heads, region_ctx, image->code, bases[r], layouts[r]);
+                         ASSERT(end == bases[r] + lengths[r]); });
+        for (std::size_t r = 0; r < regions.size(); r++)
         {
-            offset += native::encode(op, code, code + offset, &label_to_offset);
+            Layout &layout = layouts[r];
+            for (std::size_t i = regions[r].first; i < regions[r].second; i++)
+            {
+                image->layout.entries[i] = layout.entries[i];
+                image->layout.ends[i] = layout.ends[i];
+            }
+            image->layout.label_to_offset.merge(layout.label_to_offset);
+            image->layout.returns.merge(layout.returns);
+            if (relocations != nullptr)
+            {
+                relocations->insert(relocations->end(), region_relocations[r].begin(), region_relocations[r].end());
+            }
         }
-        ASSERT(offset <= size);
+        offset = regions.empty() ? code_offset : bases.back() + lengths.back();
+        ASSERT(offset <= image->size);
+        image->used = offset;
+        image->compiled = offset;
+        image->op_map = map_ops(image->layout);
+        phase.reset();
 
         // Make the buffer executable
-        native::finalise(code, offset, size);
+        native::finalise(image->code, offset, image->size);
+        return image;
+    }
+
+    CompiledCode compile(Ops const &source, CompileOptions const &options)
+    {
+        TraceSpan const span(trace::kCompile, source.size());
+        std::optional<Ops> optimised;
+        Ops const &ops = options.optimised ? optimised.emplace(optimise(source)) : source;
+        CpuFeatures const features = options.features.value_or(host_cpu_features());
+        if (options.lazy)
+        {
+            // Lay out the way in and out with whatever the first op leads to
+            auto image = new_image(ops, features, options);
+            image->size = image->exit_offset + native::exit_stub(nullptr);
+            image->used = image->size;
+            return CompiledCode(compile_reachable(*image, 0));
+        }
+        bool const cached = !options.cache.empty() && !options.counted && !options.traced && !options.memory_counted;
+        if (cached)
+        {
+            TraceSpan const loading(trace::kLoadCached);
+            if (auto image = load_cached(options.cache, ops, features, options.metered))
+            {
+                image->optimised = options.optimised;
+                image->perf = name_symbols(options.perf);
+                publish(*image);
+                return CompiledCode(std::move(image));
+            }
+        }
+        std::vector<Relocation> relocations;
+        auto image = compile_eagerly(ops, options, cached ? &relocations : nullptr);
+        if (cached)
+        {
+            store_cached(options.cache, *image, relocations);
+        }
+        publish(*image);
 
         // Return it ready for us
-        return CompiledCode(code, size);
+        return CompiledCode(std::move(image));
     }
 }
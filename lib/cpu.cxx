@@ -0,0 +1,52 @@
+#include "internal.h"
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <cpuid.h>
+#endif
+
+namespace jitlib
+{
+    namespace
+    {
+        CpuFeatures detect()
+        {
+            CpuFeatures features{};
+#if defined(__x86_64__) || defined(__i386__)
+            unsigned int eax, ebx, ecx, edx;
+            bool avx_os_support = false;
+            if (__get_cpuid(1, &eax, &ebx, &ecx, &edx))
+            {
+                // OSXSAVE and AVX, then check the OS saves ymm state.
+                if ((ecx & bit_OSXSAVE) && (ecx & bit_AVX))
+                {
+                    unsigned int xcr0_lo, xcr0_hi;
+                    __asm__("xgetbv" : "=a"(xcr0_lo), "=d"(xcr0_hi) : "c"(0));
+                    avx_os_support = (xcr0_lo & 0x6) == 0x6;
+                }
+            }
+            if (__get_cpuid_count(7, 0, &eax, &ebx, &ecx, &edx))
+            {
+                features.bmi1 = ebx & bit_BMI;
+                features.bmi2 = ebx & bit_BMI2;
+                features.avx2 = avx_os_support && (ebx & bit_AVX2);
+                features.erms = ebx & (1u << 9);
+                features.fsrm = edx & (1u << 4);
+            }
+            if (__get_cpuid(0x80000001, &eax, &ebx, &ecx, &edx))
+            {
+                features.lzcnt = ecx & bit_LZCNT;
+            }
+            // Cores new enough for AVX2 fetch and cache decoded uops in 32 byte
+            // windows, older ones in 16.
+            features.alignment = features.avx2 ? 32 : 16;
+#endif
+            return features;
+        }
+    }
+
+    CpuFeatures const &host_cpu_features()
+    {
+        static CpuFeatures const features = detect();
+        return features;
+    }
+}
@@ -0,0 +1,203 @@
+#include "internal.h"
+#include <jitlib/generate.h>
+#include <cstdio>
+#include <random>
+
+namespace jitlib
+{
+    namespace
+    {
+        // Everything but the loops' counter
+        constexpr Register kRegisters = 3;
+        constexpr Register kCounter = 3;
+        // Overhead of a loop around its body: setting the counter, the head
+        // label, counting down, leaving, going round and the exit label
+        constexpr std::size_t kLoopOps = 6;
+        constexpr std::size_t kMaxLoopBody = 24;
+
+        void bump(ExecutionEnvironment &env)
+        {
+            env.regs[0] += 1;
+        }
+
+        // Draws from mt19937_64 directly rather than through the standard
+        // distributions, which aren't the same everywhere, so that a seed
+        // makes the same program with any standard library.
+        class Generator
+        {
+        public:
+            Generator(GenerateOptions const &options, std::uint64_t seed) : m_options{options}, m_random{seed} {}
+
+            // Emits exactly |length| ops of |subroutine|, 0 being the main
+            // program, placing the labels its branches go to before the end.
+            void block(std::size_t length, bool may_loop, std::size_t subroutine)
+            {
+                std::vector<Label> pending;
+                std::size_t const end = m_count + length;
+                while (m_count < end)
+                {
+                    std::size_t const free = end - m_count - pending.size();
+                    if (free == 0)
+                    {
+                        add(Op::make_Label(pending.front()));
+                        pending.erase(pending.begin());
+                        continue;
+                    }
+                    double roll = uniform();
+                    if (may_loop && free > kLoopOps && (roll -= m_options.loops) < 0)
+                    {
+                        loop(std::min(free - kLoopOps, 1 + below(kMaxLoopBody)), subroutine);
+                    }
+                    else if (free >= 2 && (roll -= m_options.branches) < 0)
+                    {
+                        Label const label = fresh('b');
+                        pending.push_back(label);
+                        add(below(4) != 0 ? Op::make_JumpIfZero(reg(kRegisters + 1), label) : Op::make_Jump(label));
+                    }
+                    else if ((roll -= m_options.labels) < 0)
+                    {
+                        if (!pending.empty() && below(2) == 0)
+                        {
+                            add(Op::make_Label(pending.front()));
+                            pending.erase(pending.begin());
+                        }
+                        else
+                        {
+                            add(Op::make_Label(fresh('l')));
+                        }
+                    }
+                    else if ((roll -= m_options.callouts) < 0)
+                    {
+                        add(Op::make_CallOut(m_options.callout != nullptr ? m_options.callout : bump));
+                    }
+                    else if (subroutine < m_options.subroutines && (roll -= m_options.calls) < 0)
+                    {
+                        std::size_t const callee = subroutine + 1 + below(m_options.subroutines - subroutine);
+                        add(Op::make_Call(subroutine_label(callee)));
+                    }
+                    else
+                    {
+                        add(simple());
+                    }
+                }
+            }
+
+            void subroutine(std::size_t index, std::size_t length)
+            {
+                add(Op::make_Label(subroutine_label(index)));
+                // Which might be called from inside a loop
+                block(length - 2, false, index);
+                add(Op::make_Return());
+            }
+
+            void finish()
+            {
+                add(Op::make_Return());
+            }
+
+            Ops const &ops() const { return m_ops; }
+
+        private:
+            GenerateOptions const &m_options;
+            std::mt19937_64 m_random;
+            Ops m_ops{};
+            std::size_t m_count = 0;
+            std::size_t m_labels = 0;
+
+            void add(Op const &op)
+            {
+                ASSERT(m_count < m_ops.size());
+                m_ops[m_count++] = op;
+            }
+
+            double uniform()
+            {
+                return static_cast<double>(m_random() >> 11) * 0x1.0p-53;
+            }
+
+            std::size_t below(std::size_t n)
+            {
+                return static_cast<std::size_t>(m_random() % n);
+            }
+
+            Register reg(std::size_t count = kRegisters)
+            {
+                return static_cast<Register>(below(count));
+            }
+
+            Label fresh(char kind)
+            {
+                Label label{""};
+                std::snprintf(label.data.data(), label.data.size(), "%c%zu", kind, m_labels++);
+                return label;
+            }
+
+            static Label subroutine_label(std::size_t index)
+            {
+                Label label{""};
+                std::snprintf(label.data.data(), label.data.size(), "sub%zu", index);
+                return label;
+            }
+
+            void loop(std::size_t body, std::size_t subroutine)
+            {
+                Label const head = fresh('h');
+                Label const exit = fresh('x');
+                add(Op::make_SetImm(kCounter, m_options.iterations));
+                add(Op::make_Label(head));
+                block(body, false, subroutine);
+                add(Op::make_AddImm(kCounter, 255));
+                add(Op::make_JumpIfZero(kCounter, exit));
+                add(Op::make_Jump(head));
+                add(Op::make_Label(exit));
+            }
+
+            // Anything that can't change where it goes next, reading any
+            // register but only writing those the loops don't use
+            Op simple()
+            {
+                switch (below(7))
+                {
+                case 0:
+                    return Op::make_Load(reg(), reg(kRegisters + 1));
+                case 1:
+                    return Op::make_Store(reg(kRegisters + 1), reg(kRegisters + 1));
+                case 2:
+                    return Op::make_SetReg(reg(), reg(kRegisters + 1));
+                case 3:
+                    return Op::make_SetImm(reg(), static_cast<Value>(m_random()));
+                case 4:
+                    return Op::make_AddReg(reg(), reg(kRegisters + 1));
+                case 5:
+                    return Op::make_AddImm(reg(), static_cast<Value>(m_random()));
+                default:
+                    return Op::make_Negate(reg());
+                }
+            }
+        };
+    }
+
+    Ops generate(GenerateOptions const &options, std::uint64_t seed)
+    {
+        // Each subroutine gets an even share of half the program, of at
+        // least its label, an op and its Return
+        std::size_t const subroutine_length = options.subroutines != 0 ? std::max<std::size_t>(3, options.ops / 2 / options.subroutines) : 0;
+        if (options.ops > std::tuple_size_v<Ops> || options.ops < 1 + options.subroutines * subroutine_length)
+        {
+            throw std::invalid_argument("Can't generate " + std::to_string(options.ops) + " ops with " + std::to_string(options.subroutines) + " subroutines");
+        }
+        if (options.iterations == 0)
+        {
+            throw std::invalid_argument("Loops need at least one iteration");
+        }
+
+        Generator generator(options, seed);
+        generator.block(options.ops - 1 - options.subroutines * subroutine_length, true, 0);
+        generator.finish();
+        for (std::size_t i = 1; i <= options.subroutines; i++)
+        {
+            generator.subroutine(i, subroutine_length);
+        }
+        return generator.ops();
+    }
+}
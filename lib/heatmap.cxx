@@ -0,0 +1,96 @@
+#include "internal.h"
+#include <jitlib/heatmap.h>
+#include <algorithm>
+#include <cstdio>
+
+namespace jitlib
+{
+    namespace
+    {
+        // Untouched, then from the least to the most accesses
+        constexpr char kShades[] = " .:-=+*#%@";
+        constexpr std::size_t kColumns = 16;
+    }
+
+    Heatmap heatmap(Ops const &ops, MemoryCounters const &counters)
+    {
+        Heatmap heatmap;
+        heatmap.reads = counters.reads;
+        heatmap.writes = counters.writes;
+        for (std::size_t address = 0; address < counters.reads.size(); address++)
+        {
+            if (counters.reads[address] != 0 || counters.writes[address] != 0)
+            {
+                heatmap.cells.push_back(CellCount{static_cast<Value>(address), counters.reads[address], counters.writes[address]});
+            }
+        }
+        std::stable_sort(heatmap.cells.begin(), heatmap.cells.end(), [](CellCount const &a, CellCount const &b)
+                         { return a.reads + a.writes > b.reads + b.writes; });
+
+        Label label{""};
+        for (std::size_t i = 0; i < ops.size(); i++)
+        {
+            if (ops[i].type == OpType::Label)
+            {
+                label = ops[i].label;
+            }
+            if (counters.accesses[i] != 0)
+            {
+                heatmap.sites.push_back(SiteCount{i, ops[i], label, counters.accesses[i]});
+            }
+        }
+        std::stable_sort(heatmap.sites.begin(), heatmap.sites.end(), [](SiteCount const &a, SiteCount const &b)
+                         { return a.accesses > b.accesses; });
+        return heatmap;
+    }
+
+    std::string report(Heatmap const &heatmap, std::size_t count)
+    {
+        std::uint64_t reads = 0;
+        std::uint64_t writes = 0;
+        std::uint64_t busiest = 0;
+        for (std::size_t address = 0; address < heatmap.reads.size(); address++)
+        {
+            reads += heatmap.reads[address];
+            writes += heatmap.writes[address];
+            busiest = std::max(busiest, heatmap.reads[address] + heatmap.writes[address]);
+        }
+        std::string text = std::to_string(reads) + " reads, " + std::to_string(writes) + " writes, " +
+                           std::to_string(heatmap.cells.size()) + " addresses\n";
+
+        char buffer[64];
+        text += "    0123456789abcdef\n";
+        for (std::size_t row = 0; row < heatmap.reads.size() / kColumns; row++)
+        {
+            std::snprintf(buffer, sizeof(buffer), "%02zx |", row * kColumns);
+            text += buffer;
+            for (std::size_t column = 0; column < kColumns; column++)
+            {
+                std::size_t const address = row * kColumns + column;
+                std::uint64_t const accesses = heatmap.reads[address] + heatmap.writes[address];
+                // Rounded up, so that anything touched at all shows
+                std::size_t const shade = accesses != 0 ? static_cast<std::size_t>((accesses * (std::size(kShades) - 2) + busiest - 1) / busiest) : 0;
+                text += kShades[shade];
+            }
+            text += "|\n";
+        }
+
+        text += "Addresses:\n";
+        for (std::size_t i = 0; i < heatmap.cells.size() && i < count; i++)
+        {
+            CellCount const &cell = heatmap.cells[i];
+            std::snprintf(buffer, sizeof(buffer), "%10llu %10llu  [%u]\n", static_cast<unsigned long long>(cell.reads),
+                          static_cast<unsigned long long>(cell.writes), static_cast<unsigned>(cell.address));
+            text += buffer;
+        }
+        text += "Sites:\n";
+        for (std::size_t i = 0; i < heatmap.sites.size() && i < count; i++)
+        {
+            SiteCount const &site = heatmap.sites[i];
+            std::string const label = site.label.data[0] != '\0' ? std::string(site.label.data.data()) : "(entry)";
+            std::snprintf(buffer, sizeof(buffer), "%10llu  ", static_cast<unsigned long long>(site.accesses));
+            text += buffer + std::to_string(site.index) + ": " + describe(site.op) + "  in " + label + "\n";
+        }
+        return text;
+    }
+}
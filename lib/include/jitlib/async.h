@@ -0,0 +1,162 @@
+#ifndef JIT_ASYNC_H
+#define JIT_ASYNC_H
+
+#include <jitlib/compiler.h>
+#include <jitlib/execution.h>
+#include <jitlib/ops.h>
+#include <coroutine>
+#include <cstdint>
+#include <exception>
+#include <utility>
+#include <vector>
+
+namespace jitlib
+{
+    // A lazily started coroutine returning T, run by co_await-ing it or by
+    // handing it to an EventLoop.
+    template <typename T>
+    class Task
+    {
+    public:
+        struct promise_type
+        {
+            T value{};
+            std::exception_ptr error;
+            std::coroutine_handle<> continuation;
+
+            Task get_return_object() { return Task{std::coroutine_handle<promise_type>::from_promise(*this)}; }
+            std::suspend_always initial_suspend() noexcept { return {}; }
+            auto final_suspend() noexcept
+            {
+                struct Resume
+                {
+                    bool await_ready() noexcept { return false; }
+                    std::coroutine_handle<> await_suspend(std::coroutine_handle<promise_type> handle) noexcept
+                    {
+                        auto continuation = handle.promise().continuation;
+                        return continuation ? continuation : std::noop_coroutine();
+                    }
+                    void await_resume() noexcept {}
+                };
+                return Resume{};
+            }
+            void return_value(T result) { value = std::move(result); }
+            void unhandled_exception() { error = std::current_exception(); }
+        };
+
+        Task(Task &&o) noexcept : m_handle{std::exchange(o.m_handle, {})} {}
+        Task &operator=(Task &&o) noexcept
+        {
+            std::swap(m_handle, o.m_handle);
+            return *this;
+        }
+        ~Task()
+        {
+            if (m_handle)
+            {
+                m_handle.destroy();
+            }
+        }
+
+        bool done() const { return m_handle.done(); }
+
+        bool await_ready() const noexcept { return false; }
+        std::coroutine_handle<> await_suspend(std::coroutine_handle<> awaiting) noexcept
+        {
+            m_handle.promise().continuation = awaiting;
+            return m_handle;
+        }
+        T await_resume()
+        {
+            auto &promise = m_handle.promise();
+            if (promise.error)
+            {
+                std::rethrow_exception(promise.error);
+            }
+            return std::move(promise.value);
+        }
+
+    private:
+        explicit Task(std::coroutine_handle<promise_type> handle) : m_handle{handle} {}
+        friend class EventLoop;
+
+        std::coroutine_handle<promise_type> m_handle;
+    };
+
+    // Single threaded epoll loop resuming coroutines as their file
+    // descriptors become ready.
+    class EventLoop
+    {
+    public:
+        class FdAwaiter
+        {
+        public:
+            FdAwaiter(EventLoop &loop, int fd, std::uint32_t events) : m_loop{loop}, m_fd{fd}, m_events{events} {}
+            bool await_ready() const noexcept { return false; }
+            void await_suspend(std::coroutine_handle<> handle);
+            std::uint32_t await_resume() const noexcept { return m_events; } // events that fired
+
+        private:
+            friend class EventLoop;
+            EventLoop &m_loop;
+            int m_fd;
+            std::uint32_t m_events;
+            std::coroutine_handle<> m_handle;
+        };
+
+        class YieldAwaiter
+        {
+        public:
+            explicit YieldAwaiter(EventLoop &loop) : m_loop{loop} {}
+            bool await_ready() const noexcept { return false; }
+            void await_suspend(std::coroutine_handle<> handle) { m_loop.m_ready.push_back(handle); }
+            void await_resume() const noexcept {}
+
+        private:
+            EventLoop &m_loop;
+        };
+
+        EventLoop();
+        ~EventLoop();
+
+        EventLoop(EventLoop const &) = delete;
+        EventLoop &operator=(EventLoop const &) = delete;
+
+        // The loop that is running on this thread.
+        static EventLoop &current();
+
+        // Resumes once |fd| is ready for any of |events| (EPOLLIN etc).
+        // Regular files are always ready.
+        FdAwaiter wait(int fd, std::uint32_t events) { return FdAwaiter{*this, fd, events}; }
+        // Resumes once everything else that's ready has had a turn.
+        YieldAwaiter yield() { return YieldAwaiter{*this}; }
+
+        // Starts |task| the next time the loop runs, keeping it until done.
+        void spawn(Task<Status> task);
+        // Runs until every spawned task is done.
+        void run();
+        // Runs until |task| and every spawned task is done.
+        Status run(Task<Status> task);
+
+    private:
+        void run_until(Task<Status> const *task);
+
+        int m_epoll;
+        std::size_t m_waiting;
+        std::vector<std::coroutine_handle<>> m_ready;
+        std::vector<Task<Status>> m_spawned;
+    };
+
+    // Runs the program, giving the thread back to the current EventLoop
+    // whenever a callout leaves it pending. |env| and the program have to
+    // outlive the task. Any other status is returned as is.
+    Task<Status> run_async(CompiledCode const &code, ExecutionEnvironment &env);
+    Task<Status> run_async(Ops const &ops, ExecutionEnvironment &env);
+
+    // For callouts: suspends the program until |fd| is ready for |events|,
+    // then calls |completion| before carrying on after the callout. Outside
+    // run_async() the program just stops with |Status::Pending|.
+    void await_fd(ExecutionEnvironment &env, int fd, std::uint32_t events, CallOutFunc completion);
+}
+
+#endif
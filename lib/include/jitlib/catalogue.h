@@ -0,0 +1,69 @@
+#ifndef JIT_CATALOGUE_H
+#define JIT_CATALOGUE_H
+
+#include <jitlib/execution.h>
+#include <jitlib/ops.h>
+#include <cstdint>
+#include <filesystem>
+#include <string>
+#include <string_view>
+#include <unordered_map>
+#include <vector>
+
+namespace jitlib
+{
+    // Callouts under the names that saved programs refer to them by.
+    class CallOutRegistry
+    {
+    public:
+        // Replaces whatever was registered under |name| before.
+        void add(std::string name, CallOutFunc func);
+        // Null if there's nothing by that name.
+        CallOutFunc find(std::string_view name) const;
+        // Null if |func| isn't registered.
+        std::string const *name_of(CallOutFunc func) const;
+
+    private:
+        std::unordered_map<std::string, CallOutFunc> m_funcs;
+        std::unordered_map<CallOutFunc, std::string> m_names;
+    };
+
+    // Saves |programs| to |path|, packed to 4 bytes an op with labels and
+    // callout names stored once for the whole file. Every callout has to be
+    // in |registry| and every jump has to have somewhere to go.
+    void save_catalogue(std::filesystem::path const &path, std::vector<Ops> const &programs, CallOutRegistry const &registry);
+
+    // Programs saved by save_catalogue(), mapped in and interpreted where
+    // they are rather than unpacked into Ops first.
+    class Catalogue
+    {
+    public:
+        // Throws if the file isn't a catalogue or uses callouts that aren't
+        // in |registry|.
+        Catalogue(std::filesystem::path const &path, CallOutRegistry const &registry);
+        ~Catalogue();
+
+        Catalogue(Catalogue &&);
+        Catalogue &operator=(Catalogue &&);
+
+        // Number of programs, none once moved from.
+        std::size_t size() const;
+
+        // As jitlib::run() and run_from(), on the program at |index|.
+        Status run(std::size_t index, ExecutionEnvironment &env) const;
+        Status run_from(std::size_t index, Label const &label, ExecutionEnvironment &env) const;
+
+        // Unpacks the program at |index|, eg. to compile it.
+        Ops ops(std::size_t index) const;
+
+    private:
+        Catalogue(Catalogue const &) = delete;
+        Catalogue &operator=(Catalogue const &) = delete;
+
+        uint8_t const *m_data;
+        std::size_t m_size;
+        std::vector<CallOutFunc> m_funcs; // callout index -> function
+    };
+}
+
+#endif
@@ -2,26 +2,159 @@
 #define JIT_COMPILER_H
 
 #include <jitlib/types.h>
+#include <atomic>
+#include <cstdint>
+#include <filesystem>
+#include <memory>
+#include <optional>
+#include <string>
+#include <unordered_map>
+#include <vector>
 
 namespace jitlib
 {
+    struct CpuFeatures
+    {
+        bool bmi1 : 1;
+        bool bmi2 : 1;
+        bool lzcnt : 1;
+        bool avx2 : 1;
+        bool erms : 1;
+        bool fsrm : 1;
+        std::size_t alignment; // preferred alignment of loop heads, 0 for none
+    };
+
+    // Detected once per process.
+    CpuFeatures const &host_cpu_features();
+
+    // Telling Linux perf where compiled code is, so that profiles of the
+    // whole process show which program and label it was running.
+    struct PerfOptions
+    {
+        // Append a symbol for each label to /tmp/perf-<pid>.map.
+        bool map = false;
+        // Record the symbols along with their code in jit-<pid>.dump in the
+        // temporary directory, for `perf inject --jit` and annotating.
+        bool jitdump = false;
+        // What the program's symbols start with, a number if empty.
+        std::string name{};
+    };
+
+    struct CompileOptions
+    {
+        // Overrides the detected host features, eg. to pin a feature level
+        // for reproducible benchmarking.
+        std::optional<CpuFeatures> features;
+        // Charge |ExecutionEnvironment::fuel| on backwards jumps and calls.
+        bool metered = false;
+        // Only compile the code reachable from the first op up front. Each
+        // Call target is compiled the first time it's called.
+        bool lazy = false;
+        // Threads to lower independent regions of the program on, 0 for one
+        // per core. Ignored when compiling lazily.
+        std::size_t threads = 1;
+        // Directory to keep compiled code in between runs, none if empty.
+        // Programs found there are mapped in and relocated instead of being
+        // compiled again. Ignored when compiling lazily.
+        std::filesystem::path cache{};
+        // Count how often each op runs in CompiledCode::counters(), for
+        // finding what's worth optimising. Short JumpIfZero blocks are left
+        // as branches so that every op is counted. Counted code isn't cached.
+        bool counted = false;
+        // Count the reads and writes to each address, and each Load and
+        // Store, in CompiledCode::memory_counters(). Costs far less than
+        // |counted|, only adding to memory ops. Isn't cached either.
+        bool memory_counted = false;
+        // Compile optimise(ops) rather than |ops|, taking out Loads and
+        // Stores it can prove unneeded. The code can then only be entered at
+        // the first op, at labels and where it suspended, and
+        // CompiledCode::run() throws std::invalid_argument elsewhere.
+        bool optimised = false;
+        // Send each callout through a trampoline that records it to a
+        // running Tracer. Traced code isn't cached.
+        bool traced = false;
+        // Nothing is written unless asked. Linked modules go by their names.
+        PerfOptions perf{};
+    };
+
+    // What CompiledCode::patch() had to do.
+    struct PatchResult
+    {
+        std::size_t patched = 0;   // ops rewritten where they were
+        std::size_t relocated = 0; // basic blocks recompiled onto the end
+        bool recompiled = false;   // the whole program was compiled again
+    };
+
+    // Native code lowered from one op, by offset into the code. Ops guarded
+    // by a JumpIfZero that's lowered without a branch are part of its range.
+    struct OpRange
+    {
+        std::uint32_t begin;
+        std::uint32_t end;
+        Value op;
+    };
+
+    struct OpCounters;
+    struct MemoryCounters;
+
     class CompiledCode
     {
-        void *m_code;
-        std::size_t m_size;
+    public:
+        static inline constexpr std::size_t kNoEntry = ~std::size_t{};
+        using Entries = std::vector<std::size_t>;                // op index -> code offset
+        using Labels = std::unordered_map<Label, std::size_t>; // label -> op index
+        using Returns = std::unordered_map<std::size_t, Value>; // Call return address offset -> op index
+
+        // The code itself along with where everything ended up in it.
+        struct Image;
+
+    private:
+        mutable std::atomic<std::shared_ptr<Image const>> m_image;
 
         CompiledCode(const CompiledCode &) = delete;
         CompiledCode &operator=(const CompiledCode &) = delete;
 
+        friend class Profiler;
+
     public:
         CompiledCode();
-        CompiledCode(void *buffer, std::size_t size); // takes ownership
+        explicit CompiledCode(std::shared_ptr<Image const> image);
         ~CompiledCode();
 
         CompiledCode(CompiledCode &&);
         CompiledCode &operator=(CompiledCode &&);
 
-        void run(ExecutionEnvironment &env) const;
+        // Starts executing at env.pc, inside env.calls if suspended there.
+        Status run(ExecutionEnvironment &env) const;
+        // Sets env.pc to the label and starts executing there.
+        Status run_from(Label const &label, ExecutionEnvironment &env) const;
+
+        // Bytes of native code, including anything compiled lazily so far.
+        std::size_t size() const;
+        // The op the native code at |offset| was lowered from, or kNoEntry
+        // for the way in and out, padding and stubs.
+        std::size_t op_at(std::size_t offset) const;
+        // Null unless compiled with |CompileOptions::counted|.
+        std::shared_ptr<OpCounters const> counters() const;
+        // Null unless compiled with |CompileOptions::memory_counted|.
+        std::shared_ptr<MemoryCounters const> memory_counters() const;
+        // Whether it was compiled with |CompileOptions::optimised|, which
+        // patched and recompiled versions keep.
+        bool optimised() const;
+
+        // Brings the code up to date with |ops|, an edited copy of the
+        // program it was compiled from. Ops that lower to the same size are
+        // rewritten where they are, basic blocks that don't are recompiled
+        // onto the end and jumped to, and edits to labels or to what gets
+        // metered recompile the lot, as does any edit to lazily compiled,
+        // traced or either kind of counted code. Recompiled code starts
+        // counting again from zero.
+        //
+        // Edits are made to a copy that's then published atomically, so any
+        // thread still running carries on with the old code, and suspended
+        // environments resume at the same op in the new code. Only one thread
+        // may patch at a time.
+        PatchResult patch(Ops const &ops);
     };
 }
 
@@ -0,0 +1,50 @@
+#ifndef JIT_COUNTERS_H
+#define JIT_COUNTERS_H
+
+#include <jitlib/execution.h>
+#include <jitlib/ops.h>
+#include <array>
+#include <cstdint>
+#include <vector>
+
+namespace jitlib
+{
+    // How often each op ran, by op index. Bumped without synchronisation, so
+    // runs on several threads at once can lose counts.
+    struct OpCounters
+    {
+        std::array<std::uint64_t, std::tuple_size_v<Ops>> executed{};
+        // JumpIfZeros that carried on to the next op
+        std::array<std::uint64_t, std::tuple_size_v<Ops>> fell_through{};
+    };
+
+    struct OpCount
+    {
+        std::size_t index;
+        Label label; // the last one at or before the op, empty if none
+        std::uint64_t executed;
+        std::uint64_t taken;     // JumpIfZero only
+        std::uint64_t not_taken; // JumpIfZero only
+    };
+
+    struct LabelCount
+    {
+        Label label;
+        std::uint64_t entered;  // times it was reached
+        std::uint64_t executed; // ops run after it, up to the next label
+    };
+
+    struct Histogram
+    {
+        std::vector<OpCount> ops;       // by op index, only those that ran
+        std::vector<LabelCount> labels; // in program order, only those that ran
+    };
+
+    // Interprets as run(), counting each op in |counters| as it goes.
+    Status run(Ops const &ops, ExecutionEnvironment &env, OpCounters &counters);
+
+    // |counters| for |ops|, by op and by the label each op follows.
+    Histogram histogram(Ops const &ops, OpCounters const &counters);
+}
+
+#endif
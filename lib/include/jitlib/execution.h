@@ -2,13 +2,15 @@
 #define JIT_EXEC_H
 
 #include <jitlib/types.h>
+#include <jitlib/compiler.h>
 
 namespace jitlib
 {
     static inline constexpr std::size_t kNumRegisters = 4;
+    // Deepest nesting of Calls that can be suspended and resumed.
+    static inline constexpr std::size_t kMaxCallDepth = 64;
 
     using Memory = std::array<Value, 256>;
-    using Ops = std::array<Op, 256>;
 
     struct ExecutionEnvironment
     {
@@ -20,10 +22,24 @@ namespace jitlib
             bool cmp : 1;
         } flags;
         void *userdata;
+        // Execution budget, 0 for none. It's charged for every op by the
+        // interpreter, and for every backwards jump and call by code compiled
+        // with |CompileOptions::metered|. Execution stops at the charge that
+        // brings it to 0.
+        std::uint64_t fuel;
+        // Return pcs of the Calls in progress when execution was suspended,
+        // outermost first. Running again resumes inside them, so clear
+        // |depth| before reusing a suspended environment from the top.
+        Value calls[kMaxCallDepth];
+        Value depth;
+        // Set by a callout to suspend with |Status::Pending| once it returns.
+        // Cleared again on the way out.
+        bool pending;
     };
 
-    void run(Ops const &ops, ExecutionEnvironment &env);
-    CompiledCode compile(Ops const &ops);
+    Status run(Ops const &ops, ExecutionEnvironment &env);
+    Status run_from(Ops const &ops, Label const &label, ExecutionEnvironment &env);
+    CompiledCode compile(Ops const &ops, CompileOptions const &options = {});
 }
 
 #endif
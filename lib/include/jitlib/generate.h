@@ -0,0 +1,31 @@
+#ifndef JIT_GENERATE_H
+#define JIT_GENERATE_H
+
+#include <jitlib/ops.h>
+#include <cstdint>
+
+namespace jitlib
+{
+    // What a generated program should look like. Densities are the chance
+    // of each op being one of those.
+    struct GenerateOptions
+    {
+        std::size_t ops = 128;         // how many, up to all 256
+        double branches = 0.1;         // forward JumpIfZeros and Jumps
+        double labels = 0.05;          // labels besides those jumped to
+        double loops = 0.02;           // counted loops starting there
+        Value iterations = 8;          // for each loop
+        double callouts = 0;           // calling |callout|
+        double calls = 0;              // Calls to subroutines, if any
+        std::size_t subroutines = 0;   // after the main program
+        CallOutFunc callout = nullptr; // adds 1 to r0 if null, mustn't change r3
+    };
+
+    // A random program made to |options| that always returns, the same for
+    // the same |seed|. Other jumps only go forwards, and loops count down in
+    // r3, which nothing else writes. They don't nest, aren't jumped into or
+    // out of, and aren't in subroutines, which only Call those after them.
+    Ops generate(GenerateOptions const &options, std::uint64_t seed);
+}
+
+#endif
@@ -0,0 +1,57 @@
+#ifndef JIT_HEATMAP_H
+#define JIT_HEATMAP_H
+
+#include <jitlib/execution.h>
+#include <jitlib/ops.h>
+#include <array>
+#include <cstdint>
+#include <string>
+#include <vector>
+
+namespace jitlib
+{
+    // Memory traffic, by address and by the Load or Store making it. Bumped
+    // without synchronisation, like OpCounters.
+    struct MemoryCounters
+    {
+        std::array<std::uint64_t, std::tuple_size_v<Memory>> reads{};
+        std::array<std::uint64_t, std::tuple_size_v<Memory>> writes{};
+        // Loads and Stores only, by op index
+        std::array<std::uint64_t, std::tuple_size_v<Ops>> accesses{};
+    };
+
+    struct CellCount
+    {
+        Value address;
+        std::uint64_t reads;
+        std::uint64_t writes;
+    };
+
+    struct SiteCount
+    {
+        std::size_t index;
+        Op op;
+        Label label; // the last one at or before the op, empty if none
+        std::uint64_t accesses;
+    };
+
+    struct Heatmap
+    {
+        std::array<std::uint64_t, std::tuple_size_v<Memory>> reads{};
+        std::array<std::uint64_t, std::tuple_size_v<Memory>> writes{};
+        std::vector<CellCount> cells; // busiest first, only those accessed
+        std::vector<SiteCount> sites; // busiest first, only those that ran
+    };
+
+    // Interprets as run(), counting each Load and Store in |counters|.
+    Status run(Ops const &ops, ExecutionEnvironment &env, MemoryCounters &counters);
+
+    // |counters| for |ops|, by address and by op.
+    Heatmap heatmap(Ops const &ops, MemoryCounters const &counters);
+
+    // A 16x16 grid of |heatmap|'s addresses shaded by their share of the
+    // busiest one, then its busiest |count| cells and sites, one per line.
+    std::string report(Heatmap const &heatmap, std::size_t count = 10);
+}
+
+#endif
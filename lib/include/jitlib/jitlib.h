@@ -5,5 +5,18 @@
 #include <jitlib/ops.h>
 #include <jitlib/execution.h>
 #include <jitlib/compiler.h>
+#include <jitlib/linker.h>
+#include <jitlib/catalogue.h>
+#include <jitlib/object.h>
+#include <jitlib/specialise.h>
+#include <jitlib/profiler.h>
+#include <jitlib/counters.h>
+#include <jitlib/heatmap.h>
+#include <jitlib/measure.h>
+#include <jitlib/trace.h>
+#include <jitlib/generate.h>
+#include <jitlib/optimise.h>
+#include <jitlib/scheduler.h>
+#include <jitlib/async.h>
 
 #endif
@@ -0,0 +1,60 @@
+#ifndef JIT_LINKER_H
+#define JIT_LINKER_H
+
+#include <jitlib/compiler.h>
+#include <jitlib/execution.h>
+#include <memory>
+#include <string>
+#include <string_view>
+#include <vector>
+
+namespace jitlib
+{
+    // A program to link, under the name it's run by.
+    struct Module
+    {
+        std::string name;
+        Ops ops;
+    };
+
+    // Several programs compiled into one image, calling each other directly.
+    class LinkedCode
+    {
+    public:
+        struct Image;
+
+    private:
+        std::shared_ptr<Image const> m_image;
+
+    public:
+        LinkedCode();
+        explicit LinkedCode(std::shared_ptr<Image const> image);
+        ~LinkedCode();
+
+        LinkedCode(LinkedCode &&);
+        LinkedCode &operator=(LinkedCode &&);
+
+        // Starts executing |module| at env.pc, inside env.calls if suspended
+        // there. A suspended environment has to be resumed from the module it
+        // was started in, its pcs are followed through any Calls into other
+        // modules from there.
+        Status run(std::string_view module, ExecutionEnvironment &env) const;
+        // Sets env.pc to the label in |module| and starts executing there.
+        Status run_from(std::string_view module, Label const &label, ExecutionEnvironment &env) const;
+
+        // Bytes of native code for all the modules together.
+        std::size_t size() const;
+        // Subroutines that were left out for being the same as another.
+        std::size_t deduplicated() const;
+    };
+
+    // Lays out |modules| one after another in a single image. A Call to a
+    // label that its module doesn't define goes straight to the one module
+    // that does; Jumps stay within their module. Subroutines that only do
+    // straight line work before returning are kept once however many
+    // modules define them. |CompileOptions::lazy|, |CompileOptions::counted|
+    // and |CompileOptions::memory_counted| are ignored.
+    LinkedCode link(std::vector<Module> const &modules, CompileOptions const &options = {});
+}
+
+#endif
@@ -0,0 +1,44 @@
+#ifndef JIT_MEASURE_H
+#define JIT_MEASURE_H
+
+#include <jitlib/execution.h>
+#include <chrono>
+#include <cstdint>
+
+namespace jitlib
+{
+    struct HardwareEvents
+    {
+        bool cycles : 1;
+        bool instructions : 1;
+        bool branch_misses : 1;
+        bool l1i_misses : 1;
+    };
+
+    // What some runs of one program took between them. Events that weren't
+    // counted for every run are left at 0.
+    struct RunStats
+    {
+        std::size_t runs = 0;
+        std::chrono::nanoseconds time{};
+        std::uint64_t cycles = 0;
+        std::uint64_t instructions = 0;
+        std::uint64_t branch_misses = 0;
+        std::uint64_t l1i_misses = 0;
+        HardwareEvents counted{};
+    };
+
+    // The events this thread can count, opening its counters with
+    // perf_event_open if it hasn't yet. None where perf events aren't
+    // available, eg. in a container or VM without a PMU.
+    HardwareEvents hardware_events();
+
+    // As run() and CompiledCode::run(), adding the wall time and hardware
+    // events they took to |stats|. The counters are user space only, and
+    // read with rdpmc where the kernel allows it rather than a syscall.
+    // Adding to the same |stats| from several threads needs a lock.
+    Status measure(Ops const &ops, ExecutionEnvironment &env, RunStats &stats);
+    Status measure(CompiledCode const &code, ExecutionEnvironment &env, RunStats &stats);
+}
+
+#endif
@@ -0,0 +1,59 @@
+#ifndef JIT_OBJECT_H
+#define JIT_OBJECT_H
+
+#include <jitlib/catalogue.h>
+#include <jitlib/compiler.h>
+#include <jitlib/execution.h>
+#include <jitlib/linker.h>
+#include <cstdint>
+#include <filesystem>
+#include <vector>
+
+namespace jitlib
+{
+    // Where a Call made by native code returns to.
+    struct NativeReturn
+    {
+        std::uint32_t offset; // into the code
+        std::uint32_t pc;     // op index
+    };
+
+    struct NativeLabel
+    {
+        Label label;
+        std::uint32_t pc;
+    };
+
+    // A program compiled ahead of time by write_object(), linked in under
+    // its module name as
+    //   extern "C" jitlib::NativeProgram const name;
+    struct NativeProgram
+    {
+        static inline constexpr std::uint32_t kNoEntry = ~std::uint32_t{};
+
+        void const *code; // NativeFunction
+        std::uint32_t entries[std::tuple_size_v<Ops>]; // op index -> code offset
+        NativeReturn const *returns; // by offset
+        std::uint32_t return_count;
+        NativeLabel const *labels;
+        std::uint32_t label_count;
+    };
+
+    // As CompiledCode::run() and run_from(), on code that's linked in.
+    Status run(NativeProgram const &program, ExecutionEnvironment &env);
+    Status run_from(NativeProgram const &program, Label const &label, ExecutionEnvironment &env);
+
+    // Compiles each of |modules| for this machine into a relocatable ELF
+    // object at |path|, to link into a binary, position independent or not,
+    // with no compiling or mapping needed at startup. Each callout is
+    // referred to by its name in |registry|, which has to be a function
+    // defined as
+    //   extern "C" void name(jitlib::ExecutionEnvironment &);
+    // |CompileOptions::lazy|, |CompileOptions::cache|,
+    // |CompileOptions::counted| and |CompileOptions::memory_counted| are
+    // ignored.
+    void write_object(std::filesystem::path const &path, std::vector<Module> const &modules, CallOutRegistry const &registry,
+                      CompileOptions const &options = {});
+}
+
+#endif
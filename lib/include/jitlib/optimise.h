@@ -0,0 +1,25 @@
+#ifndef JIT_OPTIMISE_H
+#define JIT_OPTIMISE_H
+
+#include <jitlib/ops.h>
+
+namespace jitlib
+{
+    // |ops| with memory traffic it can prove unneeded taken out, op for op
+    // so that labels and indices stay where they were. Within each straight
+    // run of ops between labels, control flow, callouts and Yields, it
+    // tracks which registers hold constants, so which addresses are known,
+    // and which registers hold what's in which cells. Then:
+    //  - Loads of a cell whose value is in a register become a SetReg, or a
+    //    SetImm if it's a constant, or a Nop if it's already there
+    //  - Stores of what a cell already holds become Nops
+    //  - Stores that are overwritten before anything could read them
+    //    become Nops
+    //
+    // Nothing is known at the start of a run, so the result behaves the
+    // same as |ops| when entered at the first op, at labels or where it
+    // suspended, but not in the middle of a run.
+    Ops optimise(Ops const &ops);
+}
+
+#endif
@@ -0,0 +1,84 @@
+#ifndef JIT_PROFILER_H
+#define JIT_PROFILER_H
+
+#include <jitlib/compiler.h>
+#include <jitlib/ops.h>
+#include <chrono>
+#include <memory>
+#include <string>
+#include <vector>
+
+namespace jitlib
+{
+    // The samples that landed in one op's native code.
+    struct OpSamples
+    {
+        std::size_t index;
+        Op op;
+        Label label; // the last one at or before the op, empty if none
+        std::size_t samples;
+    };
+
+    struct LabelSamples
+    {
+        Label label;
+        std::size_t samples;
+    };
+
+    struct Profile
+    {
+        std::size_t samples = 0;          // kept by the profiler
+        std::size_t attributed = 0;       // of those, in the code's ops
+        std::vector<OpSamples> ops;       // hottest first, only those sampled
+        std::vector<LabelSamples> labels; // hottest first, only those sampled
+    };
+
+    // Samples where the process is every so often of CPU time, using
+    // SIGPROF, for attributing to the ops of compiled code afterwards. The
+    // signal handler only notes the address it interrupted, so it's cheap
+    // enough to leave running in production.
+    //
+    // Only one profiler can run at a time. The handler stays installed once
+    // started, ignoring the signal while no profiler is running, so nothing
+    // else in the process can use SIGPROF or ITIMER_PROF alongside it.
+    class Profiler
+    {
+    public:
+        struct Options
+        {
+            std::chrono::microseconds interval = std::chrono::milliseconds(1);
+            // The most recent samples kept, older ones are overwritten.
+            std::size_t capacity = 1 << 16;
+        };
+
+        Profiler();
+        explicit Profiler(Options const &options);
+        // Stops if running.
+        ~Profiler();
+
+        Profiler(Profiler const &) = delete;
+        Profiler &operator=(Profiler const &) = delete;
+
+        // Throws if another profiler is running.
+        void start();
+        void stop();
+        // Forgets the samples taken so far.
+        void clear();
+
+        // Samples taken so far, including any overwritten.
+        std::size_t samples() const;
+        // Attributes the samples kept so far to the ops of |code| as it is
+        // now. Time spent in callouts, or in code it's since been patched
+        // from, isn't attributed to anything.
+        Profile profile(CompiledCode const &code) const;
+
+    private:
+        struct State;
+        std::unique_ptr<State> m_state;
+    };
+
+    // The hottest |count| ops and labels in |profile|, one per line.
+    std::string report(Profile const &profile, std::size_t count = 10);
+}
+
+#endif
@@ -0,0 +1,70 @@
+#ifndef JIT_SCHEDULER_H
+#define JIT_SCHEDULER_H
+
+#include <jitlib/execution.h>
+#include <algorithm>
+#include <chrono>
+#include <memory>
+#include <thread>
+
+namespace jitlib
+{
+    // Runs many programs as tasks on a fixed pool of worker threads.
+    //
+    // Tasks are preempted at safe points, ie. wherever fuel is charged, once
+    // they've used up their time slice, and requeued behind everything else
+    // on their worker. A Yield requeues the task straight away. Idle workers
+    // steal from the back of busy workers' queues.
+    //
+    // The scheduler owns |ExecutionEnvironment::fuel|. Compiled code has to
+    // be built with |CompileOptions::metered| to be preemptible; unmetered
+    // code only gives up its worker when it yields or returns.
+    class Scheduler
+    {
+    public:
+        using Clock = std::chrono::steady_clock;
+        using TaskId = std::size_t;
+
+        struct Options
+        {
+            std::size_t workers = std::max(1u, std::thread::hardware_concurrency());
+            Clock::duration time_slice = std::chrono::milliseconds(1);
+            // Fuel between checks of the time slice, at least 2.
+            std::uint64_t check_interval = 1024;
+        };
+
+        struct TaskStats
+        {
+            std::chrono::nanoseconds cpu_time{};          // thread CPU time spent running
+            std::chrono::nanoseconds queue_latency{};     // total time spent runnable but queued
+            std::chrono::nanoseconds max_queue_latency{}; // longest single wait in a queue
+            std::size_t slices = 0;                       // times it was given a worker
+            std::size_t steals = 0;                       // times it moved to another worker
+        };
+
+        Scheduler();
+        explicit Scheduler(Options const &options);
+        // Stops the workers, abandoning any unfinished tasks.
+        ~Scheduler();
+
+        Scheduler(Scheduler const &) = delete;
+        Scheduler &operator=(Scheduler const &) = delete;
+
+        // Queues a task starting from |env|. The program has to outlive it.
+        TaskId spawn(CompiledCode const &code, ExecutionEnvironment const &env);
+        TaskId spawn(Ops const &ops, ExecutionEnvironment const &env);
+
+        // Blocks until every task spawned so far has returned.
+        void wait();
+
+        // Only stable once the task has returned.
+        ExecutionEnvironment const &environment(TaskId task) const;
+        TaskStats stats(TaskId task) const;
+
+    private:
+        struct State;
+        std::unique_ptr<State> m_state;
+    };
+}
+
+#endif
@@ -0,0 +1,387 @@
+#ifndef JIT_SPECIALISE_H
+#define JIT_SPECIALISE_H
+
+#include <jitlib/execution.h>
+#include <jitlib/ops.h>
+#include <algorithm>
+#include <array>
+#include <cstddef>
+#include <stdexcept>
+#include <string>
+#include <utility>
+
+namespace jitlib
+{
+    namespace specialise
+    {
+        struct Registers
+        {
+            Value r[kNumRegisters];
+        };
+
+        // Left by a backwards jump for the loop in execute() to carry on at
+        // |Exit::pc|. Never returned from run_specialised().
+        static inline constexpr Status kLoopStatus = static_cast<Status>(0xfe);
+
+        // How a stretch of code finished. Registers are passed by reference
+        // instead, so that within a loop they can stay in host registers.
+        struct Exit
+        {
+            Status status;
+            Value pc;
+        };
+
+        struct Context
+        {
+            ExecutionEnvironment &env;
+            // Return pcs of the Calls being suspended in, innermost first
+            Value calls[kMaxCallDepth];
+            std::size_t depth;
+        };
+
+        template <auto MakeOps>
+        inline constexpr auto kOps = MakeOps();
+
+        // The last definition wins, as in the interpreter. Not finding it
+        // stops the program from compiling, or throws when run.
+        template <typename Program>
+        constexpr std::size_t find_label(Program const &ops, Label const &label)
+        {
+            std::size_t found = ops.size();
+            for (std::size_t i = 0; i < ops.size(); i++)
+            {
+                if (ops[i].type == OpType::Label && ops[i].label == label)
+                {
+                    found = i;
+                }
+            }
+            if (found == ops.size())
+            {
+                throw std::out_of_range("Unknown label: " + std::string(label.data.data()));
+            }
+            return found;
+        }
+
+        // Whether a backwards jump goes to |pc|.
+        template <typename Program>
+        constexpr bool is_loop_head(Program const &ops, std::size_t pc)
+        {
+            if (ops[pc].type != OpType::Label)
+            {
+                return false;
+            }
+            for (std::size_t i = pc; i < ops.size(); i++)
+            {
+                if ((ops[i].type == OpType::Jump || ops[i].type == OpType::JumpIfZero) && ops[i].label == ops[pc].label)
+                {
+                    return true;
+                }
+            }
+            return false;
+        }
+
+        // Whether more than one op carries on to |pc|, by jumping to it or
+        // falling through.
+        template <typename Program>
+        constexpr bool is_merge_point(Program const &ops, std::size_t pc)
+        {
+            if (ops[pc].type != OpType::Label)
+            {
+                return false;
+            }
+            std::size_t predecessors = 0;
+            if (pc > 0 && ops[pc - 1].type != OpType::Jump && ops[pc - 1].type != OpType::Return && ops[pc - 1].type != OpType::Yield)
+            {
+                predecessors++;
+            }
+            for (std::size_t i = 0; i < ops.size(); i++)
+            {
+                if ((ops[i].type == OpType::Jump || ops[i].type == OpType::JumpIfZero) && ops[i].label == ops[pc].label)
+                {
+                    predecessors++;
+                }
+            }
+            return predecessors > 1;
+        }
+
+        template <auto MakeOps>
+        Exit execute(Context &ctx, Registers &regs, Exit exit);
+        template <auto MakeOps, std::size_t Pc>
+        Exit step(Context &ctx, Registers &regs);
+        template <auto MakeOps, std::size_t Pc>
+        Exit loop(Context &ctx, Registers &regs);
+        template <auto MakeOps, std::size_t Pc>
+        Exit merge(Context &ctx, Registers &regs);
+        template <auto MakeOps, std::size_t Pc>
+        Exit body(Context &ctx, Registers &regs);
+
+        // Calls out of line on a copy of the registers, so that the caller's
+        // never have their address taken.
+        template <typename Function>
+        [[gnu::always_inline]] inline Exit call_with_copy(Registers &regs, Function &&function)
+        {
+            Registers copy = regs;
+            Exit const exit = function(copy);
+            regs = copy;
+            return exit;
+        }
+
+        // Carries on straight into the code for |To|, unless that would go
+        // round a loop or join other paths there. Each loop is a function of
+        // its own for the compiler to optimise as one, and each join is one
+        // so that what follows isn't inlined again into every path to it.
+        template <auto MakeOps, std::size_t From, std::size_t To>
+        [[gnu::always_inline]] inline Exit go(Context &ctx, Registers &regs)
+        {
+            if constexpr (To <= From)
+            {
+                return Exit{kLoopStatus, static_cast<Value>(To)};
+            }
+            else if constexpr (is_loop_head(kOps<MakeOps>, To))
+            {
+                return call_with_copy(regs, [&](Registers &copy) { return loop<MakeOps, To>(ctx, copy); });
+            }
+            else if constexpr (is_merge_point(kOps<MakeOps>, To))
+            {
+                return call_with_copy(regs, [&](Registers &copy) { return merge<MakeOps, To>(ctx, copy); });
+            }
+            else
+            {
+                return body<MakeOps, To>(ctx, regs);
+            }
+        }
+
+        inline Exit suspend(ExecutionEnvironment &env, Status status, std::size_t pc)
+        {
+            env.pc = static_cast<Value>(pc);
+            return Exit{status, static_cast<Value>(pc)};
+        }
+
+        inline bool charge(ExecutionEnvironment &env)
+        {
+            return env.fuel != 0 && --env.fuel == 0;
+        }
+
+        // Runs the op at |Pc| and whatever follows it up to the next
+        // backwards jump, Return or suspension. Forwards jumps go straight
+        // to the code for their target, so each stretch between loop heads
+        // is straight line code as far as the compiler is concerned.
+        template <auto MakeOps, std::size_t Pc>
+        [[gnu::always_inline]] inline Exit body(Context &ctx, Registers &regs)
+        {
+            constexpr auto const &ops = kOps<MakeOps>;
+            constexpr Op op = ops[Pc];
+            ExecutionEnvironment &env = ctx.env;
+            constexpr std::size_t next = Pc + 1 < ops.size() ? Pc + 1 : 0;
+
+            if constexpr (op.type == OpType::Load)
+            {
+                regs.r[op.regA] = env.mem[regs.r[op.regB]];
+            }
+            else if constexpr (op.type == OpType::Store)
+            {
+                env.mem[regs.r[op.regA]] = regs.r[op.regB];
+            }
+            else if constexpr (op.type == OpType::SetReg)
+            {
+                regs.r[op.regA] = regs.r[op.regB];
+            }
+            else if constexpr (op.type == OpType::SetImm)
+            {
+                regs.r[op.regA] = op.imm;
+            }
+            else if constexpr (op.type == OpType::AddReg)
+            {
+                regs.r[op.regA] += regs.r[op.regB];
+            }
+            else if constexpr (op.type == OpType::AddImm)
+            {
+                regs.r[op.regA] += op.imm;
+            }
+            else if constexpr (op.type == OpType::Negate)
+            {
+                regs.r[op.regA] = static_cast<Value>(1 + ~regs.r[op.regA]);
+            }
+            else if constexpr (op.type == OpType::Return)
+            {
+                return Exit{Status::Returned, Pc};
+            }
+            else if constexpr (op.type == OpType::Jump || op.type == OpType::JumpIfZero)
+            {
+                constexpr std::size_t target = find_label(ops, op.label);
+                if (target <= Pc && charge(env))
+                {
+                    return suspend(env, Status::OutOfFuel, Pc);
+                }
+                if (op.type == OpType::Jump || regs.r[op.regA] == 0)
+                {
+                    return go<MakeOps, Pc, target>(ctx, regs);
+                }
+            }
+            else if constexpr (op.type == OpType::Call)
+            {
+                constexpr std::size_t target = find_label(ops, op.label);
+                if (charge(env))
+                {
+                    return suspend(env, Status::OutOfFuel, Pc);
+                }
+                Exit const exit = call_with_copy(regs, [&](Registers &copy)
+                                                 { return execute<MakeOps>(ctx, copy, step<MakeOps, target>(ctx, copy)); });
+                if (exit.status != Status::Returned)
+                {
+                    if (ctx.depth == kMaxCallDepth)
+                    {
+                        throw std::length_error("Call stack too deep to suspend");
+                    }
+                    ctx.calls[ctx.depth++] = static_cast<Value>(next);
+                    return exit;
+                }
+            }
+            else if constexpr (op.type == OpType::CallOut)
+            {
+                // Callouts see the registers where they always are
+                std::copy(std::begin(regs.r), std::end(regs.r), env.regs);
+                op.func(env);
+                std::copy(std::begin(env.regs), std::end(env.regs), regs.r);
+                if (env.pending)
+                {
+                    env.pending = false;
+                    return suspend(env, Status::Pending, next);
+                }
+            }
+            else if constexpr (op.type == OpType::Yield)
+            {
+                return suspend(env, Status::Yielded, next);
+            }
+            return go<MakeOps, Pc, next>(ctx, regs);
+        }
+
+        // Goes round the loop at |Pc| for as long as it jumps back there.
+        template <auto MakeOps, std::size_t Pc>
+        Exit loop(Context &ctx, Registers &regs)
+        {
+            Registers local = regs;
+            Exit exit;
+            do
+            {
+                exit = body<MakeOps, Pc>(ctx, local);
+            } while (exit.status == kLoopStatus && exit.pc == Pc);
+            regs = local;
+            return exit;
+        }
+
+        // Runs on from the label at |Pc|, which several paths lead to. Never
+        // inlined, so each chain of branches costs as many copies of the code
+        // as there are branches, rather than paths through them.
+        template <auto MakeOps, std::size_t Pc>
+        [[gnu::noinline]] Exit merge(Context &ctx, Registers &regs)
+        {
+            Registers local = regs;
+            Exit const exit = body<MakeOps, Pc>(ctx, local);
+            regs = local;
+            return exit;
+        }
+
+        // Runs from |Pc| until Returning, suspending or jumping back.
+        template <auto MakeOps, std::size_t Pc>
+        Exit step(Context &ctx, Registers &regs)
+        {
+            if constexpr (is_loop_head(kOps<MakeOps>, Pc))
+            {
+                return loop<MakeOps, Pc>(ctx, regs);
+            }
+            else
+            {
+                Registers local = regs;
+                Exit const exit = body<MakeOps, Pc>(ctx, local);
+                regs = local;
+                return exit;
+            }
+        }
+
+        template <auto MakeOps, std::size_t... Pcs>
+        constexpr auto make_steps(std::index_sequence<Pcs...>)
+        {
+            return std::array<Exit (*)(Context &, Registers &), sizeof...(Pcs)>{&step<MakeOps, Pcs>...};
+        }
+
+        // Where to start from each pc, eg. on resuming.
+        template <auto MakeOps>
+        inline constexpr auto kSteps = make_steps<MakeOps>(std::make_index_sequence<kOps<MakeOps>.size()>());
+
+        // Keeps going round loops until Returning or suspending.
+        template <auto MakeOps>
+        Exit execute(Context &ctx, Registers &regs, Exit exit)
+        {
+            while (exit.status == kLoopStatus)
+            {
+                exit = kSteps<MakeOps>[exit.pc](ctx, regs);
+            }
+            return exit;
+        }
+    }
+
+    // Runs the program returned by the constexpr function |MakeOps| as C++
+    // generated for it at build time, with no compiling at runtime. Labels
+    // are resolved when building and each op becomes code that the host
+    // compiler optimises along with its neighbours. Otherwise as run(), but
+    // fuel is only charged for backwards jumps and Calls, as with
+    // |CompileOptions::metered|.
+    template <auto MakeOps>
+    Status run_specialised(ExecutionEnvironment &env)
+    {
+        static_assert(specialise::kOps<MakeOps>.size() <= std::tuple_size_v<Ops>, "Too many ops");
+        using namespace specialise;
+        if (env.depth > kMaxCallDepth)
+        {
+            throw std::out_of_range("Call depth " + std::to_string(env.depth) + " is too deep");
+        }
+        if (env.pc >= kOps<MakeOps>.size())
+        {
+            throw std::out_of_range("No entry point for pc " + std::to_string(env.pc));
+        }
+
+        // Run from env.pc, then return out through each Call we were
+        // suspended in
+        Context ctx{env, {}, 0};
+        Registers regs;
+        std::copy(std::begin(env.regs), std::end(env.regs), regs.r);
+        Value outer[kMaxCallDepth];
+        std::size_t const outer_depth = env.depth;
+        std::copy(env.calls, env.calls + outer_depth, outer);
+        Exit exit{kLoopStatus, env.pc};
+        for (std::size_t depth = outer_depth;;)
+        {
+            exit = execute<MakeOps>(ctx, regs, exit);
+            if (exit.status != Status::Returned)
+            {
+                if (depth + ctx.depth > kMaxCallDepth)
+                {
+                    throw std::length_error("Call stack too deep to suspend");
+                }
+                std::copy(outer, outer + depth, env.calls);
+                std::reverse_copy(ctx.calls, ctx.calls + ctx.depth, env.calls + depth);
+                env.depth = static_cast<Value>(depth + ctx.depth);
+                break;
+            }
+            if (depth == 0)
+            {
+                env.depth = 0;
+                break;
+            }
+            exit = Exit{kLoopStatus, outer[--depth]};
+        }
+        std::copy(std::begin(regs.r), std::end(regs.r), env.regs);
+        return exit.status;
+    }
+
+    // Sets env.pc to the label and starts executing there.
+    template <auto MakeOps>
+    Status run_specialised_from(Label const &label, ExecutionEnvironment &env)
+    {
+        env.pc = static_cast<Value>(specialise::find_label(specialise::kOps<MakeOps>, label));
+        return run_specialised<MakeOps>(env);
+    }
+}
+
+#endif
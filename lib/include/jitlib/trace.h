@@ -0,0 +1,51 @@
+#ifndef JIT_TRACE_H
+#define JIT_TRACE_H
+
+#include <memory>
+#include <string>
+
+namespace jitlib
+{
+    // Records spans of time spent compiling, running and in callouts, on
+    // every thread, for viewing in chrome://tracing or Perfetto. Each thread
+    // writes to a ring buffer of its own without locking, and while no
+    // tracer is running a span costs a call and a load.
+    //
+    // Only one tracer can run at a time. Callouts from compiled code are
+    // only recorded if it was compiled with |CompileOptions::traced|.
+    class Tracer
+    {
+    public:
+        struct Options
+        {
+            // The most recent events kept per thread, older ones are
+            // overwritten.
+            std::size_t capacity = 1 << 16;
+        };
+
+        Tracer();
+        explicit Tracer(Options const &options);
+        // Stops if running.
+        ~Tracer();
+
+        Tracer(Tracer const &) = delete;
+        Tracer &operator=(Tracer const &) = delete;
+
+        // Throws if another tracer is running.
+        void start();
+        void stop();
+        // Forgets the events recorded so far.
+        void clear();
+
+        // Events recorded so far, including any overwritten.
+        std::size_t events() const;
+        // The events kept so far in Chrome's trace event format.
+        std::string json() const;
+
+    private:
+        struct State;
+        std::unique_ptr<State> m_state;
+    };
+}
+
+#endif
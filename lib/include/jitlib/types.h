@@ -1,6 +1,7 @@
 #ifndef JIT_TYPES_H
 #define JIT_TYPES_H
 
+#include <algorithm>
 #include <array>
 #include <cstdint>
 #include <string_view>
@@ -10,14 +11,23 @@ namespace jitlib
     using Register = uint8_t;
     using Value = uint8_t;
 
+    enum class Status
+    {
+        Returned = 0,
+        OutOfFuel, // env.pc holds the op that would have run next
+        Yielded,   // env.pc holds the op after the Yield
+        Pending,   // a callout set env.pending, env.pc holds the op after it
+    };
+
     class CompiledCode;
     struct ExecutionEnvironment;
     struct Op;
+    using Ops = std::array<Op, 256>;
 
     struct Label
     {
         template <std::size_t N>
-        Label(const char (&str)[N])
+        constexpr Label(const char (&str)[N])
         {
             static_assert(N <= 16);
             std::copy(std::begin(str), std::end(str), data.begin());
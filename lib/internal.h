@@ -2,8 +2,12 @@
 #define INTERNAL_H
 
 #include <jitlib/jitlib.h>
+#include <cstddef>
+#include <functional>
 #include <stdexcept>
+#include <string>
 #include <unordered_map>
+#include <vector>
 
 #define ASSERT(x)                                           \
     do                                                      \
@@ -16,19 +20,351 @@
 
 namespace jitlib
 {
-    using NativeRegister = std::size_t;
-    struct NativeState
+    // Return addresses of the Calls in progress, innermost first. Passed in
+    // to resume and filled in by native::exit_stub() when suspending, in
+    // which case |count| may exceed kMaxCallDepth and only the innermost
+    // frames were kept.
+    struct NativeFrames
     {
-        NativeRegister regs[kNumRegisters];
-        void *data;
+        std::size_t count;
+        void const *frames[kMaxCallDepth];
     };
-    using NativeFunction = void (*)(NativeState *);
+
+    using NativeFunction = Status (*)(ExecutionEnvironment *, void const *entry, NativeFrames *frames);
     using LabelToOffsetMap = std::unordered_map<Label, std::size_t>;
+    using OpFlags = std::array<bool, std::tuple_size_v<Ops>>;
+
+    // An absolute address in the code, only good for this process, of what
+    // the op at |index| refers to. Position independent code loads it from
+    // a slot instead, and |offset| is where the slot's distance from there,
+    // plus |addend|, goes.
+    struct Relocation
+    {
+        std::size_t offset;
+        std::size_t index;
+        std::ptrdiff_t addend = 0;
+    };
+
+    struct EncodeContext
+    {
+        uint8_t const *buffer_base;               // null when only sizing
+        LabelToOffsetMap const *label_to_offset; // null when only sizing
+        CpuFeatures features;
+        std::size_t exit_offset; // see native::exit_stub()
+        OpFlags const *charges;  // ops that charge fuel, null if unmetered
+        std::vector<Relocation> *relocations = nullptr; // added to if not null
+        OpCounters *counters = nullptr;                 // bumped as ops run if not null
+        CallOutFunc callout = nullptr;                  // called instead of each op's if not null
+        MemoryCounters *memory_counters = nullptr;      // bumped by Loads and Stores if not null
+        bool position_independent = false;              // callouts loaded from slots, see Relocation
+    };
+
+    // Left with by the stub standing in for a Call target that hasn't been
+    // compiled yet, with the pc of its label. Never returned from run().
+    static inline constexpr Status kCompileStatus = static_cast<Status>(0xff);
+
+    // Where each op and label was lowered to.
+    struct Layout
+    {
+        LabelToOffsetMap label_to_offset;
+        CompiledCode::Entries entries; // op index -> code offset
+        CompiledCode::Entries ends;    // op index -> code offset after it
+        CompiledCode::Labels labels;
+        CompiledCode::Returns returns;
+    };
+
+    struct CompiledCode::Image
+    {
+        uint8_t *code;
+        std::size_t size;        // allocated
+        std::size_t used;        // the rest traps
+        std::size_t compiled;    // used when last compiled in full
+        std::size_t exit_offset; // see native::exit_stub()
+        Ops ops;                 // as compiled
+        CpuFeatures features;
+        bool metered;
+        bool lazy;
+        OpFlags loop_heads;
+        OpFlags charges;
+        Layout layout;
+        std::vector<OpRange> op_map; // see map_ops()
+        PerfOptions perf;            // named, see publish_symbols()
+        std::shared_ptr<OpCounters> counters;            // null unless counted, shared by each version
+        bool traced;                                     // callouts go through traced_callout()
+        std::shared_ptr<MemoryCounters> memory_counters; // null unless memory counted, likewise shared
+        bool optimised;                                  // |ops| came from optimise()
+
+        explicit Image(Ops const &ops) : code{}, size{}, used{}, compiled{}, exit_offset{}, ops{ops}, features{}, metered{}, lazy{}, loop_heads{}, charges{}, traced{}, optimised{} {}
+        Image(Image const &) = delete;
+        Image &operator=(Image const &) = delete;
+        ~Image();
+    };
+
+    std::unordered_map<Label, std::size_t> find_labels(Ops const &ops);
+    // Labels that are the target of a backwards jump.
+    OpFlags find_loop_heads(Ops const &ops);
+    // Ops that can repeat without bound, ie. backwards jumps and calls.
+    OpFlags find_charges(Ops const &ops);
+    // Whether optimise() leaves |pc| safe to start at, ie. the first op, or
+    // on or just after one that a run can start, end or suspend at.
+    bool is_entry(Ops const &ops, std::size_t pc);
+    std::size_t padding(std::size_t offset, std::size_t alignment);
+    // |op| as a line of assembly, for reports.
+    std::string describe(Op const &op);
+    bool same_op(Op const &a, Op const &b);
+    Layout empty_layout(Ops const &ops);
+    // Where each op ended up, by offset.
+    std::vector<OpRange> map_ops(Layout const &layout);
+    // The op whose range in |op_map| holds |offset|, or kNoEntry.
+    std::size_t find_op(std::vector<OpRange> const &op_map, std::size_t offset);
+    // Lowers ops [begin, end) at |offset|, or only sizes them if |code| is
+    // null, noting where everything went. Returns the offset after them.
+    std::size_t emit(Ops const &ops, std::size_t begin, std::size_t end, OpFlags const &loop_heads, EncodeContext const &ctx,
+                     uint8_t *code, std::size_t offset, Layout &layout);
+    // Compiles all of |ops| up front, adding where the code needs relocating
+    // to |relocations| if not null. |options.lazy| and |options.cache| are
+    // ignored. Position independent code can't be run until each slot's
+    // distance is filled in.
+    std::shared_ptr<CompiledCode::Image> compile_eagerly(Ops const &ops, CompileOptions const &options, std::vector<Relocation> *relocations,
+                                                         bool position_independent = false);
+    // Runs |code| from |entry| inside |frames|, and tidies up |env| after.
+    // If it suspends, |frames| holds where the Calls it was in return to
+    // and |env.depth| how many there were.
+    Status enter(uint8_t const *code, void const *entry, NativeFrames &frames, ExecutionEnvironment &env);
+
+    struct LinkedCode::Image
+    {
+        // Where one module ended up
+        struct Unit
+        {
+            std::string name;
+            Layout layout;
+            std::vector<std::size_t> callees; // op index -> module its Call goes to
+        };
+
+        uint8_t *code;
+        std::size_t size;
+        std::size_t used;
+        std::size_t deduplicated;
+        std::vector<Unit> units;
+
+        Image() : code{}, size{}, used{}, deduplicated{} {}
+        Image(Image const &) = delete;
+        Image &operator=(Image const &) = delete;
+        ~Image();
+    };
+
+    // The program as compiled with these settings by an earlier store_cached()
+    // into |directory|, or null if there isn't one.
+    std::shared_ptr<CompiledCode::Image> load_cached(std::filesystem::path const &directory, Ops const &ops, CpuFeatures const &features, bool metered);
+    // Saves |image| and where it needs relocating into |directory|, if it can.
+    void store_cached(std::filesystem::path const &directory, CompiledCode::Image const &image, std::vector<Relocation> const &relocations);
+
+    // A named stretch of code, for perf.
+    struct Symbol
+    {
+        std::size_t begin;
+        std::size_t end;
+        std::string name;
+    };
+
+    // |perf| with a name, numbering the program if it hasn't got one.
+    PerfOptions name_symbols(PerfOptions perf);
+    // A symbol for each run of code in |layout| after the same label, called
+    // name:label, or just |name| for code before the first label.
+    std::vector<Symbol> symbolise(std::string const &name, Layout const &layout);
+    // Tells perf about |symbols| in |code| the ways |perf| asks for, if it can.
+    void publish_symbols(PerfOptions const &perf, uint8_t const *code, std::vector<Symbol> const &symbols);
+
+    // Something a Tracer records spans of, as it's named in the trace.
+    struct TracePoint
+    {
+        char const *name;
+        char const *category;
+        char const *arg; // what a span's argument is, null if it hasn't one
+    };
+
+    namespace trace
+    {
+        inline constexpr TracePoint kCompile{"compile", "compile", "ops"};
+        inline constexpr TracePoint kLoadCached{"load cached", "compile", nullptr};
+        inline constexpr TracePoint kLabelPass{"label pass", "compile", nullptr};
+        inline constexpr TracePoint kEncode{"encode", "compile", nullptr};
+        inline constexpr TracePoint kAllocate{"allocate", "compile", "bytes"};
+        inline constexpr TracePoint kFinalise{"finalise", "compile", "bytes"};
+        inline constexpr TracePoint kCompileReachable{"compile reachable", "compile", "pc"};
+        inline constexpr TracePoint kPatch{"patch", "compile", nullptr};
+        inline constexpr TracePoint kRun{"run", "run", "pc"};
+        inline constexpr TracePoint kInterpret{"interpret", "run", "pc"};
+        inline constexpr TracePoint kCallOut{"callout", "run", "op"};
+    }
+
+    // Now in ns if a Tracer is running, otherwise 0.
+    std::uint64_t trace_clock();
+    // Adds a span of |point| from |begin| until now to this thread's events.
+    void record_span(TracePoint const &point, std::uint64_t begin, std::size_t arg);
+    // Stands in for every callout in code compiled with
+    // |CompileOptions::traced|, finding the op it was called from and
+    // recording a span around its callout.
+    void traced_callout(ExecutionEnvironment &env);
+
+    // Records a span of |point| from construction to destruction, if a
+    // Tracer is running when it starts.
+    class TraceSpan
+    {
+    public:
+        explicit TraceSpan(TracePoint const &point, std::size_t arg = 0) : m_point{point}, m_arg{arg}, m_begin{trace_clock()} {}
+        ~TraceSpan()
+        {
+            if (m_begin != 0)
+            {
+                record_span(m_point, m_begin, m_arg);
+            }
+        }
+
+        TraceSpan(TraceSpan const &) = delete;
+        TraceSpan &operator=(TraceSpan const &) = delete;
+
+    private:
+        TracePoint const &m_point;
+        std::size_t m_arg;
+        std::uint64_t m_begin;
+    };
+
+    // Interprets |program| from env.pc, inside env.calls if suspended there.
+    // |program[pc]| is the op at |pc|, |program.target(op)| the pc of the
+    // label it goes to and |program.func(op)| its callout. Each op is
+    // counted in |counters| if |Counted|, and each Load and Store in
+    // |memory| if |MemoryCounted|.
+    template <bool Counted = false, bool MemoryCounted = false, typename Program>
+    Status interpret(Program const &program, ExecutionEnvironment &env, OpCounters *counters = nullptr, MemoryCounters *memory = nullptr)
+    {
+        // Add the first program counter, inside any Calls we were suspended in
+        if (env.depth > kMaxCallDepth)
+        {
+            throw std::out_of_range("Call depth " + std::to_string(env.depth) + " is too deep");
+        }
+        std::vector<Value> pcs(env.calls, env.calls + env.depth);
+        pcs.push_back(env.pc);
+
+        auto suspend = [&](Status status)
+        {
+            if (pcs.size() - 1 > kMaxCallDepth)
+            {
+                throw std::length_error("Call stack too deep to suspend");
+            }
+            env.pc = pcs.back();
+            env.depth = static_cast<Value>(pcs.size() - 1);
+            std::copy(pcs.begin(), pcs.end() - 1, env.calls);
+            return status;
+        };
+
+        // Keep going until we've returned
+        while (!pcs.empty())
+        {
+            Value &pc = pcs.back();
+            if (env.fuel != 0 && --env.fuel == 0)
+            {
+                return suspend(Status::OutOfFuel);
+            }
+            Value const index = pc++;
+            auto const op = program[index];
+            if constexpr (Counted)
+            {
+                counters->executed[index]++;
+            }
+            switch (op.type)
+            {
+            case OpType::Nop:
+                break;
+            case OpType::Load:
+                if constexpr (MemoryCounted)
+                {
+                    memory->accesses[index]++;
+                    memory->reads[env.regs[op.regB]]++;
+                }
+                env.regs[op.regA] = env.mem[env.regs[op.regB]];
+                break;
+            case OpType::Store:
+                if constexpr (MemoryCounted)
+                {
+                    memory->accesses[index]++;
+                    memory->writes[env.regs[op.regA]]++;
+                }
+                env.mem[env.regs[op.regA]] = env.regs[op.regB];
+                break;
+            case OpType::SetReg:
+                env.regs[op.regA] = env.regs[op.regB];
+                break;
+            case OpType::SetImm:
+                env.regs[op.regA] = op.imm;
+                break;
+            case OpType::AddReg:
+                env.regs[op.regA] += env.regs[op.regB];
+                break;
+            case OpType::AddImm:
+                env.regs[op.regA] += op.imm;
+                break;
+            case OpType::Negate:
+                env.regs[op.regA] = 1 + ~env.regs[op.regA];
+                break;
+            case OpType::Jump:
+                pc = program.target(op);
+                break;
+            case OpType::JumpIfZero:
+                if (env.regs[op.regA] == 0)
+                {
+                    pc = program.target(op);
+                }
+                else if constexpr (Counted)
+                {
+                    counters->fell_through[index]++;
+                }
+                break;
+            case OpType::Call:
+                pcs.push_back(program.target(op));
+                break;
+            case OpType::Return:
+                pcs.pop_back();
+                break;
+            case OpType::Label:
+                break;
+            case OpType::CallOut:
+            {
+                TraceSpan const span(trace::kCallOut, index);
+                program.func(op)(env);
+                if (env.pending)
+                {
+                    env.pending = false;
+                    return suspend(Status::Pending);
+                }
+                break;
+            }
+            case OpType::Yield:
+                return suspend(Status::Yielded);
+            }
+        }
+        env.depth = 0;
+        return Status::Returned;
+    }
+
+    // Calls |body| with each index in [0, count) across up to |threads|
+    // threads, including this one, rethrowing the first exception.
+    void parallel_for(std::size_t count, std::size_t threads, std::function<void(std::size_t)> const &body);
 
     namespace native
     {
         std::size_t preamble(uint8_t *buffer);
-        std::size_t encode(Op const &op, uint8_t const *buffer_base, uint8_t *buffer, LabelToOffsetMap const *label_to_offset);
+        // Leaves the code from any depth, with the temporary register holding
+        // |pc | (status << 8)|.
+        std::size_t exit_stub(uint8_t *buffer);
+        // Leaves via the exit stub with |pc| and |status|.
+        std::size_t exit(std::size_t pc, Status status, EncodeContext const &ctx, uint8_t *buffer);
+        std::size_t encode(Op const &op, std::size_t index, EncodeContext const &ctx, uint8_t *buffer);
+        std::size_t encode_conditional(Op const &jump, Op const *ops, std::size_t count, uint8_t *buffer);
+        std::size_t pad(std::size_t length, uint8_t *buffer);
+        // Jumps to |offset| in the same buffer.
+        std::size_t jump(std::size_t offset, EncodeContext const &ctx, uint8_t *buffer);
         uint8_t *allocate(std::size_t &size);
         void finalise(uint8_t *buffer, std::size_t used, std::size_t length);
         void deallocate(void *buffer, std::size_t length);
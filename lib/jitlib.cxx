@@ -1,5 +1,5 @@
 #include "internal.h"
-#include <stack>
+#include <vector>
 
 namespace jitlib
 {
@@ -18,67 +18,73 @@ namespace jitlib
             }
             return lookup;
         }
+
+        // Ops, for interpret()
+        struct OpsProgram
+        {
+            Ops const &ops;
+            std::unordered_map<Label, Value> lookup;
+
+            Op const &operator[](Value pc) const { return ops[pc]; }
+            Value target(Op const &op) const { return lookup.at(op.label); }
+            CallOutFunc func(Op const &op) const { return op.func; }
+        };
     }
 
-    void run(Ops const &ops, ExecutionEnvironment &env)
+    Status run(Ops const &ops, ExecutionEnvironment &env)
     {
-        auto const lookup = generate_lookups(ops);
+        TraceSpan const span(trace::kInterpret, env.pc);
+        return interpret(OpsProgram{ops, generate_lookups(ops)}, env);
+    }
 
-        // Add the first program counter
-        std::stack<Value> pcs;
-        pcs.push(env.pc);
+    Status run(Ops const &ops, ExecutionEnvironment &env, OpCounters &counters)
+    {
+        return interpret<true>(OpsProgram{ops, generate_lookups(ops)}, env, &counters);
+    }
 
-        // Keep going until we've returned
-        while (!pcs.empty())
+    Status run(Ops const &ops, ExecutionEnvironment &env, MemoryCounters &counters)
+    {
+        return interpret<false, true>(OpsProgram{ops, generate_lookups(ops)}, env, nullptr, &counters);
+    }
+
+    Histogram histogram(Ops const &ops, OpCounters const &counters)
+    {
+        Histogram histogram;
+        Label label{""};
+        for (std::size_t i = 0; i < ops.size(); i++)
         {
-            Value &pc = pcs.top();
-            Op const op = ops[pc++];
-            switch (op.type)
+            if (ops[i].type == OpType::Label)
             {
-            case OpType::Nop:
-                break;
-            case OpType::Load:
-                env.regs[op.regA] = env.mem[env.regs[op.regB]];
-                break;
-            case OpType::Store:
-                env.mem[env.regs[op.regA]] = env.regs[op.regB];
-                break;
-            case OpType::SetReg:
-                env.regs[op.regA] = env.regs[op.regB];
-                break;
-            case OpType::SetImm:
-                env.regs[op.regA] = op.imm;
-                break;
-            case OpType::AddReg:
-                env.regs[op.regA] += env.regs[op.regB];
-                break;
-            case OpType::AddImm:
-                env.regs[op.regA] += op.imm;
-                break;
-            case OpType::Negate:
-                env.regs[op.regA] = 1 + ~env.regs[op.regA];
-                break;
-            case OpType::Jump:
-                pc = lookup.at(op.label);
-                break;
-            case OpType::JumpIfZero:
-                if (env.regs[op.regA] == 0)
-                {
-                    pc = lookup.at(op.label);
-                }
-                break;
-            case OpType::Call:
-                pcs.push(lookup.at(op.label));
-                break;
-            case OpType::Return:
-                pcs.pop();
-                break;
-            case OpType::Label:
-                break;
-            case OpType::CallOut:
-                op.func(env);
-                break;
+                label = ops[i].label;
+                histogram.labels.push_back(LabelCount{label, counters.executed[i], 0});
+            }
+            std::uint64_t const executed = counters.executed[i];
+            if (executed == 0)
+            {
+                continue;
+            }
+            if (histogram.labels.empty())
+            {
+                // Before the first label
+                histogram.labels.push_back(LabelCount{label, 0, 0});
             }
+            histogram.labels.back().executed += executed;
+            OpCount count{i, label, executed, 0, 0};
+            if (ops[i].type == OpType::JumpIfZero)
+            {
+                count.not_taken = counters.fell_through[i];
+                count.taken = executed - count.not_taken;
+            }
+            histogram.ops.push_back(count);
         }
+        std::erase_if(histogram.labels, [](LabelCount const &count)
+                      { return count.executed == 0; });
+        return histogram;
+    }
+
+    Status run_from(Ops const &ops, Label const &label, ExecutionEnvironment &env)
+    {
+        env.pc = generate_lookups(ops).at(label);
+        return run(ops, env);
     }
 }
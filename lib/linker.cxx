@@ -0,0 +1,403 @@
+#include "internal.h"
+#include <algorithm>
+#include <thread>
+#include <vector>
+
+namespace jitlib
+{
+    namespace
+    {
+        constexpr std::size_t kNone = CompiledCode::kNoEntry;
+
+        // Ops that neither go anywhere else nor leave the code.
+        bool is_straight_line(Op const &op)
+        {
+            switch (op.type)
+            {
+            case OpType::Nop:
+            case OpType::Load:
+            case OpType::Store:
+            case OpType::SetReg:
+            case OpType::SetImm:
+            case OpType::AddReg:
+            case OpType::AddImm:
+            case OpType::Negate:
+                return true;
+            default:
+                return false;
+            }
+        }
+
+        // Returns the Return ending the subroutine at |label| if that's all
+        // it does before it, otherwise 0. These can be shared between modules
+        // since the code never stops inside them.
+        std::size_t leaf_end(Ops const &ops, std::size_t label)
+        {
+            for (std::size_t i = label + 1; i < ops.size(); i++)
+            {
+                if (ops[i].type == OpType::Return)
+                {
+                    return i;
+                }
+                if (!is_straight_line(ops[i]))
+                {
+                    return 0;
+                }
+            }
+            return 0;
+        }
+
+        bool falls_through(Op const &op)
+        {
+            return op.type != OpType::Jump && op.type != OpType::Return;
+        }
+
+        // A subroutine left out in favour of an identical one.
+        struct Duplicate
+        {
+            std::size_t begin;  // Label
+            std::size_t end;    // Return
+            std::size_t module; // where the copy that's kept is
+            std::size_t label;
+        };
+    }
+
+    LinkedCode::Image::~Image()
+    {
+        if (code != nullptr)
+        {
+            native::deallocate(code, size);
+        }
+    }
+
+    LinkedCode::LinkedCode() = default;
+    LinkedCode::LinkedCode(std::shared_ptr<Image const> image) : m_image{std::move(image)} {}
+    LinkedCode::~LinkedCode() = default;
+    LinkedCode::LinkedCode(LinkedCode &&) = default;
+    LinkedCode &LinkedCode::operator=(LinkedCode &&) = default;
+
+    Status LinkedCode::run(std::string_view module, ExecutionEnvironment &env) const
+    {
+        ASSERT(m_image != nullptr);
+        auto const &units = m_image->units;
+        auto const it = std::find_if(units.begin(), units.end(), [&](Image::Unit const &unit)
+                                     { return unit.name == module; });
+        if (it == units.end())
+        {
+            throw std::out_of_range("Unknown module: " + std::string(module));
+        }
+        std::size_t const first = it - units.begin();
+        uint8_t const *const code = m_image->code;
+        auto find_entry = [&](std::size_t m, Value pc)
+        {
+            auto const &entries = units[m].layout.entries;
+            if (pc >= entries.size() || entries[pc] == kNone)
+            {
+                throw std::out_of_range("No entry point for pc " + std::to_string(pc) + " in " + units[m].name);
+            }
+            return code + entries[pc];
+        };
+        auto callee = [&](std::size_t m, Value pc)
+        {
+            if (pc == 0 || units[m].callees[pc - 1] == kNone)
+            {
+                throw std::out_of_range("No Call returning to pc " + std::to_string(pc) + " in " + units[m].name);
+            }
+            return units[m].callees[pc - 1];
+        };
+
+        // Find the Calls to return through, following each one into the
+        // module it went to, and then where to start
+        if (env.depth > kMaxCallDepth)
+        {
+            throw std::out_of_range("Call depth " + std::to_string(env.depth) + " is too deep");
+        }
+        NativeFrames frames;
+        frames.count = env.depth;
+        std::size_t m = first;
+        for (std::size_t i = 0; i < frames.count; i++)
+        {
+            frames.frames[frames.count - 1 - i] = find_entry(m, env.calls[i]);
+            m = callee(m, env.calls[i]);
+        }
+        auto const *entry = find_entry(m, env.pc);
+
+        // Run it, noting which Calls it suspended in, if any
+        Status const status = enter(code, entry, frames, env);
+        m = first;
+        for (std::size_t i = 0; i < env.depth; i++)
+        {
+            auto const offset = static_cast<uint8_t const *>(frames.frames[env.depth - 1 - i]) - code;
+            env.calls[i] = units[m].layout.returns.at(offset);
+            m = callee(m, env.calls[i]);
+        }
+        return status;
+    }
+
+    Status LinkedCode::run_from(std::string_view module, Label const &label, ExecutionEnvironment &env) const
+    {
+        ASSERT(m_image != nullptr);
+        for (auto const &unit : m_image->units)
+        {
+            if (unit.name == module)
+            {
+                env.pc = static_cast<Value>(unit.layout.labels.at(label));
+                return run(module, env);
+            }
+        }
+        throw std::out_of_range("Unknown module: " + std::string(module));
+    }
+
+    std::size_t LinkedCode::size() const
+    {
+        return m_image->used;
+    }
+
+    std::size_t LinkedCode::deduplicated() const
+    {
+        return m_image->deduplicated;
+    }
+
+    LinkedCode link(std::vector<Module> const &modules, CompileOptions const &options)
+    {
+        if (options.optimised)
+        {
+            std::vector<Module> optimised = modules;
+            for (Module &module : optimised)
+            {
+                module.ops = optimise(module.ops);
+            }
+            CompileOptions unoptimised = options;
+            unoptimised.optimised = false;
+            return link(optimised, unoptimised);
+        }
+        CpuFeatures const features = options.features.value_or(host_cpu_features());
+        auto image = std::make_shared<LinkedCode::Image>();
+        image->units.resize(modules.size());
+
+        // Note which module defines each label, then where each Call goes
+        std::unordered_map<Label, std::size_t> definitions; // label -> module, kNone if more than one
+        std::vector<std::unordered_map<Label, std::size_t>> labels(modules.size());
+        for (std::size_t m = 0; m < modules.size(); m++)
+        {
+            for (std::size_t n = 0; n < m; n++)
+            {
+                if (modules[n].name == modules[m].name)
+                {
+                    throw std::logic_error("Duplicate module: " + modules[m].name);
+                }
+            }
+            labels[m] = find_labels(modules[m].ops);
+            for (auto const &[label, index] : labels[m])
+            {
+                if (auto [it, added] = definitions.emplace(label, m); !added)
+                {
+                    it->second = kNone;
+                }
+            }
+        }
+        for (std::size_t m = 0; m < modules.size(); m++)
+        {
+            Ops const &ops = modules[m].ops;
+            auto &unit = image->units[m];
+            unit.name = modules[m].name;
+            unit.layout = empty_layout(ops);
+            unit.callees.assign(ops.size(), kNone);
+            for (std::size_t i = 0; i < ops.size(); i++)
+            {
+                Op const &op = ops[i];
+                if (op.type != OpType::Jump && op.type != OpType::JumpIfZero && op.type != OpType::Call)
+                {
+                    continue;
+                }
+                if (labels[m].contains(op.label))
+                {
+                    unit.callees[i] = op.type == OpType::Call ? m : kNone;
+                    continue;
+                }
+                auto it = definitions.find(op.label);
+                if (op.type != OpType::Call || it == definitions.end())
+                {
+                    throw std::logic_error("Unknown label: " + std::string(op.label.data.data()) + " in " + unit.name);
+                }
+                if (it->second == kNone)
+                {
+                    throw std::logic_error("Ambiguous label: " + std::string(op.label.data.data()) + " in " + unit.name);
+                }
+                unit.callees[i] = it->second;
+            }
+        }
+
+        // Keep the first copy of each subroutine that can be shared
+        std::vector<std::vector<Duplicate>> duplicates(modules.size());
+        std::vector<Duplicate> kept;
+        for (std::size_t m = 0; m < modules.size(); m++)
+        {
+            Ops const &ops = modules[m].ops;
+            for (std::size_t i = 0; i < ops.size(); i++)
+            {
+                std::size_t const end = ops[i].type == OpType::Label ? leaf_end(ops, i) : 0;
+                if (end == 0)
+                {
+                    continue;
+                }
+                auto same = [&](Duplicate const &other)
+                {
+                    Ops const &other_ops = modules[other.module].ops;
+                    return other.end - other.begin == end - i &&
+                           std::equal(ops.begin() + i + 1, ops.begin() + end + 1, other_ops.begin() + other.begin + 1, same_op);
+                };
+                if (auto it = std::find_if(kept.begin(), kept.end(), same); it != kept.end())
+                {
+                    duplicates[m].push_back(Duplicate{i, end, it->module, it->begin});
+                    image->deduplicated++;
+                }
+                else
+                {
+                    kept.push_back(Duplicate{i, end, m, i});
+                }
+                i = end;
+            }
+        }
+
+        // Lowers what's left of module |m|, jumping to the kept copy of any
+        // subroutine that was left out if the code before it falls into it
+        std::vector<OpFlags> loop_heads(modules.size());
+        std::vector<OpFlags> charges(modules.size());
+        for (std::size_t m = 0; m < modules.size(); m++)
+        {
+            loop_heads[m] = find_loop_heads(modules[m].ops);
+            charges[m] = find_charges(modules[m].ops);
+        }
+        auto lower = [&](std::size_t m, EncodeContext const &ctx, uint8_t *code, std::size_t offset, Layout &layout)
+        {
+            Ops const &ops = modules[m].ops;
+            std::size_t begin = 0;
+            for (Duplicate const &duplicate : duplicates[m])
+            {
+                offset = emit(ops, begin, duplicate.begin, loop_heads[m], ctx, code, offset, layout);
+                if (duplicate.begin != 0 && falls_through(ops[duplicate.begin - 1]))
+                {
+                    std::size_t const target = code != nullptr ? ctx.label_to_offset->at(ops[duplicate.begin].label) : 0;
+                    offset += native::jump(target, ctx, code != nullptr ? code + offset : nullptr);
+                }
+                begin = duplicate.end + 1;
+            }
+            return emit(ops, begin, ops.size(), loop_heads[m], ctx, code, offset, layout);
+        };
+
+        // Size up each module. The first starts straight after the exit
+        // stub, the rest are aligned so that their loop heads are padded the
+        // same wherever they land.
+        std::size_t const exit_offset = native::preamble(nullptr);
+        std::size_t const code_offset = exit_offset + native::exit_stub(nullptr);
+        std::size_t const threads = options.threads != 0 ? options.threads : std::max(1u, std::thread::hardware_concurrency());
+        auto module_start = [&](std::size_t m)
+        { return m == 0 ? code_offset : 0; };
+        std::vector<Layout> sizing(modules.size());
+        std::vector<std::size_t> lengths(modules.size());
+        parallel_for(modules.size(), threads, [&](std::size_t m)
+                     {
+                         EncodeContext const ctx{nullptr, nullptr, features, exit_offset, options.metered ? &charges[m] : nullptr};
+                         sizing[m] = empty_layout(modules[m].ops);
+                         lengths[m] = lower(m, ctx, nullptr, module_start(m), sizing[m]) - module_start(m); });
+
+        // Lay them out one after another, then resolve the labels each one
+        // refers to, including those of left out subroutines and other modules
+        std::vector<LabelToOffsetMap> label_to_offset(modules.size());
+        std::vector<std::size_t> bases(modules.size());
+        std::size_t size = code_offset;
+        for (std::size_t m = 0; m < modules.size(); m++)
+        {
+            if (m != 0)
+            {
+                size += padding(size, features.alignment);
+            }
+            bases[m] = size;
+            size += lengths[m];
+            for (auto const &[label, offset] : sizing[m].label_to_offset)
+            {
+                label_to_offset[m][label] = bases[m] + offset - module_start(m);
+            }
+        }
+        for (std::size_t m = 0; m < modules.size(); m++)
+        {
+            for (Duplicate const &duplicate : duplicates[m])
+            {
+                Label const &kept_label = modules[duplicate.module].ops[duplicate.label].label;
+                label_to_offset[m][modules[m].ops[duplicate.begin].label] = label_to_offset[duplicate.module].at(kept_label);
+            }
+        }
+        for (std::size_t m = 0; m < modules.size(); m++)
+        {
+            Ops const &ops = modules[m].ops;
+            for (std::size_t i = 0; i < ops.size(); i++)
+            {
+                std::size_t const callee = image->units[m].callees[i];
+                if (callee != kNone && callee != m)
+                {
+                    label_to_offset[m][ops[i].label] = label_to_offset[callee].at(ops[i].label);
+                }
+            }
+        }
+
+        // Allocate a buffer that we can make executable
+        image->code = native::allocate(size);
+        image->size = size;
+
+        // Lower each module into its place
+        std::size_t offset = native::preamble(image->code);
+        offset += native::exit_stub(image->code + offset);
+        ASSERT(offset == code_offset);
+        parallel_for(modules.size(), threads, [&](std::size_t m)
+                     {
+                         EncodeContext const ctx{image->code, &label_to_offset[m], features, exit_offset, options.metered ? &charges[m] : nullptr};
+                         std::size_t const gap = m == 0 ? code_offset : bases[m - 1] + lengths[m - 1];
+                         native::pad(bases[m] - gap, image->code + gap);
+                         std::size_t const end = lower(m, ctx, image->code, bases[m], image->units[m].layout);
+                         ASSERT(end == bases[m] + lengths[m]); });
+
+        // Left out subroutines start wherever the kept copy does
+        for (std::size_t m = 0; m < modules.size(); m++)
+        {
+            Layout &layout = image->units[m].layout;
+            for (Duplicate const &duplicate : duplicates[m])
+            {
+                Layout const &kept_layout = image->units[duplicate.module].layout;
+                for (std::size_t i = duplicate.begin; i <= duplicate.end; i++)
+                {
+                    layout.entries[i] = kept_layout.entries[duplicate.label + i - duplicate.begin];
+                    layout.ends[i] = kept_layout.ends[duplicate.label + i - duplicate.begin];
+                }
+                Label const &label = modules[m].ops[duplicate.begin].label;
+                layout.label_to_offset[label] = label_to_offset[m].at(label);
+                layout.labels[label] = duplicate.begin;
+            }
+        }
+        offset = modules.empty() ? code_offset : bases.back() + lengths.back();
+        ASSERT(offset <= image->size);
+        image->used = offset;
+
+        // Make the buffer executable
+        native::finalise(image->code, offset, image->size);
+
+        // Left out subroutines only get a symbol under the module they're kept in
+        if (options.perf.map || options.perf.jitdump)
+        {
+            std::vector<Symbol> symbols{Symbol{0, code_offset, name_symbols(options.perf).name}};
+            for (auto const &unit : image->units)
+            {
+                for (Symbol &symbol : symbolise(unit.name, unit.layout))
+                {
+                    if (std::none_of(symbols.begin(), symbols.end(), [&](Symbol const &other)
+                                     { return symbol.begin < other.end && other.begin < symbol.end; }))
+                    {
+                        symbols.push_back(std::move(symbol));
+                    }
+                }
+            }
+            publish_symbols(options.perf, image->code, symbols);
+        }
+        return LinkedCode(std::move(image));
+    }
+}
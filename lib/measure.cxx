@@ -0,0 +1,184 @@
+#include "internal.h"
+#include <jitlib/measure.h>
+#include <atomic>
+#include <linux/perf_event.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+namespace jitlib
+{
+    namespace
+    {
+        constexpr std::size_t kEvents = 4;
+
+        // Only counted in user space, so that it works with
+        // perf_event_paranoid at 2
+        perf_event_attr event_attr(std::uint32_t type, std::uint64_t config)
+        {
+            perf_event_attr attr{};
+            attr.size = sizeof(attr);
+            attr.type = type;
+            attr.config = config;
+            attr.exclude_kernel = 1;
+            attr.exclude_hv = 1;
+            return attr;
+        }
+
+        // Opened separately rather than as a group, so that one the PMU
+        // doesn't have doesn't lose the rest.
+        struct ThreadCounters
+        {
+            int fds[kEvents];
+            perf_event_mmap_page *pages[kEvents]; // null if not mapped
+            HardwareEvents events;
+
+            ThreadCounters() : fds{-1, -1, -1, -1}, pages{}, events{}
+            {
+                perf_event_attr const attrs[kEvents]{
+                    event_attr(PERF_TYPE_HARDWARE, PERF_COUNT_HW_CPU_CYCLES),
+                    event_attr(PERF_TYPE_HARDWARE, PERF_COUNT_HW_INSTRUCTIONS),
+                    event_attr(PERF_TYPE_HARDWARE, PERF_COUNT_HW_BRANCH_MISSES),
+                    event_attr(PERF_TYPE_HW_CACHE, PERF_COUNT_HW_CACHE_L1I | (PERF_COUNT_HW_CACHE_OP_READ << 8) | (PERF_COUNT_HW_CACHE_RESULT_MISS << 16)),
+                };
+                auto const page_size = static_cast<std::size_t>(sysconf(_SC_PAGESIZE));
+                for (std::size_t i = 0; i < kEvents; i++)
+                {
+                    perf_event_attr attr = attrs[i];
+                    fds[i] = static_cast<int>(syscall(SYS_perf_event_open, &attr, 0, -1, -1, PERF_FLAG_FD_CLOEXEC));
+                    if (fds[i] == -1)
+                    {
+                        continue;
+                    }
+                    void *const page = mmap(nullptr, page_size, PROT_READ, MAP_SHARED, fds[i], 0);
+                    pages[i] = page != MAP_FAILED ? static_cast<perf_event_mmap_page *>(page) : nullptr;
+                }
+                events.cycles = fds[0] != -1;
+                events.instructions = fds[1] != -1;
+                events.branch_misses = fds[2] != -1;
+                events.l1i_misses = fds[3] != -1;
+            }
+
+            ~ThreadCounters()
+            {
+                auto const page_size = static_cast<std::size_t>(sysconf(_SC_PAGESIZE));
+                for (std::size_t i = 0; i < kEvents; i++)
+                {
+                    if (pages[i] != nullptr)
+                    {
+                        munmap(pages[i], page_size);
+                    }
+                    if (fds[i] != -1)
+                    {
+                        close(fds[i]);
+                    }
+                }
+            }
+
+            ThreadCounters(ThreadCounters const &) = delete;
+            ThreadCounters &operator=(ThreadCounters const &) = delete;
+
+            std::uint64_t read_counter(std::size_t i) const
+            {
+                if (fds[i] == -1)
+                {
+                    return 0;
+                }
+#if defined(__x86_64__) || defined(__i386__)
+                // See the comment on perf_event_mmap_page in linux/perf_event.h
+                if (perf_event_mmap_page const volatile *const page = pages[i]; page != nullptr)
+                {
+                    for (;;)
+                    {
+                        std::uint32_t const sequence = page->lock;
+                        std::atomic_signal_fence(std::memory_order_seq_cst);
+                        std::uint32_t const index = page->index;
+                        bool const usable = page->cap_user_rdpmc && index != 0;
+                        std::int64_t count = page->offset;
+                        if (usable)
+                        {
+                            std::uint32_t low;
+                            std::uint32_t high;
+                            __asm__ __volatile__("rdpmc" : "=a"(low), "=d"(high) : "c"(index - 1));
+                            unsigned const shift = 64 - page->pmc_width;
+                            count += static_cast<std::int64_t>(((std::uint64_t{high} << 32) | low) << shift) >> shift;
+                        }
+                        std::atomic_signal_fence(std::memory_order_seq_cst);
+                        if (page->lock == sequence)
+                        {
+                            if (usable)
+                            {
+                                return static_cast<std::uint64_t>(count);
+                            }
+                            break;
+                        }
+                    }
+                }
+#endif
+                std::uint64_t value = 0;
+                if (read(fds[i], &value, sizeof(value)) != sizeof(value))
+                {
+                    return 0;
+                }
+                return value;
+            }
+        };
+
+        ThreadCounters &thread_counters()
+        {
+            thread_local ThreadCounters counters;
+            return counters;
+        }
+
+        template <typename Run>
+        Status measured(RunStats &stats, Run &&run)
+        {
+            ThreadCounters const &counters = thread_counters();
+            std::uint64_t before[kEvents];
+            auto const start = std::chrono::steady_clock::now();
+            for (std::size_t i = 0; i < kEvents; i++)
+            {
+                before[i] = counters.read_counter(i);
+            }
+            Status const status = run();
+            std::uint64_t after[kEvents];
+            for (std::size_t i = 0; i < kEvents; i++)
+            {
+                after[i] = counters.read_counter(i);
+            }
+            auto const end = std::chrono::steady_clock::now();
+
+            // Only keep events that every run counted
+            HardwareEvents &counted = stats.counted;
+            HardwareEvents const &events = counters.events;
+            bool const first = stats.runs++ == 0;
+            counted.cycles = events.cycles && (first || counted.cycles);
+            counted.instructions = events.instructions && (first || counted.instructions);
+            counted.branch_misses = events.branch_misses && (first || counted.branch_misses);
+            counted.l1i_misses = events.l1i_misses && (first || counted.l1i_misses);
+            stats.time += end - start;
+            stats.cycles = counted.cycles ? stats.cycles + after[0] - before[0] : 0;
+            stats.instructions = counted.instructions ? stats.instructions + after[1] - before[1] : 0;
+            stats.branch_misses = counted.branch_misses ? stats.branch_misses + after[2] - before[2] : 0;
+            stats.l1i_misses = counted.l1i_misses ? stats.l1i_misses + after[3] - before[3] : 0;
+            return status;
+        }
+    }
+
+    HardwareEvents hardware_events()
+    {
+        return thread_counters().events;
+    }
+
+    Status measure(Ops const &ops, ExecutionEnvironment &env, RunStats &stats)
+    {
+        return measured(stats, [&]
+                        { return run(ops, env); });
+    }
+
+    Status measure(CompiledCode const &code, ExecutionEnvironment &env, RunStats &stats)
+    {
+        return measured(stats, [&]
+                        { return code.run(env); });
+    }
+}
@@ -9,6 +9,7 @@ namespace jitlib
     {
         uint8_t *allocate(std::size_t &size)
         {
+            TraceSpan const span(trace::kAllocate, size);
             long pagesize = sysconf(_SC_PAGE_SIZE);
             ASSERT(pagesize > 0);
             size = ((size - 1) | (pagesize - 1)) + 1;
@@ -19,6 +20,8 @@ namespace jitlib
 
         void finalise(uint8_t *buffer, std::size_t used, std::size_t length)
         {
+            TraceSpan const span(trace::kFinalise, length);
+
             // Trap on any leftover space
             uint8_t *unused_start = buffer + used;
             std::size_t unused_length = length - used;
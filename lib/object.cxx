@@ -0,0 +1,363 @@
+#include "internal.h"
+#include <jitlib/object.h>
+#include <algorithm>
+#include <cstddef>
+#include <cstring>
+#include <elf.h>
+#include <fstream>
+#include <link.h>
+
+namespace jitlib
+{
+    namespace
+    {
+#if defined(__x86_64__)
+        constexpr std::uint16_t kMachine = EM_X86_64;
+        constexpr std::uint32_t kAbsolute = R_X86_64_64;
+        constexpr std::uint32_t kRelative = R_X86_64_PC32;
+        constexpr bool kRela = true;
+#elif defined(__i386__)
+        constexpr std::uint16_t kMachine = EM_386;
+        constexpr std::uint32_t kAbsolute = R_386_32;
+        constexpr std::uint32_t kRelative = R_386_PC32;
+        constexpr bool kRela = false;
+#elif defined(__arm__)
+        constexpr std::uint16_t kMachine = EM_ARM;
+        constexpr std::uint32_t kAbsolute = R_ARM_ABS32;
+        constexpr std::uint32_t kRelative = R_ARM_REL32;
+        constexpr bool kRela = false;
+#else
+#error "Unknown platform"
+#endif
+        using Ehdr = ElfW(Ehdr);
+        using Shdr = ElfW(Shdr);
+        using Sym = ElfW(Sym);
+        using Rel = std::conditional_t<kRela, ElfW(Rela), ElfW(Rel)>;
+
+        // Sections in the order they're written
+        enum Section : std::uint16_t
+        {
+            kNullSection,
+            kText,
+            kRodata,
+            kData,
+            kRelText,
+            kRelData,
+            kSymtab,
+            kStrtab,
+            kShstrtab,
+            kNoteStack,
+            kSectionCount,
+        };
+
+        // Local symbols before global ones, as ELF wants
+        enum Symbol : std::uint32_t
+        {
+            kNullSymbol,
+            kTextSymbol,
+            kRodataSymbol,
+            kDataSymbol,
+            kFirstLocal,
+        };
+
+        // An address in |section| to fill in with |symbol| + |addend|, or
+        // with its distance from there if |relative|.
+        struct Fixup
+        {
+            std::vector<uint8_t> *section;
+            std::size_t offset;
+            std::uint32_t symbol;
+            std::ptrdiff_t addend;
+            bool relative = false;
+        };
+
+        std::size_t append(std::vector<uint8_t> &section, void const *data, std::size_t size, std::size_t alignment)
+        {
+            section.resize(section.size() + padding(section.size(), alignment));
+            std::size_t const offset = section.size();
+            auto const *bytes = static_cast<uint8_t const *>(data);
+            section.insert(section.end(), bytes, bytes + size);
+            return offset;
+        }
+
+        std::uint32_t add_string(std::vector<uint8_t> &table, std::string const &str)
+        {
+            return static_cast<std::uint32_t>(append(table, str.c_str(), str.size() + 1, 1));
+        }
+
+        // The same for either class
+        unsigned char symbol_info(unsigned char binding, unsigned char type)
+        {
+            return ELF32_ST_INFO(binding, type);
+        }
+
+        template <typename R = Rel>
+        R make_rel(Fixup const &fixup)
+        {
+            R rel{};
+            rel.r_offset = fixup.offset;
+            std::uint32_t const type = fixup.relative ? kRelative : kAbsolute;
+            if constexpr (sizeof(void *) == 8)
+            {
+                rel.r_info = ELF64_R_INFO(fixup.symbol, type);
+            }
+            else
+            {
+                rel.r_info = ELF32_R_INFO(fixup.symbol, type);
+            }
+            if constexpr (kRela)
+            {
+                rel.r_addend = static_cast<decltype(rel.r_addend)>(fixup.addend);
+            }
+            return rel;
+        }
+    }
+
+    Status run(NativeProgram const &program, ExecutionEnvironment &env)
+    {
+        auto const *const code = static_cast<uint8_t const *>(program.code);
+        auto find_entry = [&](Value pc)
+        {
+            if (program.entries[pc] == NativeProgram::kNoEntry)
+            {
+                throw std::out_of_range("No entry point for pc " + std::to_string(pc));
+            }
+            return code + program.entries[pc];
+        };
+
+        // Find where to start, and the Calls to return through
+        auto const *entry = find_entry(env.pc);
+        if (env.depth > kMaxCallDepth)
+        {
+            throw std::out_of_range("Call depth " + std::to_string(env.depth) + " is too deep");
+        }
+        NativeFrames frames;
+        frames.count = env.depth;
+        for (std::size_t i = 0; i < frames.count; i++)
+        {
+            frames.frames[i] = find_entry(env.calls[frames.count - 1 - i]);
+        }
+
+        // Run it, noting which Calls it suspended in, if any
+        Status const status = enter(code, entry, frames, env);
+        NativeReturn const *const returns_end = program.returns + program.return_count;
+        for (std::size_t i = 0; i < env.depth; i++)
+        {
+            auto const offset = static_cast<std::uint32_t>(static_cast<uint8_t const *>(frames.frames[i]) - code);
+            auto const it = std::lower_bound(program.returns, returns_end, offset, [](NativeReturn const &ret, std::uint32_t value)
+                                             { return ret.offset < value; });
+            if (it == returns_end || it->offset != offset)
+            {
+                throw std::out_of_range("No Call returning to offset " + std::to_string(offset));
+            }
+            env.calls[frames.count - 1 - i] = static_cast<Value>(it->pc);
+        }
+        return status;
+    }
+
+    Status run_from(NativeProgram const &program, Label const &label, ExecutionEnvironment &env)
+    {
+        auto const *const end = program.labels + program.label_count;
+        auto const it = std::find_if(program.labels, end, [&](NativeLabel const &entry)
+                                     { return entry.label == label; });
+        if (it == end)
+        {
+            throw std::out_of_range("Unknown label: " + std::string(label.data.data()));
+        }
+        env.pc = static_cast<Value>(it->pc);
+        return run(program, env);
+    }
+
+    void write_object(std::filesystem::path const &path, std::vector<Module> const &modules, CallOutRegistry const &registry,
+                      CompileOptions const &options)
+    {
+        std::vector<uint8_t> text;
+        std::vector<uint8_t> rodata;
+        std::vector<uint8_t> data;
+        std::vector<uint8_t> strtab(1);
+        std::vector<Sym> locals(kFirstLocal);
+        std::vector<Sym> globals;
+        std::vector<std::string> callouts;
+        std::vector<std::size_t> slots; // by callout
+        std::vector<Fixup> fixups;
+        locals[kTextSymbol].st_info = symbol_info(STB_LOCAL, STT_SECTION);
+        locals[kTextSymbol].st_shndx = kText;
+        locals[kRodataSymbol].st_info = symbol_info(STB_LOCAL, STT_SECTION);
+        locals[kRodataSymbol].st_shndx = kRodata;
+        locals[kDataSymbol].st_info = symbol_info(STB_LOCAL, STT_SECTION);
+        locals[kDataSymbol].st_shndx = kData;
+
+        // Counters and the tracing trampoline would only be where they are
+        // in this process
+        CompileOptions portable = options;
+        portable.counted = false;
+        portable.memory_counted = false;
+        portable.traced = false;
+        for (Module const &module : modules)
+        {
+            // Lower it on its own, with its own way in and out
+            std::vector<Relocation> relocations;
+            auto const image = compile_eagerly(options.optimised ? optimise(module.ops) : module.ops, portable, &relocations, true);
+            std::size_t const gap = padding(text.size(), 16);
+            text.resize(text.size() + gap);
+            native::pad(gap, text.data() + text.size() - gap);
+            std::size_t const base = append(text, image->code, image->used, 1);
+
+            Sym code{};
+            code.st_name = add_string(strtab, module.name + ".code");
+            code.st_info = symbol_info(STB_LOCAL, STT_FUNC);
+            code.st_shndx = kText;
+            code.st_value = base;
+            code.st_size = image->used;
+            locals.push_back(code);
+
+            // Callouts are left for the linker to fill in, by name, in a
+            // slot of their own that the code loads them from. That keeps
+            // the code itself free of absolute addresses, so that it can be
+            // linked into a position independent binary.
+            for (Relocation const &relocation : relocations)
+            {
+                std::string const *name = registry.name_of(module.ops[relocation.index].func);
+                if (name == nullptr)
+                {
+                    throw std::invalid_argument("Callout at pc " + std::to_string(relocation.index) + " in " + module.name + " isn't registered");
+                }
+                auto const it = std::find(callouts.begin(), callouts.end(), *name);
+                std::size_t const callout = it - callouts.begin();
+                if (it == callouts.end())
+                {
+                    void const *const null = nullptr;
+                    callouts.push_back(*name);
+                    slots.push_back(append(data, &null, sizeof(null), alignof(void *)));
+                }
+                fixups.push_back(Fixup{&text, base + relocation.offset, kDataSymbol, static_cast<std::ptrdiff_t>(slots[callout]) + relocation.addend, true});
+            }
+
+            // Everything run() needs to find its way around
+            std::vector<NativeReturn> returns;
+            for (auto const &[offset, pc] : image->layout.returns)
+            {
+                returns.push_back(NativeReturn{static_cast<std::uint32_t>(offset), pc});
+            }
+            std::sort(returns.begin(), returns.end(), [](NativeReturn const &a, NativeReturn const &b)
+                      { return a.offset < b.offset; });
+            std::vector<NativeLabel> labels;
+            for (auto const &[label, pc] : image->layout.labels)
+            {
+                labels.push_back(NativeLabel{label, static_cast<std::uint32_t>(pc)});
+            }
+            std::size_t const returns_offset = append(rodata, returns.data(), returns.size() * sizeof(NativeReturn), alignof(NativeReturn));
+            std::size_t const labels_offset = append(rodata, labels.data(), labels.size() * sizeof(NativeLabel), alignof(NativeLabel));
+
+            NativeProgram program{};
+            for (std::size_t i = 0; i < module.ops.size(); i++)
+            {
+                std::size_t const entry = image->layout.entries[i];
+                program.entries[i] = entry != CompiledCode::kNoEntry ? static_cast<std::uint32_t>(entry) : NativeProgram::kNoEntry;
+            }
+            program.return_count = static_cast<std::uint32_t>(returns.size());
+            program.label_count = static_cast<std::uint32_t>(labels.size());
+            std::size_t const offset = append(data, &program, sizeof(program), alignof(NativeProgram));
+            fixups.push_back(Fixup{&data, offset + offsetof(NativeProgram, code), kTextSymbol, static_cast<std::ptrdiff_t>(base)});
+            fixups.push_back(Fixup{&data, offset + offsetof(NativeProgram, returns), kRodataSymbol, static_cast<std::ptrdiff_t>(returns_offset)});
+            fixups.push_back(Fixup{&data, offset + offsetof(NativeProgram, labels), kRodataSymbol, static_cast<std::ptrdiff_t>(labels_offset)});
+
+            Sym symbol{};
+            symbol.st_name = add_string(strtab, module.name);
+            symbol.st_info = symbol_info(STB_GLOBAL, STT_OBJECT);
+            symbol.st_shndx = kData;
+            symbol.st_value = offset;
+            symbol.st_size = sizeof(program);
+            globals.push_back(symbol);
+        }
+
+        // Callouts come last, each filling in its slot
+        for (std::size_t i = 0; i < callouts.size(); i++)
+        {
+            fixups.push_back(Fixup{&data, slots[i], static_cast<std::uint32_t>(locals.size() + globals.size()), 0});
+            Sym symbol{};
+            symbol.st_name = add_string(strtab, callouts[i]);
+            symbol.st_info = symbol_info(STB_GLOBAL, STT_NOTYPE);
+            symbol.st_shndx = SHN_UNDEF;
+            globals.push_back(symbol);
+        }
+        std::vector<Rel> rel_text;
+        std::vector<Rel> rel_data;
+        for (Fixup const &fixup : fixups)
+        {
+            if constexpr (!kRela)
+            {
+                // The addend is whatever's there already
+                auto const addend = static_cast<ElfW(Addr)>(fixup.addend);
+                std::memcpy(fixup.section->data() + fixup.offset, &addend, sizeof(addend));
+            }
+            (fixup.section == &text ? rel_text : rel_data).push_back(make_rel(fixup));
+        }
+        std::vector<Sym> symbols = locals;
+        symbols.insert(symbols.end(), globals.begin(), globals.end());
+
+        // Lay the file out as a header, each section and then the table of them
+        std::vector<uint8_t> file(sizeof(Ehdr));
+        std::vector<uint8_t> shstrtab(1);
+        Shdr sections[kSectionCount]{};
+        auto add_section = [&](Section index, char const *name, std::uint32_t type, std::size_t flags, std::vector<uint8_t> const &contents, std::size_t alignment)
+        {
+            Shdr &section = sections[index];
+            section.sh_name = add_string(shstrtab, name);
+            section.sh_type = type;
+            section.sh_flags = flags;
+            section.sh_offset = append(file, contents.data(), contents.size(), alignment);
+            section.sh_size = contents.size();
+            section.sh_addralign = alignment;
+            return &section;
+        };
+        auto bytes = [](auto const &items)
+        {
+            auto const *begin = reinterpret_cast<uint8_t const *>(items.data());
+            return std::vector<uint8_t>(begin, begin + items.size() * sizeof(items[0]));
+        };
+        add_section(kText, ".text", SHT_PROGBITS, SHF_ALLOC | SHF_EXECINSTR, text, 16);
+        add_section(kRodata, ".rodata", SHT_PROGBITS, SHF_ALLOC, rodata, std::max(alignof(NativeReturn), alignof(NativeLabel)));
+        add_section(kData, ".data.rel.ro", SHT_PROGBITS, SHF_ALLOC | SHF_WRITE, data, alignof(NativeProgram));
+        for (auto [index, target, relocations] : {std::tuple{kRelText, kText, &rel_text}, std::tuple{kRelData, kData, &rel_data}})
+        {
+            std::string const name = std::string(kRela ? ".rela" : ".rel") + (target == kText ? ".text" : ".data.rel.ro");
+            Shdr *section = add_section(index, name.c_str(), kRela ? SHT_RELA : SHT_REL, SHF_INFO_LINK, bytes(*relocations), alignof(Rel));
+            section->sh_link = kSymtab;
+            section->sh_info = target;
+            section->sh_entsize = sizeof(Rel);
+        }
+        Shdr *symtab = add_section(kSymtab, ".symtab", SHT_SYMTAB, 0, bytes(symbols), alignof(Sym));
+        symtab->sh_link = kStrtab;
+        symtab->sh_info = static_cast<std::uint32_t>(locals.size());
+        symtab->sh_entsize = sizeof(Sym);
+        add_section(kStrtab, ".strtab", SHT_STRTAB, 0, strtab, 1);
+        add_section(kNoteStack, ".note.GNU-stack", SHT_PROGBITS, 0, {}, 1);
+        // Last, with its own name already added by the time it's written
+        add_section(kShstrtab, ".shstrtab", SHT_STRTAB, 0, shstrtab, 1);
+
+        Ehdr header{};
+        std::memcpy(header.e_ident, ELFMAG, SELFMAG);
+        header.e_ident[EI_CLASS] = sizeof(void *) == 8 ? ELFCLASS64 : ELFCLASS32;
+        header.e_ident[EI_DATA] = ELFDATA2LSB;
+        header.e_ident[EI_VERSION] = EV_CURRENT;
+        header.e_ident[EI_OSABI] = ELFOSABI_SYSV;
+        header.e_type = ET_REL;
+        header.e_machine = kMachine;
+        header.e_version = EV_CURRENT;
+        header.e_flags = kMachine == EM_ARM ? EF_ARM_EABI_VER5 : 0;
+        header.e_ehsize = sizeof(Ehdr);
+        header.e_shentsize = sizeof(Shdr);
+        header.e_shnum = kSectionCount;
+        header.e_shstrndx = kShstrtab;
+        header.e_shoff = append(file, sections, sizeof(sections), alignof(Shdr));
+        std::memcpy(file.data(), &header, sizeof(header));
+
+        std::ofstream out(path, std::ios::binary | std::ios::trunc);
+        out.write(reinterpret_cast<char const *>(file.data()), static_cast<std::streamsize>(file.size()));
+        if (!out)
+        {
+            throw std::runtime_error("Couldn't write object " + path.string());
+        }
+    }
+}
@@ -0,0 +1,211 @@
+#include "internal.h"
+#include <jitlib/optimise.h>
+#include <algorithm>
+#include <array>
+#include <optional>
+#include <vector>
+
+namespace jitlib
+{
+    namespace
+    {
+        // A known constant, or whatever's in a register for as long as it
+        // isn't written
+        struct Operand
+        {
+            bool constant;
+            Value value; // the constant, or the register
+
+            bool operator==(Operand const &) const = default;
+
+            bool uses(Register reg) const { return !constant && value == reg; }
+        };
+
+        // The cell at |address| holds |value|
+        struct Fact
+        {
+            Operand address;
+            Operand value;
+        };
+
+        // A Store that nothing has read since
+        struct PendingStore
+        {
+            std::size_t index;
+            Operand address;
+        };
+
+        // Whether |a| and |b| could be the same address
+        bool may_alias(Operand const &a, Operand const &b)
+        {
+            return !a.constant || !b.constant || a.value == b.value;
+        }
+
+        // Whether |op| ends what Forwarder knows
+        bool ends_run(Op const &op)
+        {
+            switch (op.type)
+            {
+            case OpType::Jump:
+            case OpType::JumpIfZero:
+            case OpType::Call:
+            case OpType::Return:
+            case OpType::Label:
+            case OpType::CallOut:
+            case OpType::Yield:
+                return true;
+            default:
+                return false;
+            }
+        }
+
+        class Forwarder
+        {
+        public:
+            explicit Forwarder(Ops const &ops) : m_ops{ops} {}
+
+            void op(std::size_t index)
+            {
+                Op const op = m_ops[index];
+                switch (op.type)
+                {
+                case OpType::Nop:
+                    break;
+                case OpType::Load:
+                    load(index, op.regA, operand(op.regB));
+                    break;
+                case OpType::Store:
+                    store(index, operand(op.regA), operand(op.regB));
+                    break;
+                case OpType::SetReg:
+                    if (op.regA != op.regB)
+                    {
+                        write(op.regA, m_known[op.regB]);
+                    }
+                    break;
+                case OpType::SetImm:
+                    write(op.regA, op.imm);
+                    break;
+                case OpType::AddReg:
+                    write(op.regA, m_known[op.regA] && m_known[op.regB] ? std::optional<Value>(static_cast<Value>(*m_known[op.regA] + *m_known[op.regB])) : std::nullopt);
+                    break;
+                case OpType::AddImm:
+                    write(op.regA, m_known[op.regA] ? std::optional<Value>(static_cast<Value>(*m_known[op.regA] + op.imm)) : std::nullopt);
+                    break;
+                case OpType::Negate:
+                    write(op.regA, m_known[op.regA] ? std::optional<Value>(static_cast<Value>(1 + ~*m_known[op.regA])) : std::nullopt);
+                    break;
+                case OpType::Jump:
+                case OpType::JumpIfZero:
+                case OpType::Call:
+                case OpType::Return:
+                case OpType::Label:
+                case OpType::CallOut:
+                case OpType::Yield:
+                    // Where a run can start, end or suspend, with anything
+                    // changed in between. Keep in step with ends_run().
+                    m_known = {};
+                    m_facts.clear();
+                    m_stores.clear();
+                    break;
+                }
+            }
+
+            Ops const &ops() const { return m_ops; }
+
+        private:
+            Ops m_ops;
+            std::array<std::optional<Value>, kNumRegisters> m_known{};
+            std::vector<Fact> m_facts;
+            std::vector<PendingStore> m_stores;
+
+            Operand operand(Register reg) const
+            {
+                return m_known[reg] ? Operand{true, *m_known[reg]} : Operand{false, reg};
+            }
+
+            Fact const *fact(Operand const &address) const
+            {
+                auto const found = std::find_if(m_facts.begin(), m_facts.end(), [&](Fact const &fact)
+                                                { return fact.address == address; });
+                return found != m_facts.end() ? &*found : nullptr;
+            }
+
+            // Forgets everything that relied on what was in |reg|
+            void write(Register reg, std::optional<Value> known)
+            {
+                std::erase_if(m_facts, [&](Fact const &fact)
+                              { return fact.address.uses(reg) || fact.value.uses(reg); });
+                // Still there to be read, just not matched with a later Store
+                std::erase_if(m_stores, [&](PendingStore const &store)
+                              { return store.address.uses(reg); });
+                m_known[reg] = known;
+            }
+
+            void load(std::size_t index, Register reg, Operand const &address)
+            {
+                if (Fact const *const known = fact(address))
+                {
+                    Operand const value = known->value;
+                    if (value.constant)
+                    {
+                        m_ops[index] = Op::make_SetImm(reg, value.value);
+                        write(reg, value.value);
+                    }
+                    else if (value.value != reg)
+                    {
+                        m_ops[index] = Op::make_SetReg(reg, value.value);
+                        write(reg, m_known[value.value]);
+                    }
+                    else
+                    {
+                        m_ops[index] = Op::make_Nop();
+                    }
+                    return;
+                }
+                std::erase_if(m_stores, [&](PendingStore const &store)
+                              { return may_alias(store.address, address); });
+                write(reg, std::nullopt);
+                if (!address.uses(reg))
+                {
+                    m_facts.push_back(Fact{address, Operand{false, reg}});
+                }
+            }
+
+            void store(std::size_t index, Operand const &address, Operand const &value)
+            {
+                if (Fact const *const known = fact(address); known != nullptr && known->value == value)
+                {
+                    m_ops[index] = Op::make_Nop();
+                    return;
+                }
+                auto const overwritten = std::find_if(m_stores.begin(), m_stores.end(), [&](PendingStore const &store)
+                                                      { return store.address == address; });
+                if (overwritten != m_stores.end())
+                {
+                    m_ops[overwritten->index] = Op::make_Nop();
+                    m_stores.erase(overwritten);
+                }
+                std::erase_if(m_facts, [&](Fact const &fact)
+                              { return may_alias(fact.address, address); });
+                m_facts.push_back(Fact{address, value});
+                m_stores.push_back(PendingStore{index, address});
+            }
+        };
+    }
+
+    Ops optimise(Ops const &ops)
+    {
+        Forwarder forwarder(ops);
+        for (std::size_t i = 0; i < ops.size(); i++)
+        {
+            forwarder.op(i);
+        }
+        return forwarder.ops();
+    }
+
+    bool is_entry(Ops const &ops, std::size_t pc)
+    {
+        return pc == 0 || ends_run(ops[pc]) || ends_run(ops[pc - 1]);
+    }
+}
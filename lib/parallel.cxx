@@ -0,0 +1,128 @@
+#include "internal.h"
+#include <algorithm>
+#include <atomic>
+#include <condition_variable>
+#include <deque>
+#include <exception>
+#include <functional>
+#include <latch>
+#include <mutex>
+#include <thread>
+
+namespace jitlib
+{
+    namespace
+    {
+        // Threads kept around between compiles, grown on demand.
+        class Pool
+        {
+        public:
+            static Pool &instance()
+            {
+                static Pool pool;
+                return pool;
+            }
+
+            ~Pool()
+            {
+                {
+                    std::lock_guard lock(m_mutex);
+                    m_stopping = true;
+                }
+                m_wake.notify_all();
+                for (auto &thread : m_threads)
+                {
+                    thread.join();
+                }
+            }
+
+            // Runs |job| on |count| pool threads, without waiting.
+            void post(std::size_t count, std::function<void()> const &job)
+            {
+                {
+                    std::lock_guard lock(m_mutex);
+                    while (m_threads.size() < count)
+                    {
+                        m_threads.emplace_back([this]
+                                               { work(); });
+                    }
+                    m_jobs.insert(m_jobs.end(), count, job);
+                }
+                m_wake.notify_all();
+            }
+
+        private:
+            void work()
+            {
+                for (;;)
+                {
+                    std::function<void()> job;
+                    {
+                        std::unique_lock lock(m_mutex);
+                        m_wake.wait(lock, [&]
+                                    { return m_stopping || !m_jobs.empty(); });
+                        if (m_jobs.empty())
+                        {
+                            return;
+                        }
+                        job = std::move(m_jobs.front());
+                        m_jobs.pop_front();
+                    }
+                    job();
+                }
+            }
+
+            std::mutex m_mutex;
+            std::condition_variable m_wake;
+            std::deque<std::function<void()>> m_jobs;
+            std::vector<std::thread> m_threads;
+            bool m_stopping = false;
+        };
+    }
+
+    void parallel_for(std::size_t count, std::size_t threads, std::function<void(std::size_t)> const &body)
+    {
+        std::size_t const workers = std::min(threads, count);
+        if (workers <= 1)
+        {
+            for (std::size_t i = 0; i < count; i++)
+            {
+                body(i);
+            }
+            return;
+        }
+
+        // Everyone takes the next index until they run out
+        std::atomic<std::size_t> next{0};
+        std::mutex error_mutex;
+        std::exception_ptr error;
+        auto work = [&]
+        {
+            for (std::size_t i; (i = next++) < count;)
+            {
+                try
+                {
+                    body(i);
+                }
+                catch (...)
+                {
+                    std::lock_guard lock(error_mutex);
+                    if (!error)
+                    {
+                        error = std::current_exception();
+                    }
+                }
+            }
+        };
+        std::size_t const helpers = workers - 1;
+        std::latch done(static_cast<std::ptrdiff_t>(helpers));
+        Pool::instance().post(helpers, [&]
+                              { work(); done.count_down(); });
+        work();
+        done.wait();
+        if (error)
+        {
+            std::rethrow_exception(error);
+        }
+    }
+}
@@ -0,0 +1,197 @@
+#include "internal.h"
+#include <algorithm>
+#include <atomic>
+#include <cstdint>
+#include <cstdio>
+#include <mutex>
+#include <elf.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+#include <time.h>
+#include <unistd.h>
+
+namespace jitlib
+{
+    namespace
+    {
+        // See tools/perf/Documentation/jitdump-specification.txt in Linux
+        constexpr std::uint32_t kJitDumpMagic = 0x4A695444;
+        constexpr std::uint32_t kJitDumpVersion = 1;
+        constexpr std::uint32_t kJitCodeLoad = 0;
+
+#if defined(__x86_64__)
+        constexpr std::uint32_t kMachine = EM_X86_64;
+#elif defined(__i386__)
+        constexpr std::uint32_t kMachine = EM_386;
+#elif defined(__arm__)
+        constexpr std::uint32_t kMachine = EM_ARM;
+#else
+#error "Unknown target processor"
+#endif
+
+        struct JitDumpHeader
+        {
+            std::uint32_t magic;
+            std::uint32_t version;
+            std::uint32_t total_size;
+            std::uint32_t elf_mach;
+            std::uint32_t pad1;
+            std::uint32_t pid;
+            std::uint64_t timestamp;
+            std::uint64_t flags;
+        };
+
+        // Followed by the name, null terminated, then the code
+        struct JitCodeLoad
+        {
+            std::uint32_t id;
+            std::uint32_t total_size;
+            std::uint64_t timestamp;
+            std::uint32_t pid;
+            std::uint32_t tid;
+            std::uint64_t vma;
+            std::uint64_t code_addr;
+            std::uint64_t code_size;
+            std::uint64_t code_index;
+        };
+
+        // Held while writing either file, so that lines and records from
+        // different threads don't interleave
+        std::mutex s_mutex;
+        std::uint64_t s_code_index = 0;
+        std::atomic<std::size_t> s_programs{};
+
+        // As perf record -k mono
+        std::uint64_t timestamp()
+        {
+            timespec now{};
+            clock_gettime(CLOCK_MONOTONIC, &now);
+            return static_cast<std::uint64_t>(now.tv_sec) * 1000000000 + static_cast<std::uint64_t>(now.tv_nsec);
+        }
+
+        bool write_all(int fd, void const *data, std::size_t size)
+        {
+            auto const *bytes = static_cast<uint8_t const *>(data);
+            while (size != 0)
+            {
+                ssize_t const written = write(fd, bytes, size);
+                if (written <= 0)
+                {
+                    return false;
+                }
+                bytes += written;
+                size -= static_cast<std::size_t>(written);
+            }
+            return true;
+        }
+
+        void write_map(uint8_t const *code, std::vector<Symbol> const &symbols)
+        {
+            std::string const path = "/tmp/perf-" + std::to_string(getpid()) + ".map";
+            FILE *const file = std::fopen(path.c_str(), "a");
+            if (file == nullptr)
+            {
+                return;
+            }
+            for (Symbol const &symbol : symbols)
+            {
+                std::fprintf(file, "%llx %llx %s\n", static_cast<unsigned long long>(reinterpret_cast<std::uintptr_t>(code + symbol.begin)),
+                             static_cast<unsigned long long>(symbol.end - symbol.begin), symbol.name.c_str());
+            }
+            std::fclose(file);
+        }
+
+        void write_jitdump(uint8_t const *code, std::vector<Symbol> const &symbols)
+        {
+            auto const path = std::filesystem::temp_directory_path() / ("jit-" + std::to_string(getpid()) + ".dump");
+            int const fd = open(path.c_str(), O_CREAT | O_WRONLY | O_APPEND | O_CLOEXEC, 0644);
+            if (fd == -1)
+            {
+                return;
+            }
+            struct stat info{};
+            bool ok = fstat(fd, &info) == 0;
+            if (ok && info.st_size == 0)
+            {
+                // perf record notices the file by it being mapped executable,
+                // which has to stay mapped for as long as it might be recording
+                JitDumpHeader const header{kJitDumpMagic, kJitDumpVersion, sizeof(JitDumpHeader), kMachine, 0, static_cast<std::uint32_t>(getpid()), timestamp(), 0};
+                ok = write_all(fd, &header, sizeof(header));
+                int const marker_fd = open(path.c_str(), O_RDONLY | O_CLOEXEC);
+                if (marker_fd != -1)
+                {
+                    mmap(nullptr, static_cast<std::size_t>(sysconf(_SC_PAGESIZE)), PROT_READ | PROT_EXEC, MAP_PRIVATE, marker_fd, 0);
+                    close(marker_fd);
+                }
+            }
+            auto const tid = static_cast<std::uint32_t>(syscall(SYS_gettid));
+            for (std::size_t i = 0; ok && i < symbols.size(); i++)
+            {
+                Symbol const &symbol = symbols[i];
+                std::size_t const size = symbol.end - symbol.begin;
+                auto const address = static_cast<std::uint64_t>(reinterpret_cast<std::uintptr_t>(code + symbol.begin));
+                JitCodeLoad const record{kJitCodeLoad, static_cast<std::uint32_t>(sizeof(JitCodeLoad) + symbol.name.size() + 1 + size), timestamp(),
+                                         static_cast<std::uint32_t>(getpid()), tid, address, address, size, s_code_index++};
+                ok = write_all(fd, &record, sizeof(record)) && write_all(fd, symbol.name.c_str(), symbol.name.size() + 1) &&
+                     write_all(fd, code + symbol.begin, size);
+            }
+            close(fd);
+        }
+    }
+
+    PerfOptions name_symbols(PerfOptions perf)
+    {
+        if ((perf.map || perf.jitdump) && perf.name.empty())
+        {
+            perf.name = "jitlib" + std::to_string(s_programs++);
+        }
+        return perf;
+    }
+
+    std::vector<Symbol> symbolise(std::string const &name, Layout const &layout)
+    {
+        std::vector<std::pair<std::size_t, Label>> by_index;
+        for (auto const &[label, index] : layout.labels)
+        {
+            by_index.emplace_back(index, label);
+        }
+        std::sort(by_index.begin(), by_index.end(), [](auto const &a, auto const &b)
+                  { return a.first < b.first; });
+        auto name_of = [&](std::size_t op)
+        {
+            auto it = std::upper_bound(by_index.begin(), by_index.end(), op, [](std::size_t index, auto const &entry)
+                                       { return index < entry.first; });
+            return it == by_index.begin() ? name : name + ":" + std::prev(it)->second.data.data();
+        };
+
+        // Ranges are in order of offset, so a run under one label that's
+        // only broken by padding becomes one symbol
+        std::vector<Symbol> symbols;
+        for (OpRange const &range : map_ops(layout))
+        {
+            std::string symbol = name_of(range.op);
+            if (!symbols.empty() && symbols.back().name == symbol)
+            {
+                symbols.back().end = range.end;
+                continue;
+            }
+            symbols.push_back(Symbol{range.begin, range.end, std::move(symbol)});
+        }
+        return symbols;
+    }
+
+    void publish_symbols(PerfOptions const &perf, uint8_t const *code, std::vector<Symbol> const &symbols)
+    {
+        std::lock_guard lock(s_mutex);
+        if (perf.map)
+        {
+            write_map(code, symbols);
+        }
+        if (perf.jitdump)
+        {
+            write_jitdump(code, symbols);
+        }
+    }
+}
@@ -0,0 +1,280 @@
+#include "internal.h"
+#include <jitlib/profiler.h>
+#include <algorithm>
+#include <atomic>
+#include <cerrno>
+#include <cstdint>
+#include <cstdio>
+#include <mutex>
+#include <system_error>
+#include <thread>
+#include <signal.h>
+#include <sys/time.h>
+#include <ucontext.h>
+
+namespace jitlib
+{
+    namespace
+    {
+        // Where the signal handler puts what it interrupted.
+        struct Samples
+        {
+            std::size_t capacity;
+            std::unique_ptr<std::atomic<std::uintptr_t>[]> addresses;
+            std::atomic<std::size_t> count{};
+        };
+
+        // Only changed with a profiler starting or stopping under |s_mutex|
+        std::mutex s_mutex;
+        bool s_installed = false;
+        std::atomic<Samples *> s_running{};
+        std::atomic<std::size_t> s_handling{}; // handlers part way through
+
+        std::uintptr_t interrupted_address(void *context)
+        {
+            auto const &mcontext = static_cast<ucontext_t *>(context)->uc_mcontext;
+#if defined(__x86_64__)
+            return static_cast<std::uintptr_t>(mcontext.gregs[REG_RIP]);
+#elif defined(__i386__)
+            return static_cast<std::uintptr_t>(mcontext.gregs[REG_EIP]);
+#elif defined(__arm__)
+            return static_cast<std::uintptr_t>(mcontext.arm_pc);
+#else
+#error "Unknown target processor"
+#endif
+        }
+
+        void on_sigprof(int, siginfo_t *, void *context)
+        {
+            s_handling++;
+            if (auto *const samples = s_running.load())
+            {
+                std::size_t const i = samples->count.fetch_add(1, std::memory_order_relaxed);
+                samples->addresses[i % samples->capacity].store(interrupted_address(context), std::memory_order_relaxed);
+            }
+            s_handling--;
+        }
+
+        void set_timer(std::chrono::microseconds interval)
+        {
+            itimerval timer{};
+            timer.it_interval.tv_sec = static_cast<time_t>(interval.count() / 1000000);
+            timer.it_interval.tv_usec = static_cast<suseconds_t>(interval.count() % 1000000);
+            timer.it_value = timer.it_interval;
+            if (setitimer(ITIMER_PROF, &timer, nullptr) != 0)
+            {
+                throw std::system_error(errno, std::generic_category(), "setitimer");
+            }
+        }
+    }
+
+    struct Profiler::State
+    {
+        std::chrono::microseconds interval;
+        Samples samples;
+        bool running = false;
+    };
+
+    Profiler::Profiler() : Profiler(Options{}) {}
+
+    Profiler::Profiler(Options const &options) : m_state{std::make_unique<State>()}
+    {
+        if (options.interval.count() <= 0 || options.capacity == 0)
+        {
+            throw std::invalid_argument("Profiler needs a positive interval and capacity");
+        }
+        m_state->interval = options.interval;
+        m_state->samples.capacity = options.capacity;
+        m_state->samples.addresses = std::make_unique<std::atomic<std::uintptr_t>[]>(options.capacity);
+    }
+
+    Profiler::~Profiler()
+    {
+        stop();
+    }
+
+    void Profiler::start()
+    {
+        std::lock_guard lock(s_mutex);
+        if (m_state->running)
+        {
+            return;
+        }
+        if (s_running.load() != nullptr)
+        {
+            throw std::logic_error("Another profiler is running");
+        }
+        if (!s_installed)
+        {
+            struct sigaction action{};
+            action.sa_sigaction = on_sigprof;
+            action.sa_flags = SA_SIGINFO | SA_RESTART;
+            sigemptyset(&action.sa_mask);
+            if (sigaction(SIGPROF, &action, nullptr) != 0)
+            {
+                throw std::system_error(errno, std::generic_category(), "sigaction");
+            }
+            s_installed = true;
+        }
+        s_running = &m_state->samples;
+        try
+        {
+            set_timer(m_state->interval);
+        }
+        catch (...)
+        {
+            s_running = nullptr;
+            throw;
+        }
+        m_state->running = true;
+    }
+
+    void Profiler::stop()
+    {
+        std::lock_guard lock(s_mutex);
+        if (!m_state->running)
+        {
+            return;
+        }
+        set_timer(std::chrono::microseconds{0});
+
+        // A signal may still be on its way, or being handled on another thread
+        s_running = nullptr;
+        while (s_handling.load() != 0)
+        {
+            std::this_thread::yield();
+        }
+        m_state->running = false;
+    }
+
+    void Profiler::clear()
+    {
+        m_state->samples.count = 0;
+    }
+
+    std::size_t Profiler::samples() const
+    {
+        return m_state->samples.count.load();
+    }
+
+    Profile Profiler::profile(CompiledCode const &code) const
+    {
+        auto const image = code.m_image.load();
+        ASSERT(image != nullptr);
+        Ops const &ops = image->ops;
+
+        // Count the samples landing in each op
+        Profile profile;
+        std::array<std::size_t, std::tuple_size_v<Ops>> counts{};
+        auto const base = reinterpret_cast<std::uintptr_t>(image->code);
+        Samples const &samples = m_state->samples;
+        profile.samples = std::min(samples.count.load(), samples.capacity);
+        for (std::size_t i = 0; i < profile.samples; i++)
+        {
+            std::uintptr_t const address = samples.addresses[i].load(std::memory_order_relaxed);
+            if (address < base || address - base >= image->used)
+            {
+                continue;
+            }
+            if (std::size_t const op = find_op(image->op_map, address - base); op != CompiledCode::kNoEntry)
+            {
+                counts[op]++;
+                profile.attributed++;
+            }
+        }
+
+        // Each op counts towards the label it follows
+        Label label{""};
+        for (std::size_t i = 0; i < ops.size(); i++)
+        {
+            if (ops[i].type == OpType::Label)
+            {
+                label = ops[i].label;
+            }
+            if (counts[i] == 0)
+            {
+                continue;
+            }
+            profile.ops.push_back(OpSamples{i, ops[i], label, counts[i]});
+            auto it = std::find_if(profile.labels.begin(), profile.labels.end(), [&](LabelSamples const &entry)
+                                   { return entry.label == label; });
+            if (it == profile.labels.end())
+            {
+                profile.labels.push_back(LabelSamples{label, 0});
+                it = std::prev(profile.labels.end());
+            }
+            it->samples += counts[i];
+        }
+        std::stable_sort(profile.ops.begin(), profile.ops.end(), [](OpSamples const &a, OpSamples const &b)
+                         { return a.samples > b.samples; });
+        std::stable_sort(profile.labels.begin(), profile.labels.end(), [](LabelSamples const &a, LabelSamples const &b)
+                         { return a.samples > b.samples; });
+        return profile;
+    }
+
+    std::string describe(Op const &op)
+    {
+        auto reg = [](Register reg)
+        { return "r" + std::to_string(reg); };
+        switch (op.type)
+        {
+        case OpType::Nop:
+            return "Nop";
+        case OpType::Return:
+            return "Return";
+        case OpType::Load:
+            return "Load " + reg(op.regA) + ", [" + reg(op.regB) + "]";
+        case OpType::Store:
+            return "Store [" + reg(op.regA) + "], " + reg(op.regB);
+        case OpType::SetReg:
+            return "SetReg " + reg(op.regA) + ", " + reg(op.regB);
+        case OpType::SetImm:
+            return "SetImm " + reg(op.regA) + ", " + std::to_string(op.imm);
+        case OpType::AddReg:
+            return "AddReg " + reg(op.regA) + ", " + reg(op.regB);
+        case OpType::AddImm:
+            return "AddImm " + reg(op.regA) + ", " + std::to_string(op.imm);
+        case OpType::Negate:
+            return "Negate " + reg(op.regA);
+        case OpType::Jump:
+            return "Jump " + std::string(op.label.data.data());
+        case OpType::JumpIfZero:
+            return "JumpIfZero " + reg(op.regA) + ", " + std::string(op.label.data.data());
+        case OpType::Call:
+            return "Call " + std::string(op.label.data.data());
+        case OpType::Label:
+            return std::string(op.label.data.data()) + ":";
+        case OpType::CallOut:
+            return "CallOut";
+        case OpType::Yield:
+            return "Yield";
+        }
+        return "?";
+    }
+
+    std::string report(Profile const &profile, std::size_t count)
+    {
+        auto line = [&](std::size_t samples, std::string const &what)
+        {
+            char buffer[32];
+            double const percent = profile.attributed != 0 ? 100.0 * static_cast<double>(samples) / static_cast<double>(profile.attributed) : 0.0;
+            std::snprintf(buffer, sizeof(buffer), "%6.1f%% %8zu  ", percent, samples);
+            return buffer + what + "\n";
+        };
+        std::string text = std::to_string(profile.samples) + " samples, " + std::to_string(profile.attributed) + " in the code profiled\n";
+        text += "Ops:\n";
+        for (std::size_t i = 0; i < profile.ops.size() && i < count; i++)
+        {
+            OpSamples const &entry = profile.ops[i];
+            std::string const label = entry.label.data[0] != '\0' ? std::string(entry.label.data.data()) : "(entry)";
+            text += line(entry.samples, std::to_string(entry.index) + ": " + describe(entry.op) + "  in " + label);
+        }
+        text += "Labels:\n";
+        for (std::size_t i = 0; i < profile.labels.size() && i < count; i++)
+        {
+            LabelSamples const &entry = profile.labels[i];
+            text += line(entry.samples, entry.label.data[0] != '\0' ? std::string(entry.label.data.data()) : "(entry)");
+        }
+        return text;
+    }
+}
@@ -0,0 +1,255 @@
+#include "internal.h"
+#include <jitlib/scheduler.h>
+#include <atomic>
+#include <condition_variable>
+#include <deque>
+#include <exception>
+#include <mutex>
+#include <utility>
+#include <time.h>
+
+namespace jitlib
+{
+    namespace
+    {
+        constexpr std::size_t kNoWorker = ~std::size_t{};
+
+        std::chrono::nanoseconds thread_cpu_time()
+        {
+            timespec ts;
+            clock_gettime(CLOCK_THREAD_CPUTIME_ID, &ts);
+            return std::chrono::seconds(ts.tv_sec) + std::chrono::nanoseconds(ts.tv_nsec);
+        }
+
+        struct Job
+        {
+            CompiledCode const *code; // null when interpreting
+            Ops const *ops;
+            ExecutionEnvironment env;
+            Scheduler::TaskStats stats;
+            Scheduler::Clock::time_point queued;
+            std::size_t worker = kNoWorker;
+        };
+
+        struct Worker
+        {
+            std::mutex mutex;
+            std::deque<Job *> queue; // runs from the front, stolen from the back
+            std::thread thread;
+        };
+    }
+
+    struct Scheduler::State
+    {
+        Options options;
+        std::vector<std::unique_ptr<Worker>> workers;
+        std::atomic<std::size_t> next_worker{0};
+
+        mutable std::mutex jobs_mutex;
+        std::deque<Job> jobs;
+
+        // Guards sleeping, waking and finishing
+        std::mutex idle_mutex;
+        std::condition_variable idle;
+        std::condition_variable finished;
+        std::atomic<std::size_t> runnable{0};
+        std::size_t outstanding = 0;
+        std::exception_ptr error;
+        std::atomic<bool> stopping{false};
+
+        void push(std::size_t worker, Job *job)
+        {
+            // Count it first so that |runnable| never undercounts the queues
+            job->queued = Clock::now();
+            {
+                std::lock_guard lock(idle_mutex);
+                runnable++;
+            }
+            {
+                std::lock_guard lock(workers[worker]->mutex);
+                workers[worker]->queue.push_back(job);
+            }
+            idle.notify_one();
+        }
+
+        Job *pop(std::size_t worker)
+        {
+            // Our own work first, then anyone else's
+            for (std::size_t i = 0; i < workers.size(); i++)
+            {
+                Worker &victim = *workers[(worker + i) % workers.size()];
+                std::lock_guard lock(victim.mutex);
+                if (!victim.queue.empty())
+                {
+                    Job *job;
+                    if (i == 0)
+                    {
+                        job = victim.queue.front();
+                        victim.queue.pop_front();
+                    }
+                    else
+                    {
+                        job = victim.queue.back();
+                        victim.queue.pop_back();
+                    }
+                    runnable--;
+                    return job;
+                }
+            }
+            return nullptr;
+        }
+
+        void finish(std::exception_ptr job_error)
+        {
+            std::lock_guard lock(idle_mutex);
+            if (job_error && !error)
+            {
+                error = job_error;
+            }
+            if (--outstanding == 0)
+            {
+                finished.notify_all();
+            }
+        }
+
+        void run_slice(std::size_t worker, Job &job)
+        {
+            auto const start = Clock::now();
+            auto const waited = std::chrono::duration_cast<std::chrono::nanoseconds>(start - job.queued);
+            job.stats.queue_latency += waited;
+            job.stats.max_queue_latency = std::max(job.stats.max_queue_latency, waited);
+            job.stats.slices++;
+            if (job.worker != worker)
+            {
+                job.stats.steals += job.worker != kNoWorker;
+                job.worker = worker;
+            }
+
+            // Keep topping up the fuel until the slice is over
+            auto const cpu_start = thread_cpu_time();
+            auto const deadline = start + options.time_slice;
+            Status status;
+            try
+            {
+                do
+                {
+                    job.env.fuel = options.check_interval;
+                    status = job.code != nullptr ? job.code->run(job.env) : run(*job.ops, job.env);
+                } while (status == Status::OutOfFuel && Clock::now() < deadline);
+            }
+            catch (...)
+            {
+                job.stats.cpu_time += thread_cpu_time() - cpu_start;
+                finish(std::current_exception());
+                return;
+            }
+            job.env.fuel = 0;
+            job.stats.cpu_time += thread_cpu_time() - cpu_start;
+
+            if (status == Status::Returned)
+            {
+                finish(nullptr);
+            }
+            else
+            {
+                push(worker, &job);
+            }
+        }
+
+        void work(std::size_t worker)
+        {
+            while (!stopping)
+            {
+                if (Job *job = pop(worker))
+                {
+                    run_slice(worker, *job);
+                    continue;
+                }
+                std::unique_lock lock(idle_mutex);
+                idle.wait(lock, [&]
+                          { return stopping || runnable != 0; });
+            }
+        }
+
+        TaskId spawn(CompiledCode const *code, Ops const *ops, ExecutionEnvironment const &env)
+        {
+            Job *job;
+            TaskId id;
+            {
+                std::lock_guard lock(jobs_mutex);
+                id = jobs.size();
+                job = &jobs.emplace_back(Job{code, ops, env, {}, {}});
+            }
+            {
+                std::lock_guard lock(idle_mutex);
+                outstanding++;
+            }
+            push(next_worker++ % workers.size(), job);
+            return id;
+        }
+    };
+
+    Scheduler::Scheduler() : Scheduler(Options{}) {}
+
+    Scheduler::Scheduler(Options const &options) : m_state{std::make_unique<State>()}
+    {
+        ASSERT(options.workers != 0);
+        m_state->options = options;
+        m_state->options.check_interval = std::max<std::uint64_t>(options.check_interval, 2);
+        for (std::size_t i = 0; i < options.workers; i++)
+        {
+            m_state->workers.push_back(std::make_unique<Worker>());
+        }
+        for (std::size_t i = 0; i < options.workers; i++)
+        {
+            m_state->workers[i]->thread = std::thread([state = m_state.get(), i]
+                                                      { state->work(i); });
+        }
+    }
+
+    Scheduler::~Scheduler()
+    {
+        {
+            std::lock_guard lock(m_state->idle_mutex);
+            m_state->stopping = true;
+        }
+        m_state->idle.notify_all();
+        for (auto &worker : m_state->workers)
+        {
+            worker->thread.join();
+        }
+    }
+
+    Scheduler::TaskId Scheduler::spawn(CompiledCode const &code, ExecutionEnvironment const &env)
+    {
+        return m_state->spawn(&code, nullptr, env);
+    }
+
+    Scheduler::TaskId Scheduler::spawn(Ops const &ops, ExecutionEnvironment const &env)
+    {
+        return m_state->spawn(nullptr, &ops, env);
+    }
+
+    void Scheduler::wait()
+    {
+        std::unique_lock lock(m_state->idle_mutex);
+        m_state->finished.wait(lock, [&]
+                               { return m_state->outstanding == 0; });
+        if (m_state->error)
+        {
+            std::rethrow_exception(std::exchange(m_state->error, nullptr));
+        }
+    }
+
+    ExecutionEnvironment const &Scheduler::environment(TaskId task) const
+    {
+        std::lock_guard lock(m_state->jobs_mutex);
+        return m_state->jobs.at(task).env;
+    }
+
+    Scheduler::TaskStats Scheduler::stats(TaskId task) const
+    {
+        std::lock_guard lock(m_state->jobs_mutex);
+        return m_state->jobs.at(task).stats;
+    }
+}
@@ -0,0 +1,231 @@
+#include "internal.h"
+#include <jitlib/trace.h>
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <cstdio>
+#include <mutex>
+#include <tuple>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+namespace jitlib
+{
+    namespace
+    {
+        struct Event
+        {
+            std::atomic<TracePoint const *> point;
+            std::atomic<std::uint64_t> begin; // ns
+            std::atomic<std::uint64_t> end;   // ns
+            std::atomic<std::size_t> arg;
+        };
+
+        // One thread's events. Written as a seqlock: |started| goes up
+        // before a slot's overwritten and |count| once it's been, so that a
+        // reader can tell which of the slots it read were overwritten as it
+        // read them. The slot's fields are released and acquired to keep
+        // them after |started| on both sides.
+        struct ThreadEvents
+        {
+            std::uint64_t tid;
+            std::size_t capacity;
+            std::unique_ptr<Event[]> events;
+            std::atomic<std::size_t> started{};
+            std::atomic<std::size_t> count{};
+            std::atomic<std::size_t> first{}; // before this were cleared
+        };
+
+        // What a tracer's threads record into.
+        struct Recording
+        {
+            std::size_t capacity;
+            std::uint64_t generation = 0;
+            // Every thread that's recorded anything, even if it's since exited
+            std::vector<std::shared_ptr<ThreadEvents>> threads;
+        };
+
+        std::uint64_t now()
+        {
+            return static_cast<std::uint64_t>(std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now().time_since_epoch()).count());
+        }
+    }
+
+    namespace
+    {
+        // Only changed with a tracer starting or stopping, or a thread
+        // joining one, under |s_mutex|. Each start is a new generation, so
+        // threads can tell their buffer belongs to one that's gone.
+        std::mutex s_mutex;
+        Recording *s_running = nullptr;
+        std::atomic<std::uint64_t> s_generation{}; // of |s_running|, 0 if none
+        std::uint64_t s_generations = 0;
+
+        struct ThreadBuffer
+        {
+            std::uint64_t generation = 0;
+            std::shared_ptr<ThreadEvents> events; // outlives the tracer if need be
+        };
+        thread_local ThreadBuffer t_buffer;
+
+        ThreadEvents *thread_events(std::uint64_t generation)
+        {
+            if (t_buffer.generation == generation)
+            {
+                return t_buffer.events.get();
+            }
+            std::lock_guard lock(s_mutex);
+            if (s_running == nullptr || s_running->generation != generation)
+            {
+                return nullptr;
+            }
+            auto events = std::make_shared<ThreadEvents>();
+            events->tid = static_cast<std::uint64_t>(syscall(SYS_gettid));
+            events->capacity = s_running->capacity;
+            events->events = std::make_unique<Event[]>(events->capacity);
+            s_running->threads.push_back(events);
+            t_buffer = ThreadBuffer{generation, std::move(events)};
+            return t_buffer.events.get();
+        }
+    }
+
+    std::uint64_t trace_clock()
+    {
+        return s_generation.load(std::memory_order_relaxed) != 0 ? now() : 0;
+    }
+
+    void record_span(TracePoint const &point, std::uint64_t begin, std::size_t arg)
+    {
+        std::uint64_t const end = now();
+        std::uint64_t const generation = s_generation.load(std::memory_order_acquire);
+        ThreadEvents *const events = generation != 0 ? thread_events(generation) : nullptr;
+        if (events == nullptr)
+        {
+            return;
+        }
+        std::size_t const i = events->count.load(std::memory_order_relaxed);
+        events->started.store(i + 1, std::memory_order_relaxed);
+        Event &event = events->events[i % events->capacity];
+        event.point.store(&point, std::memory_order_release);
+        event.begin.store(begin, std::memory_order_release);
+        event.end.store(end, std::memory_order_release);
+        event.arg.store(arg, std::memory_order_release);
+        events->count.store(i + 1, std::memory_order_release);
+    }
+
+    struct Tracer::State
+    {
+        Recording recording;
+        bool running = false;
+    };
+
+    Tracer::Tracer() : Tracer(Options{}) {}
+
+    Tracer::Tracer(Options const &options) : m_state{std::make_unique<State>()}
+    {
+        if (options.capacity == 0)
+        {
+            throw std::invalid_argument("Tracer needs a positive capacity");
+        }
+        m_state->recording.capacity = options.capacity;
+    }
+
+    Tracer::~Tracer()
+    {
+        stop();
+    }
+
+    void Tracer::start()
+    {
+        std::lock_guard lock(s_mutex);
+        if (m_state->running)
+        {
+            return;
+        }
+        if (s_running != nullptr)
+        {
+            throw std::logic_error("Another tracer is running");
+        }
+        m_state->recording.generation = ++s_generations;
+        m_state->running = true;
+        s_running = &m_state->recording;
+        s_generation.store(m_state->recording.generation, std::memory_order_release);
+    }
+
+    void Tracer::stop()
+    {
+        // A thread part way through recording still has its buffer
+        std::lock_guard lock(s_mutex);
+        if (!m_state->running)
+        {
+            return;
+        }
+        s_generation.store(0);
+        s_running = nullptr;
+        m_state->running = false;
+    }
+
+    void Tracer::clear()
+    {
+        std::lock_guard lock(s_mutex);
+        for (auto const &events : m_state->recording.threads)
+        {
+            events->first.store(events->count.load());
+        }
+    }
+
+    std::size_t Tracer::events() const
+    {
+        std::lock_guard lock(s_mutex);
+        std::size_t count = 0;
+        for (auto const &events : m_state->recording.threads)
+        {
+            count += events->count.load() - events->first.load();
+        }
+        return count;
+    }
+
+    std::string Tracer::json() const
+    {
+        std::lock_guard lock(s_mutex);
+        std::string text = "{\"traceEvents\":[";
+        bool first_event = true;
+        auto const pid = static_cast<unsigned long long>(getpid());
+        for (auto const &events : m_state->recording.threads)
+        {
+            // Copy out what's there, then drop anything overwritten meanwhile
+            std::size_t const count = events->count.load(std::memory_order_acquire);
+            std::size_t const begin = std::max({events->first.load(), count > events->capacity ? count - events->capacity : 0});
+            std::vector<std::tuple<TracePoint const *, std::uint64_t, std::uint64_t, std::size_t>> copied;
+            for (std::size_t i = begin; i < count; i++)
+            {
+                Event const &event = events->events[i % events->capacity];
+                copied.emplace_back(event.point.load(std::memory_order_acquire), event.begin.load(std::memory_order_acquire),
+                                    event.end.load(std::memory_order_acquire), event.arg.load(std::memory_order_acquire));
+            }
+            std::size_t const started = events->started.load(std::memory_order_relaxed);
+            std::size_t const intact = started > events->capacity ? started - events->capacity : 0;
+
+            for (std::size_t i = std::max(begin, intact); i < count; i++)
+            {
+                auto const &[point, span_begin, span_end, arg] = copied[i - begin];
+                char buffer[256];
+                int length = std::snprintf(buffer, sizeof(buffer), "%s{\"name\":\"%s\",\"cat\":\"%s\",\"ph\":\"X\",\"ts\":%llu.%03llu,\"dur\":%llu.%03llu,\"pid\":%llu,\"tid\":%llu",
+                                           first_event ? "" : ",", point->name, point->category, static_cast<unsigned long long>(span_begin / 1000),
+                                           static_cast<unsigned long long>(span_begin % 1000), static_cast<unsigned long long>((span_end - span_begin) / 1000),
+                                           static_cast<unsigned long long>((span_end - span_begin) % 1000), pid, static_cast<unsigned long long>(events->tid));
+                text.append(buffer, static_cast<std::size_t>(length));
+                if (point->arg != nullptr)
+                {
+                    length = std::snprintf(buffer, sizeof(buffer), ",\"args\":{\"%s\":%zu}", point->arg, arg);
+                    text.append(buffer, static_cast<std::size_t>(length));
+                }
+                text += "}";
+                first_event = false;
+            }
+        }
+        text += "],\"displayTimeUnit\":\"ns\"}\n";
+        return text;
+    }
+}
@@ -7,13 +7,23 @@
 // registers: rax,rcx,rdx,rsi
 // r10 - base data ptr / ExecutionEnvironment
 // r11 - temporary
+// rbp - stack pointer on entry, so that we can exit from any depth
+//
+// Guest Calls use the native stack, so suspending copies their return
+// addresses out to |NativeFrames| and resuming pushes them back.
 
 namespace jitlib
 {
     static_assert(jitlib::kNumRegisters == 4, "Native code will need changing");
     static_assert(std::is_same_v<Value, uint8_t>, "Native code will need changing");
     static_assert(offsetof(ExecutionEnvironment, mem) == 0, "ExecutionEnvironment and data ptr aren't interchangeable");
-    static_assert(std::is_same_v<NativeRegister, std::uint64_t>, "Registers are 64bit");
+    static_assert(offsetof(ExecutionEnvironment, regs) == 0x100, "Native code will need changing");
+    static_assert(offsetof(ExecutionEnvironment, pc) == 0x104, "Native code will need changing");
+    static_assert(offsetof(ExecutionEnvironment, fuel) == 0x110, "Native code will need changing");
+    static_assert(offsetof(ExecutionEnvironment, pending) == 0x159, "Native code will need changing");
+    static_assert(sizeof(void *) == 8, "Pointers are 64bit");
+    static_assert(offsetof(NativeFrames, frames) == 8, "Native code will need changing");
+    static_assert(kMaxCallDepth < 0x80, "Native code will need changing");
 
     namespace
     {
@@ -41,12 +51,8 @@ namespace jitlib
             if (op.type == OpType::Load)
             {
                 uint8_t const ins[]{
-                    // mov %r10,%r11
-                    0x4d, 0x89, 0xd3,
-                    // add reg,%r11
-                    0x49, 0x01, uint8_t(0xc3 | (regB << 3)),
-                    // movzbl (%r11),reg
-                    0x41, 0x0f, 0xb6, uint8_t(0x03 | (regA << 3))};
+                    // movzbl (%r10,regB),regA
+                    0x41, 0x0f, 0xb6, uint8_t(0x04 | (regA << 3)), uint8_t((regB << 3) | 0x2)};
                 if (buffer != nullptr)
                 {
                     std::copy(std::begin(ins), std::end(ins), buffer);
@@ -56,12 +62,8 @@ namespace jitlib
             else if (op.type == OpType::Store)
             {
                 uint8_t const ins[]{
-                    // mov %r10,%r11
-                    0x4d, 0x89, 0xd3,
-                    // add reg,%r11
-                    0x49, 0x01, uint8_t(0xc3 | (regA << 3)),
-                    // mov reg,(%r11)
-                    0x66, 0x41, 0x89, uint8_t(0x03 | (regB << 3))};
+                    // mov regB8,(%r10,regA)
+                    0x41, 0x88, uint8_t(0x04 | (regB << 3)), uint8_t((regA << 3) | 0x2)};
                 if (buffer != nullptr)
                 {
                     std::copy(std::begin(ins), std::end(ins), buffer);
@@ -96,16 +98,14 @@ namespace jitlib
             throw std::logic_error("Unknown set op");
         }
 
-        std::size_t handle_arithmetic(Op const &op, uint8_t *buffer)
+        std::size_t handle_arithmetic_byte(Op const &op, uint8_t *buffer)
         {
             auto reg = encode_reg(op.regA);
             if (op.type == OpType::AddImm)
             {
                 uint8_t const ins[]{
-                    // add reg <imm>
-                    0x48, 0x83, uint8_t(0xc0 | reg), op.imm,
-                    // and 0xff reg
-                    0x48, 0x81, uint8_t(0xe0 | reg), 0xff, 0x00, 0x00, 0x00};
+                    // add <imm> reg8
+                    0x40, 0x80, uint8_t(0xc0 | reg), op.imm};
                 if (buffer != nullptr)
                 {
                     std::copy(std::begin(ins), std::end(ins), buffer);
@@ -116,10 +116,8 @@ namespace jitlib
             {
                 auto regB = encode_reg(op.regB);
                 uint8_t const ins[]{
-                    // add reg reg
-                    0x48, 0x01, uint8_t(0xc0 | (regB << 3) | reg),
-                    // and 0xff reg
-                    0x48, 0x81, uint8_t(0xe0 | reg), 0xff, 0x00, 0x00, 0x00};
+                    // add regB8 reg8
+                    0x40, 0x00, uint8_t(0xc0 | (regB << 3) | reg)};
                 if (buffer != nullptr)
                 {
                     std::copy(std::begin(ins), std::end(ins), buffer);
@@ -129,10 +127,8 @@ namespace jitlib
             else if (op.type == OpType::Negate)
             {
                 uint8_t const ins[]{
-                    // neg reg
-                    0x48, 0xf7, uint8_t(0xd8 | reg),
-                    // and 0xff reg
-                    0x48, 0x81, uint8_t(0xe0 | reg), 0xff, 0x00, 0x00, 0x00};
+                    // neg reg8
+                    0x40, 0xf6, uint8_t(0xd8 | reg)};
                 if (buffer != nullptr)
                 {
                     std::copy(std::begin(ins), std::end(ins), buffer);
@@ -142,6 +138,54 @@ namespace jitlib
             throw std::logic_error("Unknown arithmetic op");
         }
 
+        std::size_t handle_arithmetic(Op const &op, CpuFeatures const &features, uint8_t *buffer)
+        {
+            auto reg = encode_reg(op.regA);
+            if (features.bmi2)
+            {
+                // Anything with BMI2 merges byte register writes without a
+                // partial register stall, so operate on the low byte directly
+                // rather than zero extending afterwards.
+                return handle_arithmetic_byte(op, buffer);
+            }
+            uint8_t const extend[]{
+                // movzbl reg8,reg
+                0x40, 0x0f, 0xb6, uint8_t(0xc0 | (reg << 3) | reg)};
+            auto emit = [&](auto const &ins)
+            {
+                if (buffer != nullptr)
+                {
+                    buffer = std::copy(std::begin(ins), std::end(ins), buffer);
+                    std::copy(std::begin(extend), std::end(extend), buffer);
+                }
+                return std::size(ins) + std::size(extend);
+            };
+
+            if (op.type == OpType::AddImm)
+            {
+                uint8_t const ins[]{
+                    // add <imm> reg
+                    0x83, uint8_t(0xc0 | reg), op.imm};
+                return emit(ins);
+            }
+            else if (op.type == OpType::AddReg)
+            {
+                auto regB = encode_reg(op.regB);
+                uint8_t const ins[]{
+                    // add regB reg
+                    0x01, uint8_t(0xc0 | (regB << 3) | reg)};
+                return emit(ins);
+            }
+            else if (op.type == OpType::Negate)
+            {
+                uint8_t const ins[]{
+                    // neg reg
+                    0xf7, uint8_t(0xd8 | reg)};
+                return emit(ins);
+            }
+            throw std::logic_error("Unknown arithmetic op");
+        }
+
         std::size_t handle_jump(Op const &op, uint8_t const *buffer_base, uint8_t *buffer, LabelToOffsetMap const *label_to_offset)
         {
             auto patch_addr = [&](auto &ins)
@@ -194,6 +238,74 @@ namespace jitlib
             throw std::logic_error("Unknown jump op");
         }
 
+        std::size_t handle_conditional(Op const &op, uint8_t *buffer)
+        {
+            // Compute the result into %r11 without touching the flags, then
+            // only commit it if the condition register was non-zero.
+            auto reg = encode_reg(op.regA);
+            uint8_t const commit[]{
+                // cmovne %r11,reg
+                0x49, 0x0f, 0x45, uint8_t(0xc3 | (reg << 3)),
+                // movzbl reg8,reg
+                0x40, 0x0f, 0xb6, uint8_t(0xc0 | (reg << 3) | reg)};
+            auto emit = [&](auto const &ins)
+            {
+                if (buffer != nullptr)
+                {
+                    buffer = std::copy(std::begin(ins), std::end(ins), buffer);
+                    std::copy(std::begin(commit), std::end(commit), buffer);
+                }
+                return std::size(ins) + std::size(commit);
+            };
+
+            if (op.type == OpType::SetImm)
+            {
+                uint8_t const ins[]{
+                    // mov $imm,%r11d
+                    0x41, 0xbb, op.imm, 0x00, 0x00, 0x00};
+                return emit(ins);
+            }
+            else if (op.type == OpType::SetReg)
+            {
+                auto regB = encode_reg(op.regB);
+                uint8_t const ins[]{
+                    // mov regB,%r11
+                    0x49, 0x89, uint8_t(0xc3 | (regB << 3))};
+                return emit(ins);
+            }
+            else if (op.type == OpType::AddImm)
+            {
+                uint8_t const ins[]{
+                    // lea imm(reg),%r11d
+                    0x44, 0x8d, uint8_t(0x58 | reg), op.imm};
+                return emit(ins);
+            }
+            else if (op.type == OpType::AddReg)
+            {
+                auto regB = encode_reg(op.regB);
+                uint8_t const ins[]{
+                    // lea (reg,regB),%r11d
+                    0x44, 0x8d, 0x1c, uint8_t((regB << 3) | reg)};
+                return emit(ins);
+            }
+            else if (op.type == OpType::Negate)
+            {
+                uint8_t const ins[]{
+                    // mov reg,%r11
+                    0x49, 0x89, uint8_t(0xc3 | (reg << 3)),
+                    // not %r11
+                    0x49, 0xf7, 0xd3,
+                    // lea 1(%r11),%r11d
+                    0x45, 0x8d, 0x5b, 0x01};
+                return emit(ins);
+            }
+            else if (op.type == OpType::Nop)
+            {
+                return 0;
+            }
+            throw std::logic_error("Unknown conditional op");
+        }
+
         std::size_t handle_return(Op const &, uint8_t *buffer)
         {
             if (buffer != nullptr)
@@ -203,124 +315,155 @@ namespace jitlib
             return 1;
         }
 
-        std::size_t handle_callout(Op const &op, uint8_t *buffer)
+        std::size_t handle_exit(std::size_t pc, Status status, EncodeContext const &ctx, uint8_t *buffer)
         {
-            auto helper_thunk = [](NativeState *state, CallOutFunc func)
+            uint32_t const exit_value = uint32_t(static_cast<Value>(pc)) | (uint32_t(status) << 8);
+            uint8_t ins[]{
+                // mov $exit_value,%r11d
+                0x41, 0xbb, 0x00, 0x00, 0x00, 0x00,
+                // jmp <exit>
+                0xe9, 0x00, 0x00, 0x00, 0x00};
+            if (buffer != nullptr)
             {
-                auto *env = static_cast<ExecutionEnvironment *>(state->data);
-                std::copy(std::begin(state->regs), std::end(state->regs), std::begin(env->regs));
-                func(*env);
-                std::copy(std::begin(env->regs), std::end(env->regs), std::begin(state->regs));
-            };
-
-            uint8_t const enter[]{
-                // Give us some stack
-                0x48, 0x83, 0xec, 0x38, // sub $0x38,%rsp
-
-                // Store current register values to a |NativeState| on the stack
-                0x48, 0x89, 0x04, 0x24,       // mov %rax,(%rsp)
-                0x48, 0x89, 0x4c, 0x24, 0x08, // mov %rcx,0x8(%rsp)
-                0x48, 0x89, 0x54, 0x24, 0x10, // mov %rdx,0x10(%rsp)
-                0x48, 0x89, 0x74, 0x24, 0x18, // mov %rsi,0x18(%rsp)
-                0x4c, 0x89, 0x54, 0x24, 0x20, // mov %r10,0x20(%rsp)
-
-                // Setup first arg
-                0x48, 0x89, 0xe7, // mov %rsp,%rdi
-
-                // Setup second arg
-                0x48, 0xbe, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00 // mov callout,%rsi
-            };
-            uint8_t const call_thunk[]{
-                // Setup call
-                0x48, 0xb8, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, // mov thunk,%rax
-            };
-            uint8_t const leave[]{
-                // Call into the helper thunk
-                // rdi = NativeState
-                // rsi = CallOutFunc
-                // rax = helper_thunk
-                0xff, 0xd0, // call *%rax
+                int32_t const relative_address = static_cast<int32_t>(ctx.exit_offset - (buffer + std::size(ins) - ctx.buffer_base));
+                memcpy(std::end(ins) - 9, &exit_value, 4);
+                memcpy(std::end(ins) - 4, &relative_address, 4);
+                std::copy(std::begin(ins), std::end(ins), buffer);
+            }
+            return std::size(ins);
+        }
 
-                // Read off each register from |NativeState|
-                0x48, 0x8b, 0x04, 0x24,       // mov (%rsp),%rax
-                0x48, 0x8b, 0x4c, 0x24, 0x08, // mov 0x8(%rsp),%rcx
-                0x48, 0x8b, 0x54, 0x24, 0x10, // mov 0x10(%rsp),%rdx
-                0x48, 0x8b, 0x74, 0x24, 0x18, // mov 0x18(%rsp),%rsi
-                0x4c, 0x8b, 0x54, 0x24, 0x20, // mov 0x20(%rsp),%r10
+        std::size_t handle_charge(std::size_t pc, EncodeContext const &ctx, uint8_t *buffer)
+        {
+            uint8_t const ins[]{
+                // subq $1,0x110(%r10)
+                0x49, 0x83, 0xaa, 0x10, 0x01, 0x00, 0x00, 0x01,
+                // jnz <continue>
+                0x75, 0x0b};
+            if (buffer != nullptr)
+            {
+                buffer = std::copy(std::begin(ins), std::end(ins), buffer);
+            }
+            return std::size(ins) + handle_exit(pc, Status::OutOfFuel, ctx, buffer);
+        }
 
-                // Restore stack
-                0x48, 0x83, 0xc4, 0x38, // add $0x38,%rsp
-            };
+        std::size_t handle_count(std::uint64_t *counter, uint8_t *buffer)
+        {
+            uint8_t const ins[]{
+                // mov $counter,%r11
+                0x49, 0xbb, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00,
+                // incq (%r11)
+                0x49, 0xff, 0x03};
             if (buffer != nullptr)
             {
-                buffer = std::copy(std::begin(enter), std::end(enter), buffer);
-                // Patch callout address
-                memcpy(buffer - 8, &op.func, 8);
+                std::copy(std::begin(ins), std::end(ins), buffer);
+                memcpy(buffer + 2, &counter, 8);
+            }
+            return std::size(ins);
+        }
 
-                buffer = std::copy(std::begin(call_thunk), std::end(call_thunk), buffer);
-                // Patch thunk address
-                auto *thunk_ptr = static_cast<void (*)(NativeState *, CallOutFunc)>(helper_thunk);
-                memcpy(buffer - 8, &thunk_ptr, 8);
+        // Bumps |counters[address]|, for the address in |reg|, which like all
+        // the guest registers is zero extended.
+        std::size_t handle_access(std::uint64_t *counters, uint8_t reg, uint8_t *buffer)
+        {
+            uint8_t const ins[]{
+                // mov $counters,%r11
+                0x49, 0xbb, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00,
+                // incq (%r11,reg,8)
+                0x49, 0xff, 0x04, uint8_t(0xc3 | (reg << 3))};
+            if (buffer != nullptr)
+            {
+                std::copy(std::begin(ins), std::end(ins), buffer);
+                memcpy(buffer + 2, &counters, 8);
+            }
+            return std::size(ins);
+        }
 
-                buffer = std::copy(std::begin(leave), std::end(leave), buffer);
+        std::size_t handle_pending(std::size_t pc, EncodeContext const &ctx, uint8_t *buffer)
+        {
+            uint8_t const ins[]{
+                // cmpb $0,0x159(%r10)
+                0x41, 0x80, 0xba, 0x59, 0x01, 0x00, 0x00, 0x00,
+                // je <continue>
+                0x74, 0x0b};
+            if (buffer != nullptr)
+            {
+                buffer = std::copy(std::begin(ins), std::end(ins), buffer);
             }
-            return std::size(enter) + std::size(call_thunk) + std::size(leave);
+            return std::size(ins) + handle_exit(pc, Status::Pending, ctx, buffer);
         }
-    }
 
-    namespace native
-    {
-        std::size_t preamble(uint8_t *buffer)
+        std::size_t handle_callout(Op const &op, std::size_t index, EncodeContext const &ctx, uint8_t *buffer)
         {
             uint8_t const enter[]{
-                // Give us some stack
-                0x48, 0x83, 0xec, 0x38, // sub $0x38,%rsp
-
-                // Store address of |NativeState| to the stack
-                0x48, 0x89, 0x7c, 0x24, 0x08, // mov %rdi,0x8(%rsp)
+                // Store current register values to |ExecutionEnvironment::regs|
+                0x41, 0x88, 0x82, 0x00, 0x01, 0x00, 0x00, // mov %al,0x100(%r10)
+                0x41, 0x88, 0x8a, 0x01, 0x01, 0x00, 0x00, // mov %cl,0x101(%r10)
+                0x41, 0x88, 0x92, 0x02, 0x01, 0x00, 0x00, // mov %dl,0x102(%r10)
+                0x41, 0x88, 0xb2, 0x03, 0x01, 0x00, 0x00, // mov %sil,0x103(%r10)
+
+                // Align the stack, keeping hold of the old one and %r10
+                0x49, 0x89, 0xe3,       // mov %rsp,%r11
+                0x48, 0x83, 0xe4, 0xf0, // and $-16,%rsp
+                0x41, 0x53,             // push %r11
+                0x41, 0x52,             // push %r10
 
-                // Read off each register from |NativeState|
-                0x48, 0x8b, 0x07,       // mov (%rdi),%rax
-                0x48, 0x8b, 0x4f, 0x08, // mov 0x8(%rdi),%rcx
-                0x48, 0x8b, 0x57, 0x10, // mov 0x10(%rdi),%rdx
-                0x48, 0x8b, 0x77, 0x18, // mov 0x18(%rdi),%rsi
-                0x4c, 0x8b, 0x57, 0x20, // mov 0x20(%rdi),%r10
-
-                // Call into the rest of the code
-                0xe8, 0x00, 0x00, 0x00, 0x00, // call <addr>
+                // Setup first arg
+                0x4c, 0x89, 0xd7, // mov %r10,%rdi
+            };
+            // Setup call
+            uint8_t const absolute[]{
+                0x48, 0xb8, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, // mov callout,%rax
+            };
+            uint8_t const relative[]{
+                0x48, 0x8b, 0x05, 0x00, 0x00, 0x00, 0x00, // mov slot(%rip),%rax
             };
             uint8_t const leave[]{
-                // Load |NativeState| address from stack
-                0x48, 0x8b, 0x7c, 0x24, 0x08, // mov 0x8(%rsp),%rdi
-
-                // Store new register values back to |NativeState|
-                0x48, 0x89, 0x07,       // mov %rax,(%rdi)
-                0x48, 0x89, 0x4f, 0x08, // mov %rcx,0x8(%rdi)
-                0x48, 0x89, 0x57, 0x10, // mov %rdx,0x10(%rdi)
-                0x48, 0x89, 0x77, 0x18, // mov %rsi,0x18(%rdi)
-                0x4c, 0x89, 0x57, 0x20, // mov %r10,0x20(%rdi)
+                // Call into the callout
+                // rdi = ExecutionEnvironment
+                // rax = CallOutFunc
+                0xff, 0xd0, // call *%rax
 
-                // Return
-                0x48, 0x83, 0xc4, 0x38, // add $0x38,%rsp
-                0xc3,                   // ret
+                // Restore %r10 and the stack
+                0x41, 0x5a, // pop %r10
+                0x5c,       // pop %rsp
 
-                // Safety guard
-                0xcc, // int3
-                0xcc, // int3
-                0xcc, // int3
+                // Read back each register from |ExecutionEnvironment::regs|
+                0x41, 0x0f, 0xb6, 0x82, 0x00, 0x01, 0x00, 0x00, // movzbl 0x100(%r10),%eax
+                0x41, 0x0f, 0xb6, 0x8a, 0x01, 0x01, 0x00, 0x00, // movzbl 0x101(%r10),%ecx
+                0x41, 0x0f, 0xb6, 0x92, 0x02, 0x01, 0x00, 0x00, // movzbl 0x102(%r10),%edx
+                0x41, 0x0f, 0xb6, 0xb2, 0x03, 0x01, 0x00, 0x00, // movzbl 0x103(%r10),%esi
             };
+            std::size_t const setup = ctx.position_independent ? std::size(relative) : std::size(absolute);
             if (buffer != nullptr)
             {
                 buffer = std::copy(std::begin(enter), std::end(enter), buffer);
-                // Patch call address
-                uint32_t const relative_address = std::size(leave);
-                memcpy(buffer - 4, &relative_address, 4);
+                if (ctx.position_independent)
+                {
+                    // The slot's distance is from the end of the instruction
+                    buffer = std::copy(std::begin(relative), std::end(relative), buffer);
+                    if (ctx.relocations != nullptr)
+                    {
+                        ctx.relocations->push_back(Relocation{static_cast<std::size_t>(buffer - 4 - ctx.buffer_base), index, -4});
+                    }
+                }
+                else
+                {
+                    // Patch callout address
+                    buffer = std::copy(std::begin(absolute), std::end(absolute), buffer);
+                    memcpy(buffer - 8, &op.func, 8);
+                    if (ctx.relocations != nullptr)
+                    {
+                        ctx.relocations->push_back(Relocation{static_cast<std::size_t>(buffer - 8 - ctx.buffer_base), index});
+                    }
+                }
+
                 buffer = std::copy(std::begin(leave), std::end(leave), buffer);
             }
-            return std::size(enter) + std::size(leave);
+            return std::size(enter) + setup + std::size(leave);
         }
 
-        std::size_t encode(Op const &op, uint8_t const *buffer_base, uint8_t *buffer, LabelToOffsetMap const *label_to_offset)
+        std::size_t encode_op(Op const &op, std::size_t index, EncodeContext const &ctx, uint8_t *buffer)
         {
             switch (op.type)
             {
@@ -338,12 +481,12 @@ namespace jitlib
             case OpType::AddReg:
             case OpType::AddImm:
             case OpType::Negate:
-                return handle_arithmetic(op, buffer);
+                return handle_arithmetic(op, ctx.features, buffer);
 
             case OpType::Jump:
             case OpType::JumpIfZero:
             case OpType::Call:
-                return handle_jump(op, buffer_base, buffer, label_to_offset);
+                return handle_jump(op, ctx.buffer_base, buffer, ctx.label_to_offset);
 
             case OpType::Return:
                 return handle_return(op, buffer);
@@ -352,9 +495,223 @@ namespace jitlib
                 return 0;
 
             case OpType::CallOut:
-                return handle_callout(op, buffer);
+            {
+                std::size_t const size = handle_callout(op, index, ctx, buffer);
+                return size + handle_pending(index + 1, ctx, buffer != nullptr ? buffer + size : nullptr);
+            }
+
+            case OpType::Yield:
+                return handle_exit(index + 1, Status::Yielded, ctx, buffer);
             }
             return 0;
         }
     }
+
+    namespace native
+    {
+        std::size_t preamble(uint8_t *buffer)
+        {
+            uint8_t enter[]{
+                // Keep hold of the |NativeFrames| below the stack pointer on entry
+                0x55,             // push %rbp
+                0x52,             // push %rdx
+                0x48, 0x89, 0xe5, // mov %rsp,%rbp
+
+                // Keep hold of the |ExecutionEnvironment| and entry point
+                0x49, 0x89, 0xfa, // mov %rdi,%r10
+                0x49, 0x89, 0xf3, // mov %rsi,%r11
+
+                // Call into the rest of the code, via resume
+                0xe8, 0x00, 0x00, 0x00, 0x00, // call <resume>
+            };
+            uint8_t const leave[]{
+                // Store new register values back to |ExecutionEnvironment::regs|
+                0x41, 0x88, 0x82, 0x00, 0x01, 0x00, 0x00, // mov %al,0x100(%r10)
+                0x41, 0x88, 0x8a, 0x01, 0x01, 0x00, 0x00, // mov %cl,0x101(%r10)
+                0x41, 0x88, 0x92, 0x02, 0x01, 0x00, 0x00, // mov %dl,0x102(%r10)
+                0x41, 0x88, 0xb2, 0x03, 0x01, 0x00, 0x00, // mov %sil,0x103(%r10)
+
+                // Return |Status::Returned|
+                0x31, 0xc0,             // xor %eax,%eax
+                0x48, 0x83, 0xc4, 0x08, // add $8,%rsp
+                0x5d,                   // pop %rbp
+                0xc3,                   // ret
+
+                // Safety guard
+                0xcc, // int3
+                0xcc, // int3
+                0xcc, // int3
+            };
+            uint8_t const resume[]{
+                // Push the return addresses of any Calls we're resuming inside
+                0x48, 0x8b, 0x0a,                               // mov (%rdx),%rcx
+                0x48, 0x8d, 0x72, 0x08,                         // lea 8(%rdx),%rsi
+                0x48, 0x8d, 0x04, 0xcd, 0x00, 0x00, 0x00, 0x00, // lea 0(,%rcx,8),%rax
+                0x48, 0x29, 0xc4,                               // sub %rax,%rsp
+                0x48, 0x89, 0xe7,                               // mov %rsp,%rdi
+                0xf3, 0x48, 0xa5,                               // rep movsq
+
+                // Read off each register from |ExecutionEnvironment::regs|
+                0x41, 0x0f, 0xb6, 0x82, 0x00, 0x01, 0x00, 0x00, // movzbl 0x100(%r10),%eax
+                0x41, 0x0f, 0xb6, 0x8a, 0x01, 0x01, 0x00, 0x00, // movzbl 0x101(%r10),%ecx
+                0x41, 0x0f, 0xb6, 0x92, 0x02, 0x01, 0x00, 0x00, // movzbl 0x102(%r10),%edx
+                0x41, 0x0f, 0xb6, 0xb2, 0x03, 0x01, 0x00, 0x00, // movzbl 0x103(%r10),%esi
+
+                // Start executing
+                0x41, 0xff, 0xe3, // jmp *%r11
+            };
+            if (buffer != nullptr)
+            {
+                int32_t const relative_address = static_cast<int32_t>(std::size(leave));
+                memcpy(std::end(enter) - 4, &relative_address, 4);
+                buffer = std::copy(std::begin(enter), std::end(enter), buffer);
+                buffer = std::copy(std::begin(leave), std::end(leave), buffer);
+                buffer = std::copy(std::begin(resume), std::end(resume), buffer);
+            }
+            return std::size(enter) + std::size(leave) + std::size(resume);
+        }
+
+        std::size_t exit_stub(uint8_t *buffer)
+        {
+            uint8_t const ins[]{
+                // Store register values back to |ExecutionEnvironment::regs|
+                0x41, 0x88, 0x82, 0x00, 0x01, 0x00, 0x00, // mov %al,0x100(%r10)
+                0x41, 0x88, 0x8a, 0x01, 0x01, 0x00, 0x00, // mov %cl,0x101(%r10)
+                0x41, 0x88, 0x92, 0x02, 0x01, 0x00, 0x00, // mov %dl,0x102(%r10)
+                0x41, 0x88, 0xb2, 0x03, 0x01, 0x00, 0x00, // mov %sil,0x103(%r10)
+
+                // Split %r11 into |ExecutionEnvironment::pc| and the status
+                0x44, 0x89, 0xd8,                         // mov %r11d,%eax
+                0x41, 0x88, 0x82, 0x04, 0x01, 0x00, 0x00, // mov %al,0x104(%r10)
+                0xc1, 0xe8, 0x08,                         // shr $8,%eax
+
+                // Copy out the return addresses of the Calls we're in, from
+                // the top of the stack down to the one returning to the
+                // preamble, keeping at most kMaxCallDepth
+                0x48, 0x8b, 0x7d, 0x00,                // mov (%rbp),%rdi
+                0x48, 0x8d, 0x4d, 0xf8,                // lea -8(%rbp),%rcx
+                0x48, 0x29, 0xe1,                      // sub %rsp,%rcx
+                0x48, 0xc1, 0xe9, 0x03,                // shr $3,%rcx
+                0x48, 0x89, 0x0f,                      // mov %rcx,(%rdi)
+                0x48, 0x83, 0xc7, 0x08,                // add $8,%rdi
+                0x48, 0x83, 0xf9, kMaxCallDepth,       // cmp $kMaxCallDepth,%rcx
+                0x76, 0x05,                            // jbe 1f
+                0xb9, kMaxCallDepth, 0x00, 0x00, 0x00, // mov $kMaxCallDepth,%ecx
+                0x48, 0x89, 0xe6,                      // 1: mov %rsp,%rsi
+                0xf3, 0x48, 0xa5,                      // rep movsq
+
+                // Return
+                0x48, 0x89, 0xec,       // mov %rbp,%rsp
+                0x48, 0x83, 0xc4, 0x08, // add $8,%rsp
+                0x5d,                   // pop %rbp
+                0xc3,                   // ret
+
+                // Safety guard
+                0xcc, // int3
+                0xcc, // int3
+                0xcc, // int3
+            };
+            if (buffer != nullptr)
+            {
+                std::copy(std::begin(ins), std::end(ins), buffer);
+            }
+            return std::size(ins);
+        }
+
+        std::size_t exit(std::size_t pc, Status status, EncodeContext const &ctx, uint8_t *buffer)
+        {
+            return handle_exit(pc, status, ctx, buffer);
+        }
+
+        std::size_t encode_conditional(Op const &jump, Op const *ops, std::size_t count, uint8_t *buffer)
+        {
+            auto reg = encode_reg(jump.regA);
+            uint8_t const test[]{
+                // test reg reg
+                0x48, 0x85, uint8_t(0xc0 | (reg << 3) | reg)};
+            std::size_t size = std::size(test);
+            if (buffer != nullptr)
+            {
+                std::copy(std::begin(test), std::end(test), buffer);
+            }
+            for (std::size_t i = 0; i < count; i++)
+            {
+                size += handle_conditional(ops[i], buffer != nullptr ? buffer + size : nullptr);
+            }
+            return size;
+        }
+
+        std::size_t pad(std::size_t length, uint8_t *buffer)
+        {
+            // Recommended multi-byte nops, indexed by length.
+            static uint8_t const nops[][9]{
+                {},
+                {0x90},
+                {0x66, 0x90},
+                {0x0f, 0x1f, 0x00},
+                {0x0f, 0x1f, 0x40, 0x00},
+                {0x0f, 0x1f, 0x44, 0x00, 0x00},
+                {0x66, 0x0f, 0x1f, 0x44, 0x00, 0x00},
+                {0x0f, 0x1f, 0x80, 0x00, 0x00, 0x00, 0x00},
+                {0x0f, 0x1f, 0x84, 0x00, 0x00, 0x00, 0x00, 0x00},
+                {0x66, 0x0f, 0x1f, 0x84, 0x00, 0x00, 0x00, 0x00, 0x00},
+            };
+            if (buffer != nullptr)
+            {
+                for (std::size_t remaining = length; remaining != 0;)
+                {
+                    std::size_t const chunk = std::min(remaining, std::size(nops) - 1);
+                    buffer = std::copy(nops[chunk], nops[chunk] + chunk, buffer);
+                    remaining -= chunk;
+                }
+            }
+            return length;
+        }
+
+        std::size_t jump(std::size_t offset, EncodeContext const &ctx, uint8_t *buffer)
+        {
+            uint8_t ins[]{
+                // jmp <offset>
+                0xe9, 0x00, 0x00, 0x00, 0x00};
+            if (buffer != nullptr)
+            {
+                int32_t const relative_address = static_cast<int32_t>(offset - (buffer + std::size(ins) - ctx.buffer_base));
+                memcpy(std::end(ins) - 4, &relative_address, 4);
+                std::copy(std::begin(ins), std::end(ins), buffer);
+            }
+            return std::size(ins);
+        }
+
+        std::size_t encode(Op const &op, std::size_t index, EncodeContext const &ctx, uint8_t *buffer)
+        {
+            auto at = [&](std::size_t offset)
+            { return buffer != nullptr ? buffer + offset : nullptr; };
+            std::size_t size = 0;
+            if (ctx.charges != nullptr && (*ctx.charges)[index])
+            {
+                size += handle_charge(index, ctx, buffer);
+            }
+            if (ctx.counters != nullptr)
+            {
+                // Only once it's not going to stop for fuel and run it again
+                size += handle_count(&ctx.counters->executed[index], at(size));
+            }
+            if (ctx.memory_counters != nullptr && op.type == OpType::Load)
+            {
+                size += handle_count(&ctx.memory_counters->accesses[index], at(size));
+                size += handle_access(ctx.memory_counters->reads.data(), encode_reg(op.regB), at(size));
+            }
+            else if (ctx.memory_counters != nullptr && op.type == OpType::Store)
+            {
+                size += handle_count(&ctx.memory_counters->accesses[index], at(size));
+                size += handle_access(ctx.memory_counters->writes.data(), encode_reg(op.regA), at(size));
+            }
+            size += encode_op(op, index, ctx, at(size));
+            if (ctx.counters != nullptr && op.type == OpType::JumpIfZero)
+            {
+                size += handle_count(&ctx.counters->fell_through[index], at(size));
+            }
+            return size;
+        }
+    }
 }
@@ -6,13 +6,23 @@
 // registers: eax,ecx,edx,ebx
 // edi - base data ptr / ExecutionEnvironment
 // esi - temporary
+// ebp - stack pointer on entry, so that we can exit from any depth
+//
+// Guest Calls use the native stack, so suspending copies their return
+// addresses out to |NativeFrames| and resuming pushes them back.
 
 namespace jitlib
 {
     static_assert(jitlib::kNumRegisters == 4, "Native code will need changing");
     static_assert(std::is_same_v<Value, uint8_t>, "Native code will need changing");
     static_assert(offsetof(ExecutionEnvironment, mem) == 0, "ExecutionEnvironment and data ptr aren't interchangeable");
-    static_assert(std::is_same_v<NativeRegister, std::uint32_t>, "Registers are 32bit");
+    static_assert(offsetof(ExecutionEnvironment, regs) == 0x100, "Native code will need changing");
+    static_assert(offsetof(ExecutionEnvironment, pc) == 0x104, "Native code will need changing");
+    static_assert(offsetof(ExecutionEnvironment, fuel) == 0x10c, "Native code will need changing");
+    static_assert(offsetof(ExecutionEnvironment, pending) == 0x155, "Native code will need changing");
+    static_assert(sizeof(void *) == 4, "Pointers are 32bit");
+    static_assert(offsetof(NativeFrames, frames) == 4, "Native code will need changing");
+    static_assert(kMaxCallDepth < 0x80, "Native code will need changing");
 
     namespace
     {
@@ -40,12 +50,8 @@ namespace jitlib
             if (op.type == OpType::Load)
             {
                 uint8_t const ins[]{
-                    // mov %edi,%esi
-                    0x89, 0xfe,
-                    // add reg,%esi
-                    0x01, uint8_t(0xc6 | (regB << 3)),
-                    // mov (%esi),reg
-                    0x8b, uint8_t(0x06 | (regA << 3)),
+                    // movzbl (%edi,regB),regA
+                    0x0f, 0xb6, uint8_t(0x04 | (regA << 3)), uint8_t((regB << 3) | 0x7),
                 };
                 if (buffer != nullptr)
                 {
@@ -56,12 +62,8 @@ namespace jitlib
             else if (op.type == OpType::Store)
             {
                 uint8_t const ins[]{
-                    // mov %edi,%esi
-                    0x89, 0xfe,
-                    // add reg,%esi
-                    0x01, uint8_t(0xc6 | (regA << 3)),
-                    // mov reg,(%esi)
-                    0x89, uint8_t(0x06 | (regB << 3)),
+                    // mov regB8,(%edi,regA)
+                    0x88, uint8_t(0x04 | (regB << 3)), uint8_t((regA << 3) | 0x7),
                 };
                 if (buffer != nullptr)
                 {
@@ -198,6 +200,80 @@ namespace jitlib
             throw std::logic_error("Unknown jump op");
         }
 
+        std::size_t handle_conditional(Op const &op, uint8_t *buffer)
+        {
+            // Compute the result into %esi without touching the flags, then
+            // only commit it if the condition register was non-zero.
+            auto reg = encode_reg(op.regA);
+            uint8_t const commit[]{
+                // cmovne %esi,reg
+                0x0f, 0x45, uint8_t(0xc6 | (reg << 3)),
+                // movzbl reg8,reg
+                0x0f, 0xb6, uint8_t(0xc0 | (reg << 3) | reg),
+            };
+            auto emit = [&](auto const &ins)
+            {
+                if (buffer != nullptr)
+                {
+                    buffer = std::copy(std::begin(ins), std::end(ins), buffer);
+                    std::copy(std::begin(commit), std::end(commit), buffer);
+                }
+                return std::size(ins) + std::size(commit);
+            };
+
+            if (op.type == OpType::SetImm)
+            {
+                uint8_t const ins[]{
+                    // mov $imm,%esi
+                    0xbe, op.imm, 0x00, 0x00, 0x00,
+                };
+                return emit(ins);
+            }
+            else if (op.type == OpType::SetReg)
+            {
+                auto regB = encode_reg(op.regB);
+                uint8_t const ins[]{
+                    // mov regB,%esi
+                    0x89, uint8_t(0xc6 | (regB << 3)),
+                };
+                return emit(ins);
+            }
+            else if (op.type == OpType::AddImm)
+            {
+                uint8_t const ins[]{
+                    // lea imm(reg),%esi
+                    0x8d, uint8_t(0x70 | reg), op.imm,
+                };
+                return emit(ins);
+            }
+            else if (op.type == OpType::AddReg)
+            {
+                auto regB = encode_reg(op.regB);
+                uint8_t const ins[]{
+                    // lea (reg,regB),%esi
+                    0x8d, 0x34, uint8_t((regB << 3) | reg),
+                };
+                return emit(ins);
+            }
+            else if (op.type == OpType::Negate)
+            {
+                uint8_t const ins[]{
+                    // mov reg,%esi
+                    0x89, uint8_t(0xc6 | (reg << 3)),
+                    // not %esi
+                    0xf7, 0xd6,
+                    // lea 1(%esi),%esi
+                    0x8d, 0x76, 0x01,
+                };
+                return emit(ins);
+            }
+            else if (op.type == OpType::Nop)
+            {
+                return 0;
+            }
+            throw std::logic_error("Unknown conditional op");
+        }
+
         std::size_t handle_return(Op const &, uint8_t *buffer)
         {
             if (buffer != nullptr)
@@ -207,73 +283,206 @@ namespace jitlib
             return 1;
         }
 
-        std::size_t handle_callout(Op const &op, uint8_t *buffer)
+        std::size_t handle_exit(std::size_t pc, Status status, EncodeContext const &ctx, uint8_t *buffer)
         {
-            auto helper_thunk = [](NativeState *state, CallOutFunc func)
+            uint32_t const exit_value = uint32_t(static_cast<Value>(pc)) | (uint32_t(status) << 8);
+            uint8_t ins[]{
+                // mov $exit_value,%esi
+                0xbe, 0x00, 0x00, 0x00, 0x00,
+                // jmp <exit>
+                0xe9, 0x00, 0x00, 0x00, 0x00};
+            if (buffer != nullptr)
             {
-                auto *env = static_cast<ExecutionEnvironment *>(state->data);
-                std::copy(std::begin(state->regs), std::end(state->regs), std::begin(env->regs));
-                func(*env);
-                std::copy(std::begin(env->regs), std::end(env->regs), std::begin(state->regs));
+                int32_t const relative_address = static_cast<int32_t>(ctx.exit_offset - (buffer + std::size(ins) - ctx.buffer_base));
+                memcpy(std::end(ins) - 9, &exit_value, 4);
+                memcpy(std::end(ins) - 4, &relative_address, 4);
+                std::copy(std::begin(ins), std::end(ins), buffer);
+            }
+            return std::size(ins);
+        }
+
+        std::size_t handle_count(std::uint64_t *counter, uint8_t *buffer)
+        {
+            uint8_t ins[]{
+                // Increment the 64bit counter
+                0x83, 0x05, 0x00, 0x00, 0x00, 0x00, 0x01, // addl $1,counter
+                0x83, 0x15, 0x00, 0x00, 0x00, 0x00, 0x00, // adcl $0,counter+4
             };
+            if (buffer != nullptr)
+            {
+                auto const low = reinterpret_cast<uint32_t>(counter);
+                auto const high = low + 4;
+                memcpy(ins + 2, &low, 4);
+                memcpy(ins + 9, &high, 4);
+                std::copy(std::begin(ins), std::end(ins), buffer);
+            }
+            return std::size(ins);
+        }
 
-            uint8_t const enter[]{
-                // Give us some stack
-                0x83, 0xec, 0x3a, // sub $0x3a,%esp
+        // Bumps |counters[address]|, for the address in |reg|
+        std::size_t handle_access(std::uint64_t *counters, uint8_t reg, uint8_t *buffer)
+        {
+            uint8_t const sib = uint8_t(0xc5 | (reg << 3));
+            uint8_t ins[]{
+                // Increment the 64bit counter
+                0x83, 0x04, sib, 0x00, 0x00, 0x00, 0x00, 0x01, // addl $1,counters(,reg,8)
+                0x83, 0x14, sib, 0x00, 0x00, 0x00, 0x00, 0x00, // adcl $0,counters+4(,reg,8)
+            };
+            if (buffer != nullptr)
+            {
+                auto const low = reinterpret_cast<uint32_t>(counters);
+                auto const high = low + 4;
+                memcpy(ins + 3, &low, 4);
+                memcpy(ins + 11, &high, 4);
+                std::copy(std::begin(ins), std::end(ins), buffer);
+            }
+            return std::size(ins);
+        }
 
-                // Store current register values to a |NativeState| on the stack
-                0x89, 0x44, 0x24, 0x18, // mov %eax,0x18(%esp)
-                0x89, 0x4c, 0x24, 0x1c, // mov %ecx,0x1c(%esp)
-                0x89, 0x54, 0x24, 0x20, // mov %edx,0x20(%esp)
-                0x89, 0x5c, 0x24, 0x24, // mov %ebx,0x24(%esp)
-                0x89, 0x7c, 0x24, 0x28, // mov %edi,0x28(%esp)
+        std::size_t handle_charge(std::size_t pc, EncodeContext const &ctx, uint8_t *buffer)
+        {
+            uint8_t const ins[]{
+                // Decrement the 64bit |ExecutionEnvironment::fuel|
+                0x83, 0x87, 0x0c, 0x01, 0x00, 0x00, 0xff, // addl $-1,0x10c(%edi)
+                0x83, 0x97, 0x10, 0x01, 0x00, 0x00, 0xff, // adcl $-1,0x110(%edi)
+                0x8b, 0xb7, 0x0c, 0x01, 0x00, 0x00,       // mov 0x10c(%edi),%esi
+                0x0b, 0xb7, 0x10, 0x01, 0x00, 0x00,       // or 0x110(%edi),%esi
+
+                // jnz <continue>
+                0x75, 0x0a};
+            if (buffer != nullptr)
+            {
+                buffer = std::copy(std::begin(ins), std::end(ins), buffer);
+            }
+            return std::size(ins) + handle_exit(pc, Status::OutOfFuel, ctx, buffer);
+        }
 
-                // Setup first arg
-                0x8d, 0x4c, 0x24, 0x18, // lea 0x18(%esp),%ecx
+        std::size_t handle_pending(std::size_t pc, EncodeContext const &ctx, uint8_t *buffer)
+        {
+            uint8_t const ins[]{
+                // cmpb $0,0x155(%edi)
+                0x80, 0xbf, 0x55, 0x01, 0x00, 0x00, 0x00,
+                // je <continue>
+                0x74, 0x0a};
+            if (buffer != nullptr)
+            {
+                buffer = std::copy(std::begin(ins), std::end(ins), buffer);
+            }
+            return std::size(ins) + handle_exit(pc, Status::Pending, ctx, buffer);
+        }
 
-                // Setup second arg
+        std::size_t handle_callout(Op const &op, std::size_t index, EncodeContext const &ctx, uint8_t *buffer)
+        {
+            uint8_t const enter[]{
+                // Store current register values to |ExecutionEnvironment::regs|
+                0x88, 0x87, 0x00, 0x01, 0x00, 0x00, // mov %al,0x100(%edi)
+                0x88, 0x8f, 0x01, 0x01, 0x00, 0x00, // mov %cl,0x101(%edi)
+                0x88, 0x97, 0x02, 0x01, 0x00, 0x00, // mov %dl,0x102(%edi)
+                0x88, 0x9f, 0x03, 0x01, 0x00, 0x00, // mov %bl,0x103(%edi)
+
+                // Align the stack, keeping hold of the old one
+                0x89, 0xe6,       // mov %esp,%esi
+                0x83, 0xe4, 0xf0, // and $-16,%esp
+                0x83, 0xec, 0x08, // sub $0x8,%esp
+                0x56,             // push %esi
+
+                // Push arg for callout
+                0x57, // push %edi
+            };
+            // Setup call
+            uint8_t const absolute[]{
                 0xb8, 0x00, 0x00, 0x00, 0x00, // mov callout,%eax
             };
-            uint8_t const call_thunk[]{
-                // Push args for thunk
-                0x50, // push %eax (func)
-                0x51, // push %ecx (state)
-
-                // Setup call
-                0xb8, 0x00, 0x00, 0x00, 0x00, // mov thunk,%eax
+            uint8_t const relative[]{
+                0xe8, 0x00, 0x00, 0x00, 0x00,       // call 1f
+                0x58,                               // 1: pop %eax
+                0x8b, 0x80, 0x00, 0x00, 0x00, 0x00, // mov slot-1b(%eax),%eax
             };
             uint8_t const leave[]{
-                // Call into the helper thunk
+                // Call into the callout
                 0xff, 0xd0, // call *%eax
 
-                // Pop args
-                0x58, // pop %eax
-                0x58, // pop %eax
+                // Pop arg and restore the stack, %edi is callee-saved
+                0x83, 0xc4, 0x04, // add $0x4,%esp
+                0x5c,             // pop %esp
 
-                // Read off each register from |NativeState|
-                0x8b, 0x44, 0x24, 0x18, // mov 0x18(%esp),%eax
-                0x8b, 0x4c, 0x24, 0x1c, // mov 0x1c(%esp),%ecx
-                0x8b, 0x54, 0x24, 0x20, // mov 0x20(%esp),%edx
-                0x8b, 0x5c, 0x24, 0x24, // mov 0x24(%esp),%ebx
-                0x8b, 0x7c, 0x24, 0x28, // mov 0x28(%esp),%edi
-
-                // Restore stack
-                0x83, 0xc4, 0x3a, // add $0x3a,%esp
+                // Read back each register from |ExecutionEnvironment::regs|
+                0x0f, 0xb6, 0x87, 0x00, 0x01, 0x00, 0x00, // movzbl 0x100(%edi),%eax
+                0x0f, 0xb6, 0x8f, 0x01, 0x01, 0x00, 0x00, // movzbl 0x101(%edi),%ecx
+                0x0f, 0xb6, 0x97, 0x02, 0x01, 0x00, 0x00, // movzbl 0x102(%edi),%edx
+                0x0f, 0xb6, 0x9f, 0x03, 0x01, 0x00, 0x00, // movzbl 0x103(%edi),%ebx
             };
+            std::size_t const setup = ctx.position_independent ? std::size(relative) : std::size(absolute);
             if (buffer != nullptr)
             {
                 buffer = std::copy(std::begin(enter), std::end(enter), buffer);
-                // Patch callout address
-                memcpy(buffer - 4, &op.func, 4);
-
-                buffer = std::copy(std::begin(call_thunk), std::end(call_thunk), buffer);
-                // Patch thunk address
-                auto *thunk_ptr = static_cast<void (*)(NativeState *, CallOutFunc)>(helper_thunk);
-                memcpy(buffer - 4, &thunk_ptr, 4);
+                if (ctx.position_independent)
+                {
+                    // There's no %eip relative addressing, so the slot's
+                    // distance is from the popped return address
+                    buffer = std::copy(std::begin(relative), std::end(relative), buffer);
+                    if (ctx.relocations != nullptr)
+                    {
+                        ctx.relocations->push_back(Relocation{static_cast<std::size_t>(buffer - 4 - ctx.buffer_base), index, 3});
+                    }
+                }
+                else
+                {
+                    // Patch callout address
+                    buffer = std::copy(std::begin(absolute), std::end(absolute), buffer);
+                    memcpy(buffer - 4, &op.func, 4);
+                    if (ctx.relocations != nullptr)
+                    {
+                        ctx.relocations->push_back(Relocation{static_cast<std::size_t>(buffer - 4 - ctx.buffer_base), index});
+                    }
+                }
 
                 buffer = std::copy(std::begin(leave), std::end(leave), buffer);
             }
-            return std::size(enter) + std::size(call_thunk) + std::size(leave);
+            return std::size(enter) + setup + std::size(leave);
+        }
+
+        std::size_t encode_op(Op const &op, std::size_t index, EncodeContext const &ctx, uint8_t *buffer)
+        {
+            switch (op.type)
+            {
+            case OpType::Nop:
+                return handle_nop(op, buffer);
+
+            case OpType::Load:
+            case OpType::Store:
+                return handle_load_store(op, buffer);
+
+            case OpType::SetReg:
+            case OpType::SetImm:
+                return handle_set(op, buffer);
+
+            case OpType::AddReg:
+            case OpType::AddImm:
+            case OpType::Negate:
+                return handle_arithmetic(op, buffer);
+
+            case OpType::Jump:
+            case OpType::JumpIfZero:
+            case OpType::Call:
+                return handle_jump(op, ctx.buffer_base, buffer, ctx.label_to_offset);
+
+            case OpType::Return:
+                return handle_return(op, buffer);
+
+            case OpType::Label:
+                return 0;
+
+            case OpType::CallOut:
+            {
+                std::size_t const size = handle_callout(op, index, ctx, buffer);
+                return size + handle_pending(index + 1, ctx, buffer != nullptr ? buffer + size : nullptr);
+            }
+
+            case OpType::Yield:
+                return handle_exit(index + 1, Status::Yielded, ctx, buffer);
+            }
+            return 0;
         }
     }
 
@@ -281,41 +490,37 @@ namespace jitlib
     {
         std::size_t preamble(uint8_t *buffer)
         {
-            uint8_t const enter[]{
+            uint8_t enter[]{
                 // Save registers that we will trample.
                 0x53, // push %ebx
                 0x57, // push %edi
                 0x56, // push %esi
+                0x55, // push %ebp
 
-                // Give us some stack
-                0x83, 0xec, 0x20, // sub $0x20,%esp
-
-                // Load |NativeState| address from caller's stack (0x20 + 3*push + 4)
-                0x8b, 0x74, 0x24, 0x30, // mov 0x30(%esp),%esi
+                // Keep hold of the |NativeFrames| below the stack pointer on
+                // entry, from caller's stack (4*push + 12)
+                0xff, 0x74, 0x24, 0x1c, // push 0x1c(%esp)
+                0x89, 0xe5,             // mov %esp,%ebp
 
-                // Read off each register from |NativeState|
-                0x8b, 0x06,             // mov (%esi),%eax
-                0x8b, 0x4e, 0x04,       // mov 0x4(%esi),%ecx
-                0x8b, 0x56, 0x08,       // mov 0x8(%esi),%edx
-                0x8b, 0x5e, 0x0c,       // mov 0xc(%esi),%ebx
-                0x8b, 0x7e, 0x10,       // mov 0x10(%esi),%edi
+                // Load |ExecutionEnvironment| address and entry point from
+                // caller's stack (5*push + 4, 5*push + 8)
+                0x8b, 0x7d, 0x18, // mov 0x18(%ebp),%edi
+                0x8b, 0x75, 0x1c, // mov 0x1c(%ebp),%esi
 
-                // Call into the rest of the code
-                0xe8, 0x00, 0x00, 0x00, 0x00, // call <addr>
+                // Call into the rest of the code, via resume
+                0xe8, 0x00, 0x00, 0x00, 0x00, // call <resume>
             };
             uint8_t const leave[]{
-                // Load |NativeState| address from caller's stack (0x20 + 3*push + 4)
-                0x8b, 0x74, 0x24, 0x30, // mov 0x30(%esp),%esi
-
-                // Store new register values back to |NativeState|
-                0x89, 0x06,       // mov %eax,(%esi)
-                0x89, 0x4e, 0x04, // mov %ecx,0x4(%esi)
-                0x89, 0x56, 0x08, // mov %edx,0x8(%esi)
-                0x89, 0x5e, 0x0c, // mov %ebx,0xc(%esi)
-                0x89, 0x7e, 0x10, // mov %edi,0x10(%esi)
-
-                // Return
-                0x83, 0xc4, 0x20, // add $0x20,%esp
+                // Store new register values back to |ExecutionEnvironment::regs|
+                0x88, 0x87, 0x00, 0x01, 0x00, 0x00, // mov %al,0x100(%edi)
+                0x88, 0x8f, 0x01, 0x01, 0x00, 0x00, // mov %cl,0x101(%edi)
+                0x88, 0x97, 0x02, 0x01, 0x00, 0x00, // mov %dl,0x102(%edi)
+                0x88, 0x9f, 0x03, 0x01, 0x00, 0x00, // mov %bl,0x103(%edi)
+
+                // Return |Status::Returned|
+                0x31, 0xc0,       // xor %eax,%eax
+                0x83, 0xc4, 0x04, // add $4,%esp
+                0x5d,             // pop %ebp
                 0x5e,             // pop %esi
                 0x5f,             // pop %edi
                 0x5b,             // pop %ebx
@@ -326,52 +531,183 @@ namespace jitlib
                 0xcc, // int3
                 0xcc, // int3
             };
+            uint8_t const resume[]{
+                // Push the return addresses of any Calls we're resuming inside
+                0x8b, 0x55, 0x00, // mov (%ebp),%edx
+                0x8b, 0x0a,       // mov (%edx),%ecx
+                0x85, 0xc9,       // 1: test %ecx,%ecx
+                0x74, 0x06,       // jz 2f
+                0xff, 0x34, 0x8a, // push (%edx,%ecx,4)
+                0x49,             // dec %ecx
+                0xeb, 0xf6,       // jmp 1b
+
+                // Read off each register from |ExecutionEnvironment::regs|
+                0x0f, 0xb6, 0x87, 0x00, 0x01, 0x00, 0x00, // 2: movzbl 0x100(%edi),%eax
+                0x0f, 0xb6, 0x8f, 0x01, 0x01, 0x00, 0x00, // movzbl 0x101(%edi),%ecx
+                0x0f, 0xb6, 0x97, 0x02, 0x01, 0x00, 0x00, // movzbl 0x102(%edi),%edx
+                0x0f, 0xb6, 0x9f, 0x03, 0x01, 0x00, 0x00, // movzbl 0x103(%edi),%ebx
+
+                // Start executing
+                0xff, 0xe6, // jmp *%esi
+            };
             if (buffer != nullptr)
             {
+                int32_t const relative_address = static_cast<int32_t>(std::size(leave));
+                memcpy(std::end(enter) - 4, &relative_address, 4);
                 buffer = std::copy(std::begin(enter), std::end(enter), buffer);
-                // Patch call address
-                uint32_t const relative_address = std::size(leave);
-                memcpy(buffer - 4, &relative_address, 4);
                 buffer = std::copy(std::begin(leave), std::end(leave), buffer);
+                buffer = std::copy(std::begin(resume), std::end(resume), buffer);
             }
-            return std::size(enter) + std::size(leave);
+            return std::size(enter) + std::size(leave) + std::size(resume);
         }
 
-        std::size_t encode(Op const &op, uint8_t const *buffer_base, uint8_t *buffer, LabelToOffsetMap const *label_to_offset)
+        std::size_t exit_stub(uint8_t *buffer)
         {
-            switch (op.type)
-            {
-            case OpType::Nop:
-                return handle_nop(op, buffer);
+            uint8_t const ins[]{
+                // Store register values back to |ExecutionEnvironment::regs|
+                0x88, 0x87, 0x00, 0x01, 0x00, 0x00, // mov %al,0x100(%edi)
+                0x88, 0x8f, 0x01, 0x01, 0x00, 0x00, // mov %cl,0x101(%edi)
+                0x88, 0x97, 0x02, 0x01, 0x00, 0x00, // mov %dl,0x102(%edi)
+                0x88, 0x9f, 0x03, 0x01, 0x00, 0x00, // mov %bl,0x103(%edi)
+
+                // Split %esi into |ExecutionEnvironment::pc| and the status
+                0x89, 0xf0,                         // mov %esi,%eax
+                0x88, 0x87, 0x04, 0x01, 0x00, 0x00, // mov %al,0x104(%edi)
+                0xc1, 0xe8, 0x08,                   // shr $8,%eax
+
+                // Copy out the return addresses of the Calls we're in, from
+                // the top of the stack down to the one returning to the
+                // preamble, keeping at most kMaxCallDepth
+                0x8b, 0x55, 0x00,                      // mov (%ebp),%edx
+                0x8d, 0x4d, 0xfc,                      // lea -4(%ebp),%ecx
+                0x29, 0xe1,                            // sub %esp,%ecx
+                0xc1, 0xe9, 0x02,                      // shr $2,%ecx
+                0x89, 0x0a,                            // mov %ecx,(%edx)
+                0x83, 0xf9, kMaxCallDepth,             // cmp $kMaxCallDepth,%ecx
+                0x76, 0x05,                            // jbe 1f
+                0xb9, kMaxCallDepth, 0x00, 0x00, 0x00, // mov $kMaxCallDepth,%ecx
+                0x85, 0xc9,                            // 1: test %ecx,%ecx
+                0x74, 0x0a,                            // jz 2f
+                0x5b,                                  // pop %ebx
+                0x89, 0x5a, 0x04,                      // mov %ebx,4(%edx)
+                0x83, 0xc2, 0x04,                      // add $4,%edx
+                0x49,                                  // dec %ecx
+                0xeb, 0xf2,                            // jmp 1b
 
-            case OpType::Load:
-            case OpType::Store:
-                return handle_load_store(op, buffer);
+                // Return
+                0x89, 0xec,       // 2: mov %ebp,%esp
+                0x83, 0xc4, 0x04, // add $4,%esp
+                0x5d,             // pop %ebp
+                0x5e,             // pop %esi
+                0x5f,             // pop %edi
+                0x5b,             // pop %ebx
+                0xc3,             // ret
 
-            case OpType::SetReg:
-            case OpType::SetImm:
-                return handle_set(op, buffer);
+                // Safety guard
+                0xcc, // int3
+                0xcc, // int3
+                0xcc, // int3
+            };
+            if (buffer != nullptr)
+            {
+                std::copy(std::begin(ins), std::end(ins), buffer);
+            }
+            return std::size(ins);
+        }
 
-            case OpType::AddReg:
-            case OpType::AddImm:
-            case OpType::Negate:
-                return handle_arithmetic(op, buffer);
+        std::size_t exit(std::size_t pc, Status status, EncodeContext const &ctx, uint8_t *buffer)
+        {
+            return handle_exit(pc, status, ctx, buffer);
+        }
 
-            case OpType::Jump:
-            case OpType::JumpIfZero:
-            case OpType::Call:
-                return handle_jump(op, buffer_base, buffer, label_to_offset);
+        std::size_t encode_conditional(Op const &jump, Op const *ops, std::size_t count, uint8_t *buffer)
+        {
+            auto reg = encode_reg(jump.regA);
+            uint8_t const test[]{
+                // test reg reg
+                0x85, uint8_t(0xc0 | (reg << 3) | reg),
+            };
+            std::size_t size = std::size(test);
+            if (buffer != nullptr)
+            {
+                std::copy(std::begin(test), std::end(test), buffer);
+            }
+            for (std::size_t i = 0; i < count; i++)
+            {
+                size += handle_conditional(ops[i], buffer != nullptr ? buffer + size : nullptr);
+            }
+            return size;
+        }
 
-            case OpType::Return:
-                return handle_return(op, buffer);
+        std::size_t pad(std::size_t length, uint8_t *buffer)
+        {
+            // Recommended multi-byte nops, indexed by length.
+            static uint8_t const nops[][8]{
+                {},
+                {0x90},
+                {0x66, 0x90},
+                {0x0f, 0x1f, 0x00},
+                {0x0f, 0x1f, 0x40, 0x00},
+                {0x0f, 0x1f, 0x44, 0x00, 0x00},
+                {0x66, 0x0f, 0x1f, 0x44, 0x00, 0x00},
+                {0x0f, 0x1f, 0x80, 0x00, 0x00, 0x00, 0x00},
+            };
+            if (buffer != nullptr)
+            {
+                for (std::size_t remaining = length; remaining != 0;)
+                {
+                    std::size_t const chunk = std::min(remaining, std::size(nops) - 1);
+                    buffer = std::copy(nops[chunk], nops[chunk] + chunk, buffer);
+                    remaining -= chunk;
+                }
+            }
+            return length;
+        }
 
-            case OpType::Label:
-                return 0;
+        std::size_t jump(std::size_t offset, EncodeContext const &ctx, uint8_t *buffer)
+        {
+            uint8_t ins[]{
+                // jmp <offset>
+                0xe9, 0x00, 0x00, 0x00, 0x00};
+            if (buffer != nullptr)
+            {
+                int32_t const relative_address = static_cast<int32_t>(offset - (buffer + std::size(ins) - ctx.buffer_base));
+                memcpy(std::end(ins) - 4, &relative_address, 4);
+                std::copy(std::begin(ins), std::end(ins), buffer);
+            }
+            return std::size(ins);
+        }
 
-            case OpType::CallOut:
-                return handle_callout(op, buffer);
+        std::size_t encode(Op const &op, std::size_t index, EncodeContext const &ctx, uint8_t *buffer)
+        {
+            auto at = [&](std::size_t offset)
+            { return buffer != nullptr ? buffer + offset : nullptr; };
+            std::size_t size = 0;
+            if (ctx.charges != nullptr && (*ctx.charges)[index])
+            {
+                size += handle_charge(index, ctx, buffer);
             }
-            return 0;
+            if (ctx.counters != nullptr)
+            {
+                // Only once it's not going to stop for fuel and run it again
+                size += handle_count(&ctx.counters->executed[index], at(size));
+            }
+            if (ctx.memory_counters != nullptr && op.type == OpType::Load)
+            {
+                size += handle_count(&ctx.memory_counters->accesses[index], at(size));
+                size += handle_access(ctx.memory_counters->reads.data(), encode_reg(op.regB), at(size));
+            }
+            else if (ctx.memory_counters != nullptr && op.type == OpType::Store)
+            {
+                size += handle_count(&ctx.memory_counters->accesses[index], at(size));
+                size += handle_access(ctx.memory_counters->writes.data(), encode_reg(op.regA), at(size));
+            }
+            size += encode_op(op, index, ctx, at(size));
+            if (ctx.counters != nullptr && op.type == OpType::JumpIfZero)
+            {
+                size += handle_count(&ctx.counters->fell_through[index], at(size));
+            }
+            return size;
         }
     }
 }
@@ -1,10 +1,19 @@
 #include <jitlib/jitlib.h>
 
+#include <algorithm>
+#include <atomic>
 #include <cstdio>
 #include <cstdlib>
+#include <filesystem>
+#include <fstream>
+#include <memory>
 #include <optional>
 #include <source_location>
+#include <stdexcept>
+#include <sys/epoll.h>
+#include <unistd.h>
 #include <string>
+#include <thread>
 #include <vector>
 
 namespace tests
@@ -13,6 +22,7 @@ namespace tests
     {
         std::vector<std::string> errors;
         bool jit;
+        jitlib::CompileOptions options;
     };
     struct TestCase
     {
@@ -29,7 +39,10 @@ namespace tests
     static void _test_func_##name([[maybe_unused]] tests::TestArgs &_test_args)
 
 #define RUN_OPS(ops, env) \
-    tests::run_ops(_test_args.jit, ops, env)
+    tests::run_ops(_test_args, ops, env)
+
+#define RUN_OPS_FROM(ops, label, env) \
+    tests::run_ops_from(_test_args, ops, label, env)
 
 #define CHECK_IMPL(lhs, rhs, op, fail)                                                                                                                                        \
     do                                                                                                                                                                        \
@@ -49,15 +62,35 @@ namespace tests
 #define CHECK_EQ(lhs, rhs) CHECK_IMPL(lhs, rhs, !=, false)
 #define REQUIRE_EQ(lhs, rhs) CHECK_IMPL(lhs, rhs, !=, true)
 
+    struct TestMode
+    {
+        const char *name;
+        bool jit;
+        std::optional<jitlib::CpuFeatures> features;
+        bool lazy = false;
+        std::size_t threads = 1;
+    };
+
     bool run_tests()
     {
+        TestMode const modes[]{
+            {"interpreter", false, std::nullopt},
+            {"jitter", true, std::nullopt},
+            {"jitter baseline", true, jitlib::CpuFeatures{}},
+            {"jitter lazy", true, std::nullopt, true},
+            {"jitter parallel", true, std::nullopt, false, 4},
+        };
+
         bool success = true;
         for (TestCase const *test : TestCase::s_tests)
         {
-            for (bool jit : {false, true})
+            for (TestMode const &mode : modes)
             {
                 TestArgs args;
-                args.jit = jit;
+                args.jit = mode.jit;
+                args.options.features = mode.features;
+                args.options.lazy = mode.lazy;
+                args.options.threads = mode.threads;
                 try
                 {
                     test->func(args);
@@ -68,7 +101,7 @@ namespace tests
                 }
                 if (!args.errors.empty())
                 {
-                    printf("Test %s failed (%s):\n", test->name, jit ? "jitter" : "interpreter");
+                    printf("Test %s failed (%s):\n", test->name, mode.name);
                     for (auto const &error : args.errors)
                     {
                         printf("  %s\n", error.c_str());
@@ -80,16 +113,29 @@ namespace tests
         return success;
     }
 
-    void run_ops(bool jit, jitlib::Ops const &ops, jitlib::ExecutionEnvironment &env)
+    jitlib::Status run_ops(TestArgs const &args, jitlib::Ops const &ops, jitlib::ExecutionEnvironment &env)
     {
-        if (jit)
+        if (args.jit)
         {
-            auto code = jitlib::compile(ops);
-            code.run(env);
+            auto code = jitlib::compile(ops, args.options);
+            return code.run(env);
         }
         else
         {
-            jitlib::run(ops, env);
+            return jitlib::run(ops, env);
+        }
+    }
+
+    jitlib::Status run_ops_from(TestArgs const &args, jitlib::Ops const &ops, jitlib::Label const &label, jitlib::ExecutionEnvironment &env)
+    {
+        if (args.jit)
+        {
+            auto code = jitlib::compile(ops, args.options);
+            return code.run_from(label, env);
+        }
+        else
+        {
+            return jitlib::run_from(ops, label, env);
         }
     }
 }
@@ -191,6 +237,28 @@ TEST_CASE(test_load_store)
     CHECK_EQ(env.mem[10], 9);
 }
 
+TEST_CASE(test_store_width)
+{
+    jitlib::Ops const ops{
+        jitlib::Op::make_Store(0, 1), // m[r0] = r1
+        jitlib::Op::make_Store(2, 1), // m[r2] = r1
+        jitlib::Op::make_Load(3, 0),  // r3 = m[r0]
+        jitlib::Op::make_Return(),
+    };
+
+    jitlib::ExecutionEnvironment env{};
+    env.regs[0] = 10;
+    env.regs[1] = 9;
+    env.regs[2] = 255;
+    env.mem[11] = 5;
+    RUN_OPS(ops, env);
+    CHECK_EQ(env.mem[10], 9);
+    CHECK_EQ(env.mem[11], 5);
+    CHECK_EQ(env.mem[255], 9);
+    CHECK_EQ(env.regs[0], 10);
+    CHECK_EQ(env.regs[3], 9);
+}
+
 TEST_CASE(test_add)
 {
     jitlib::Ops const ops{
@@ -283,6 +351,71 @@ TEST_CASE(test_jump_if_zero)
     CHECK_EQ(env.regs[2], 2);
 }
 
+TEST_CASE(test_jump_if_zero_short)
+{
+    for (int i = 0; i <= 1; i++)
+    {
+        jitlib::Ops const ops{
+            jitlib::Op::make_SetImm(0, i),          // r0 = i
+            jitlib::Op::make_SetImm(1, 3),          // r1 = 3
+            jitlib::Op::make_SetImm(2, 5),          // r2 = 5
+            jitlib::Op::make_JumpIfZero(0, "test"), // r0 == 0, jmp over
+            jitlib::Op::make_AddReg(1, 2),          // r1 += r2
+            jitlib::Op::make_Nop(),                 //
+            jitlib::Op::make_Negate(2),             // r2 = -r2
+            jitlib::Op::make_Label("test"),         //
+            jitlib::Op::make_AddImm(3, 1),          // r3 += 1
+            jitlib::Op::make_Return(),
+        };
+
+        jitlib::ExecutionEnvironment env{};
+        RUN_OPS(ops, env);
+        CHECK_EQ(env.regs[0], i);
+        CHECK_EQ(env.regs[1], i ? 8 : 3);
+        CHECK_EQ(env.regs[2], i ? 251 : 5);
+        CHECK_EQ(env.regs[3], 1);
+    }
+}
+
+TEST_CASE(test_jump_if_zero_short_self)
+{
+    for (int i = 0; i <= 255; i += 51)
+    {
+        jitlib::Ops const ops{
+            jitlib::Op::make_SetImm(0, i),          // r0 = i
+            jitlib::Op::make_JumpIfZero(0, "test"), // r0 == 0, jmp over
+            jitlib::Op::make_AddImm(0, 205),        // r0 += 205
+            jitlib::Op::make_SetReg(1, 0),          // r1 = r0
+            jitlib::Op::make_Label("test"),         //
+            jitlib::Op::make_Return(),
+        };
+
+        jitlib::ExecutionEnvironment env{};
+        RUN_OPS(ops, env);
+        CHECK_EQ(env.regs[0], i ? (i + 205) % 256 : 0);
+        CHECK_EQ(env.regs[1], i ? (i + 205) % 256 : 0);
+    }
+}
+
+TEST_CASE(test_loop)
+{
+    jitlib::Ops const ops{
+        jitlib::Op::make_SetImm(0, 10),         // r0 = 10
+        jitlib::Op::make_Label("loop"),         //
+        jitlib::Op::make_AddImm(1, 3),          // r1 += 3
+        jitlib::Op::make_AddImm(0, 255),        // r0 -= 1
+        jitlib::Op::make_JumpIfZero(0, "done"), // r0 == 0, jmp out
+        jitlib::Op::make_Jump("loop"),          // jmp back
+        jitlib::Op::make_Label("done"),         //
+        jitlib::Op::make_Return(),
+    };
+
+    jitlib::ExecutionEnvironment env{};
+    RUN_OPS(ops, env);
+    CHECK_EQ(env.regs[0], 0);
+    CHECK_EQ(env.regs[1], 30);
+}
+
 TEST_CASE(test_call)
 {
     jitlib::Ops const ops{
@@ -300,6 +433,46 @@ TEST_CASE(test_call)
     CHECK_EQ(env.regs[1], 8);
 }
 
+TEST_CASE(test_entry_pc)
+{
+    jitlib::Ops const ops{
+        jitlib::Op::make_SetImm(0, 1), // r0 = 1
+        jitlib::Op::make_SetImm(1, 2), // r1 = 2
+        jitlib::Op::make_SetImm(2, 3), // r2 = 3
+        jitlib::Op::make_Return(),
+    };
+
+    jitlib::ExecutionEnvironment env{};
+    env.pc = 1;
+    RUN_OPS(ops, env);
+    CHECK_EQ(env.regs[0], 0);
+    CHECK_EQ(env.regs[1], 2);
+    CHECK_EQ(env.regs[2], 3);
+}
+
+TEST_CASE(test_run_from)
+{
+    jitlib::Ops const ops{
+        jitlib::Op::make_Label("first"),
+        jitlib::Op::make_AddImm(0, 1), // r0 += 1
+        jitlib::Op::make_Return(),
+        jitlib::Op::make_Label("second"),
+        jitlib::Op::make_AddImm(1, 1), // r1 += 1
+        jitlib::Op::make_Call("first"),
+        jitlib::Op::make_Return(),
+    };
+
+    jitlib::ExecutionEnvironment env{};
+    RUN_OPS_FROM(ops, "second", env);
+    CHECK_EQ(env.pc, 3);
+    CHECK_EQ(env.regs[0], 1);
+    CHECK_EQ(env.regs[1], 1);
+    RUN_OPS_FROM(ops, "first", env);
+    CHECK_EQ(env.pc, 0);
+    CHECK_EQ(env.regs[0], 2);
+    CHECK_EQ(env.regs[1], 1);
+}
+
 TEST_CASE(test_call_out)
 {
     using UserData = int;
@@ -337,6 +510,1574 @@ TEST_CASE(test_call_out)
     CHECK_EQ(env.regs[3], 8);
 }
 
+TEST_CASE(test_call_out_nested)
+{
+    auto func = [](jitlib::ExecutionEnvironment &env)
+    {
+        env.regs[0] += 1;
+    };
+
+    jitlib::Ops const ops{
+        jitlib::Op::make_Call("one"),
+        jitlib::Op::make_Return(),
+        jitlib::Op::make_Label("one"),
+        jitlib::Op::make_CallOut(func),
+        jitlib::Op::make_Call("two"),
+        jitlib::Op::make_Return(),
+        jitlib::Op::make_Label("two"),
+        jitlib::Op::make_CallOut(func),
+        jitlib::Op::make_Return(),
+    };
+
+    jitlib::ExecutionEnvironment env{};
+    RUN_OPS(ops, env);
+    CHECK_EQ(env.regs[0], 2);
+}
+
+TEST_CASE(test_fuel_loop)
+{
+    jitlib::Ops const ops{
+        jitlib::Op::make_Label("loop"),
+        jitlib::Op::make_AddImm(0, 1), // r0 += 1
+        jitlib::Op::make_Jump("loop"), // jmp back, forever
+    };
+
+    _test_args.options.metered = true;
+    jitlib::ExecutionEnvironment env{};
+    env.fuel = 10;
+    REQUIRE_EQ(static_cast<int>(RUN_OPS(ops, env)), static_cast<int>(jitlib::Status::OutOfFuel));
+    CHECK_EQ(env.fuel, 0u);
+    int const first = env.regs[0];
+    CHECK_EQ(first != 0, true);
+
+    // Picks up where it left off
+    env.fuel = 10;
+    REQUIRE_EQ(static_cast<int>(RUN_OPS(ops, env)), static_cast<int>(jitlib::Status::OutOfFuel));
+    CHECK_EQ(env.regs[0] > first, true);
+}
+
+TEST_CASE(test_fuel_resume)
+{
+    jitlib::Ops const ops{
+        jitlib::Op::make_SetImm(0, 200),        // r0 = 200
+        jitlib::Op::make_Label("loop"),         //
+        jitlib::Op::make_AddImm(1, 1),          // r1 += 1
+        jitlib::Op::make_AddImm(0, 255),        // r0 -= 1
+        jitlib::Op::make_JumpIfZero(0, "done"), // r0 == 0, jmp out
+        jitlib::Op::make_Jump("loop"),          // jmp back
+        jitlib::Op::make_Label("done"),         //
+        jitlib::Op::make_Return(),
+    };
+
+    _test_args.options.metered = true;
+    jitlib::ExecutionEnvironment env{};
+    int slices = 0;
+    for (;; slices++)
+    {
+        env.fuel = 16;
+        if (RUN_OPS(ops, env) == jitlib::Status::Returned)
+        {
+            break;
+        }
+    }
+    CHECK_EQ(slices > 1, true);
+    CHECK_EQ(env.regs[0], 0);
+    CHECK_EQ(env.regs[1], 200);
+}
+
+TEST_CASE(test_fuel_recursion)
+{
+    jitlib::Ops const ops{
+        jitlib::Op::make_Label("self"),
+        jitlib::Op::make_AddImm(0, 1), // r0 += 1
+        jitlib::Op::make_Call("self"), // recurse, forever
+        jitlib::Op::make_Return(),
+    };
+
+    _test_args.options.metered = true;
+    jitlib::ExecutionEnvironment env{};
+    env.fuel = 50;
+    CHECK_EQ(static_cast<int>(RUN_OPS(ops, env)), static_cast<int>(jitlib::Status::OutOfFuel));
+    CHECK_EQ(env.regs[0] != 0, true);
+}
+
+TEST_CASE(test_fuel_unlimited)
+{
+    jitlib::Ops const ops{
+        jitlib::Op::make_SetImm(0, 10),         // r0 = 10
+        jitlib::Op::make_Label("loop"),         //
+        jitlib::Op::make_AddImm(0, 255),        // r0 -= 1
+        jitlib::Op::make_JumpIfZero(0, "done"), // r0 == 0, jmp out
+        jitlib::Op::make_Jump("loop"),          // jmp back
+        jitlib::Op::make_Label("done"),         //
+        jitlib::Op::make_Return(),
+    };
+
+    _test_args.options.metered = true;
+    jitlib::ExecutionEnvironment env{};
+    CHECK_EQ(static_cast<int>(RUN_OPS(ops, env)), static_cast<int>(jitlib::Status::Returned));
+    CHECK_EQ(env.fuel, 0u);
+    CHECK_EQ(env.regs[0], 0);
+}
+
+TEST_CASE(test_fuel_resume_nested)
+{
+    jitlib::Ops const ops{
+        jitlib::Op::make_SetImm(0, 5),          // r0 = 5
+        jitlib::Op::make_Label("self"),         //
+        jitlib::Op::make_AddImm(0, 255),        // r0 -= 1
+        jitlib::Op::make_JumpIfZero(0, "done"), // r0 == 0, jmp out
+        jitlib::Op::make_Call("self"),          // recurse
+        jitlib::Op::make_AddImm(1, 1),          // r1 += 1
+        jitlib::Op::make_Label("done"),         //
+        jitlib::Op::make_Return(),
+    };
+
+    _test_args.options.metered = true;
+    jitlib::ExecutionEnvironment env{};
+    int slices = 0;
+    for (;; slices++)
+    {
+        env.fuel = 2;
+        if (RUN_OPS(ops, env) == jitlib::Status::Returned)
+        {
+            break;
+        }
+    }
+    CHECK_EQ(slices > 1, true);
+    CHECK_EQ(env.depth, 0);
+    CHECK_EQ(env.regs[0], 0);
+    CHECK_EQ(env.regs[1], 4);
+}
+
+TEST_CASE(test_yield)
+{
+    jitlib::Ops const ops{
+        jitlib::Op::make_SetImm(0, 1), // r0 = 1
+        jitlib::Op::make_Yield(),
+        jitlib::Op::make_AddImm(0, 1), // r0 += 1
+        jitlib::Op::make_Return(),
+    };
+
+    jitlib::ExecutionEnvironment env{};
+    REQUIRE_EQ(static_cast<int>(RUN_OPS(ops, env)), static_cast<int>(jitlib::Status::Yielded));
+    CHECK_EQ(env.pc, 2);
+    CHECK_EQ(env.regs[0], 1);
+    REQUIRE_EQ(static_cast<int>(RUN_OPS(ops, env)), static_cast<int>(jitlib::Status::Returned));
+    CHECK_EQ(env.regs[0], 2);
+}
+
+TEST_CASE(test_yield_nested)
+{
+    jitlib::Ops const ops{
+        jitlib::Op::make_Call("one"),
+        jitlib::Op::make_AddImm(1, 1), // r1 += 1
+        jitlib::Op::make_Return(),
+        jitlib::Op::make_Label("one"),
+        jitlib::Op::make_Call("two"),
+        jitlib::Op::make_AddImm(2, 1), // r2 += 1
+        jitlib::Op::make_Return(),
+        jitlib::Op::make_Label("two"),
+        jitlib::Op::make_Yield(),
+        jitlib::Op::make_AddImm(3, 1), // r3 += 1
+        jitlib::Op::make_Return(),
+    };
+
+    jitlib::ExecutionEnvironment env{};
+    REQUIRE_EQ(static_cast<int>(RUN_OPS(ops, env)), static_cast<int>(jitlib::Status::Yielded));
+    CHECK_EQ(env.pc, 9);
+    REQUIRE_EQ(env.depth, 2);
+    CHECK_EQ(env.calls[0], 1);
+    CHECK_EQ(env.calls[1], 5);
+    REQUIRE_EQ(static_cast<int>(RUN_OPS(ops, env)), static_cast<int>(jitlib::Status::Returned));
+    CHECK_EQ(env.depth, 0);
+    CHECK_EQ(env.regs[1], 1);
+    CHECK_EQ(env.regs[2], 1);
+    CHECK_EQ(env.regs[3], 1);
+}
+
+TEST_CASE(test_yield_loop)
+{
+    jitlib::Ops const ops{
+        jitlib::Op::make_SetImm(0, 10),         // r0 = 10
+        jitlib::Op::make_Label("loop"),         //
+        jitlib::Op::make_Call("step"),          //
+        jitlib::Op::make_JumpIfZero(0, "done"), // r0 == 0, jmp out
+        jitlib::Op::make_Jump("loop"),          // jmp back
+        jitlib::Op::make_Label("done"),         //
+        jitlib::Op::make_Return(),
+        jitlib::Op::make_Label("step"),
+        jitlib::Op::make_AddImm(0, 255), // r0 -= 1
+        jitlib::Op::make_Yield(),
+        jitlib::Op::make_AddImm(1, 1), // r1 += 1
+        jitlib::Op::make_Return(),
+    };
+
+    jitlib::ExecutionEnvironment env{};
+    int yields = 0;
+    while (RUN_OPS(ops, env) == jitlib::Status::Yielded)
+    {
+        CHECK_EQ(env.regs[1], yields);
+        yields++;
+    }
+    CHECK_EQ(yields, 10);
+    CHECK_EQ(env.regs[0], 0);
+    CHECK_EQ(env.regs[1], 10);
+}
+
+TEST_CASE(test_resume_too_deep)
+{
+    jitlib::Ops const ops{
+        jitlib::Op::make_Return(),
+    };
+
+    // Only kMaxCallDepth Calls fit in |calls|, whatever |depth| says
+    jitlib::ExecutionEnvironment env{};
+    env.depth = jitlib::kMaxCallDepth + 1;
+    bool threw = false;
+    try
+    {
+        RUN_OPS(ops, env);
+    }
+    catch (std::out_of_range const &)
+    {
+        threw = true;
+    }
+    CHECK_EQ(threw, true);
+}
+
+TEST_CASE(test_scheduler)
+{
+    jitlib::Ops const ops{
+        jitlib::Op::make_SetImm(0, 200),        // r0 = 200
+        jitlib::Op::make_Label("loop"),         //
+        jitlib::Op::make_AddImm(1, 1),          // r1 += 1
+        jitlib::Op::make_AddImm(0, 255),        // r0 -= 1
+        jitlib::Op::make_JumpIfZero(0, "done"), // r0 == 0, jmp out
+        jitlib::Op::make_Yield(),               //
+        jitlib::Op::make_Jump("loop"),          // jmp back
+        jitlib::Op::make_Label("done"),         //
+        jitlib::Op::make_Return(),
+    };
+
+    _test_args.options.metered = true;
+    auto const code = jitlib::compile(ops, _test_args.options);
+
+    jitlib::Scheduler::Options options;
+    options.workers = 4;
+    jitlib::Scheduler scheduler(options);
+    std::vector<jitlib::Scheduler::TaskId> tasks;
+    for (int i = 0; i < 64; i++)
+    {
+        jitlib::ExecutionEnvironment env{};
+        env.regs[2] = static_cast<jitlib::Value>(i);
+        tasks.push_back(_test_args.jit ? scheduler.spawn(code, env) : scheduler.spawn(ops, env));
+    }
+    scheduler.wait();
+    for (int i = 0; i < 64; i++)
+    {
+        auto const &env = scheduler.environment(tasks[i]);
+        CHECK_EQ(env.regs[0], 0);
+        CHECK_EQ(env.regs[1], 200);
+        CHECK_EQ(env.regs[2], i);
+        CHECK_EQ(scheduler.stats(tasks[i]).slices, 200u);
+    }
+}
+
+TEST_CASE(test_scheduler_preempt)
+{
+    // The first task spins until the second runs, so with a single worker
+    // it has to be preempted.
+    auto poll = [](jitlib::ExecutionEnvironment &env)
+    {
+        env.regs[0] = static_cast<std::atomic<bool> *>(env.userdata)->load();
+    };
+    auto set = [](jitlib::ExecutionEnvironment &env)
+    {
+        static_cast<std::atomic<bool> *>(env.userdata)->store(true);
+    };
+    jitlib::Ops const spin{
+        jitlib::Op::make_Label("loop"),
+        jitlib::Op::make_CallOut(poll),         // r0 = flag
+        jitlib::Op::make_JumpIfZero(0, "loop"), // !r0, jmp back
+        jitlib::Op::make_Return(),
+    };
+    jitlib::Ops const release{
+        jitlib::Op::make_CallOut(set), // flag = true
+        jitlib::Op::make_Return(),
+    };
+
+    _test_args.options.metered = true;
+    auto const spin_code = jitlib::compile(spin, _test_args.options);
+    auto const release_code = jitlib::compile(release, _test_args.options);
+
+    std::atomic<bool> flag = false;
+    jitlib::Scheduler::Options options;
+    options.workers = 1;
+    options.time_slice = std::chrono::microseconds(100);
+    jitlib::Scheduler scheduler(options);
+    jitlib::ExecutionEnvironment env{};
+    env.userdata = &flag;
+    auto const spinner = _test_args.jit ? scheduler.spawn(spin_code, env) : scheduler.spawn(spin, env);
+    auto const releaser = _test_args.jit ? scheduler.spawn(release_code, env) : scheduler.spawn(release, env);
+    scheduler.wait();
+    CHECK_EQ(scheduler.environment(spinner).regs[0], 1);
+    CHECK_EQ(scheduler.stats(spinner).slices >= 2, true);
+    CHECK_EQ(scheduler.stats(releaser).slices, 1u);
+    CHECK_EQ(scheduler.stats(spinner).cpu_time.count() > 0, true);
+    CHECK_EQ(scheduler.stats(releaser).queue_latency.count() > 0, true);
+}
+
+TEST_CASE(test_pending)
+{
+    auto func = [](jitlib::ExecutionEnvironment &env)
+    {
+        env.regs[0] += 1;
+        env.pending = env.regs[0] == 1;
+    };
+
+    jitlib::Ops const ops{
+        jitlib::Op::make_Call("sub"),
+        jitlib::Op::make_Return(),
+        jitlib::Op::make_Label("sub"),
+        jitlib::Op::make_CallOut(func), // r0 += 1, pending the first time
+        jitlib::Op::make_AddImm(1, 1),  // r1 += 1
+        jitlib::Op::make_Return(),
+    };
+
+    jitlib::ExecutionEnvironment env{};
+    REQUIRE_EQ(static_cast<int>(RUN_OPS(ops, env)), static_cast<int>(jitlib::Status::Pending));
+    CHECK_EQ(env.pc, 4);
+    CHECK_EQ(env.depth, 1);
+    CHECK_EQ(env.pending, false);
+    CHECK_EQ(env.regs[0], 1);
+    CHECK_EQ(env.regs[1], 0);
+    CHECK_EQ(static_cast<int>(RUN_OPS(ops, env)), static_cast<int>(jitlib::Status::Returned));
+    CHECK_EQ(env.regs[0], 1);
+    CHECK_EQ(env.regs[1], 1);
+}
+
+namespace
+{
+    // Reads a byte from the fd in |env.userdata| into r0 once it's ready
+    void read_byte(jitlib::ExecutionEnvironment &env)
+    {
+        jitlib::await_fd(env, *static_cast<int *>(env.userdata), EPOLLIN, [](jitlib::ExecutionEnvironment &env)
+                         {
+                             char byte = 0;
+                             if (read(*static_cast<int *>(env.userdata), &byte, 1) == 1)
+                             {
+                                 env.regs[0] = static_cast<jitlib::Value>(byte);
+                             } });
+    }
+
+    jitlib::Task<jitlib::Status> write_byte(int fd, char byte)
+    {
+        co_await jitlib::EventLoop::current().wait(fd, EPOLLOUT);
+        co_return write(fd, &byte, 1) == 1 ? jitlib::Status::Returned : jitlib::Status::Pending;
+    }
+
+    jitlib::Ops const read_ops{
+        jitlib::Op::make_CallOut(read_byte), // r0 = byte
+        jitlib::Op::make_AddImm(0, 1),       // r0 += 1
+        jitlib::Op::make_Return(),
+    };
+}
+
+TEST_CASE(test_async_pipe)
+{
+    int fds[2];
+    REQUIRE_EQ(pipe(fds), 0);
+    auto const code = jitlib::compile(read_ops, _test_args.options);
+
+    jitlib::ExecutionEnvironment env{};
+    env.userdata = &fds[0];
+    jitlib::EventLoop loop;
+    loop.spawn(_test_args.jit ? jitlib::run_async(code, env) : jitlib::run_async(read_ops, env));
+    loop.spawn(write_byte(fds[1], 41));
+    loop.run();
+    close(fds[0]);
+    close(fds[1]);
+    CHECK_EQ(env.regs[0], 42);
+}
+
+TEST_CASE(test_async_file)
+{
+    FILE *file = tmpfile();
+    REQUIRE_EQ(file != nullptr, true);
+    int fd = fileno(file);
+    REQUIRE_EQ(write(fd, "\x09", 1), 1);
+    REQUIRE_EQ(lseek(fd, 0, SEEK_SET), 0);
+    auto const code = jitlib::compile(read_ops, _test_args.options);
+
+    jitlib::ExecutionEnvironment env{};
+    env.userdata = &fd;
+    jitlib::EventLoop loop;
+    auto const status = loop.run(_test_args.jit ? jitlib::run_async(code, env) : jitlib::run_async(read_ops, env));
+    fclose(file);
+    CHECK_EQ(static_cast<int>(status), static_cast<int>(jitlib::Status::Returned));
+    CHECK_EQ(env.regs[0], 10);
+}
+
+TEST_CASE(test_patch_in_place)
+{
+    auto add_one = [](jitlib::ExecutionEnvironment &env)
+    {
+        env.regs[2] += 1;
+    };
+    auto add_two = [](jitlib::ExecutionEnvironment &env)
+    {
+        env.regs[2] += 2;
+    };
+
+    jitlib::Ops ops{
+        jitlib::Op::make_SetImm(0, 1),    // r0 = 1
+        jitlib::Op::make_AddImm(0, 2),    // r0 += 2
+        jitlib::Op::make_CallOut(add_one), // r2 += 1
+        jitlib::Op::make_Jump("a"),       // jmp a
+        jitlib::Op::make_Label("b"),      //
+        jitlib::Op::make_SetImm(1, 5),    // r1 = 5
+        jitlib::Op::make_Return(),        //
+        jitlib::Op::make_Label("a"),      //
+        jitlib::Op::make_SetImm(1, 7),    // r1 = 7
+        jitlib::Op::make_Return(),
+    };
+    _test_args.options.lazy = false;
+    auto code = jitlib::compile(ops, _test_args.options);
+    jitlib::ExecutionEnvironment env{};
+    code.run(env);
+    CHECK_EQ(env.regs[0], 3);
+    CHECK_EQ(env.regs[1], 7);
+    CHECK_EQ(env.regs[2], 1);
+
+    ops[0] = jitlib::Op::make_SetImm(0, 10);
+    ops[1] = jitlib::Op::make_AddImm(0, 20);
+    ops[2] = jitlib::Op::make_CallOut(add_two);
+    ops[3] = jitlib::Op::make_Jump("b");
+    auto const result = code.patch(ops);
+    CHECK_EQ(result.patched, 4u);
+    CHECK_EQ(result.relocated, 0u);
+    CHECK_EQ(result.recompiled, false);
+
+    env = {};
+    code.run(env);
+    CHECK_EQ(env.regs[0], 30);
+    CHECK_EQ(env.regs[1], 5);
+    CHECK_EQ(env.regs[2], 2);
+}
+
+TEST_CASE(test_patch_relocate)
+{
+    jitlib::Ops ops{
+        jitlib::Op::make_SetImm(0, 10),         // r0 = 10
+        jitlib::Op::make_Label("loop"),         //
+        jitlib::Op::make_AddImm(1, 1),          // r1 += 1
+        jitlib::Op::make_AddImm(0, 255),        // r0 -= 1
+        jitlib::Op::make_JumpIfZero(0, "done"), // r0 == 0, jmp out
+        jitlib::Op::make_Jump("loop"),          // jmp back
+        jitlib::Op::make_Label("done"),         //
+        jitlib::Op::make_Return(),
+    };
+    _test_args.options.metered = true;
+    _test_args.options.lazy = false;
+    auto code = jitlib::compile(ops, _test_args.options);
+
+    // Stop part way round the loop, then change what it does
+    jitlib::ExecutionEnvironment env{};
+    env.fuel = 5;
+    REQUIRE_EQ(static_cast<int>(code.run(env)), static_cast<int>(jitlib::Status::OutOfFuel));
+    auto const first = env.regs[1];
+
+    ops[2] = jitlib::Op::make_Store(0, 0); // mem[r0] = r0
+    auto result = code.patch(ops);
+    CHECK_EQ(result.patched, 0u);
+    CHECK_EQ(result.relocated, 1u);
+    CHECK_EQ(result.recompiled, false);
+
+    env.fuel = 0;
+    CHECK_EQ(static_cast<int>(code.run(env)), static_cast<int>(jitlib::Status::Returned));
+    CHECK_EQ(env.regs[0], 0);
+    CHECK_EQ(env.regs[1], first);
+    for (int i = 1; i < 10; i++)
+    {
+        CHECK_EQ(env.mem[i], i <= 10 - first ? i : 0);
+    }
+
+    // Labels moving means starting again
+    ops[7] = jitlib::Op::make_Label("end");
+    ops[4] = jitlib::Op::make_JumpIfZero(0, "end");
+    ops[8] = jitlib::Op::make_Return();
+    result = code.patch(ops);
+    CHECK_EQ(result.recompiled, true);
+    env = {};
+    CHECK_EQ(static_cast<int>(code.run(env)), static_cast<int>(jitlib::Status::Returned));
+    CHECK_EQ(env.mem[10], 10);
+}
+
+TEST_CASE(test_patch_optimised)
+{
+    jitlib::Ops ops{
+        jitlib::Op::make_SetImm(1, 16), // r1 = 16
+        jitlib::Op::make_Store(1, 2),   // mem[r1] = r2
+        jitlib::Op::make_Load(3, 1),    // r3 = mem[r1], which is r2
+        jitlib::Op::make_SetImm(0, 1),  // r0 = 1
+        jitlib::Op::make_Return(),
+    };
+    _test_args.options.lazy = false;
+    _test_args.options.optimised = true;
+    auto code = jitlib::compile(ops, _test_args.options);
+    CHECK_EQ(code.optimised(), true);
+
+    ops[3] = jitlib::Op::make_SetImm(0, 2);
+    CHECK_EQ(code.patch(ops).recompiled, false);
+    CHECK_EQ(code.optimised(), true);
+    ops[2] = jitlib::Op::make_Load(0, 1); // r0 = mem[r1], which is r2
+    ops[3] = jitlib::Op::make_Nop();
+    CHECK_EQ(code.patch(ops).recompiled, false);
+    CHECK_EQ(code.optimised(), true);
+
+    jitlib::ExecutionEnvironment env{};
+    env.regs[2] = 5;
+    code.run(env);
+    CHECK_EQ(env.regs[0], 5);
+    CHECK_EQ(env.mem[16], 5);
+
+    // The Load was forwarded from r2, so entering part way through a run
+    // would skip the Store it relies on
+    env = {};
+    env.pc = 2;
+    bool threw = false;
+    try
+    {
+        code.run(env);
+    }
+    catch (std::invalid_argument const &)
+    {
+        threw = true;
+    }
+    CHECK_EQ(threw, true);
+}
+
+TEST_CASE(test_patch_concurrent)
+{
+    jitlib::Ops ops{
+        jitlib::Op::make_SetImm(0, 1), // r0 = 1
+        jitlib::Op::make_Nop(),        //
+        jitlib::Op::make_Return(),
+    };
+    auto code = jitlib::compile(ops, _test_args.options);
+
+    // Everyone sees one version or the other, never anything in between
+    std::atomic<bool> done = false;
+    std::atomic<int> bad = 0;
+    std::thread runner([&]
+                       {
+                           while (!done)
+                           {
+                               jitlib::ExecutionEnvironment env{};
+                               code.run(env);
+                               bad += (env.regs[0] != 1 && env.regs[0] != 2) || (env.regs[1] != 0 && env.regs[1] != 3);
+                           } });
+    for (int i = 0; i < 100; i++)
+    {
+        ops[0] = i % 2 == 0 ? jitlib::Op::make_SetImm(0, 2) : jitlib::Op::make_SetImm(0, 1);
+        code.patch(ops);
+        ops[1] = i % 3 == 0 ? jitlib::Op::make_SetImm(1, 3) : jitlib::Op::make_Nop();
+        code.patch(ops);
+    }
+    done = true;
+    runner.join();
+    CHECK_EQ(bad.load(), 0);
+}
+
+TEST_CASE(test_lazy)
+{
+    auto set = [](jitlib::ExecutionEnvironment &env)
+    {
+        env.regs[2] = 9;
+    };
+
+    jitlib::Ops const ops{
+        jitlib::Op::make_JumpIfZero(0, "skip"), // r0 == 0, jmp skip
+        jitlib::Op::make_Call("cold"),          //
+        jitlib::Op::make_Label("skip"),         //
+        jitlib::Op::make_Call("hot"),           //
+        jitlib::Op::make_Call("hot"),           //
+        jitlib::Op::make_Return(),              //
+        jitlib::Op::make_Label("hot"),          //
+        jitlib::Op::make_AddImm(1, 1),          // r1 += 1
+        jitlib::Op::make_Return(),              //
+        jitlib::Op::make_Label("cold"),         //
+        jitlib::Op::make_CallOut(set),          // r2 = 9
+        jitlib::Op::make_Call("hot"),           //
+        jitlib::Op::make_Return(),
+    };
+    _test_args.options.lazy = true;
+    auto const eager = jitlib::compile(ops, {});
+    auto const code = jitlib::compile(ops, _test_args.options);
+    auto const initial = code.size();
+    CHECK_EQ(initial < eager.size(), true);
+
+    // Only what runs gets compiled, and only once
+    jitlib::ExecutionEnvironment env{};
+    CHECK_EQ(static_cast<int>(code.run(env)), static_cast<int>(jitlib::Status::Returned));
+    CHECK_EQ(env.regs[1], 2);
+    CHECK_EQ(env.regs[2], 0);
+    auto const hot = code.size();
+    CHECK_EQ(hot > initial, true);
+    env = {};
+    code.run(env);
+    CHECK_EQ(env.regs[1], 2);
+    CHECK_EQ(code.size(), hot);
+
+    env = {};
+    env.regs[0] = 1;
+    code.run(env);
+    CHECK_EQ(env.regs[1], 3);
+    CHECK_EQ(env.regs[2], 9);
+    CHECK_EQ(code.size() > hot, true);
+}
+
+TEST_CASE(test_link)
+{
+    jitlib::Module const main{"main", {
+                                          jitlib::Op::make_SetImm(0, 3),  // r0 = 3
+                                          jitlib::Op::make_Call("twice"), //
+                                          jitlib::Op::make_Call("inc"),   //
+                                          jitlib::Op::make_Return(),      //
+                                          jitlib::Op::make_Label("inc"),  //
+                                          jitlib::Op::make_AddImm(1, 1),  // r1 += 1
+                                          jitlib::Op::make_Return(),
+                                      }};
+    jitlib::Module const lib{"lib", {
+                                        jitlib::Op::make_Label("twice"),  //
+                                        jitlib::Op::make_AddReg(0, 0),    // r0 += r0
+                                        jitlib::Op::make_Call("inc"),     //
+                                        jitlib::Op::make_SetImm(2, 1),    // r2 = 1
+                                        jitlib::Op::make_Label("inc"),    //
+                                        jitlib::Op::make_AddImm(1, 1),    // r1 += 1
+                                        jitlib::Op::make_Return(),
+                                    }};
+    auto const code = jitlib::link({main, lib}, _test_args.options);
+    CHECK_EQ(code.deduplicated(), 1u);
+
+    jitlib::ExecutionEnvironment env{};
+    REQUIRE_EQ(static_cast<int>(code.run("main", env)), static_cast<int>(jitlib::Status::Returned));
+    CHECK_EQ(env.regs[0], 6);
+    CHECK_EQ(env.regs[1], 3);
+    CHECK_EQ(env.regs[2], 1);
+
+    env = {};
+    code.run_from("lib", "inc", env);
+    CHECK_EQ(env.regs[1], 1);
+}
+
+TEST_CASE(test_link_resume)
+{
+    jitlib::Module const main{"main", {
+                                          jitlib::Op::make_Call("outer"), //
+                                          jitlib::Op::make_AddImm(1, 1),  // r1 += 1
+                                          jitlib::Op::make_Return(),
+                                      }};
+    jitlib::Module const a{"a", {
+                                    jitlib::Op::make_Nop(),          //
+                                    jitlib::Op::make_Label("outer"), //
+                                    jitlib::Op::make_Call("inner"),  //
+                                    jitlib::Op::make_AddImm(2, 1),   // r2 += 1
+                                    jitlib::Op::make_Return(),
+                                }};
+    jitlib::Module const b{"b", {
+                                    jitlib::Op::make_Nop(),          //
+                                    jitlib::Op::make_Nop(),          //
+                                    jitlib::Op::make_Label("inner"), //
+                                    jitlib::Op::make_Yield(),        //
+                                    jitlib::Op::make_AddImm(3, 1),   // r3 += 1
+                                    jitlib::Op::make_Return(),
+                                }};
+    auto const code = jitlib::link({main, a, b}, _test_args.options);
+
+    // Each pc is in the module the Call before it went into
+    jitlib::ExecutionEnvironment env{};
+    REQUIRE_EQ(static_cast<int>(code.run("main", env)), static_cast<int>(jitlib::Status::Yielded));
+    CHECK_EQ(env.pc, 4);
+    REQUIRE_EQ(env.depth, 2);
+    CHECK_EQ(env.calls[0], 1);
+    CHECK_EQ(env.calls[1], 3);
+    REQUIRE_EQ(static_cast<int>(code.run("main", env)), static_cast<int>(jitlib::Status::Returned));
+    CHECK_EQ(env.regs[1], 1);
+    CHECK_EQ(env.regs[2], 1);
+    CHECK_EQ(env.regs[3], 1);
+}
+
+TEST_CASE(test_cache)
+{
+    auto add_one = [](jitlib::ExecutionEnvironment &env)
+    {
+        env.regs[2] += 1;
+    };
+    auto add_two = [](jitlib::ExecutionEnvironment &env)
+    {
+        env.regs[2] += 2;
+    };
+
+    jitlib::Ops ops{
+        jitlib::Op::make_SetImm(0, 5),     // r0 = 5
+        jitlib::Op::make_Call("sub"),      //
+        jitlib::Op::make_CallOut(add_one), // r2 += 1
+        jitlib::Op::make_Return(),         //
+        jitlib::Op::make_Label("sub"),     //
+        jitlib::Op::make_AddImm(0, 1),     // r0 += 1
+        jitlib::Op::make_Return(),
+    };
+    auto const directory = std::filesystem::temp_directory_path() / ("jittest-cache-" + std::to_string(getpid()));
+    std::filesystem::remove_all(directory);
+    _test_args.options.lazy = false;
+    _test_args.options.cache = directory;
+    auto entries = [&]
+    { return std::distance(std::filesystem::directory_iterator(directory), std::filesystem::directory_iterator()); };
+
+    // The first compile saves the code, later ones map it back in without
+    // saving it again
+    auto const fresh = jitlib::compile(ops, _test_args.options);
+    REQUIRE_EQ(entries(), 1);
+    auto const path = std::filesystem::directory_iterator(directory)->path();
+    auto const saved = std::filesystem::file_time_type::clock::now() - std::chrono::hours(1);
+    std::filesystem::last_write_time(path, saved);
+    auto const cached = jitlib::compile(ops, _test_args.options);
+    CHECK_EQ(std::filesystem::last_write_time(path) == saved, true);
+    CHECK_EQ(cached.size(), fresh.size());
+    jitlib::ExecutionEnvironment env{};
+    cached.run(env);
+    CHECK_EQ(env.regs[0], 6);
+    CHECK_EQ(env.regs[2], 1);
+
+    // Callouts are relocated, anything else needs compiling again
+    ops[2] = jitlib::Op::make_CallOut(add_two);
+    auto const relocated = jitlib::compile(ops, _test_args.options);
+    CHECK_EQ(std::filesystem::last_write_time(path) == saved, true);
+    env = {};
+    relocated.run(env);
+    CHECK_EQ(env.regs[2], 2);
+    ops[0] = jitlib::Op::make_SetImm(0, 7);
+    jitlib::compile(ops, _test_args.options);
+    CHECK_EQ(entries(), 2);
+    std::filesystem::remove_all(directory);
+}
+
+TEST_CASE(test_cache_concurrent)
+{
+    jitlib::Ops const ops{
+        jitlib::Op::make_SetImm(0, 5), // r0 = 5
+        jitlib::Op::make_AddImm(0, 1), // r0 += 1
+        jitlib::Op::make_Return(),
+    };
+    auto const directory = std::filesystem::temp_directory_path() / ("jittest-cache-concurrent-" + std::to_string(getpid()));
+    std::filesystem::remove_all(directory);
+    _test_args.options.lazy = false;
+    _test_args.options.cache = directory;
+
+    // Threads storing the same entry at once each write their own copy,
+    // and whichever lands last is a whole one
+    std::vector<std::thread> threads;
+    std::atomic<int> wrong = 0;
+    for (int t = 0; t < 8; t++)
+    {
+        threads.emplace_back([&]
+                             {
+                                 jitlib::ExecutionEnvironment env{};
+                                 jitlib::compile(ops, _test_args.options).run(env);
+                                 wrong += env.regs[0] != 6; });
+    }
+    for (auto &thread : threads)
+    {
+        thread.join();
+    }
+    CHECK_EQ(wrong.load(), 0);
+    REQUIRE_EQ(std::distance(std::filesystem::directory_iterator(directory), std::filesystem::directory_iterator()), 1);
+    jitlib::ExecutionEnvironment env{};
+    jitlib::compile(ops, _test_args.options).run(env);
+    CHECK_EQ(env.regs[0], 6);
+    std::filesystem::remove_all(directory);
+}
+
+TEST_CASE(test_cache_damaged)
+{
+    jitlib::Ops const ops{
+        jitlib::Op::make_SetImm(0, 5), // r0 = 5
+        jitlib::Op::make_AddImm(0, 1), // r0 += 1
+        jitlib::Op::make_Return(),
+    };
+    auto const directory = std::filesystem::temp_directory_path() / ("jittest-cache-damaged-" + std::to_string(getpid()));
+    std::filesystem::remove_all(directory);
+    _test_args.options.lazy = false;
+    _test_args.options.cache = directory;
+    jitlib::compile(ops, _test_args.options);
+    auto const path = std::filesystem::directory_iterator(directory)->path();
+
+    // Claim more code than was mapped, which is then compiled again rather
+    // than trusted
+    {
+        std::fstream file(path, std::ios::binary | std::ios::in | std::ios::out);
+        file.seekp(48); // CacheHeader::used
+        std::uint64_t const used = ~std::uint64_t{};
+        file.write(reinterpret_cast<char const *>(&used), sizeof(used));
+    }
+    auto const saved = std::filesystem::file_time_type::clock::now() - std::chrono::hours(1);
+    std::filesystem::last_write_time(path, saved);
+    jitlib::ExecutionEnvironment env{};
+    jitlib::compile(ops, _test_args.options).run(env);
+    CHECK_EQ(env.regs[0], 6);
+    CHECK_EQ(std::filesystem::last_write_time(path) == saved, false);
+    std::filesystem::remove_all(directory);
+}
+
+TEST_CASE(test_catalogue)
+{
+    auto add_one = [](jitlib::ExecutionEnvironment &env)
+    {
+        env.regs[2] += 1;
+    };
+    jitlib::CallOutRegistry registry;
+    registry.add("add_one", add_one);
+
+    jitlib::Ops const counter{
+        jitlib::Op::make_SetImm(0, 3),         // r0 = 3
+        jitlib::Op::make_Label("loop"),        //
+        jitlib::Op::make_Call("step"),         //
+        jitlib::Op::make_JumpIfZero(0, "end"), //
+        jitlib::Op::make_Jump("loop"),         //
+        jitlib::Op::make_Label("end"),         //
+        jitlib::Op::make_Yield(),              //
+        jitlib::Op::make_Return(),             //
+        jitlib::Op::make_Label("step"),        //
+        jitlib::Op::make_AddImm(0, 255),       // r0 -= 1
+        jitlib::Op::make_CallOut(add_one),     // r2 += 1
+        jitlib::Op::make_Return(),
+    };
+    jitlib::Ops const store{
+        jitlib::Op::make_Label("step"),  //
+        jitlib::Op::make_SetImm(1, 9),   // r1 = 9
+        jitlib::Op::make_Store(1, 1),    // mem[r1] = r1
+        jitlib::Op::make_Return(),
+    };
+    auto const path = std::filesystem::temp_directory_path() / ("jittest-catalogue-" + std::to_string(getpid()));
+    jitlib::save_catalogue(path, {counter, store}, registry);
+    jitlib::Catalogue const catalogue(path, registry);
+    std::filesystem::remove(path);
+    REQUIRE_EQ(catalogue.size(), 2u);
+
+    // Unpacking gives back the programs that were saved
+    jitlib::ExecutionEnvironment env{};
+    REQUIRE_EQ(static_cast<int>(RUN_OPS(catalogue.ops(0), env)), static_cast<int>(jitlib::Status::Yielded));
+    CHECK_EQ(env.regs[0], 0);
+    CHECK_EQ(env.regs[2], 3);
+
+    // Run in place, suspending and resuming like any other program
+    env = {};
+    REQUIRE_EQ(static_cast<int>(catalogue.run(0, env)), static_cast<int>(jitlib::Status::Yielded));
+    CHECK_EQ(env.regs[2], 3);
+    REQUIRE_EQ(static_cast<int>(catalogue.run(0, env)), static_cast<int>(jitlib::Status::Returned));
+    env = {};
+    catalogue.run_from(1, "step", env);
+    CHECK_EQ(env.mem[9], 9);
+
+    // Labels are shared between programs, but only found in their own
+    bool threw = false;
+    try
+    {
+        catalogue.run_from(1, "loop", env);
+    }
+    catch (std::out_of_range const &)
+    {
+        threw = true;
+    }
+    CHECK_EQ(threw, true);
+
+    // Callouts have to be registered both ways
+    jitlib::CallOutRegistry empty;
+    threw = false;
+    try
+    {
+        jitlib::save_catalogue(path, {counter}, empty);
+    }
+    catch (std::invalid_argument const &)
+    {
+        threw = true;
+    }
+    CHECK_EQ(threw, true);
+    jitlib::save_catalogue(path, {counter}, registry);
+    threw = false;
+    try
+    {
+        jitlib::Catalogue const unresolved(path, empty);
+    }
+    catch (std::out_of_range const &)
+    {
+        threw = true;
+    }
+    CHECK_EQ(threw, true);
+
+    // Registering a name again takes it away from the old function
+    auto add_two = [](jitlib::ExecutionEnvironment &env)
+    {
+        env.regs[2] += 2;
+    };
+    jitlib::CallOutRegistry renamed;
+    renamed.add("add", add_one);
+    renamed.add("add", add_two);
+    CHECK_EQ(renamed.find("add") == add_two, true);
+    CHECK_EQ(renamed.name_of(add_one) == nullptr, true);
+    CHECK_EQ(*renamed.name_of(add_two) == "add", true);
+
+    // A moved-from catalogue has no programs left
+    jitlib::Catalogue moved(path, registry);
+    jitlib::Catalogue const taken(std::move(moved));
+    CHECK_EQ(taken.size(), 1u);
+    CHECK_EQ(moved.size(), 0u);
+    threw = false;
+    try
+    {
+        moved.run(0, env);
+    }
+    catch (std::out_of_range const &)
+    {
+        threw = true;
+    }
+    CHECK_EQ(threw, true);
+    std::filesystem::remove(path);
+}
+
+TEST_CASE(test_object)
+{
+    auto add_one = [](jitlib::ExecutionEnvironment &env)
+    {
+        env.regs[2] += 1;
+    };
+    jitlib::Module const module{"counter", {
+                                               jitlib::Op::make_CallOut(add_one), // r2 += 1
+                                               jitlib::Op::make_Return(),
+                                           }};
+    auto const path = std::filesystem::temp_directory_path() / ("jittest-object-" + std::to_string(getpid()) + ".o");
+
+    // Callouts are linked by name, so they have to have one
+    bool threw = false;
+    try
+    {
+        jitlib::write_object(path, {module}, {}, _test_args.options);
+    }
+    catch (std::invalid_argument const &)
+    {
+        threw = true;
+    }
+    CHECK_EQ(threw, true);
+
+    jitlib::CallOutRegistry registry;
+    registry.add("add_one", add_one);
+    jitlib::write_object(path, {module}, registry, _test_args.options);
+    std::ifstream file(path, std::ios::binary);
+    char magic[4]{};
+    file.read(magic, sizeof(magic));
+    CHECK_EQ(std::string(magic, sizeof(magic)) == "\x7f" "ELF", true);
+    std::string const contents{std::istreambuf_iterator<char>(file), std::istreambuf_iterator<char>()};
+    CHECK_EQ(contents.find(std::string("counter\0add_one\0", 16)) != std::string::npos, true);
+    std::filesystem::remove(path);
+}
+
+namespace
+{
+    void add_to_r3(jitlib::ExecutionEnvironment &env)
+    {
+        env.regs[3] += 1;
+    }
+
+    constexpr jitlib::Ops specialised_program()
+    {
+        return {
+            jitlib::Op::make_SetImm(0, 3),         // r0 = 3
+            jitlib::Op::make_Label("loop"),        //
+            jitlib::Op::make_Call("step"),         //
+            jitlib::Op::make_JumpIfZero(0, "end"), //
+            jitlib::Op::make_Jump("loop"),         //
+            jitlib::Op::make_Label("end"),         //
+            jitlib::Op::make_Load(2, 1),           // r2 = mem[r1]
+            jitlib::Op::make_Return(),             //
+            jitlib::Op::make_Label("step"),        //
+            jitlib::Op::make_AddImm(0, 255),       // r0 -= 1
+            jitlib::Op::make_AddReg(1, 0),         // r1 += r0
+            jitlib::Op::make_Store(1, 0),          // mem[r1] = r0
+            jitlib::Op::make_CallOut(add_to_r3),   // r3 += 1
+            jitlib::Op::make_Yield(),              //
+            jitlib::Op::make_Return(),
+        };
+    }
+}
+
+TEST_CASE(test_specialised)
+{
+    // Matches the same program run any other way, through each Yield
+    jitlib::ExecutionEnvironment expected{};
+    jitlib::ExecutionEnvironment env{};
+    std::size_t yields = 0;
+    for (;;)
+    {
+        jitlib::Status const status = jitlib::run_specialised<specialised_program>(env);
+        REQUIRE_EQ(static_cast<int>(RUN_OPS(specialised_program(), expected)), static_cast<int>(status));
+        REQUIRE_EQ(env.pc, expected.pc);
+        REQUIRE_EQ(env.depth, expected.depth);
+        for (std::size_t i = 0; i < env.depth; i++)
+        {
+            CHECK_EQ(env.calls[i], expected.calls[i]);
+        }
+        if (status != jitlib::Status::Yielded)
+        {
+            break;
+        }
+        yields++;
+    }
+    CHECK_EQ(yields, 3u);
+    CHECK_EQ(env.mem == expected.mem, true);
+    for (std::size_t i = 0; i < jitlib::kNumRegisters; i++)
+    {
+        CHECK_EQ(env.regs[i], expected.regs[i]);
+    }
+    CHECK_EQ(env.mem[2], 2);
+    CHECK_EQ(env.regs[3], 3);
+
+    env = {};
+    jitlib::run_specialised_from<specialised_program>("step", env);
+    CHECK_EQ(env.pc, 14);
+    CHECK_EQ(env.regs[0], 255);
+}
+
+namespace
+{
+    constexpr jitlib::Label numbered(char kind, std::size_t n)
+    {
+        jitlib::Label label{""};
+        label.data[0] = kind;
+        label.data[1] = static_cast<char>('0' + n / 10);
+        label.data[2] = static_cast<char>('0' + n % 10);
+        return label;
+    }
+
+    // A chain of if/else diamonds, with 2^36 paths through it
+    constexpr jitlib::Ops branchy_program()
+    {
+        jitlib::Ops ops{};
+        std::size_t pc = 0;
+        for (std::size_t i = 0; i < 36; i++)
+        {
+            ops[pc++] = jitlib::Op::make_JumpIfZero(0, numbered('e', i)); // if (r0 == 0) goto e<i>
+            ops[pc++] = jitlib::Op::make_AddReg(1, 0);                    // r1 += r0
+            ops[pc++] = jitlib::Op::make_Jump(numbered('j', i));          // goto j<i>
+            ops[pc++] = jitlib::Op::make_Label(numbered('e', i));         //
+            ops[pc++] = jitlib::Op::make_AddImm(0, 3);                    // r0 += 3
+            ops[pc++] = jitlib::Op::make_Label(numbered('j', i));         //
+            ops[pc++] = jitlib::Op::make_AddReg(0, 1);                    // r0 += r1
+        }
+        ops[pc] = jitlib::Op::make_Return();
+        return ops;
+    }
+}
+
+TEST_CASE(test_specialised_branches)
+{
+    // Compiles in time linear in the branches, and matches the program run
+    // any other way down whichever paths it takes
+    for (jitlib::Value start = 0; start < 4; start++)
+    {
+        jitlib::ExecutionEnvironment expected{};
+        jitlib::ExecutionEnvironment env{};
+        expected.regs[0] = env.regs[0] = start;
+        jitlib::Status const status = jitlib::run_specialised<branchy_program>(env);
+        REQUIRE_EQ(static_cast<int>(RUN_OPS(branchy_program(), expected)), static_cast<int>(status));
+        for (std::size_t i = 0; i < jitlib::kNumRegisters; i++)
+        {
+            CHECK_EQ(env.regs[i], expected.regs[i]);
+        }
+    }
+}
+
+TEST_CASE(test_profiler)
+{
+    jitlib::Ops const ops{
+        jitlib::Op::make_SetImm(0, 0),            // r0 = 0
+        jitlib::Op::make_Label("outer"),          //
+        jitlib::Op::make_SetImm(1, 0),            // r1 = 0
+        jitlib::Op::make_Label("inner"),          //
+        jitlib::Op::make_AddImm(1, 1),            // r1 += 1
+        jitlib::Op::make_JumpIfZero(1, "next"),   // if (r1 == 0) goto next
+        jitlib::Op::make_Jump("inner"),           // goto inner
+        jitlib::Op::make_Label("next"),           //
+        jitlib::Op::make_AddImm(0, 1),            // r0 += 1
+        jitlib::Op::make_JumpIfZero(0, "return"), // if (r0 == 0) return
+        jitlib::Op::make_Jump("outer"),           // goto outer
+        jitlib::Op::make_Label("return"),         //
+        jitlib::Op::make_Return(),
+    };
+    auto const code = jitlib::compile(ops, _test_args.options);
+
+    // Each byte of native code maps back to an op that has some
+    std::size_t mapped = 0;
+    for (std::size_t offset = 0; offset < code.size(); offset++)
+    {
+        std::size_t const op = code.op_at(offset);
+        if (op != jitlib::CompiledCode::kNoEntry)
+        {
+            CHECK_EQ(ops[op].type != jitlib::OpType::Label, true);
+            mapped += op == 4;
+        }
+    }
+    CHECK_EQ(mapped != 0, true);
+    CHECK_EQ(code.op_at(code.size()), jitlib::CompiledCode::kNoEntry);
+
+    // Nearly all the time goes in the inner loop
+    jitlib::Profiler profiler({std::chrono::microseconds(100), 1024});
+    profiler.start();
+    auto const deadline = std::chrono::steady_clock::now() + std::chrono::seconds(10);
+    while (profiler.samples() < 20 && std::chrono::steady_clock::now() < deadline)
+    {
+        jitlib::ExecutionEnvironment env{};
+        code.run(env);
+    }
+    profiler.stop();
+    auto const profile = profiler.profile(code);
+    REQUIRE_EQ(profile.ops.empty(), false);
+    CHECK_EQ(profile.attributed <= profile.samples, true);
+    CHECK_EQ(profile.labels.front().label == jitlib::Label("inner"), true);
+    CHECK_EQ(profile.ops.front().label == jitlib::Label("inner"), true);
+    CHECK_EQ(jitlib::report(profile).find("  in inner\n") != std::string::npos, true);
+}
+
+TEST_CASE(test_perf)
+{
+    jitlib::Ops const ops{
+        jitlib::Op::make_SetImm(0, 3), // r0 = 3
+        jitlib::Op::make_Call("sub"),  //
+        jitlib::Op::make_Return(),     //
+        jitlib::Op::make_Label("sub"), //
+        jitlib::Op::make_AddImm(0, 1), // r0 += 1
+        jitlib::Op::make_Return(),
+    };
+    auto const pid = std::to_string(getpid());
+    std::filesystem::path const map = "/tmp/perf-" + pid + ".map";
+    auto const dump = std::filesystem::temp_directory_path() / ("jit-" + pid + ".dump");
+    std::filesystem::remove(map);
+    std::filesystem::remove(dump);
+    _test_args.options.perf = {true, true, "perftest"};
+    auto const code = jitlib::compile(ops, _test_args.options);
+    jitlib::ExecutionEnvironment env{};
+    code.run(env);
+    CHECK_EQ(env.regs[0], 4);
+
+    // A line of start, size and name for the program and each label in it
+    std::ifstream lines(map);
+    std::vector<std::string> names;
+    for (std::string start, size, name; lines >> start >> size >> name;)
+    {
+        names.push_back(name);
+    }
+    CHECK_EQ(std::find(names.begin(), names.end(), "perftest") != names.end(), true);
+    CHECK_EQ(std::find(names.begin(), names.end(), "perftest:sub") != names.end(), true);
+
+    // The dump starts with its magic number and version
+    std::ifstream file(dump, std::ios::binary);
+    std::uint32_t header[2]{};
+    file.read(reinterpret_cast<char *>(header), sizeof(header));
+    CHECK_EQ(header[0], 0x4A695444u);
+    CHECK_EQ(header[1], 1u);
+    CHECK_EQ(std::filesystem::file_size(dump) > 40, true);
+    std::filesystem::remove(map);
+    std::filesystem::remove(dump);
+}
+
+TEST_CASE(test_counters)
+{
+    jitlib::Ops const ops{
+        jitlib::Op::make_SetImm(0, 3),          // r0 = 3
+        jitlib::Op::make_Label("loop"),         //
+        jitlib::Op::make_AddImm(1, 1),          // r1 += 1
+        jitlib::Op::make_AddImm(0, 255),        // r0 -= 1
+        jitlib::Op::make_JumpIfZero(0, "out"),  // if (r0 == 0) goto out
+        jitlib::Op::make_Jump("loop"),          // goto loop
+        jitlib::Op::make_Label("out"),          //
+        jitlib::Op::make_JumpIfZero(2, "skip"), // if (r2 == 0) goto skip
+        jitlib::Op::make_SetImm(3, 7),          // r3 = 7
+        jitlib::Op::make_Label("skip"),         //
+        jitlib::Op::make_Return(),
+    };
+    jitlib::ExecutionEnvironment env{};
+    std::shared_ptr<jitlib::OpCounters const> counters;
+    if (_test_args.jit)
+    {
+        CHECK_EQ(jitlib::compile(ops, _test_args.options).counters() == nullptr, true);
+        _test_args.options.counted = true;
+        auto const code = jitlib::compile(ops, _test_args.options);
+        code.run(env);
+        counters = code.counters();
+    }
+    else
+    {
+        auto interpreted = std::make_shared<jitlib::OpCounters>();
+        jitlib::run(ops, env, *interpreted);
+        counters = interpreted;
+    }
+    CHECK_EQ(env.regs[1], 3);
+    REQUIRE_EQ(counters != nullptr, true);
+    CHECK_EQ(counters->executed[2], 3u);
+    CHECK_EQ(counters->executed[5], 2u);
+    CHECK_EQ(counters->executed[8], 0u);
+
+    // Branches are split into taken and not, and labels add up what follows
+    auto const histogram = jitlib::histogram(ops, *counters);
+    auto find = [&](std::size_t index)
+    { return std::find_if(histogram.ops.begin(), histogram.ops.end(), [&](jitlib::OpCount const &count)
+                          { return count.index == index; }); };
+    REQUIRE_EQ(find(4) != histogram.ops.end(), true);
+    CHECK_EQ(find(4)->taken, 1u);
+    CHECK_EQ(find(4)->not_taken, 2u);
+    CHECK_EQ(find(4)->label == jitlib::Label("loop"), true);
+    REQUIRE_EQ(find(7) != histogram.ops.end(), true);
+    CHECK_EQ(find(7)->taken, 1u);
+    CHECK_EQ(find(8) == histogram.ops.end(), true);
+    REQUIRE_EQ(histogram.labels.size(), 4u);
+    CHECK_EQ(histogram.labels[0].label == jitlib::Label(""), true);
+    CHECK_EQ(histogram.labels[1].label == jitlib::Label("loop"), true);
+    CHECK_EQ(histogram.labels[1].entered, 3u);
+    CHECK_EQ(histogram.labels[1].executed, 3u * 4 + 2);
+    CHECK_EQ(histogram.labels[3].label == jitlib::Label("skip"), true);
+}
+
+TEST_CASE(test_heatmap)
+{
+    jitlib::Ops const ops{
+        jitlib::Op::make_SetImm(0, 3),         // r0 = 3
+        jitlib::Op::make_SetImm(1, 16),        // r1 = 16
+        jitlib::Op::make_SetImm(2, 5),         // r2 = 5
+        jitlib::Op::make_Label("loop"),        //
+        jitlib::Op::make_Store(1, 2),          // mem[r1] = r2
+        jitlib::Op::make_Load(3, 1),           // r3 = mem[r1]
+        jitlib::Op::make_AddImm(1, 1),         // r1 += 1
+        jitlib::Op::make_AddImm(0, 255),       // r0 -= 1
+        jitlib::Op::make_JumpIfZero(0, "out"), // if (r0 == 0) goto out
+        jitlib::Op::make_Jump("loop"),         // goto loop
+        jitlib::Op::make_Label("out"),         //
+        jitlib::Op::make_Load(2, 2),           // r2 = mem[r2]
+        jitlib::Op::make_Return(),
+    };
+    jitlib::ExecutionEnvironment env{};
+    std::shared_ptr<jitlib::MemoryCounters const> counters;
+    if (_test_args.jit)
+    {
+        CHECK_EQ(jitlib::compile(ops, _test_args.options).memory_counters() == nullptr, true);
+        _test_args.options.memory_counted = true;
+        auto const code = jitlib::compile(ops, _test_args.options);
+        code.run(env);
+        counters = code.memory_counters();
+    }
+    else
+    {
+        auto interpreted = std::make_shared<jitlib::MemoryCounters>();
+        jitlib::run(ops, env, *interpreted);
+        counters = interpreted;
+    }
+    CHECK_EQ(env.regs[3], 5);
+    CHECK_EQ(env.regs[2], 0);
+    REQUIRE_EQ(counters != nullptr, true);
+    for (std::size_t address = 16; address < 19; address++)
+    {
+        CHECK_EQ(counters->reads[address], 1u);
+        CHECK_EQ(counters->writes[address], 1u);
+    }
+    CHECK_EQ(counters->writes[19], 0u);
+    // Counted at the address it was loaded from, not what it loaded
+    CHECK_EQ(counters->reads[5], 1u);
+    CHECK_EQ(counters->reads[0], 0u);
+    CHECK_EQ(counters->accesses[4], 3u);
+    CHECK_EQ(counters->accesses[5], 3u);
+    CHECK_EQ(counters->accesses[11], 1u);
+
+    auto const heatmap = jitlib::heatmap(ops, *counters);
+    REQUIRE_EQ(heatmap.cells.size(), 4u);
+    CHECK_EQ(heatmap.cells[0].address, 16);
+    CHECK_EQ(heatmap.cells[3].address, 5);
+    REQUIRE_EQ(heatmap.sites.size(), 3u);
+    CHECK_EQ(heatmap.sites[0].index, 4u);
+    CHECK_EQ(heatmap.sites[0].label == jitlib::Label("loop"), true);
+    CHECK_EQ(heatmap.sites[2].index, 11u);
+    auto const text = jitlib::report(heatmap);
+    CHECK_EQ(text.find("10 |@@@ ") != std::string::npos, true);
+    CHECK_EQ(text.find("Load r2, [r2]  in out") != std::string::npos, true);
+}
+
+TEST_CASE(test_measure)
+{
+    jitlib::Ops const ops{
+        jitlib::Op::make_SetImm(0, 100),        // r0 = 100
+        jitlib::Op::make_Label("loop"),         //
+        jitlib::Op::make_AddImm(1, 2),          // r1 += 2
+        jitlib::Op::make_AddImm(0, 255),        // r0 -= 1
+        jitlib::Op::make_JumpIfZero(0, "out"),  // if (r0 == 0) goto out
+        jitlib::Op::make_Jump("loop"),          // goto loop
+        jitlib::Op::make_Label("out"),          //
+        jitlib::Op::make_Return(),
+    };
+    jitlib::RunStats stats;
+    for (int i = 0; i < 3; i++)
+    {
+        jitlib::ExecutionEnvironment env{};
+        auto const status = _test_args.jit ? jitlib::measure(jitlib::compile(ops, _test_args.options), env, stats) : jitlib::measure(ops, env, stats);
+        CHECK_EQ(status == jitlib::Status::Returned, true);
+        CHECK_EQ(env.regs[1], 200);
+    }
+    CHECK_EQ(stats.runs, 3u);
+    CHECK_EQ(stats.time.count() > 0, true);
+
+    // Where the machine has no PMU, or perf events aren't allowed, only the
+    // time is measured
+    auto const events = jitlib::hardware_events();
+    CHECK_EQ(stats.counted.instructions == events.instructions, true);
+    CHECK_EQ(stats.counted.cycles == events.cycles, true);
+    CHECK_EQ(events.instructions ? stats.instructions >= 3 * 100 * 4 : stats.instructions == 0, true);
+    CHECK_EQ(events.cycles || stats.cycles == 0, true);
+    CHECK_EQ(events.l1i_misses || stats.l1i_misses == 0, true);
+}
+
+TEST_CASE(test_trace)
+{
+    auto func = [](jitlib::ExecutionEnvironment &env)
+    { env.regs[0] += 1; };
+    jitlib::Ops const ops{
+        jitlib::Op::make_SetImm(1, 2),  // r1 = 2
+        jitlib::Op::make_CallOut(func), // r0 += 1
+        jitlib::Op::make_Return(),
+    };
+    auto run = [&]
+    {
+        jitlib::ExecutionEnvironment env{};
+        if (_test_args.jit)
+        {
+            _test_args.options.traced = true;
+            jitlib::compile(ops, _test_args.options).run(env);
+        }
+        else
+        {
+            jitlib::run(ops, env);
+        }
+        CHECK_EQ(env.regs[0], 1);
+    };
+
+    // Nothing's recorded until it starts, or after it stops
+    jitlib::Tracer tracer({16});
+    run();
+    CHECK_EQ(tracer.events(), 0u);
+    tracer.start();
+    run();
+    std::thread(run).join();
+    tracer.stop();
+    std::size_t const events = tracer.events();
+    run();
+    CHECK_EQ(tracer.events(), events);
+
+    std::string const json = tracer.json();
+    CHECK_EQ(json.starts_with("{\"traceEvents\":[{"), true);
+    CHECK_EQ(json.find("\"name\":\"callout\",\"cat\":\"run\",\"ph\":\"X\"") != std::string::npos, true);
+    CHECK_EQ(json.find("\"args\":{\"op\":1}") != std::string::npos, true);
+    if (_test_args.jit)
+    {
+        CHECK_EQ(json.find("\"name\":\"compile\"") != std::string::npos, true);
+        CHECK_EQ(json.find("\"name\":\"finalise\"") != std::string::npos, true);
+        CHECK_EQ(json.find("\"name\":\"run\"") != std::string::npos, true);
+    }
+    else
+    {
+        CHECK_EQ(json.find("\"name\":\"interpret\"") != std::string::npos, true);
+        CHECK_EQ(events, 4u);
+    }
+
+    // Only one can run at once
+    jitlib::Tracer other;
+    tracer.start();
+    bool threw = false;
+    try
+    {
+        other.start();
+    }
+    catch (std::logic_error const &)
+    {
+        threw = true;
+    }
+    CHECK_EQ(threw, true);
+    tracer.stop();
+    tracer.clear();
+    CHECK_EQ(tracer.events(), 0u);
+    CHECK_EQ(tracer.json().find("\"name\""), std::string::npos);
+}
+
+TEST_CASE(test_generate)
+{
+    // Every program returns, and compiles to code that does the same
+    for (std::uint64_t seed = 0; seed < 40; seed++)
+    {
+        jitlib::GenerateOptions options;
+        options.ops = 16 + seed * 6;
+        options.branches = 0.05 * static_cast<double>(seed % 5);
+        options.labels = 0.05 * static_cast<double>(seed % 3);
+        options.loops = 0.05;
+        options.callouts = seed % 2 != 0 ? 0.05 : 0.0;
+        options.subroutines = seed % 4;
+        options.calls = 0.1;
+        jitlib::Ops const ops = jitlib::generate(options, seed);
+
+        jitlib::ExecutionEnvironment expected{};
+        expected.fuel = 1 << 20;
+        REQUIRE_EQ(jitlib::run(ops, expected) == jitlib::Status::Returned, true);
+        jitlib::ExecutionEnvironment env{};
+        if (_test_args.jit)
+        {
+            jitlib::compile(ops, _test_args.options).run(env);
+        }
+        else
+        {
+            jitlib::run(jitlib::generate(options, seed), env);
+        }
+        CHECK_EQ(std::equal(std::begin(env.regs), std::end(env.regs), std::begin(expected.regs)), true);
+        CHECK_EQ(env.mem == expected.mem, true);
+    }
+
+    // Programs that can't be made
+    jitlib::GenerateOptions options;
+    options.ops = 257;
+    bool threw = false;
+    try
+    {
+        jitlib::generate(options, 0);
+    }
+    catch (std::invalid_argument const &)
+    {
+        threw = true;
+    }
+    CHECK_EQ(threw, true);
+}
+
+TEST_CASE(test_optimise)
+{
+    jitlib::Ops const ops{
+        jitlib::Op::make_SetImm(1, 16),   // r1 = 16
+        jitlib::Op::make_Store(1, 2),     // mem[r1] = r2, overwritten before it's read
+        jitlib::Op::make_Load(3, 1),      // r3 = mem[r1], which is r2
+        jitlib::Op::make_AddImm(3, 1),    // r3 += 1
+        jitlib::Op::make_Store(1, 3),     // mem[r1] = r3
+        jitlib::Op::make_SetImm(0, 16),   // r0 = 16
+        jitlib::Op::make_Load(2, 0),      // r2 = mem[r0], the same cell
+        jitlib::Op::make_Store(0, 3),     // mem[r0] = r3, which it already is
+        jitlib::Op::make_Label("next"),   //
+        jitlib::Op::make_Load(0, 1),      // r0 = mem[r1], which could be anything now
+        jitlib::Op::make_SetImm(2, 40),   // r2 = 40
+        jitlib::Op::make_Store(2, 2),     // mem[r2] = r2
+        jitlib::Op::make_SetImm(1, 40),   // r1 = 40
+        jitlib::Op::make_Load(3, 1),      // r3 = mem[r1], which is 40
+        jitlib::Op::make_Return(),
+    };
+    auto const optimised = jitlib::optimise(ops);
+    auto is = [](jitlib::Op const &op, jitlib::OpType type, jitlib::Register regA, std::uint8_t regB_or_imm)
+    { return op.type == type && op.regA == regA && (type == jitlib::OpType::SetImm ? op.imm : op.regB) == regB_or_imm; };
+    CHECK_EQ(optimised[1].type == jitlib::OpType::Nop, true);
+    CHECK_EQ(is(optimised[2], jitlib::OpType::SetReg, 3, 2), true);
+    CHECK_EQ(is(optimised[4], jitlib::OpType::Store, 1, 3), true);
+    CHECK_EQ(is(optimised[6], jitlib::OpType::SetReg, 2, 3), true);
+    CHECK_EQ(optimised[7].type == jitlib::OpType::Nop, true);
+    CHECK_EQ(is(optimised[9], jitlib::OpType::Load, 0, 1), true);
+    CHECK_EQ(is(optimised[13], jitlib::OpType::SetImm, 3, 40), true);
+
+    jitlib::ExecutionEnvironment env{};
+    env.regs[2] = 5;
+    if (_test_args.jit)
+    {
+        _test_args.options.optimised = true;
+        jitlib::compile(ops, _test_args.options).run(env);
+    }
+    else
+    {
+        jitlib::run(optimised, env);
+    }
+    CHECK_EQ(env.mem[16], 6);
+    CHECK_EQ(env.mem[40], 40);
+    CHECK_EQ(env.regs[0], 6);
+    CHECK_EQ(env.regs[3], 40);
+
+    // Generated programs do the same either way
+    for (std::uint64_t seed = 0; seed < 40; seed++)
+    {
+        jitlib::GenerateOptions options;
+        options.ops = 16 + seed * 6;
+        options.callouts = seed % 2 != 0 ? 0.05 : 0.0;
+        options.subroutines = seed % 4;
+        options.calls = 0.1;
+        jitlib::Ops const generated = jitlib::generate(options, seed);
+
+        jitlib::ExecutionEnvironment expected{};
+        expected.fuel = 1 << 20;
+        REQUIRE_EQ(jitlib::run(generated, expected) == jitlib::Status::Returned, true);
+        jitlib::ExecutionEnvironment optimised_env{};
+        optimised_env.fuel = 1 << 20;
+        if (_test_args.jit)
+        {
+            jitlib::compile(generated, _test_args.options).run(optimised_env);
+        }
+        else
+        {
+            jitlib::run(jitlib::optimise(generated), optimised_env);
+        }
+        CHECK_EQ(std::equal(std::begin(optimised_env.regs), std::end(optimised_env.regs), std::begin(expected.regs)), true);
+        CHECK_EQ(optimised_env.mem == expected.mem, true);
+
+        // And when metered, a few ops at a time, resuming where each stopped
+        jitlib::ExecutionEnvironment metered_env{};
+        jitlib::CompileOptions metered_options = _test_args.options;
+        metered_options.metered = true;
+        auto const metered = jitlib::compile(generated, metered_options);
+        jitlib::Ops const optimised_ops = jitlib::optimise(generated);
+        jitlib::Status status;
+        do
+        {
+            metered_env.fuel = 3;
+            status = _test_args.jit ? metered.run(metered_env) : jitlib::run(optimised_ops, metered_env);
+        } while (status == jitlib::Status::OutOfFuel);
+        REQUIRE_EQ(static_cast<int>(status), static_cast<int>(jitlib::Status::Returned));
+        CHECK_EQ(std::equal(std::begin(metered_env.regs), std::end(metered_env.regs), std::begin(expected.regs)), true);
+        CHECK_EQ(metered_env.mem == expected.mem, true);
+    }
+
+    // Linked modules are each optimised, up to the Calls between them
+    jitlib::Module const main{"main", {
+                                          jitlib::Op::make_SetImm(1, 16), // r1 = 16
+                                          jitlib::Op::make_SetImm(2, 5),  // r2 = 5
+                                          jitlib::Op::make_Store(1, 2),   // mem[r1] = r2
+                                          jitlib::Op::make_Load(3, 1),    // r3 = mem[r1], which is r2
+                                          jitlib::Op::make_Call("bump"),  //
+                                          jitlib::Op::make_Load(0, 1),    // r0 = mem[r1], which bump changed
+                                          jitlib::Op::make_Return(),
+                                      }};
+    jitlib::Module const lib{"lib", {
+                                        jitlib::Op::make_Label("bump"), //
+                                        jitlib::Op::make_Load(2, 1),    // r2 = mem[r1]
+                                        jitlib::Op::make_AddImm(2, 1),  // r2 += 1
+                                        jitlib::Op::make_Store(1, 2),   // mem[r1] = r2
+                                        jitlib::Op::make_Load(0, 1),    // r0 = mem[r1], which is r2
+                                        jitlib::Op::make_Return(),
+                                    }};
+    jitlib::CompileOptions link_options = _test_args.options;
+    link_options.optimised = true;
+    auto const linked = jitlib::link({main, lib}, link_options);
+    env = {};
+    REQUIRE_EQ(static_cast<int>(linked.run("main", env)), static_cast<int>(jitlib::Status::Returned));
+    CHECK_EQ(env.regs[0], 6);
+    CHECK_EQ(env.regs[2], 6);
+    CHECK_EQ(env.regs[3], 5);
+    CHECK_EQ(env.mem[16], 6);
+}
+
 int main()
 {
     return tests::run_tests() ? EXIT_SUCCESS : EXIT_FAILURE;